@@ -0,0 +1,184 @@
+#!/usr/bin/env bash
+# Benchmark the proxy's bandwidth caps (--conn-rate, --user-rate).
+#
+# - accuracy: downloads through a proxy started with --conn-rate <rate> and
+#   compares the achieved rate with the configured one.
+# - user:     splits a download across PARALLEL connections of the same user,
+#             under --user-rate <rate>, and compares their aggregate.
+# - overhead: downloads a large file with no cap and with one far above what
+#             the machine can move, which only adds the bookkeeping.
+# - Appends results to a CSV for later plotting.
+#
+# Usage:
+#   scripts/benchmark_shaping.sh [output.csv]
+# Environment overrides:
+#   RATES="64K 256K 1M 4M"   # caps to check, in the proxy's syntax
+#   SECONDS_PER_RUN=4        # each capped download should take about this
+#   PARALLEL=4               # connections sharing the user's cap
+#   OVERHEAD_MB=256          # file size for the overhead runs
+#   REPEATS=3
+#   HTTP_PORT=8001
+#   SOCKS_PORT=1080
+#   PROXY_USER="foo:bar"
+
+set -euo pipefail
+
+SCRIPT_DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
+REPO_ROOT="$(cd "${SCRIPT_DIR}/.." && pwd)"
+
+OUTPUT_CSV="${1:-${REPO_ROOT}/shaping_benchmark.csv}"
+RATES=${RATES:-"64K 256K 1M 4M"}
+SECONDS_PER_RUN=${SECONDS_PER_RUN:-4}
+PARALLEL=${PARALLEL:-4}
+OVERHEAD_MB=${OVERHEAD_MB:-256}
+REPEATS=${REPEATS:-3}
+HTTP_PORT=${HTTP_PORT:-8001}
+SOCKS_PORT=${SOCKS_PORT:-1080}
+PROXY_USER=${PROXY_USER:-foo:bar}
+
+FILES_DIR="${REPO_ROOT}/.bench_http_files"
+LOG_DIR="${REPO_ROOT}/.bench_logs"
+mkdir -p "${FILES_DIR}" "${LOG_DIR}"
+
+HTTP_PID=""
+PROXY_PID=""
+
+stop_proxy() {
+  if [[ -n "${PROXY_PID}" ]] && kill -0 "${PROXY_PID}" 2>/dev/null; then
+    kill "${PROXY_PID}" 2>/dev/null || true
+    wait "${PROXY_PID}" 2>/dev/null || true
+  fi
+  PROXY_PID=""
+}
+
+cleanup() {
+  stop_proxy
+  if [[ -n "${HTTP_PID}" ]] && kill -0 "${HTTP_PID}" 2>/dev/null; then
+    kill "${HTTP_PID}" 2>/dev/null || true
+    wait "${HTTP_PID}" 2>/dev/null || true
+  fi
+}
+trap cleanup EXIT
+
+# "256K" -> 262144
+to_bytes() {
+  local n=${1%[KkMmGg]} unit=${1: -1}
+  case "${unit}" in
+    K|k) echo $((n * 1024)) ;;
+    M|m) echo $((n * 1024 * 1024)) ;;
+    G|g) echo $((n * 1024 * 1024 * 1024)) ;;
+    *) echo "$1" ;;
+  esac
+}
+
+# file_of <bytes>: path of a file that size, created on first use
+file_of() {
+  local bytes=$1
+  local path="${FILES_DIR}/shaping_${bytes}.bin"
+  if [[ ! -f "${path}" ]] || [[ "$(stat -c%s "${path}")" -ne "${bytes}" ]]; then
+    head -c "${bytes}" /dev/zero >"${path}"
+  fi
+  echo "${path}"
+}
+
+start_http_server() {
+  echo "Starting local HTTP server on port ${HTTP_PORT}..."
+  python3 -m http.server "${HTTP_PORT}" --bind 127.0.0.1 --directory "${FILES_DIR}" \
+    >"${LOG_DIR}/http_server.log" 2>&1 &
+  HTTP_PID=$!
+  sleep 1
+}
+
+build_proxy() {
+  echo "Building proxy..."
+  (cd "${REPO_ROOT}" && make all >"${LOG_DIR}/build_shaping.log" 2>&1)
+}
+
+# start_proxy <log name> [proxy options...]
+start_proxy() {
+  local name=$1
+  shift
+  # Logins aren't what's being measured
+  "${REPO_ROOT}/build/bin/socks5d" -u "${PROXY_USER}" -p "${SOCKS_PORT}" \
+    --kdf-iterations 1 "$@" >"${LOG_DIR}/proxy_${name}.log" 2>&1 &
+  PROXY_PID=$!
+  sleep 1
+}
+
+# download <path>: seconds it took through the proxy, empty on failure
+download() {
+  local url="http://127.0.0.1:${HTTP_PORT}/$(basename "$1")"
+  local duration
+  if duration="$(curl -s -w "%{time_total}" -o /dev/null \
+      --socks5-hostname "127.0.0.1:${SOCKS_PORT}" --proxy-user "${PROXY_USER}" \
+      "${url}")"; then
+    printf "%s" "${duration}" | tr -d '[:space:]'
+  fi
+}
+
+record() {
+  local scenario=$1 configured=$2 bytes=$3 duration=$4 run=$5
+  if [[ -z "${duration}" || ! "${duration}" =~ ^[0-9.]+$ ]]; then
+    echo "Skipping ${scenario} run ${run} (rate=${configured}), curl failed" >&2
+    return
+  fi
+  local line
+  line=$(awk -v s="${scenario}" -v c="${configured}" -v b="${bytes}" -v d="${duration}" -v r="${run}" \
+    'BEGIN { if (d <= 0) exit 1; a = b / d;
+             e = c > 0 ? sprintf("%.2f", (a - c) * 100 / c) : "";
+             printf "%s,%d,%d,%.6f,%.0f,%s,%d", s, c, b, d, a, e, r }') || return 0
+  echo "${line}" >>"${OUTPUT_CSV}"
+  echo "${scenario} rate=${configured} -> ${line}"
+}
+
+write_csv_header() {
+  if [[ ! -f "${OUTPUT_CSV}" ]]; then
+    echo "scenario,configured_bytes_per_s,bytes,seconds,achieved_bytes_per_s,error_pct,run" >"${OUTPUT_CSV}"
+  fi
+}
+
+build_proxy
+start_http_server
+write_csv_header
+
+for rate in ${RATES}; do
+  bytes_per_s=$(to_bytes "${rate}")
+  file=$(file_of $((bytes_per_s * SECONDS_PER_RUN)))
+
+  start_proxy "conn_${rate}" --conn-rate "${rate}"
+  for run in $(seq 1 "${REPEATS}"); do
+    record accuracy "${bytes_per_s}" "$(stat -c%s "${file}")" "$(download "${file}")" "${run}"
+  done
+  stop_proxy
+
+  # The same bytes in PARALLEL pieces, all under one user's cap
+  part=$(file_of $((bytes_per_s * SECONDS_PER_RUN / PARALLEL)))
+  start_proxy "user_${rate}" --user-rate "${rate}"
+  for run in $(seq 1 "${REPEATS}"); do
+    start=$(date +%s.%N)
+    pids=()
+    for _ in $(seq 1 "${PARALLEL}"); do
+      download "${part}" >/dev/null &
+      pids+=($!)
+    done
+    wait "${pids[@]}"
+    duration=$(awk -v s="${start}" -v e="$(date +%s.%N)" 'BEGIN { printf "%.6f", e - s }')
+    record user "${bytes_per_s}" $(($(stat -c%s "${part}") * PARALLEL)) "${duration}" "${run}"
+  done
+  stop_proxy
+done
+
+big=$(file_of $((OVERHEAD_MB * 1024 * 1024)))
+for mode in uncapped capped; do
+  if [[ "${mode}" == "uncapped" ]]; then
+    start_proxy overhead_uncapped
+  else
+    start_proxy overhead_capped --conn-rate 1024G --user-rate 1024G
+  fi
+  for run in $(seq 1 "${REPEATS}"); do
+    record "overhead_${mode}" 0 "$(stat -c%s "${big}")" "$(download "${big}")" "${run}"
+  done
+  stop_proxy
+done
+
+echo "Done. Results at ${OUTPUT_CSV}"
@@ -0,0 +1,259 @@
+#if !defined(_POSIX_C_SOURCE) || _POSIX_C_SOURCE < 200809L
+#undef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "access_log.h"
+
+// Turns the binary access log (see access_log.h) back into the lines the
+// text format writes, optionally keeping only some user or destination.
+// Filters are resolved to name numbers as NAME records show up, so
+// sessions are matched without looking at any string.
+
+#define READ_BUFFER (1024 * 1024)
+
+static void usage(const char *progname) {
+  fprintf(stderr,
+          "Usage: %s [OPTIONS] [FILE...]\n"
+          "\n"
+          "Prints the sessions in binary access logs (default: %s) as "
+          "text.\n"
+          "\n"
+          "Options:\n"
+          "  -u <user>   Only sessions of this user\n"
+          "  -d <host>   Only sessions to this destination, a name or an IP\n"
+          "              as the client requested it\n"
+          "  -h          Show this help message\n",
+          progname, ACCESS_LOG_FILE);
+  exit(1);
+}
+
+// =============================================================================
+// Names
+// =============================================================================
+
+struct name {
+  char *text;
+  bool user_match;
+  bool dest_match;
+};
+
+static struct name *names = NULL;
+static size_t names_len = 0;
+
+static const char *user_filter = NULL;
+static const char *dest_filter = NULL;
+static uint8_t dest_filter_addr[16];
+static int dest_filter_family = AF_UNSPEC; // AF_UNSPEC: filter by name
+
+static void names_clear(void) {
+  for (size_t i = 0; i < names_len; i++) {
+    free(names[i].text);
+    names[i] = (struct name){0};
+  }
+}
+
+static bool name_define(uint32_t id, const char *text, size_t len) {
+  if (id >= names_len) {
+    size_t n = names_len == 0 ? 1024 : names_len;
+    while (n <= id) {
+      n *= 2;
+    }
+    struct name *grown = realloc(names, n * sizeof(*names));
+    if (grown == NULL) {
+      return false;
+    }
+    memset(grown + names_len, 0, (n - names_len) * sizeof(*names));
+    names = grown;
+    names_len = n;
+  }
+
+  struct name *name = &names[id];
+  free(name->text);
+  name->text = malloc(len + 1);
+  if (name->text == NULL) {
+    return false;
+  }
+  memcpy(name->text, text, len);
+  name->text[len] = '\0';
+  name->user_match = user_filter != NULL && strcmp(name->text, user_filter) == 0;
+  name->dest_match = dest_filter != NULL && strcmp(name->text, dest_filter) == 0;
+  return true;
+}
+
+static const struct name *name_get(uint32_t id) {
+  static const struct name unknown = {.text = "?"};
+  return id < names_len && names[id].text != NULL ? &names[id] : &unknown;
+}
+
+// =============================================================================
+// Sessions
+// =============================================================================
+
+static bool session_matches(const struct access_record_session *rec) {
+  if (user_filter != NULL &&
+      (rec->user_id == ACCESS_NO_NAME || !name_get(rec->user_id)->user_match)) {
+    return false;
+  }
+  if (dest_filter == NULL) {
+    return true;
+  }
+  if (rec->flags & ACCESS_DEST_NAME) {
+    return dest_filter_family == AF_UNSPEC &&
+           name_get(rec->dest.name_id)->dest_match;
+  }
+  const int family = (rec->flags & ACCESS_DEST_IPV6) ? AF_INET6 : AF_INET;
+  return family == dest_filter_family &&
+         memcmp(rec->dest.addr, dest_filter_addr,
+                family == AF_INET ? 4 : 16) == 0;
+}
+
+static void session_print(const struct access_record_session *rec) {
+  char stamp[32];
+  const time_t t = (time_t)(rec->time_ms / 1000);
+  struct tm tm_info;
+  localtime_r(&t, &tm_info);
+  strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm_info);
+
+  char client[INET6_ADDRSTRLEN];
+  const bool client_v6 = rec->flags & ACCESS_CLIENT_IPV6;
+  inet_ntop(client_v6 ? AF_INET6 : AF_INET, rec->client_addr, client,
+            sizeof(client));
+
+  char dest[INET6_ADDRSTRLEN];
+  const char *host = dest;
+  if (rec->flags & ACCESS_DEST_NAME) {
+    host = name_get(rec->dest.name_id)->text;
+  } else {
+    inet_ntop((rec->flags & ACCESS_DEST_IPV6) ? AF_INET6 : AF_INET,
+              rec->dest.addr, dest, sizeof(dest));
+  }
+
+  char status[16] = "OK";
+  if (rec->status != 0) {
+    snprintf(status, sizeof(status), "FAIL(%u)", rec->status);
+  }
+
+  printf("%s %s %s%s%s:%u -> %s:%u %s up=%lu down=%lu %lums\n", stamp,
+         rec->user_id == ACCESS_NO_NAME ? "-" : name_get(rec->user_id)->text,
+         client_v6 ? "[" : "", client, client_v6 ? "]" : "",
+         rec->client_port, host, rec->dest_port, status,
+         (unsigned long)rec->bytes_up, (unsigned long)rec->bytes_down,
+         (unsigned long)rec->duration_ms);
+}
+
+// =============================================================================
+// Files
+// =============================================================================
+
+static bool read_exact(FILE *f, void *buf, size_t len) {
+  return fread(buf, 1, len, f) == len;
+}
+
+static bool decode(const char *path) {
+  FILE *f = fopen(path, "rb");
+  if (f == NULL) {
+    perror(path);
+    return false;
+  }
+  setvbuf(f, NULL, _IOFBF, READ_BUFFER);
+
+  bool started = false, ok = true;
+  int type;
+  while (ok && (type = fgetc(f)) != EOF) {
+    if (!started && type != ACCESS_RECORD_START) {
+      fprintf(stderr, "%s: not a binary access log\n", path);
+      ok = false;
+      break;
+    }
+
+    switch (type) {
+      case ACCESS_RECORD_START: {
+        struct access_record_start start = {.type = (uint8_t)type};
+        ok = read_exact(f, (uint8_t *)&start + 1, sizeof(start) - 1);
+        if (ok && (memcmp(start.magic, ACCESS_LOG_MAGIC, 4) != 0 ||
+                   start.version != ACCESS_LOG_VERSION ||
+                   start.session_size !=
+                       sizeof(struct access_record_session))) {
+          fprintf(stderr, "%s: unsupported access log version\n", path);
+          ok = false;
+        }
+        names_clear();
+        started = true;
+        break;
+      }
+      case ACCESS_RECORD_NAME: {
+        struct access_record_name header = {.type = (uint8_t)type};
+        char text[UINT8_MAX];
+        ok = read_exact(f, (uint8_t *)&header + 1, sizeof(header) - 1) &&
+             read_exact(f, text, header.len) &&
+             name_define(header.id, text, header.len);
+        break;
+      }
+      case ACCESS_RECORD_SESSION: {
+        struct access_record_session rec = {.type = (uint8_t)type};
+        ok = read_exact(f, (uint8_t *)&rec + 1, sizeof(rec) - 1);
+        if (ok && session_matches(&rec)) {
+          session_print(&rec);
+        }
+        break;
+      }
+      default:
+        fprintf(stderr, "%s: unknown record type %d\n", path, type);
+        ok = false;
+        break;
+    }
+  }
+  if (!ok && !ferror(f) && feof(f)) {
+    fprintf(stderr, "%s: truncated record at the end\n", path);
+  }
+
+  fclose(f);
+  return ok;
+}
+
+int main(int argc, char *argv[]) {
+  int opt;
+  while ((opt = getopt(argc, argv, "u:d:h")) != -1) {
+    switch (opt) {
+      case 'u':
+        user_filter = optarg;
+        break;
+      case 'd':
+        dest_filter = optarg;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+
+  if (dest_filter != NULL) {
+    if (inet_pton(AF_INET6, dest_filter, dest_filter_addr) == 1) {
+      dest_filter_family = AF_INET6;
+    } else if (inet_pton(AF_INET, dest_filter, dest_filter_addr) == 1) {
+      dest_filter_family = AF_INET;
+    }
+  }
+
+  bool ok = true;
+  if (optind == argc) {
+    ok = decode(ACCESS_LOG_FILE);
+  }
+  for (int i = optind; i < argc; i++) {
+    ok = decode(argv[i]) && ok;
+  }
+
+  names_clear();
+  free(names);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,234 @@
+#include "admission.h"
+
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "args.h"
+#include "metrics.h"
+#include "socks5nio.h"
+
+extern struct socks5args socks5args;
+
+// =============================================================================
+// Per address counts
+// =============================================================================
+
+#define BUCKETS 1024 // power of two, a multiple of ADMISSION_STRIPES
+
+// IPv4 clients of a dual-stack listener show up as ::ffff:a.b.c.d, so every
+// address is kept in that form
+struct address {
+  uint8_t bytes[16];
+};
+
+struct address_count {
+  struct address addr;
+  unsigned count;
+  struct address_count *next;
+};
+
+static pthread_mutex_t stripes[ADMISSION_STRIPES];
+static pthread_once_t stripes_once = PTHREAD_ONCE_INIT;
+static struct address_count *buckets[BUCKETS];
+
+static void stripes_init(void) {
+  for (unsigned i = 0; i < ADMISSION_STRIPES; i++) {
+    pthread_mutex_init(&stripes[i], NULL);
+  }
+}
+
+static void address_of(const struct sockaddr_storage *ss, struct address *a) {
+  memset(a, 0, sizeof(*a));
+  if (ss->ss_family == AF_INET6) {
+    memcpy(a->bytes, &((const struct sockaddr_in6 *)ss)->sin6_addr, 16);
+  } else if (ss->ss_family == AF_INET) {
+    a->bytes[10] = a->bytes[11] = 0xff;
+    memcpy(a->bytes + 12, &((const struct sockaddr_in *)ss)->sin_addr, 4);
+  }
+}
+
+// FNV-1a
+static uint32_t address_hash(const struct address *a) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < sizeof(a->bytes); i++) {
+    h = (h ^ a->bytes[i]) * 16777619u;
+  }
+  return h;
+}
+
+// Buckets are spread over the stripes, so a stripe's lock covers every
+// bucket b with b % ADMISSION_STRIPES == stripe
+static pthread_mutex_t *bucket_lock(uint32_t bucket) {
+  pthread_once(&stripes_once, stripes_init);
+  return &stripes[bucket % ADMISSION_STRIPES];
+}
+
+static struct address_count **find(const struct address *a, uint32_t bucket) {
+  struct address_count **p = &buckets[bucket];
+  while (*p != NULL && memcmp(&(*p)->addr, a, sizeof(*a)) != 0) {
+    p = &(*p)->next;
+  }
+  return p;
+}
+
+static bool address_acquire(const struct sockaddr_storage *ss, unsigned max) {
+  struct address a;
+  address_of(ss, &a);
+  const uint32_t bucket = address_hash(&a) & (BUCKETS - 1);
+
+  bool admitted = true;
+  pthread_mutex_lock(bucket_lock(bucket));
+  struct address_count **p = find(&a, bucket);
+  if (*p == NULL) {
+    // Out of memory the address just goes uncounted
+    struct address_count *c = malloc(sizeof(*c));
+    if (c != NULL) {
+      *c = (struct address_count){.addr = a, .count = 1};
+      *p = c;
+    }
+  } else if ((*p)->count >= max) {
+    admitted = false;
+  } else {
+    (*p)->count++;
+  }
+  pthread_mutex_unlock(bucket_lock(bucket));
+  return admitted;
+}
+
+static void address_release(const struct sockaddr_storage *ss) {
+  struct address a;
+  address_of(ss, &a);
+  const uint32_t bucket = address_hash(&a) & (BUCKETS - 1);
+
+  struct address_count *gone = NULL;
+  pthread_mutex_lock(bucket_lock(bucket));
+  struct address_count **p = find(&a, bucket);
+  if (*p != NULL && --(*p)->count == 0) {
+    gone = *p;
+    *p = gone->next;
+  }
+  pthread_mutex_unlock(bucket_lock(bucket));
+  free(gone);
+}
+
+void admission_destroy(void) {
+  for (uint32_t b = 0; b < BUCKETS; b++) {
+    pthread_mutex_lock(bucket_lock(b));
+    struct address_count *c = buckets[b];
+    buckets[b] = NULL;
+    pthread_mutex_unlock(bucket_lock(b));
+    while (c != NULL) {
+      struct address_count *next = c->next;
+      free(c);
+      c = next;
+    }
+  }
+}
+
+// =============================================================================
+// Admission
+// =============================================================================
+
+static unsigned long open_conns = 0;
+
+static bool full(void) {
+  return socks5args.max_conns > 0 &&
+         __atomic_load_n(&open_conns, __ATOMIC_RELAXED) >= socks5args.max_conns;
+}
+
+enum admission_result admission_acquire(const struct sockaddr_storage *addr) {
+  const unsigned long n =
+      __atomic_add_fetch(&open_conns, 1, __ATOMIC_RELAXED);
+  // Another worker may have taken the last slot since we last looked
+  if (socks5args.max_conns > 0 && n > socks5args.max_conns) {
+    __atomic_sub_fetch(&open_conns, 1, __ATOMIC_RELAXED);
+    metrics_admission_rejected(METRICS_REJECTED_GLOBAL);
+    return ADMISSION_FULL;
+  }
+  if (socks5args.max_conns_per_ip > 0 &&
+      !address_acquire(addr, socks5args.max_conns_per_ip)) {
+    __atomic_sub_fetch(&open_conns, 1, __ATOMIC_RELAXED);
+    metrics_admission_rejected(METRICS_REJECTED_PER_IP);
+    return ADMISSION_IP_FULL;
+  }
+  return ADMISSION_OK;
+}
+
+unsigned long admission_open(void) {
+  return __atomic_load_n(&open_conns, __ATOMIC_RELAXED);
+}
+
+void admission_refuse(int fd) {
+  // What the client may have sent already is dropped, or closing with it
+  // unread would reset the connection before the reply is read
+  uint8_t greeting[2 + 255];
+  while (recv(fd, greeting, sizeof(greeting), MSG_DONTWAIT) > 0) {
+  }
+  static const uint8_t no_method[] = {SOCKS_VERSION, SOCKS_AUTH_NO_ACCEPTABLE};
+  send(fd, no_method, sizeof(no_method), MSG_DONTWAIT | MSG_NOSIGNAL);
+  close(fd);
+}
+
+// =============================================================================
+// Listeners
+// =============================================================================
+
+static _Thread_local int listeners[ADMISSION_MAX_LISTENERS];
+static _Thread_local unsigned listener_count = 0;
+static _Thread_local bool paused = false;
+
+void admission_listener(int fd) {
+  if (listener_count < ADMISSION_MAX_LISTENERS) {
+    listeners[listener_count++] = fd;
+  }
+}
+
+static void listeners_interest(fd_selector s, fd_interest interest,
+                               unsigned timeout_ms) {
+  for (unsigned i = 0; i < listener_count; i++) {
+    selector_set_interest(s, listeners[i], interest);
+    selector_set_timeout(s, listeners[i], timeout_ms);
+  }
+}
+
+bool admission_pause_if_full(fd_selector s) {
+  if (!full()) {
+    return false;
+  }
+  if (!paused) {
+    paused = true;
+    metrics_listener_paused();
+    listeners_interest(s, OP_NOOP, ADMISSION_RETRY_MS);
+  }
+  return true;
+}
+
+static void resume(fd_selector s) {
+  paused = false;
+  listeners_interest(s, OP_READ, 0);
+}
+
+void admission_release(fd_selector s, const struct sockaddr_storage *addr) {
+  if (socks5args.max_conns_per_ip > 0) {
+    address_release(addr);
+  }
+  __atomic_sub_fetch(&open_conns, 1, __ATOMIC_RELAXED);
+  if (paused && !full()) {
+    resume(s);
+  }
+}
+
+void admission_listener_timeout(struct selector_key *key) {
+  if (!paused) {
+    return;
+  }
+  if (full()) {
+    selector_set_timeout(key->s, key->fd, ADMISSION_RETRY_MS);
+  } else {
+    resume(key->s);
+  }
+}
@@ -0,0 +1,80 @@
+#include "auth_parser.h"
+
+#include <string.h>
+
+//+----+------+----------+------+----------+
+//|VER | ULEN |  UNAME   | PLEN |  PASSWD  |
+//+----+------+----------+------+----------+
+//| 1  |  1   | 1 to 255 |  1   | 1 to 255 |
+//+----+------+----------+------+----------+
+
+#define AUTH_VERSION_1 0x01
+
+// The whole request from the buffer, if it is all there and valid; nothing
+// is consumed otherwise
+static bool auth_consume_message(struct auth_st* a) {
+  size_t n;
+  const uint8_t* ptr = buffer_read_ptr(a->rb, &n);
+  if (n < 2 || ptr[0] != AUTH_VERSION_1 || ptr[1] == 0) {
+    return false;
+  }
+  const size_t ulen = ptr[1];
+  if (n < 3 + ulen || ptr[2 + ulen] == 0) {
+    return false;
+  }
+  const size_t plen = ptr[2 + ulen];
+  if (n < 3 + ulen + plen) {
+    return false;
+  }
+
+  a->ulen = ulen;
+  memcpy(a->username, ptr + 2, ulen);
+  a->username[ulen] = 0;
+  a->plen = plen;
+  memcpy(a->password, ptr + 3 + ulen, plen);
+  a->password[plen] = 0;
+  buffer_read_adv(a->rb, 3 + ulen + plen);
+  a->state = AUTH_DONE;
+  return true;
+}
+
+enum auth_state auth_consume(struct auth_st* a) {
+  if (a->state == AUTH_VERSION && auth_consume_message(a)) {
+    return a->state;
+  }
+
+  while (buffer_can_read(a->rb) && a->state != AUTH_DONE &&
+         a->state != AUTH_ERROR) {
+    uint8_t byte = buffer_read(a->rb);
+    switch (a->state) {
+      case AUTH_VERSION:
+        a->state = (byte == AUTH_VERSION_1) ? AUTH_ULEN : AUTH_ERROR;
+        break;
+      case AUTH_ULEN:
+        a->ulen = byte;
+        a->idx = 0;
+        a->state = (byte == 0) ? AUTH_ERROR : AUTH_UNAME;
+        break;
+      case AUTH_UNAME:
+        a->username[a->idx++] = byte;
+        if (a->idx >= a->ulen) {
+          a->username[a->idx] = 0;
+          a->state = AUTH_PLEN;
+        }
+        break;
+      case AUTH_PLEN:
+        a->plen = byte;
+        a->idx = 0;
+        a->state = (byte == 0) ? AUTH_ERROR : AUTH_PASSWD;
+        break;
+      case AUTH_PASSWD:
+        a->password[a->idx++] = byte;
+        if (a->idx >= a->plen) {
+          a->password[a->idx] = 0;
+          a->state = AUTH_DONE;
+        }
+        break;
+    }
+  }
+  return a->state;
+}
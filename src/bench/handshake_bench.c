@@ -0,0 +1,182 @@
+/**
+ * handshake_bench.c - Microbenchmark of the handshake parsers
+ *
+ * Replays a set of recorded SOCKS handshakes (greeting, username/password
+ * and a CONNECT to an IPv4 address or a name) through hello_consume(),
+ * auth_consume() and request_consume(), the way a reconnect storm hits
+ * them, and prints the CPU time per handshake:
+ *   - whole: each message arrives in one read, the usual case
+ *   - split: each message arrives as its first byte and then the rest,
+ *            which sends it all through the byte at a time fallback
+ *
+ * Usage: handshake_bench [handshakes] [rounds]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "auth_parser.h"
+#include "hello_parser.h"
+#include "request_parser.h"
+
+#define RECORDED 256 // distinct handshakes replayed in a loop
+
+struct message {
+  uint8_t bytes[300];
+  size_t len;
+};
+
+struct handshake {
+  struct message hello, auth, request;
+};
+
+static struct handshake recorded[RECORDED];
+
+static void record(void) {
+  for (unsigned i = 0; i < RECORDED; i++) {
+    struct handshake *h = &recorded[i];
+    const uint8_t hello[] = {0x05, 0x02, 0x00, 0x02};
+    memcpy(h->hello.bytes, hello, sizeof(hello));
+    h->hello.len = sizeof(hello);
+
+    char user[32], pass[32];
+    const int ulen = snprintf(user, sizeof(user), "user%04u", i);
+    const int plen = snprintf(pass, sizeof(pass), "secret-password-%u", i);
+    uint8_t *p = h->auth.bytes;
+    *p++ = 0x01;
+    *p++ = ulen;
+    memcpy(p, user, ulen);
+    p += ulen;
+    *p++ = plen;
+    memcpy(p, pass, plen);
+    p += plen;
+    h->auth.len = p - h->auth.bytes;
+
+    p = h->request.bytes;
+    *p++ = SOCKS_VERSION;
+    *p++ = SOCKS_CMD_CONNECT;
+    *p++ = SOCKS_RSV;
+    if (i % 2 == 0) {
+      *p++ = SOCKS_ATYP_IPV4;
+      const uint8_t ip[] = {10, 0, i >> 8, i & 0xFF};
+      memcpy(p, ip, sizeof(ip));
+      p += sizeof(ip);
+    } else {
+      char host[64];
+      const int len = snprintf(host, sizeof(host), "host-%u.example.com", i);
+      *p++ = SOCKS_ATYP_DOMAIN;
+      *p++ = len;
+      memcpy(p, host, len);
+      p += len;
+    }
+    *p++ = 0x01;
+    *p++ = 0xBB;
+    h->request.len = p - h->request.bytes;
+  }
+}
+
+// Session state, as in struct socks5: the inline handshake buffer and the
+// per state parsers that share it
+struct session {
+  uint8_t data[HANDSHAKE_BUFFER_SIZE];
+  buffer rb;
+  struct hello_parser hello;
+  uint8_t method;
+  struct auth_st auth;
+  struct request_st request;
+};
+
+static void on_method(struct hello_parser *p, const uint8_t method) {
+  if (method == SOCKS_AUTH_USERPASS) {
+    *(uint8_t *)p->data = method;
+  }
+}
+
+// What recv() would do
+static void deliver(struct session *s, const uint8_t *bytes, size_t n) {
+  size_t room;
+  uint8_t *ptr = buffer_write_ptr(&s->rb, &room);
+  memcpy(ptr, bytes, n);
+  buffer_write_adv(&s->rb, n);
+}
+
+static size_t first_part(const struct message *m, bool split) {
+  return split ? 1 : m->len;
+}
+
+// 0 if the handshake parsed, as it must
+static int replay(struct session *s, const struct handshake *h, bool split) {
+  bool error;
+  buffer_init(&s->rb, sizeof(s->data), s->data);
+
+  hello_parser_init(&s->hello);
+  s->method = SOCKS_AUTH_NO_ACCEPTABLE;
+  s->hello.data = &s->method;
+  s->hello.on_authentication_method = on_method;
+  size_t n = first_part(&h->hello, split);
+  deliver(s, h->hello.bytes, n);
+  hello_consume(&s->rb, &s->hello, &error);
+  deliver(s, h->hello.bytes + n, h->hello.len - n);
+  if (hello_consume(&s->rb, &s->hello, &error) != HELLO_DONE) {
+    return 1;
+  }
+
+  buffer_reset(&s->rb);
+  s->auth.rb = &s->rb;
+  s->auth.state = AUTH_VERSION;
+  n = first_part(&h->auth, split);
+  deliver(s, h->auth.bytes, n);
+  auth_consume(&s->auth);
+  deliver(s, h->auth.bytes + n, h->auth.len - n);
+  if (auth_consume(&s->auth) != AUTH_DONE) {
+    return 1;
+  }
+
+  buffer_reset(&s->rb);
+  s->request.rb = &s->rb;
+  s->request.state = REQUEST_VERSION;
+  n = first_part(&h->request, split);
+  deliver(s, h->request.bytes, n);
+  request_consume(&s->request);
+  deliver(s, h->request.bytes + n, h->request.len - n);
+  return request_consume(&s->request) != REQUEST_DONE;
+}
+
+static double now_s(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+  const unsigned long count = argc > 1 ? strtoul(argv[1], NULL, 10) : 4000000;
+  const unsigned rounds = argc > 2 ? strtoul(argv[2], NULL, 10) : 5;
+  if (count == 0 || rounds == 0) {
+    fprintf(stderr, "usage: handshake_bench [handshakes] [rounds]\n");
+    return 1;
+  }
+  record();
+
+  printf("mode,handshakes,best_seconds,ns_per_handshake,handshakes_per_s\n");
+  static struct session s;
+  for (int split = 0; split < 2; split++) {
+    double best = 0;
+    for (unsigned r = 0; r < rounds; r++) {
+      int failed = 0;
+      const double start = now_s();
+      for (unsigned long i = 0; i < count; i++) {
+        failed |= replay(&s, &recorded[i % RECORDED], split);
+      }
+      const double t = now_s() - start;
+      if (failed) {
+        fprintf(stderr, "a replayed handshake didn't parse\n");
+        return 1;
+      }
+      best = r == 0 || t < best ? t : best;
+    }
+    printf("%s,%lu,%.6f,%.1f,%.0f\n", split ? "split" : "whole", count, best,
+           best * 1e9 / count, count / best);
+  }
+  return 0;
+}
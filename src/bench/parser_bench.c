@@ -0,0 +1,176 @@
+/**
+ * parser_bench.c - Microbenchmark of the parser engine
+ *
+ * Runs a case-insensitive search for "PASS " over a buffer of text, as the
+ * dissectors do, with each way of feeding the engine:
+ *   - list:         parser_feed() walking each state's transitions
+ *   - table:        parser_feed() on the compiled table
+ *   - list-buffer:  parser_feed_buffer() without a table
+ *   - table-buffer: parser_feed_buffer() on the compiled table
+ * and prints the throughput of each. All of them must find the same
+ * matches.
+ *
+ * Usage: parser_bench [MiB] [rounds]
+ */
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "parser.h"
+
+#define NEEDLE "PASS "
+#define NEEDLE_LEN (sizeof(NEEDLE) - 1)
+#define NEEDLE_EVERY 4096 // bytes of text between planted matches
+
+enum bench_event { EV_NONE, EV_MATCH };
+
+static void none(struct parser_event *e, const uint8_t c) {
+  e->type = EV_NONE;
+  e->n = 1;
+  e->data[0] = c;
+}
+
+static void found(struct parser_event *e, const uint8_t c) {
+  e->type = EV_MATCH;
+  e->n = 1;
+  e->data[0] = c;
+}
+
+// State i has matched the first i characters. The needle's first character
+// doesn't repeat, so a mismatch restarts at 0, or at 1 on that character.
+static struct parser_state_transition transitions[NEEDLE_LEN][5];
+static const struct parser_state_transition *states[NEEDLE_LEN];
+static size_t states_n[NEEDLE_LEN];
+static const struct parser_definition definition = {
+    .states_count = NEEDLE_LEN,
+    .states = states,
+    .states_n = states_n,
+    .start_state = 0,
+};
+
+static void needle_init(void) {
+  for (unsigned i = 0; i < NEEDLE_LEN; i++) {
+    struct parser_state_transition *t = transitions[i];
+    const bool last = i + 1 == NEEDLE_LEN;
+    const unsigned dest = last ? 0 : i + 1;
+    size_t n = 0;
+    t[n++] = (struct parser_state_transition){
+        .when = tolower(NEEDLE[i]), .dest = dest, .act1 = last ? found : none};
+    if (toupper(NEEDLE[i]) != tolower(NEEDLE[i])) {
+      t[n++] = (struct parser_state_transition){
+          .when = toupper(NEEDLE[i]), .dest = dest,
+          .act1 = last ? found : none};
+    }
+    t[n++] = (struct parser_state_transition){
+        .when = tolower(NEEDLE[0]), .dest = 1, .act1 = none};
+    t[n++] = (struct parser_state_transition){
+        .when = toupper(NEEDLE[0]), .dest = 1, .act1 = none};
+    t[n++] = (struct parser_state_transition){
+        .when = ANY, .dest = 0, .act1 = none};
+    states[i] = t;
+    states_n[i] = n;
+  }
+}
+
+static uint8_t *text(size_t size) {
+  uint8_t *b = malloc(size);
+  if (b == NULL) {
+    return NULL;
+  }
+  static const char alphabet[] =
+      "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789 \r\n";
+  unsigned seed = 1;
+  for (size_t i = 0; i < size; i++) {
+    seed = seed * 1103515245u + 12345u;
+    b[i] = alphabet[(seed >> 16) % (sizeof(alphabet) - 1)];
+  }
+  for (size_t i = NEEDLE_EVERY; i + NEEDLE_LEN < size; i += NEEDLE_EVERY) {
+    memcpy(b + i, NEEDLE, NEEDLE_LEN);
+  }
+  return b;
+}
+
+static double now_s(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t by_byte(struct parser *p, const uint8_t *b, size_t n) {
+  size_t matches = 0;
+  for (size_t i = 0; i < n; i++) {
+    matches += parser_feed(p, b[i])->type == EV_MATCH;
+  }
+  return matches;
+}
+
+static size_t by_buffer(struct parser *p, const uint8_t *b, size_t n) {
+  size_t matches = 0;
+  const struct parser_event *e;
+  for (size_t i = 0; i < n;) {
+    i += parser_feed_buffer(p, b + i, n - i, PARSER_EVENT_BIT(EV_MATCH), &e);
+    matches += e != NULL;
+  }
+  return matches;
+}
+
+struct engine {
+  const char *name;
+  bool table;
+  size_t (*run)(struct parser *p, const uint8_t *b, size_t n);
+};
+
+int main(int argc, char **argv) {
+  const size_t mib = argc > 1 ? strtoul(argv[1], NULL, 10) : 64;
+  const unsigned rounds = argc > 2 ? strtoul(argv[2], NULL, 10) : 5;
+  const size_t size = mib << 20;
+
+  needle_init();
+  uint8_t *b = text(size);
+  struct parser_table *table =
+      parser_table_compile(parser_no_classes(), &definition);
+  if (b == NULL || table == NULL || rounds == 0) {
+    fprintf(stderr, "parser_bench: out of memory\n");
+    return 1;
+  }
+
+  static const struct engine engines[] = {
+      {"list", false, by_byte},
+      {"table", true, by_byte},
+      {"list-buffer", false, by_buffer},
+      {"table-buffer", true, by_buffer},
+  };
+  printf("engine,mib,best_seconds,mib_per_s,ns_per_byte,matches\n");
+  size_t expected = 0;
+  int ret = 0;
+  for (size_t i = 0; i < sizeof(engines) / sizeof(engines[0]); i++) {
+    const struct engine *e = &engines[i];
+    double best = 0;
+    size_t matches = 0;
+    for (unsigned r = 0; r < rounds; r++) {
+      struct parser p;
+      parser_init_at(&p, parser_no_classes(), &definition);
+      parser_use_table(&p, e->table ? table : NULL);
+      const double start = now_s();
+      matches = e->run(&p, b, size);
+      const double t = now_s() - start;
+      best = r == 0 || t < best ? t : best;
+    }
+    if (i == 0) {
+      expected = matches;
+    } else if (matches != expected) {
+      fprintf(stderr, "%s found %zu matches, list found %zu\n", e->name,
+              matches, expected);
+      ret = 1;
+    }
+    printf("%s,%zu,%.6f,%.1f,%.3f,%zu\n", e->name, mib, best, mib / best,
+           best * 1e9 / size, matches);
+  }
+
+  parser_table_destroy(table);
+  free(b);
+  return ret;
+}
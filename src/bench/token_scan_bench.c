@@ -0,0 +1,121 @@
+/**
+ * token_scan_bench.c - Microbenchmark of the multi-literal scanner
+ *
+ * Looks for "USER ", "PASS " and "AUTH " over a buffer of random bytes
+ * (what bulk traffic looks like to a dissector) with each implementation
+ * of token_scan_find() the machine supports, next to memchr() for a byte
+ * that isn't there, which runs at about the speed memory can be read.
+ * All the scanners must find the same matches.
+ *
+ * Usage: token_scan_bench [MiB] [rounds]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "token_scan.h"
+
+#define MATCH_EVERY (64 * 1024) // bytes between planted literals
+
+static const char *const keywords[] = {"USER ", "PASS ", "AUTH "};
+#define KEYWORDS (sizeof(keywords) / sizeof(keywords[0]))
+
+static uint8_t *bytes(size_t size) {
+  uint8_t *b = malloc(size);
+  if (b == NULL) {
+    return NULL;
+  }
+  unsigned seed = 1;
+  for (size_t i = 0; i < size; i++) {
+    seed = seed * 1103515245u + 12345u;
+    b[i] = seed >> 16;
+    // memchr() below looks for a 0 that never comes
+    b[i] += b[i] == 0;
+  }
+  for (size_t i = MATCH_EVERY, k = 0; i + 5 < size; i += MATCH_EVERY, k++) {
+    memcpy(b + i, keywords[k % KEYWORDS], 5);
+  }
+  return b;
+}
+
+// keeps the compiler from dropping the memchr() calls
+static const void *volatile sink;
+
+static double now_s(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t scan(const struct token_scan *s, const uint8_t *b, size_t n) {
+  size_t matches = 0;
+  for (size_t i = 0; (i += token_scan_find(s, b + i, n - i)) < n; i++) {
+    matches++;
+  }
+  return matches;
+}
+
+static void report(const char *name, size_t mib, double best, size_t size,
+                   size_t matches) {
+  printf("%s,%zu,%.6f,%.1f,%.3f,%zu\n", name, mib, best, mib / best,
+         best * 1e9 / size, matches);
+}
+
+int main(int argc, char **argv) {
+  const size_t mib = argc > 1 ? strtoul(argv[1], NULL, 10) : 64;
+  const unsigned rounds = argc > 2 ? strtoul(argv[2], NULL, 10) : 5;
+  const size_t size = mib << 20;
+
+  uint8_t *b = bytes(size);
+  struct token_scan s;
+  if (b == NULL || rounds == 0 || !token_scan_init(&s, keywords, KEYWORDS)) {
+    fprintf(stderr, "token_scan_bench: out of memory\n");
+    return 1;
+  }
+  printf("scanner,mib,best_seconds,mib_per_s,ns_per_byte,matches\n");
+
+  double best = 0;
+  for (unsigned r = 0; r < rounds; r++) {
+    const double start = now_s();
+    sink = memchr(b, 0, size);
+    const double t = now_s() - start;
+    best = r == 0 || t < best ? t : best;
+  }
+  report("memchr", mib, best, size, 0);
+
+  static const struct {
+    const char *name;
+    enum token_scan_impl impl;
+  } impls[] = {
+      {"scalar", TOKEN_SCAN_SCALAR},
+      {"sse2", TOKEN_SCAN_SSE2},
+      {"avx2", TOKEN_SCAN_AVX2},
+  };
+  size_t expected = 0;
+  int ret = 0;
+  for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+    if (!token_scan_use(&s, impls[i].impl)) {
+      printf("%s,%zu,,,,\n", impls[i].name, mib);
+      continue;
+    }
+    size_t matches = 0;
+    for (unsigned r = 0; r < rounds; r++) {
+      const double start = now_s();
+      matches = scan(&s, b, size);
+      const double t = now_s() - start;
+      best = r == 0 || t < best ? t : best;
+    }
+    if (i == 0) {
+      expected = matches;
+    } else if (matches != expected) {
+      fprintf(stderr, "%s found %zu matches, scalar found %zu\n",
+              impls[i].name, matches, expected);
+      ret = 1;
+    }
+    report(impls[i].name, mib, best, size, matches);
+  }
+
+  free(b);
+  return ret;
+}
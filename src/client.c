@@ -34,8 +34,13 @@ static void usage(const char *progname) {
             "  PING               Liveness check (returns PONG)\n"
             "  STATS              Show server statistics\n"
             "  USERS              List registered users\n"
+            "  BUFFERS            Show relay buffer sizes in use\n"
+            "  LATENCY            Show latency percentiles per phase\n"
+            "  USERSTATS [user]   Show traffic and sessions per user\n"
             "  ADD <user>:<pass>  Add a new user\n"
             "  DEL <user>         Delete a user\n"
+            "  RATE <user> <rate> Cap a user's bandwidth (bytes/s[K|M|G],\n"
+            "                     unlimited or default)\n"
             "\n"
             "If no command is provided, interactive mode is started.\n",
             progname, DEFAULT_MNG_ADDR, DEFAULT_MNG_PORT);
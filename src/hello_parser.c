@@ -7,10 +7,38 @@ void hello_parser_init(struct hello_parser* p) {
   p->state = HELLO_VERSION;
 }
 
+// The usual case: the whole greeting arrived in one read, so it is checked
+// and its methods reported straight from the buffer. False (and nothing
+// consumed) if it isn't all there or isn't valid, which the byte at a time
+// loop then sorts out.
+static bool hello_consume_message(buffer* b, struct hello_parser* p) {
+  size_t n;
+  const uint8_t* ptr = buffer_read_ptr(b, &n);
+  if (n < 2 || ptr[0] != SOCKS_VERSION || n < 2 + (size_t)ptr[1]) {
+    return false;
+  }
+  const uint8_t nmethods = ptr[1];
+  if (p->on_authentication_method != NULL) {
+    for (unsigned i = 0; i < nmethods; i++) {
+      p->on_authentication_method(p, ptr[2 + i]);
+    }
+  }
+  buffer_read_adv(b, 2 + nmethods);
+  p->remaining = 0;
+  p->state = HELLO_DONE;
+  return true;
+}
+
 enum hello_state hello_consume(buffer* b, struct hello_parser* p, bool* error) {
   *error = false;
 
-  while (buffer_can_read(b)) {
+  if (p->state == HELLO_VERSION && hello_consume_message(b, p)) {
+    return p->state;
+  }
+
+  // What follows the greeting isn't ours to read
+  while (buffer_can_read(b) && p->state != HELLO_DONE &&
+         p->state != HELLO_ERROR) {
     const uint8_t c = buffer_read(b);
     switch (p->state) {
       case HELLO_VERSION:
@@ -0,0 +1,84 @@
+/**
+ * access_log.h - Binary access log format
+ *
+ * With --access-log-format binary the server appends to access.bin a stream
+ * of records instead of the text lines of access.log. Each record starts
+ * with its type byte:
+ *
+ *  - START, written every time the server opens the file. Names defined
+ *    before it are forgotten.
+ *  - NAME, binding a number to a user or destination host name. A name is
+ *    defined once, before the first session using it; sessions refer to it
+ *    by that number, so filtering by user or host compares integers.
+ *  - SESSION, fixed size, one per session that got to send a request,
+ *    written when it ends.
+ *
+ * Integers are in host byte order; START carries the version and the size
+ * of SESSION so a reader on another architecture notices. build/bin/
+ * access_decode turns the file back into the text format.
+ */
+#ifndef ACCESS_LOG_H
+#define ACCESS_LOG_H
+
+#include <stdint.h>
+
+#define ACCESS_LOG_FILE "access.bin"
+#define ACCESS_LOG_MAGIC "S5AL"
+#define ACCESS_LOG_VERSION 1
+
+// user_id and dest_name_id of sessions without one
+#define ACCESS_NO_NAME UINT32_MAX
+
+enum access_record_type {
+  ACCESS_RECORD_START = 1,
+  ACCESS_RECORD_NAME,
+  ACCESS_RECORD_SESSION,
+};
+
+struct access_record_start {
+  uint8_t type;
+  uint8_t version;
+  uint16_t session_size; // sizeof(struct access_record_session)
+  char magic[4];         // ACCESS_LOG_MAGIC, unterminated
+  uint64_t time_ms;      // Unix time the file was opened
+};
+
+// Followed by `len` bytes of name, unterminated
+struct access_record_name {
+  uint8_t type;
+  uint8_t len;
+  uint16_t reserved;
+  uint32_t id;
+};
+
+// access_record_session.flags
+#define ACCESS_CLIENT_IPV6 0x01 // client_addr holds an IPv6 address
+#define ACCESS_DEST_IPV6 0x02   // dest.addr holds an IPv6 address
+#define ACCESS_DEST_NAME 0x04   // dest.name_id is valid, not dest.addr
+#define ACCESS_TRUNCATED 0x08   // the host name was cut short
+
+struct access_record_session {
+  uint8_t type;
+  uint8_t status; // SOCKS reply code sent to the client
+  uint8_t flags;
+  uint8_t reserved;
+  uint16_t client_port;
+  uint16_t dest_port;
+  uint32_t user_id;
+  uint32_t duration_ms;
+  uint64_t time_ms; // Unix time the session ended
+  uint64_t bytes_up;   // from the client
+  uint64_t bytes_down; // to the client
+  uint8_t client_addr[16]; // IPv4 in the first 4 bytes
+  union {
+    uint8_t addr[16]; // IPv4 in the first 4 bytes
+    uint32_t name_id;
+  } dest;
+};
+
+_Static_assert(sizeof(struct access_record_start) == 16, "START has padding");
+_Static_assert(sizeof(struct access_record_name) == 8, "NAME has padding");
+_Static_assert(sizeof(struct access_record_session) == 72,
+               "SESSION has padding");
+
+#endif // ACCESS_LOG_H
@@ -0,0 +1,82 @@
+/**
+ * admission.h - Caps on concurrent connections
+ *
+ * Three caps, all optional:
+ *   - --max-conns: connections open in the whole server (default 500).
+ *     Once reached, every worker stops polling its listening sockets, so
+ *     new clients wait in the kernel's backlog instead of being accepted
+ *     and closed. A worker resumes as soon as one of its own connections
+ *     closes, or on its listeners' next ADMISSION_RETRY_MS timer if the
+ *     room was made by another worker.
+ *   - --max-conns-per-ip: connections open from one client address. A
+ *     client over it is told that no authentication method is acceptable
+ *     (the only SOCKS failure that fits before its greeting) and closed.
+ *   - --max-user-sessions: sessions open by one user, checked once the
+ *     user authenticates (see user_stats_session_try_open()). A session
+ *     over it gets its request refused with "not allowed by ruleset".
+ *
+ * The global count is one atomic counter. Per address counts live in a
+ * hash table split into ADMISSION_STRIPES independently locked parts, and
+ * are only kept while --max-conns-per-ip is set.
+ *
+ * Every rejection is counted in metrics (see metrics_admission_rejected()).
+ */
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdbool.h>
+#include <sys/socket.h>
+
+#include "selector.h"
+
+#define ADMISSION_DEFAULT_MAX_CONNS 500
+#define ADMISSION_RETRY_MS 50
+#define ADMISSION_STRIPES 64
+
+// Listening sockets of one worker that can be paused
+#define ADMISSION_MAX_LISTENERS 2
+
+enum admission_result {
+  ADMISSION_OK,
+  ADMISSION_FULL,    // --max-conns reached
+  ADMISSION_IP_FULL, // --max-conns-per-ip reached for the address
+};
+
+/**
+ * Registers one of the calling worker's listening sockets, to be paused
+ * while the server is full.
+ */
+void admission_listener(int fd);
+
+/**
+ * Takes a slot for a connection just accepted from `addr`. Unless it
+ * returns ADMISSION_OK the connection must be refused (admission_refuse()),
+ * and no slot was taken.
+ */
+enum admission_result admission_acquire(const struct sockaddr_storage *addr);
+
+/**
+ * Gives back the slot of a connection from `addr`. Resumes the calling
+ * worker's listeners if they were paused and there is room now.
+ */
+void admission_release(fd_selector s, const struct sockaddr_storage *addr);
+
+/**
+ * Pauses the calling worker's listeners if the server is full; returns
+ * whether it is.
+ */
+bool admission_pause_if_full(fd_selector s);
+
+/** Timer of a paused listener: resumes it if there is room. */
+void admission_listener_timeout(struct selector_key *key);
+
+/** Closes a connection admission_acquire() didn't let in. */
+void admission_refuse(int fd);
+
+/** Connections currently admitted. */
+unsigned long admission_open(void);
+
+/** Frees the per address counts. */
+void admission_destroy(void);
+
+#endif // ADMISSION_H
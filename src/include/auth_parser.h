@@ -0,0 +1,17 @@
+#ifndef AUTH_PARSER_H
+#define AUTH_PARSER_H
+
+#include "socks5_internal.h"
+
+/**
+ * Consumes from a->rb the username/password request (RFC 1929) being
+ * read. Returns the new a->state: AUTH_DONE once username and password are
+ * in, AUTH_ERROR if the request is malformed, anything else if more bytes
+ * are needed. Bytes past the request are left in the buffer.
+ *
+ * A request that arrived whole is checked and copied in one go; one split
+ * across reads goes a byte at a time.
+ */
+enum auth_state auth_consume(struct auth_st *a);
+
+#endif
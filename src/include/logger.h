@@ -1,12 +1,29 @@
 
+/**
+ * logger.h - Asynchronous logging
+ *
+ * LOG_*() and logger_access() format their record on the calling thread
+ * into a preallocated lock-free ring and return; a writer thread started by
+ * logger_init() drains the ring with batched writev() calls, so event loops
+ * never block on the disk. When the ring is full the record is dropped and
+ * counted (see logger_dropped()); the writer reports the loss once there is
+ * room again. Records longer than LOG_RECORD_SIZE are cut short.
+ *
+ * Before logger_init() and after logger_close() records are written to
+ * stderr synchronously.
+ */
 #ifndef LOGGER_H
 #define LOGGER_H
 
 #include <netinet/in.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/socket.h>
 #include <time.h>
 
+// Longest record kept whole, timestamp and level included
+#define LOG_RECORD_SIZE 256
+
 typedef enum {
   LOG_DEBUG = 0,
   LOG_INFO,
@@ -14,15 +31,42 @@ typedef enum {
   LOG_ERROR,
 } log_level_t;
 
+// Format of the access log, see access_log.h for the binary one
+enum log_access_format {
+  LOG_ACCESS_TEXT,   // lines in access.log
+  LOG_ACCESS_BINARY, // records in access.bin
+};
+
+/** Picks the access log format; takes effect on the next logger_init(). */
+void logger_access_format(enum log_access_format format);
+
 void logger_init(const char *log_file, log_level_t min_level);
 
+/** Writes out every pending record and stops the writer thread. */
 void logger_close(void);
 
+/** Records lost because the ring was full, since startup. */
+uint64_t logger_dropped(void);
+
 void logger_log(log_level_t level, const char *fmt, ...);
 
-void logger_access(const char *username,
-                   const struct sockaddr_storage *client_addr,
-                   const char *dest_host, uint16_t dest_port, bool success);
+// A finished session, as the access log records it
+struct log_access {
+  const char *username; // NULL if the session didn't authenticate
+  const struct sockaddr_storage *client_addr;
+  const char *dest_host; // as requested: a name or an IP literal
+  uint16_t dest_port;
+  uint8_t status;       // SOCKS reply code, 0 on success
+  uint64_t bytes_up;    // from the client
+  uint64_t bytes_down;  // to the client
+  uint64_t duration_us;
+};
+
+/**
+ * Appends `entry` to the access log. In binary mode records are only kept
+ * while the writer thread runs; the rest count as dropped.
+ */
+void logger_access(const struct log_access *entry);
 
 #define LOG_DEBUG(...) logger_log(LOG_DEBUG, __VA_ARGS__)
 #define LOG_INFO(...) logger_log(LOG_INFO, __VA_ARGS__)
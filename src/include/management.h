@@ -13,7 +13,11 @@
  * Commands:
  *   STATS              - Get server statistics
  *   USERS              - List registered users
- *   ADD <user>:<pass>  - Add a new user
+ *   BUFFERS            - Show relay buffer sizing and buffers in use
+ *   LATENCY            - Show latency percentiles per session phase
+ *   USERSTATS [user]   - Show traffic and sessions per user
+ *   ADD <user>:<pass>  - Add a new user; a plain-text password is hashed
+ *                        off the event loop and the answer comes after
  *   DEL <user>         - Remove a user
  *   HELP               - Show available commands
  */
@@ -28,6 +32,9 @@
 #define MGMT_MAX_CMD_LEN 256
 #define MGMT_MAX_RESP_LEN 4096
 
+// ADDs whose password may be hashing at once; more are refused
+#define MGMT_MAX_PENDING_ADDS 16
+
 // Response status codes
 #define MGMT_STATUS_OK "OK"
 #define MGMT_STATUS_ERROR "ERR"
@@ -35,14 +42,24 @@
 // Commands
 #define MGMT_CMD_STATS "STATS"
 #define MGMT_CMD_USERS "USERS"
+#define MGMT_CMD_BUFFERS "BUFFERS"
+#define MGMT_CMD_LATENCY "LATENCY"
+#define MGMT_CMD_USERSTATS "USERSTATS"
 #define MGMT_CMD_ADD "ADD"
 #define MGMT_CMD_DEL "DEL"
+#define MGMT_CMD_RATE "RATE"
 #define MGMT_CMD_HELP "HELP"
 #define MGMT_CMD_QUIT "QUIT"
 #define MGMT_CMD_PING "PING"
 
 void mgmt_handle_request(struct selector_key *key);
 
+/**
+ * Answers the ADDs whose password finished hashing on a verifier thread
+ * (see verifier.h); the management socket's handle_block().
+ */
+void mgmt_handle_block(struct selector_key *key);
+
 void mgmt_init(void);
 
 void mgmt_cleanup(void);
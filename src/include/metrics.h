@@ -1,4 +1,3 @@
-
 #ifndef METRICS_H
 #define METRICS_H
 
@@ -6,17 +5,78 @@
 #include <stdint.h>
 #include <stdio.h>
 
+// Relay buffers are tracked per power-of-two size class, 4 KiB .. 4 MiB
+#define METRICS_BUFFER_CLASSES 11
+#define METRICS_BUFFER_MIN_SHIFT 12
+
+// Every thread that updates a counter gets its own shard, aligned to this,
+// so the hot path is a plain increment on a line no other core writes to.
+// Readers sum the shards; gauges like current_connections may be negative
+// in a single shard (a session closed on another thread) but not in total.
+#define METRICS_CACHE_LINE 64
+
+// Upper bound on the session states counted by metrics_session_state()
+#define METRICS_SESSION_STATES 16
+
+// Latency histograms are log-linear (HDR style): values below
+// 2^METRICS_HISTOGRAM_SUB_BITS microseconds get a bucket each, and every
+// power of two above is split into as many equal buckets, so a reported
+// percentile is within 1/16 (6.25%) of the real one. Values past
+// 2^METRICS_HISTOGRAM_MAX_SHIFT us (about 19 hours) land in the last bucket.
+#define METRICS_HISTOGRAM_SUB_BITS 4
+#define METRICS_HISTOGRAM_MAX_SHIFT 36
+#define METRICS_HISTOGRAM_BUCKETS                                            \
+  ((METRICS_HISTOGRAM_MAX_SHIFT - METRICS_HISTOGRAM_SUB_BITS + 1)            \
+   << METRICS_HISTOGRAM_SUB_BITS)
+
+// Phases of a session whose latency is tracked
+enum metrics_latency {
+  METRICS_LATENCY_AUTH,       // accept until the client may send its request
+  METRICS_LATENCY_RESOLVE,    // name lookup (cache hits included)
+  METRICS_LATENCY_CONNECT,    // first connection attempt until one succeeds
+  METRICS_LATENCY_FIRST_BYTE, // tunnel up until the origin's first byte
+  METRICS_LATENCY_SESSION,    // accept until close
+  METRICS_LATENCY_COUNT,
+};
+
+// Connections and sessions turned away by admission control (admission.h)
+enum metrics_rejection {
+  METRICS_REJECTED_GLOBAL,   // --max-conns
+  METRICS_REJECTED_PER_IP,   // --max-conns-per-ip
+  METRICS_REJECTED_PER_USER, // --max-user-sessions
+  METRICS_REJECTIONS,
+};
+
+struct metrics_histogram {
+  uint64_t count;
+  uint64_t sum; // us
+  uint64_t max; // us
+  uint64_t buckets[METRICS_HISTOGRAM_BUCKETS];
+};
+
 struct metrics {
-  volatile uint64_t historic_connections;
-  volatile uint64_t current_connections;
-  volatile uint64_t bytes_sent;
-  volatile uint64_t bytes_received;
-  volatile uint64_t auth_success;
-  volatile uint64_t auth_failure;
+  uint64_t historic_connections;
+  uint64_t current_connections;
+  uint64_t bytes_sent;
+  uint64_t bytes_received;
+  uint64_t auth_success;
+  uint64_t auth_failure;
+  uint64_t relay_buffers[METRICS_BUFFER_CLASSES]; // in use
+  uint64_t relay_buffer_grows;
+  uint64_t relay_buffer_shrinks;
+  uint64_t sessions[METRICS_SESSION_STATES]; // by state, see socks5_state
+  uint64_t rejected[METRICS_REJECTIONS];
+  uint64_t listener_pauses; // times a worker stopped accepting, server full
 };
 
-struct metrics *metrics_get(void);
+/**
+ * Fills `out` with the sum of every thread's counters. Each counter is read
+ * atomically, but the snapshot as a whole is not: counters updated while
+ * it is taken may be from slightly different instants.
+ */
+void metrics_snapshot(struct metrics *out);
 
+/** Zeroes every shard. Call before the worker threads start. */
 void metrics_init(void);
 
 void metrics_new_connection(void);
@@ -31,6 +91,54 @@ void metrics_auth_success(void);
 
 void metrics_auth_failure(void);
 
+void metrics_relay_buffer_attached(size_t size);
+
+void metrics_relay_buffer_detached(size_t size);
+
+void metrics_relay_buffer_resized(size_t old_size, size_t new_size);
+
+void metrics_admission_rejected(enum metrics_rejection why);
+
+void metrics_listener_paused(void);
+
+/** A session moved from state `from` to `to`; -1 stands for none. */
+void metrics_session_state(int from, int to);
+
+/** Monotonic clock in microseconds, the time base of the histograms. */
+uint64_t metrics_clock_us(void);
+
+void metrics_latency_record(enum metrics_latency phase, uint64_t us);
+
+/**
+ * Records the time elapsed since `start` (from metrics_clock_us()) and
+ * returns the current time, so phases can be chained:
+ *   s->phase_start = metrics_latency_since(PHASE, s->phase_start);
+ */
+uint64_t metrics_latency_since(enum metrics_latency phase, uint64_t start);
+
+/** Sum of every thread's histogram for `phase`. */
+void metrics_latency_snapshot(enum metrics_latency phase,
+                              struct metrics_histogram *out);
+
+/**
+ * Value below which `percentile` percent (0-100) of the recorded samples
+ * fall, rounded up to its bucket's upper bound and never above the maximum
+ * seen. 0 if nothing was recorded.
+ */
+uint64_t metrics_histogram_percentile(const struct metrics_histogram *h,
+                                      double percentile);
+
+/**
+ * Samples of `h` known to be at most `us`: those in buckets whose upper
+ * bound doesn't exceed it. Off by less than a bucket (6.25%) when `us`
+ * isn't a bucket boundary.
+ */
+uint64_t metrics_histogram_count_le(const struct metrics_histogram *h,
+                                    uint64_t us);
+
+/** Short name of `phase`, as shown by the management LATENCY command. */
+const char *metrics_latency_name(enum metrics_latency phase);
+
 void metrics_print(FILE *fp);
 
 #endif // METRICS_H
@@ -0,0 +1,50 @@
+/**
+ * metrics_http.h - OpenMetrics exposition over HTTP
+ *
+ * An optional plain HTTP/1.x listener, registered on a worker's selector
+ * like the management socket, that answers `GET /metrics` with the raw
+ * counters, gauges and latency histograms in the OpenMetrics text format.
+ * Prometheus can scrape it directly instead of parsing the human-formatted
+ * output of STATS.
+ *
+ * Scrapes never allocate: connections take one of METRICS_HTTP_MAX_CLIENTS
+ * static slots, each with its own request and response buffers, and the
+ * body is rendered straight into the latter. Every response closes the
+ * connection.
+ */
+#ifndef METRICS_HTTP_H
+#define METRICS_HTTP_H
+
+#include <stddef.h>
+
+#include "selector.h"
+
+// Scrapes served at once; further connections are closed right away
+#define METRICS_HTTP_MAX_CLIENTS 8
+
+// Room for a rendered body. Per-user series that don't fit are left out
+// whole; anything else that doesn't fit makes the scrape a 500.
+#define METRICS_HTTP_BODY_SIZE (256 * 1024)
+
+// Users whose series are exported by default (--metrics-users), the first
+// ones seen. Short names fit about a thousand.
+#define METRICS_HTTP_DEFAULT_USERS 500
+
+// Milliseconds a scraper gets to send its request and take the response
+#define METRICS_HTTP_TIMEOUT_MS 5000
+
+/**
+ * Serves scrapes arriving on `fd`, a listening non-blocking socket, from
+ * selector `s`. The caller keeps owning `fd` and closes it after the
+ * selector is destroyed.
+ */
+selector_status metrics_http_register(fd_selector s, int fd);
+
+/**
+ * Renders the OpenMetrics exposition into `buf`, with the series of at
+ * most socks5args.metrics_users users. Returns its length, or 0 if it
+ * didn't fit in `len` bytes even without them.
+ */
+size_t metrics_http_render(char *buf, size_t len);
+
+#endif // METRICS_HTTP_H
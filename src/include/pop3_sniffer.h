@@ -0,0 +1,76 @@
+/**
+ * pop3_sniffer.h - POP3 credential dissector
+ *
+ * Watches what a client sends through its tunnel for the POP3 USER and PASS
+ * commands (RFC 1939) and reports each name/password pair it sees. The
+ * command keywords are matched with parser_utils_strcmpi() machines,
+ * compiled to tables (parser_table_compile()) and shared by every session;
+ * each session only embeds their state, the argument being read and the
+ * last USER name, so nothing is allocated per session and a command split
+ * across any number of reads is still recognised.
+ *
+ * The matchers only see the start of lines that look like one of the
+ * keywords: token_scan.h finds those with SIMD and everything else is
+ * skipped without being looked at byte by byte.
+ *
+ * Only the start of a tunnel is looked at: POP3_SNIFF_PORT_BYTES of it when
+ * the origin is on POP3_PORT, POP3_SNIFF_PROBE_BYTES on any other port (for
+ * servers on unusual ports). Logins happen before that, and past it the
+ * relay only pays a branch per read.
+ */
+#ifndef POP3_SNIFFER_H
+#define POP3_SNIFFER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "parser.h"
+
+#define POP3_PORT 110
+#define POP3_SNIFF_PORT_BYTES 4096
+#define POP3_SNIFF_PROBE_BYTES 256
+#define POP3_ARG_MAX 128 // longest argument kept, terminator included
+
+enum pop3_sniffer_state {
+  POP3_COMMAND,  // matching the keyword at the start of a line
+  POP3_ARGUMENT, // reading the argument of USER or PASS
+  POP3_SKIP,     // any other line, up to its '\n'
+};
+
+struct pop3_sniffer {
+  size_t budget; // client bytes still to look at; 0 once done
+  uint8_t state; // enum pop3_sniffer_state
+  bool pass;     // the argument being read is a password
+  struct parser user_cmd;
+  struct parser pass_cmd;
+
+  char arg[POP3_ARG_MAX];
+  size_t arg_len;
+  char user[POP3_ARG_MAX]; // empty until a USER command is seen
+
+  void *data;
+  void (*on_credentials)(struct pop3_sniffer *p, const char *user,
+                         const char *password);
+};
+
+/** Starts looking at a tunnel to `port`. */
+void pop3_sniffer_init(struct pop3_sniffer *p, uint16_t port);
+
+/** Stops looking; pop3_sniffer_feed() ignores everything from now on. */
+void pop3_sniffer_stop(struct pop3_sniffer *p);
+
+static inline bool pop3_sniffer_active(const struct pop3_sniffer *p) {
+  return p->budget > 0;
+}
+
+/**
+ * Looks at the next `n` bytes the client sent. Calls on_credentials for
+ * every PASS that follows a USER.
+ */
+void pop3_sniffer_feed(struct pop3_sniffer *p, const uint8_t *bytes, size_t n);
+
+/** Frees the keyword matchers shared by every session. */
+void pop3_sniffer_destroy(void);
+
+#endif // POP3_SNIFFER_H
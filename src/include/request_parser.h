@@ -0,0 +1,18 @@
+#ifndef REQUEST_PARSER_H
+#define REQUEST_PARSER_H
+
+#include "socks5_internal.h"
+
+/**
+ * Consumes from r->rb the request (RFC 1928 section 4) being read. Returns
+ * the new r->state: REQUEST_DONE once it is complete, REQUEST_ERROR (with
+ * r->reply saying why) if it is malformed or asks for something we don't
+ * do, anything else if more bytes are needed. Bytes past the request are
+ * left in the buffer.
+ *
+ * A request that arrived whole is checked and copied in one go; one split
+ * across reads goes a byte at a time.
+ */
+enum request_state request_consume(struct request_st *r);
+
+#endif
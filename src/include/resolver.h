@@ -0,0 +1,110 @@
+/**
+ * resolver.h - Asynchronous, cached name resolution for the event loops
+ *
+ * getaddrinfo() blocks, so running it on a selector thread would stall every
+ * connection served by that loop. Lookups are queued to a small pool of
+ * resolver threads instead; when one finishes, the owning loop is woken
+ * through selector_notify_block() and the session's handle_block() picks up
+ * the result.
+ *
+ * Results are cached per (host, port): successful lookups for
+ * RESOLVER_CACHE_TTL seconds, failures for RESOLVER_NEGATIVE_TTL. Sessions
+ * asking for a name that is already being looked up wait for that lookup
+ * instead of starting another one. Answers are reference counted, so every
+ * session connecting to the same host shares one addrinfo list.
+ *
+ * Usage (from a selector thread):
+ *   job = resolver_submit(key->s, key->fd, "example.org", 443);
+ *   ...
+ *   // right away (cache hit) or in handle_block():
+ *   if (resolver_poll(job, &answer)) { ...job is gone, answer is ours... }
+ *   ...
+ *   resolver_answer_release(answer);
+ *   // or, if the session goes away before the answer arrives:
+ *   resolver_cancel(job);
+ */
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include <netdb.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "selector.h"
+
+// Resolver threads started by default
+#define RESOLVER_DEFAULT_THREADS 4
+
+// Lookups waiting for a thread beyond which resolver_submit() fails
+#define RESOLVER_MAX_QUEUED 1024
+
+// Cached names; the least recently used answer is evicted past this
+#define RESOLVER_CACHE_SIZE 1024
+
+// Seconds a successful / failed lookup is reused. getaddrinfo() doesn't
+// expose the record TTL, so this is an upper bound rather than the TTL.
+#define RESOLVER_CACHE_TTL 60
+#define RESOLVER_NEGATIVE_TTL 5
+
+struct resolver_job;
+
+struct resolver_answer {
+  int error;             // getaddrinfo() status, 0 on success
+  struct addrinfo *list; // NULL unless error == 0
+  unsigned refs;         // managed by resolver.c
+};
+
+struct resolver_stats {
+  uint64_t hits;      // answered from the cache
+  uint64_t misses;    // started a lookup
+  uint64_t coalesced; // joined a lookup already in flight
+  uint64_t evictions; // entries dropped for age or space
+  uint64_t entries;   // currently cached (or in flight)
+};
+
+/**
+ * Starts `threads` resolver threads. Returns 0 on success or -1 if none
+ * could be started.
+ */
+int resolver_init(unsigned threads);
+
+/**
+ * Stops and joins the resolver threads and drops the cache. Jobs still
+ * pending remain owned by their sessions, which release them with
+ * resolver_cancel() as usual.
+ *
+ * Must run before the selectors that may receive notifications are
+ * destroyed or their threads joined.
+ */
+void resolver_destroy(void);
+
+/**
+ * Asks for `host`:`port` (TCP, any family). On a cache hit the job is ready
+ * immediately; otherwise selector_notify_block(s, fd) is called from a
+ * resolver thread once it is.
+ *
+ * Returns NULL if the queue is full or memory is exhausted.
+ */
+struct resolver_job *resolver_submit(fd_selector s, int fd, const char *host,
+                                     uint16_t port);
+
+/**
+ * Checks whether `job` finished. If so, hands over a reference to the
+ * answer, releases the job and returns true. Returns false (and leaves the
+ * job alone) if it is still pending.
+ */
+bool resolver_poll(struct resolver_job *job, struct resolver_answer **answer);
+
+/**
+ * Releases a job whose answer is no longer wanted. Safe at any point of the
+ * job's life; the lookup itself still completes and fills the cache.
+ */
+void resolver_cancel(struct resolver_job *job);
+
+/** Drops a reference obtained from resolver_poll(). */
+void resolver_answer_release(struct resolver_answer *answer);
+
+/** Snapshot of the cache counters. */
+void resolver_get_stats(struct resolver_stats *stats);
+
+#endif // RESOLVER_H
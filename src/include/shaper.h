@@ -0,0 +1,74 @@
+/**
+ * shaper.h - Bandwidth caps for the tunnels
+ *
+ * Each direction of a tunnel may be capped on its own (--conn-rate) and,
+ * together with the same direction of every other session of its user, by
+ * the user's rate (see user_db_set_rate() and --user-rate). Both are token
+ * buckets (token_bucket.h) refilled at the rate, holding a tenth of a
+ * second's worth so short bursts pass unharmed.
+ *
+ * The relay asks for as many bytes as it could read and gets at most what
+ * both buckets allow. When either is empty it gets nothing and how long to
+ * wait: long enough for SHAPER_TICK_MS worth of bytes, so a capped
+ * direction wakes up at most 1000 / SHAPER_TICK_MS times a second.
+ *
+ * A connection's own buckets belong to its worker. A user's are shared by
+ * every worker and take a mutex, only while the user is actually capped.
+ */
+#ifndef SHAPER_H
+#define SHAPER_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "token_bucket.h"
+
+#define SHAPER_BURST_MS 100
+#define SHAPER_MIN_BURST 1500 // bytes; at least a full-sized segment
+#define SHAPER_TICK_MS 20
+#define SHAPER_MAX_RATE (UINT64_C(1) << 40) // bytes/s, keeps the math exact
+
+// One direction of one connection
+struct shaper {
+  struct token_bucket bucket;
+};
+
+// One direction of all of a user's connections
+struct shaper_shared {
+  pthread_mutex_t lock;
+  bool limited; // read without the lock
+  struct token_bucket bucket;
+};
+
+/**
+ * Parses a rate in bytes/s, optionally followed by K, M or G (powers of
+ * 1024). False if it isn't one or exceeds SHAPER_MAX_RATE.
+ */
+bool shaper_parse_rate(const char *s, uint64_t *rate);
+
+/** Caps at `rate` bytes per second, or nothing if 0. */
+void shaper_init(struct shaper *s, uint64_t rate, uint64_t now_ms);
+
+void shaper_shared_init(struct shaper_shared *s);
+void shaper_shared_set_rate(struct shaper_shared *s, uint64_t rate,
+                            uint64_t now_ms);
+void shaper_shared_destroy(struct shaper_shared *s);
+
+/**
+ * Takes up to `max` bytes from `own` and, unless NULL, `shared`. Returns
+ * how many may go now; when that's 0, `*wait_ms` says when to try again.
+ */
+size_t shaper_take(struct shaper *own, struct shaper_shared *shared,
+                   uint64_t now_ms, size_t max, uint64_t *wait_ms);
+
+/** Whether `own` or, unless NULL, `shared` caps the direction at all. */
+bool shaper_limited(const struct shaper *own,
+                    const struct shaper_shared *shared);
+
+/** Gives back what shaper_take() granted but didn't go. */
+void shaper_refund(struct shaper *own, struct shaper_shared *shared,
+                   size_t n);
+
+#endif // SHAPER_H
@@ -6,6 +6,8 @@
 #include "stm.h"
 #include <netdb.h>
 #include "hello_parser.h"
+#include "pop3_sniffer.h"
+#include "shaper.h"
 
 #define ATTACHMENT(key) ((struct socks5 *)(key)->data)
 
@@ -35,10 +37,12 @@ struct auth_st {
   uint8_t state; // enum auth_state
   uint8_t version;
   uint8_t ulen;
+  uint8_t idx; // bytes of the current field read so far
   char username[SOCKS_AUTH_MAX_LEN];
   uint8_t plen;
   char password[SOCKS_AUTH_MAX_LEN];
   uint8_t status;
+  bool known_user; // while verifying: the name exists, see user_db_lookup()
 };
 
 // Internal States for REQUEST
@@ -53,6 +57,23 @@ enum request_state {
   REQUEST_ERROR,
 };
 
+// Happy Eyeballs (RFC 8305) tuning
+#define HE_MAX_CANDIDATES 16   // addresses considered per request
+#define HE_MAX_ATTEMPTS 4      // connections in flight at once
+#define HE_ATTEMPT_DELAY_MS 250 // stagger between attempts
+
+struct connect_st {
+  const struct addrinfo *candidates[HE_MAX_CANDIDATES];
+  unsigned ncandidates;
+  unsigned next; // next candidate to try
+  int attempts[HE_MAX_ATTEMPTS]; // connecting sockets, -1 if unused
+  unsigned inflight; // the newest one carries the stagger timeout
+  int last_error;
+  // IP literal requests get a single candidate backed by these
+  struct addrinfo literal;
+  struct sockaddr_storage literal_addr;
+};
+
 struct request_st {
   buffer *rb, *wb;
   uint8_t state; // enum request_state
@@ -69,6 +90,16 @@ struct request_st {
   uint16_t dest_port;
   uint8_t addr_index;
   uint8_t reply;
+  struct connect_st connect;
+};
+
+// Kernel pipe used to splice() one direction of the tunnel without copying
+// the bytes through user space.
+struct splice_pipe {
+  int rfd, wfd;
+  size_t len;      // bytes currently sitting in the pipe
+  size_t capacity; // as reported by F_GETPIPE_SZ
+  bool full;       // pipe refused more data before reaching capacity
 };
 
 struct copy_st {
@@ -76,6 +107,45 @@ struct copy_st {
   buffer *rb, *wb;
   fd_interest duplex;
   struct copy_st *other;
+  // When non-NULL, bytes read from *fd go to this pipe instead of rb, and
+  // bytes for *fd come from other->pipe instead of wb.
+  struct splice_pipe *pipe;
+
+  // Adaptive sizing of rb (buffered mode only): the size the next relay
+  // buffer borrowed for this direction will have, and what recent reads and
+  // sends to the peer looked like.
+  size_t buffer_size;
+  uint8_t full_reads;  // consecutive reads that filled rb
+  uint8_t small_reads; // consecutive reads using a small part of it
+  bool backpressure;   // the last send of these bytes was partial
+
+  // Bandwidth caps on reading from *fd (see shaper.h): the connection's own
+  // and, if the user has one, the user's. A capped direction out of tokens
+  // stops reading until resume_at, when its fd's timer wakes it up.
+  struct shaper shaper;
+  struct shaper_shared *shared;
+  bool throttled;
+  uint64_t resume_at;
+
+  // With io_uring the kernel reads into rb and sends from wb by itself (see
+  // selector_recv()): what it has in flight, and how much the read in flight
+  // took from the caps. A direction polls and reads (or sends) right away
+  // instead once it got EAGAIN, or while capped, so that tokens only go to
+  // bytes already waiting (see copy_submit() for the rest).
+  bool completions;
+  bool recv_pending;
+  bool send_pending;
+  bool poll_read;
+  bool poll_write;
+  size_t recv_len;
+};
+
+// Deadline the client fd runs under, see state_deadlines in socks5nio.c
+enum session_deadline {
+  DEADLINE_NONE = 0,
+  DEADLINE_HANDSHAKE, // HELLO, AUTH, REQUEST and the reply
+  DEADLINE_CONNECT,   // resolving and connecting to the origin
+  DEADLINE_IDLE,      // relaying, reset by traffic
 };
 
 struct socks5 {
@@ -86,17 +156,50 @@ struct socks5 {
   struct sockaddr_storage client_addr;
   socklen_t client_addr_len;
 
-  struct addrinfo *origin_resolution;
-  struct addrinfo *current_origin_addr;
+  struct addrinfo *origin_resolution; // origin_answer->list, not owned
+  struct resolver_job *resolve_job; // pending lookup, see resolver.h
+  struct verifier_job *verify_job;  // pending password check, see verifier.h
+  struct resolver_answer *origin_answer;
 
   char *username;
+  struct user_stats *user; // accounting entry of username, see user_stats.h
+  bool over_user_cap;      // authenticated past --max-user-sessions
   unsigned references;
   bool done;
 
+  uint8_t deadline;       // enum session_deadline armed on client_fd
+  uint8_t state;          // last state reported to metrics_session_state()
+  uint64_t last_activity; // selector_now() of the last relayed bytes
+
+  // metrics_clock_us() at accept and at the start of the current phase,
+  // for the latency histograms
+  uint64_t accepted_at;
+  uint64_t phase_start;
+  bool first_byte; // the origin already sent something through the tunnel
+
+  // What the access log records when the session ends; dest_host stays
+  // empty unless a whole request was read
+  char dest_host[SOCKS_DOMAIN_MAX_LEN];
+  uint16_t dest_port;
+  uint8_t reply;       // SOCKS reply code sent to the client
+  uint64_t bytes_up;   // relayed from the client
+  uint64_t bytes_down; // relayed to the client
+
   struct socks5 *next; // For pool
 
-  uint8_t read_buffer_data[BUFFER_SIZE];
-  uint8_t write_buffer_data[BUFFER_SIZE];
+  // client->origin and origin->client pipes, only open in splice mode
+  struct splice_pipe pipes[2];
+  bool pipes_open;
+  bool relay_buffers; // read/write_buffer are (detachable) pool blocks
+
+  // Credential dissector over what the client sends, see pop3_sniffer.h
+  struct pop3_sniffer pop3;
+
+  // During the handshake read/write_buffer use these small inline arrays.
+  // In COPY they are detached and only hold a BUFFER_SIZE block from
+  // buffer_pool while the direction has bytes in flight.
+  uint8_t handshake_read_data[HANDSHAKE_BUFFER_SIZE];
+  uint8_t handshake_write_data[HANDSHAKE_BUFFER_SIZE];
   buffer read_buffer;
   buffer write_buffer;
 
@@ -112,6 +215,10 @@ struct socks5 {
   } origin;
 };
 
+// Reads from the client into `rb` during the handshake, unless it already
+// holds bytes pipelined behind the previous message. False on EOF or error.
+bool handshake_recv(struct selector_key *key, buffer *rb);
+
 // State Handlers
 void hello_read_init(const unsigned state, struct selector_key *key);
 unsigned hello_read(struct selector_key *key); //lee datos del cliente en la fase de saludo (hello), parsea el mensaje entrante y transita al estado de escritura o de falla. Handler del estado HELLO_READ
@@ -119,16 +226,24 @@ unsigned hello_write(struct selector_key *key);
 
 void auth_read_init(const unsigned state, struct selector_key *key);
 unsigned auth_read(struct selector_key *key);
+unsigned auth_verifying(struct selector_key *key);
 unsigned auth_write(struct selector_key *key);
 
 void request_read_init(const unsigned state, struct selector_key *key);
 unsigned request_read(struct selector_key *key);
 unsigned request_resolving(struct selector_key *key);
 unsigned request_connecting(struct selector_key *key);
+unsigned request_timeout(struct selector_key *key);
+void request_connecting_departure(const unsigned state,
+                                  struct selector_key *key);
 unsigned request_write(struct selector_key *key);
 
 void copy_init(const unsigned state, struct selector_key *key);
 unsigned copy_read(struct selector_key *key);
 unsigned copy_write(struct selector_key *key);
+unsigned copy_timeout(struct selector_key *key);
+unsigned copy_recv_done(struct selector_key *key, ssize_t n);
+unsigned copy_send_done(struct selector_key *key, ssize_t n);
+void copy_close(struct socks5 *s);
 
 #endif
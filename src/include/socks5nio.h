@@ -21,10 +21,17 @@
 // =============================================================================
 // Buffer sizes
 // =============================================================================
+// Relay buffers, one per direction while a tunnel has data in flight
 #ifndef BUFFER_SIZE
 #define BUFFER_SIZE 131072
 #endif
 
+// Inline buffers for HELLO/AUTH/REQUEST; the largest message (AUTH) is 513
+// bytes and replies are much smaller.
+#ifndef HANDSHAKE_BUFFER_SIZE
+#define HANDSHAKE_BUFFER_SIZE 1024
+#endif
+
 // =============================================================================
 // SOCKSv5 Protocol Constants (RFC 1928)
 // =============================================================================
@@ -78,6 +85,7 @@ enum socks5_state {
 
   // Authentication phase (RFC 1929)
   AUTH_READ,
+  AUTH_VERIFYING, // password check on a verifier thread
   AUTH_WRITE,
 
   // Request phase (RFC 1928 section 4)
@@ -111,7 +119,7 @@ enum socks5_state {
 void socksv5_passive_accept(struct selector_key* key);
 
 /**
- * Clean up the connection pool on server shutdown.
+ * Clean up the calling thread's connection pool on server shutdown.
  */
 void socksv5_pool_destroy(void);
 
@@ -0,0 +1,134 @@
+/**
+ * user_db.h - Users allowed to authenticate
+ *
+ * An open-addressing hash table keyed by username, so AUTH looks a user up
+ * in constant time however many there are. Users come from -u, from the
+ * file given with --users-file and from the management ADD/DEL commands.
+ *
+ * Workers look users up while the management thread adds and deletes them:
+ * lookups take a read lock, changes the write lock. The table only grows
+ * (or drops its tombstones) while holding the latter.
+ *
+ * Passwords are never kept: each user holds a PBKDF2-HMAC-SHA256 key
+ * derived from it with a random salt. Passwords may also be given already
+ * hashed, in passlib's format:
+ *
+ *   $pbkdf2-sha256$<iterations>$<salt>$<key>
+ *
+ * with salt and key in base64 using '.' for '+' and no padding. Checking a
+ * password costs as many HMACs as the iterations, far too slow for the
+ * event loops: see verifier.h.
+ *
+ * Each user also has a bandwidth cap (see shaper.h), by default the one
+ * given with user_db_set_default_rate().
+ */
+#ifndef USER_DB_H
+#define USER_DB_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// PBKDF2 iterations for the passwords hashed here, unless changed with
+// user_db_set_iterations()
+#define USER_DB_DEFAULT_ITERATIONS 100000
+#define USER_DB_MAX_ITERATIONS 10000000
+
+#define USER_DB_SALT_SIZE 16     // generated here
+#define USER_DB_MAX_SALT_SIZE 32 // accepted in hashed passwords
+#define USER_DB_KEY_SIZE 32
+
+// A user's rate that follows user_db_set_default_rate()
+#define USER_DB_RATE_DEFAULT UINT64_MAX
+
+struct user_credential {
+  uint32_t iterations;
+  uint8_t salt_len;
+  uint8_t salt[USER_DB_MAX_SALT_SIZE];
+  uint8_t key[USER_DB_KEY_SIZE];
+};
+
+enum user_db_status {
+  USER_DB_OK,
+  USER_DB_EXISTS,    // add: the name is taken
+  USER_DB_NOT_FOUND, // del: no such user
+  USER_DB_NO_MEMORY,
+  USER_DB_BAD_HASH, // add: starts like a hashed password but isn't one
+};
+
+enum user_db_check {
+  USER_DB_AUTHENTICATED,
+  USER_DB_WRONG_PASSWORD,
+  USER_DB_UNKNOWN_USER,
+};
+
+/**
+ * Adds `name` (its first `name_len` bytes) with password `pass`, either in
+ * plain text, which is hashed here, or already hashed.
+ */
+enum user_db_status user_db_add(const char *name, size_t name_len,
+                                const char *pass);
+
+/**
+ * The two halves of user_db_add() for a plain-text password, so the slow
+ * one can run elsewhere: user_db_derive() hashes `pass` with the current
+ * iterations and user_db_add_credential() adds the result.
+ */
+void user_db_derive(const char *pass, struct user_credential *cred);
+enum user_db_status user_db_add_credential(const char *name, size_t name_len,
+                                           const struct user_credential *cred);
+
+/** Whether `pass` is given already hashed, which user_db_add() takes fast. */
+bool user_db_hashed(const char *pass);
+
+enum user_db_status user_db_del(const char *name);
+
+/** Iterations for the passwords hashed from now on. */
+void user_db_set_iterations(uint32_t iterations);
+
+/** Bytes/s each direction of a user's traffic is capped at, 0 for none. */
+void user_db_set_default_rate(uint64_t rate);
+
+/**
+ * Caps `name` at `rate` bytes/s (0 for none) or, with USER_DB_RATE_DEFAULT,
+ * at the default.
+ */
+enum user_db_status user_db_set_rate(const char *name, uint64_t rate);
+
+/** The cap `name` is under, 0 if none; unknown users get the default. */
+uint64_t user_db_rate(const char *name);
+
+/**
+ * Copies the credential of `name` into `cred`. For an unknown user fills it
+ * with one that no password matches but costs as much to check, so telling
+ * unknown users apart by timing takes more than skipping the KDF.
+ */
+bool user_db_lookup(const char *name, struct user_credential *cred);
+
+/** Runs the KDF over `pass`: slow, and constant time on the comparison. */
+bool user_db_verify(const struct user_credential *cred, const char *pass);
+
+/** user_db_lookup() and user_db_verify() on the calling thread. */
+enum user_db_check user_db_check(const char *name, const char *pass);
+
+/** Users currently defined; with none, clients need not authenticate. */
+size_t user_db_count(void);
+
+/**
+ * Adds every `name:password` line of the file at `path`; blank lines and
+ * lines starting with '#' are skipped. Plain-text passwords are hashed on
+ * as many threads as there are cores. Returns the number of users added,
+ * or -1 after reporting to stderr the first line it couldn't take.
+ */
+long user_db_load(const char *path);
+
+/**
+ * Calls `fn` with every username, in no particular order, while holding
+ * the read lock: `fn` must not call back into user_db.
+ */
+void user_db_foreach(void (*fn)(const char *name, void *data), void *data);
+
+/** Removes every user. */
+void user_db_destroy(void);
+
+#endif // USER_DB_H
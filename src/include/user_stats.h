@@ -0,0 +1,85 @@
+/**
+ * user_stats.h - Per-user traffic and session accounting
+ *
+ * Every user that ever authenticated (or failed to, with an existing name)
+ * gets an entry that lives until shutdown, even if the user is deleted, so
+ * billing figures survive a DEL/ADD. A session looks its entry up once when
+ * it authenticates and keeps the pointer; from then on every update is a
+ * single relaxed atomic add on that user's own cache line.
+ *
+ * Lookups and listings take a mutex; updates never do.
+ *
+ * The entry also carries the user's bandwidth cap, shared by all of its
+ * sessions (see shaper.h).
+ */
+#ifndef USER_STATS_H
+#define USER_STATS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "shaper.h"
+
+struct user_stats;
+
+enum user_stats_direction {
+  USER_STATS_UP,   // from the user's clients
+  USER_STATS_DOWN, // to the user's clients
+  USER_STATS_DIRECTIONS,
+};
+
+// Snapshot of one user's counters
+struct user_stats_view {
+  const char *name;
+  uint64_t bytes_received;  // from the user's clients
+  uint64_t bytes_sent;      // to the user's clients
+  uint64_t active_sessions; // authenticated and not yet closed
+  uint64_t total_sessions;  // authenticated, ever
+  uint64_t auth_failures;   // wrong password for this name
+};
+
+/**
+ * Entry for `name`, created on first use. Returns NULL only if memory is
+ * exhausted, in which case the user simply goes unaccounted.
+ */
+struct user_stats *user_stats_get(const char *name);
+
+// All of these accept NULL and do nothing then
+void user_stats_session_open(struct user_stats *u);
+/** Opens a session unless the user already has `max` (0 is no limit). */
+bool user_stats_session_try_open(struct user_stats *u, uint64_t max);
+void user_stats_session_close(struct user_stats *u);
+void user_stats_add_bytes_received(struct user_stats *u, size_t bytes);
+void user_stats_add_bytes_sent(struct user_stats *u, size_t bytes);
+void user_stats_auth_failure(struct user_stats *u);
+
+/**
+ * Caps each direction of the user's traffic at `rate` bytes/s, 0 lifts it.
+ * `now_ms` is selector_now(): every selector runs on the same clock.
+ */
+void user_stats_set_rate(struct user_stats *u, uint64_t rate,
+                         uint64_t now_ms);
+
+/** The user's bucket for `dir`, NULL if `u` is. */
+struct shaper_shared *user_stats_shaper(struct user_stats *u,
+                                        enum user_stats_direction dir);
+
+/**
+ * Fills `out` with the counters of `name`. Returns false if it never
+ * logged in nor failed to.
+ */
+bool user_stats_find(const char *name, struct user_stats_view *out);
+
+/**
+ * Calls `fn` with every user, in the order they were first seen, while
+ * holding the registry lock: `fn` must not call back into user_stats.
+ */
+void user_stats_foreach(void (*fn)(const struct user_stats_view *u,
+                                   void *data),
+                        void *data);
+
+/** Frees every entry. No session may hold one anymore. */
+void user_stats_destroy(void);
+
+#endif // USER_STATS_H
@@ -0,0 +1,111 @@
+/**
+ * verifier.h - Password checks off the event loops
+ *
+ * Checking a password runs the user's KDF (see user_db.h), which takes tens
+ * of milliseconds by design; on a selector thread it would stall every
+ * connection of that loop. Checks are queued to a small pool of verifier
+ * threads instead and, like the resolver, the owning loop is woken through
+ * selector_notify_block() once the result is in.
+ *
+ * Successful checks are remembered for VERIFIER_CACHE_TTL seconds, so a
+ * client reconnecting over and over with the same credentials pays the KDF
+ * once. The cache holds an HMAC, under a key drawn at startup, of the
+ * stored credential and the password, never the password itself; changing
+ * or deleting the user changes the credential and so misses it.
+ *
+ * The same threads hash new passwords for the management ADD command
+ * (verifier_submit_derive()), which would otherwise stall the loop serving
+ * management just the same. Those never touch the cache.
+ *
+ * Usage (from a selector thread):
+ *   job = verifier_submit(key->s, key->fd, &cred, password);
+ *   ...
+ *   // right away (cache hit) or in handle_block():
+ *   if (verifier_poll(job, &ok)) { ...job is gone... }
+ *   ...
+ *   // or, if the session goes away before the result arrives:
+ *   verifier_cancel(job);
+ */
+#ifndef VERIFIER_H
+#define VERIFIER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "selector.h"
+#include "user_db.h"
+
+// Verifier threads started by default
+#define VERIFIER_DEFAULT_THREADS 4
+
+// Checks waiting for a thread beyond which verifier_submit() fails
+#define VERIFIER_MAX_QUEUED 1024
+
+// Remembered successes; direct mapped, a newer one replaces an older one
+#define VERIFIER_CACHE_SIZE 4096
+
+// Seconds a success is reused
+#define VERIFIER_CACHE_TTL 300
+
+struct verifier_job;
+
+struct verifier_stats {
+  uint64_t hits;   // answered from the cache
+  uint64_t misses; // ran the KDF
+};
+
+/**
+ * Starts `threads` verifier threads. Returns 0 on success or -1 if none
+ * could be started.
+ */
+int verifier_init(unsigned threads);
+
+/**
+ * Stops and joins the verifier threads and forgets the cache. Checks still
+ * queued fail; their jobs remain owned by their sessions.
+ *
+ * Must run before the selectors that may receive notifications are
+ * destroyed or their threads joined.
+ */
+void verifier_destroy(void);
+
+/**
+ * Checks `password` against `cred`. On a cache hit the job is ready
+ * immediately; otherwise selector_notify_block(s, fd) is called from a
+ * verifier thread once it is.
+ *
+ * Returns NULL if the queue is full or memory is exhausted.
+ */
+struct verifier_job *verifier_submit(fd_selector s, int fd,
+                                     const struct user_credential *cred,
+                                     const char *password);
+
+/**
+ * Hashes `password` as user_db_derive() would, notifying like
+ * verifier_submit(). Returns NULL if the queue is full or memory is
+ * exhausted.
+ */
+struct verifier_job *verifier_submit_derive(fd_selector s, int fd,
+                                            const char *password);
+
+/**
+ * verifier_poll() for a job of verifier_submit_derive(): once it finished,
+ * stores in `derived` whether it ran and, if so, the result in `cred`.
+ */
+bool verifier_poll_derive(struct verifier_job *job, bool *derived,
+                          struct user_credential *cred);
+
+/**
+ * Checks whether `job` finished. If so, stores whether the password matched
+ * in `authenticated`, releases the job and returns true. Returns false (and
+ * leaves the job alone) if it is still pending.
+ */
+bool verifier_poll(struct verifier_job *job, bool *authenticated);
+
+/** Releases a job whose result is no longer wanted, at any point. */
+void verifier_cancel(struct verifier_job *job);
+
+/** Snapshot of the counters. */
+void verifier_get_stats(struct verifier_stats *stats);
+
+#endif // VERIFIER_H
@@ -4,15 +4,73 @@
 #endif
 
 #include "logger.h"
+#include "access_log.h"
 #include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
 #include <time.h>
+#include <unistd.h>
 
-static FILE *g_log_file = NULL;
-static FILE *g_access_file = NULL;
+// =============================================================================
+// State
+// =============================================================================
+//
+// Records are formatted by the thread that logs them straight into a slot of
+// a bounded multi-producer ring (Vyukov's sequence-numbered queue): claiming
+// a slot is a CAS, publishing it a store, and a full ring drops the record
+// instead of waiting. A single writer thread drains the ring in order and
+// hands consecutive records for the same file to one writev().
+
+#define RING_SLOTS 4096 // power of two
+#define RING_MASK (RING_SLOTS - 1)
+#define WRITE_BATCH 64 // records per writev(), well under IOV_MAX
+
+enum log_target {
+  TARGET_LOG,
+  TARGET_ACCESS,
+};
+
+// Six cache lines with the header. A SESSION record always fits with its
+// user whole and some of the host.
+#define SLOT_SIZE 368
+
+struct log_slot {
+  // == position: free for the producer claiming that position
+  // == position + 1: holds that position's record
+  _Alignas(64) size_t seq;
+  uint16_t len;
+  uint8_t target;
+  char data[SLOT_SIZE];
+};
+
+_Static_assert(SLOT_SIZE >= LOG_RECORD_SIZE, "slots cut text records");
+_Static_assert(SLOT_SIZE > sizeof(struct access_record_session) + 2 + UINT8_MAX,
+               "slots cut user names");
+
+static struct log_slot ring[RING_SLOTS];
+static _Alignas(64) size_t enqueue_pos;
+static _Alignas(64) size_t dequeue_pos; // writer only
+static _Alignas(64) uint64_t dropped;
+static bool writer_sleeping;
+
+static bool running = false;
+static bool stopping = false;
+static pthread_t writer;
+static int wakeup_fd = -1;
+
+static int g_log_fd = STDERR_FILENO;
+static int g_access_fd = -1;
+static enum log_access_format g_access_format = LOG_ACCESS_TEXT;
 static log_level_t g_min_level = LOG_INFO;
 
 static const char *level_strings[] = {
@@ -22,35 +80,443 @@ static const char *level_strings[] = {
     "ERROR",
 };
 
+// =============================================================================
+// Timestamps
+// =============================================================================
+
+// localtime_r() and strftime() run once per second per thread
+struct stamp {
+  time_t second;
+  size_t len;
+  char text[32];
+};
+
+static const struct stamp *timestamp(void) {
+  static _Thread_local struct stamp cache = {.second = -1};
+  const time_t now = time(NULL);
+  if (now != cache.second) {
+    struct tm tm_info;
+    localtime_r(&now, &tm_info);
+    cache.len = strftime(cache.text, sizeof(cache.text), "%Y-%m-%d %H:%M:%S",
+                         &tm_info);
+    cache.second = now;
+  }
+  return &cache;
+}
+
+// =============================================================================
+// Ring
+// =============================================================================
+
+static struct log_slot *ring_claim(size_t *pos_out) {
+  size_t pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+  while (true) {
+    struct log_slot *slot = &ring[pos & RING_MASK];
+    const size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    const intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&enqueue_pos, &pos, pos + 1, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        *pos_out = pos;
+        return slot;
+      }
+    } else if (diff < 0) {
+      // the writer hasn't freed it yet: full
+      __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+      return NULL;
+    } else {
+      pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+static void ring_publish(struct log_slot *slot, size_t pos) {
+  __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+  // Pairs with the fence in writer_wait(): either it sees this record or
+  // we see it asleep
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&writer_sleeping, __ATOMIC_RELAXED)) {
+    const uint64_t one = 1;
+    ssize_t r = write(wakeup_fd, &one, sizeof(one));
+    (void)r;
+  }
+}
+
+static bool ring_ready(size_t pos) {
+  return __atomic_load_n(&ring[pos & RING_MASK].seq, __ATOMIC_ACQUIRE) ==
+         pos + 1;
+}
+
+// Fits a formatted length into a slot, marking cut records
+static uint16_t slot_fit(struct log_slot *slot, int len) {
+  if (len < 0) {
+    return 0;
+  }
+  if ((size_t)len >= LOG_RECORD_SIZE) {
+    memcpy(slot->data + LOG_RECORD_SIZE - 4, "...\n", 4);
+    return LOG_RECORD_SIZE;
+  }
+  return (uint16_t)len;
+}
+
+// =============================================================================
+// Binary access log names
+// =============================================================================
+//
+// Producers copy a SESSION record into their slot followed by the user and
+// host names (a length byte each, 0 for none). The writer swaps the names
+// for numbers, defining those this file hasn't seen yet with NAME records
+// written right before the session. When the table fills up it starts over:
+// the numbers get defined again as names come back.
+
+#define NAME_TABLE_SIZE 16384 // power of two
+#define NAME_TABLE_MAX (NAME_TABLE_SIZE / 4 * 3)
+#define NAME_POOL_SIZE (1024 * 1024)
+
+struct name_entry {
+  uint32_t hash;
+  uint32_t id;
+  uint32_t offset; // of the length byte in name_pool; 0 if free
+};
+
+static struct name_entry *name_table;
+static uint8_t *name_pool;
+static uint32_t name_pool_used;
+static uint32_t name_count;
+
+// NAME records of the batch being written
+static uint8_t name_records[WRITE_BATCH * 2]
+                           [sizeof(struct access_record_name) + UINT8_MAX];
+
+static void names_reset(void) {
+  memset(name_table, 0, NAME_TABLE_SIZE * sizeof(*name_table));
+  name_pool_used = 1;
+  name_count = 0;
+}
+
+static bool names_init(void) {
+  name_table = calloc(NAME_TABLE_SIZE, sizeof(*name_table));
+  name_pool = malloc(NAME_POOL_SIZE);
+  if (name_table == NULL || name_pool == NULL) {
+    free(name_table);
+    free(name_pool);
+    name_table = NULL;
+    name_pool = NULL;
+    return false;
+  }
+  names_reset();
+  return true;
+}
+
+static void names_destroy(void) {
+  free(name_table);
+  free(name_pool);
+  name_table = NULL;
+  name_pool = NULL;
+}
+
+// Number of the name, appending a NAME record to iov if it is new here
+static uint32_t name_id(const uint8_t *name, uint8_t len, struct iovec *iov,
+                        int *iov_count, unsigned *records) {
+  if (name_count >= NAME_TABLE_MAX ||
+      name_pool_used + 1 + len > NAME_POOL_SIZE) {
+    names_reset();
+  }
+
+  uint32_t hash = 2166136261u; // FNV-1a
+  for (uint8_t i = 0; i < len; i++) {
+    hash = (hash ^ name[i]) * 16777619u;
+  }
+
+  uint32_t i = hash & (NAME_TABLE_SIZE - 1);
+  while (name_table[i].offset != 0) {
+    const struct name_entry *e = &name_table[i];
+    if (e->hash == hash && name_pool[e->offset] == len &&
+        memcmp(name_pool + e->offset + 1, name, len) == 0) {
+      return e->id;
+    }
+    i = (i + 1) & (NAME_TABLE_SIZE - 1);
+  }
+
+  struct name_entry *e = &name_table[i];
+  *e = (struct name_entry){hash, name_count++, name_pool_used};
+  name_pool[name_pool_used] = len;
+  memcpy(name_pool + name_pool_used + 1, name, len);
+  name_pool_used += 1 + len;
+
+  uint8_t *record = name_records[(*records)++];
+  const struct access_record_name header = {
+      .type = ACCESS_RECORD_NAME,
+      .len = len,
+      .id = e->id,
+  };
+  memcpy(record, &header, sizeof(header));
+  memcpy(record + sizeof(header), name, len);
+  iov[(*iov_count)++] =
+      (struct iovec){record, sizeof(header) + (size_t)len};
+  return e->id;
+}
+
+// Appends to iov the NAME records the slot needs and its SESSION record
+static void access_binary_iov(struct log_slot *slot, struct iovec *iov,
+                              int *iov_count, unsigned *records) {
+  struct access_record_session rec;
+  memcpy(&rec, slot->data, sizeof(rec));
+  const uint8_t *user = (const uint8_t *)slot->data + sizeof(rec);
+  const uint8_t *host = user + 1 + user[0];
+
+  if (user[0] > 0) {
+    rec.user_id = name_id(user + 1, user[0], iov, iov_count, records);
+  }
+  if (rec.flags & ACCESS_DEST_NAME) {
+    rec.dest.name_id = name_id(host + 1, host[0], iov, iov_count, records);
+  }
+  memcpy(slot->data, &rec, sizeof(rec));
+  iov[(*iov_count)++] = (struct iovec){slot->data, sizeof(rec)};
+}
+
+// =============================================================================
+// Writer
+// =============================================================================
+
+static void write_all(int fd, struct iovec *iov, int count) {
+  while (count > 0) {
+    ssize_t n = writev(fd, iov, count);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return; // nowhere to complain to
+    }
+    while (count > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+}
+
+static int target_fd(uint8_t target) {
+  return target == TARGET_ACCESS ? g_access_fd : g_log_fd;
+}
+
+// Writes and frees up to WRITE_BATCH ready records; returns how many
+static unsigned writer_drain(void) {
+  struct iovec iov[WRITE_BATCH * 3]; // a binary session may add two names
+  unsigned count = 0, records = 0;
+  int iov_count = 0;
+  uint8_t target = TARGET_LOG;
+
+  while (count < WRITE_BATCH && ring_ready(dequeue_pos + count)) {
+    struct log_slot *slot = &ring[(dequeue_pos + count) & RING_MASK];
+    if (iov_count > 0 && slot->target != target) {
+      write_all(target_fd(target), iov, iov_count);
+      iov_count = 0;
+    }
+    target = slot->target;
+    if (target_fd(target) < 0) {
+      // nowhere to write it
+    } else if (target == TARGET_ACCESS &&
+               g_access_format == LOG_ACCESS_BINARY) {
+      access_binary_iov(slot, iov, &iov_count, &records);
+    } else {
+      iov[iov_count++] = (struct iovec){slot->data, slot->len};
+    }
+    count++;
+  }
+  if (iov_count > 0) {
+    write_all(target_fd(target), iov, iov_count);
+  }
+
+  for (unsigned i = 0; i < count; i++) {
+    __atomic_store_n(&ring[dequeue_pos & RING_MASK].seq,
+                     dequeue_pos + RING_SLOTS, __ATOMIC_RELEASE);
+    dequeue_pos++;
+  }
+  return count;
+}
+
+// Tells about records lost since the last report, once the ring has room
+static void writer_report_drops(uint64_t *reported) {
+  const uint64_t now = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+  if (now == *reported) {
+    return;
+  }
+  char line[LOG_RECORD_SIZE];
+  const struct stamp *ts = timestamp();
+  const int n = snprintf(line, sizeof(line),
+                         "[%s] [WARNING] Log ring full, dropped %lu records\n",
+                         ts->text, (unsigned long)(now - *reported));
+  struct iovec iov = {line, (size_t)n};
+  write_all(g_log_fd, &iov, 1);
+  *reported = now;
+}
+
+static void writer_wait(void) {
+  __atomic_store_n(&writer_sleeping, true, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (!ring_ready(dequeue_pos) && !__atomic_load_n(&stopping,
+                                                    __ATOMIC_ACQUIRE)) {
+    uint64_t n;
+    ssize_t r = read(wakeup_fd, &n, sizeof(n));
+    (void)r;
+  }
+  __atomic_store_n(&writer_sleeping, false, __ATOMIC_RELAXED);
+}
+
+static void *writer_thread(void *arg) {
+  (void)arg;
+  uint64_t reported = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+  while (true) {
+    if (writer_drain() > 0) {
+      writer_report_drops(&reported);
+      continue;
+    }
+    if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+      // done once every claimed slot was published and written; new
+      // records already go inline
+      if (__atomic_load_n(&enqueue_pos, __ATOMIC_ACQUIRE) == dequeue_pos) {
+        break;
+      }
+      sched_yield();
+      continue;
+    }
+    writer_wait();
+  }
+  writer_report_drops(&reported);
+  return NULL;
+}
+
+// =============================================================================
+// Setup
+// =============================================================================
+
+static int open_append(const char *path) {
+  return open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+}
+
+static uint64_t unix_time_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+// Marks where this run starts appending; the names restart with it
+static void access_binary_start(void) {
+  if (!names_init()) {
+    fprintf(stderr, "Warning: No memory for the access log names\n");
+    close(g_access_fd);
+    g_access_fd = -1;
+    return;
+  }
+  struct access_record_start start = {
+      .type = ACCESS_RECORD_START,
+      .version = ACCESS_LOG_VERSION,
+      .session_size = sizeof(struct access_record_session),
+      .time_ms = unix_time_ms(),
+  };
+  memcpy(start.magic, ACCESS_LOG_MAGIC, sizeof(start.magic));
+  struct iovec iov = {&start, sizeof(start)};
+  write_all(g_access_fd, &iov, 1);
+}
+
+void logger_access_format(enum log_access_format format) {
+  g_access_format = format;
+}
+
 void logger_init(const char *log_file, log_level_t min_level) {
   g_min_level = min_level;
 
+  g_log_fd = STDERR_FILENO;
   if (log_file != NULL) {
-    g_log_file = fopen(log_file, "a");
-    if (g_log_file == NULL) {
+    g_log_fd = open_append(log_file);
+    if (g_log_fd < 0) {
       fprintf(stderr, "Failed to open log file: %s\n", log_file);
-      g_log_file = stderr;
+      g_log_fd = STDERR_FILENO;
     }
-  } else {
-    g_log_file = stderr;
   }
 
-  g_access_file = fopen("access.log", "a");
-  if (g_access_file == NULL) {
-    fprintf(stderr, "Warning: Failed to open access.log\n");
+  const char *access_file = g_access_format == LOG_ACCESS_BINARY
+                                ? ACCESS_LOG_FILE
+                                : "access.log";
+  g_access_fd = open_append(access_file);
+  if (g_access_fd < 0) {
+    fprintf(stderr, "Warning: Failed to open %s\n", access_file);
+  } else if (g_access_format == LOG_ACCESS_BINARY) {
+    access_binary_start();
+  }
+
+  for (size_t i = 0; i < RING_SLOTS; i++) {
+    ring[i].seq = i;
+  }
+  enqueue_pos = dequeue_pos = 0;
+  writer_sleeping = false;
+  stopping = false;
+
+  wakeup_fd = eventfd(0, EFD_CLOEXEC);
+  if (wakeup_fd < 0) {
+    fprintf(stderr, "Failed to create logger eventfd, logging inline\n");
+    return;
+  }
+
+  // Signals are for the event loops, not for the writer
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  running = pthread_create(&writer, NULL, writer_thread, NULL) == 0;
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (!running) {
+    fprintf(stderr, "Failed to start logger thread, logging inline\n");
+    close(wakeup_fd);
+    wakeup_fd = -1;
   }
 }
 
 void logger_close(void) {
-  if (g_log_file != NULL && g_log_file != stderr) {
-    fclose(g_log_file);
-    g_log_file = NULL;
+  if (running) {
+    __atomic_store_n(&stopping, true, __ATOMIC_RELEASE);
+    const uint64_t one = 1;
+    ssize_t r = write(wakeup_fd, &one, sizeof(one));
+    (void)r;
+    pthread_join(writer, NULL);
+    running = false;
+    close(wakeup_fd);
+    wakeup_fd = -1;
+  }
+
+  if (g_log_fd != STDERR_FILENO && g_log_fd >= 0) {
+    close(g_log_fd);
   }
+  g_log_fd = STDERR_FILENO;
 
-  if (g_access_file != NULL) {
-    fclose(g_access_file);
-    g_access_file = NULL;
+  if (g_access_fd >= 0) {
+    close(g_access_fd);
+    g_access_fd = -1;
   }
+  names_destroy();
+}
+
+uint64_t logger_dropped(void) {
+  return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
+
+// =============================================================================
+// Records
+// =============================================================================
+
+// Without the writer (before logger_init() or after logger_close()) records
+// go straight to stderr, as they are produced
+static void log_inline(log_level_t level, const char *fmt, va_list args) {
+  const struct stamp *ts = timestamp();
+  flockfile(stderr);
+  fprintf(stderr, "[%s] [%s] ", ts->text, level_strings[level]);
+  vfprintf(stderr, fmt, args);
+  fflush(stderr);
+  funlockfile(stderr);
 }
 
 void logger_log(log_level_t level, const char *fmt, ...) {
@@ -58,21 +524,33 @@ void logger_log(log_level_t level, const char *fmt, ...) {
     return;
   }
 
-  FILE *f = g_log_file ? g_log_file : stderr;
-
-  time_t now = time(NULL);
-  struct tm *tm_info = localtime(&now);
-  char time_buf[32];
-  strftime(time_buf, sizeof(time_buf), "%Y-%m-%d %H:%M:%S", tm_info);
-
-  fprintf(f, "[%s] [%s] ", time_buf, level_strings[level]);
-
   va_list args;
   va_start(args, fmt);
-  vfprintf(f, fmt, args);
+  if (!running || __atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+    log_inline(level, fmt, args);
+    va_end(args);
+    return;
+  }
+
+  size_t pos;
+  struct log_slot *slot = ring_claim(&pos);
+  if (slot == NULL) {
+    va_end(args);
+    return;
+  }
+
+  const struct stamp *ts = timestamp();
+  int n = snprintf(slot->data, LOG_RECORD_SIZE, "[%s] [%s] ", ts->text,
+                   level_strings[level]);
+  if (n >= 0 && n < LOG_RECORD_SIZE) {
+    const int m = vsnprintf(slot->data + n, LOG_RECORD_SIZE - n, fmt, args);
+    n = m < 0 ? n : n + m;
+  }
   va_end(args);
 
-  fflush(f);
+  slot->target = TARGET_LOG;
+  slot->len = slot_fit(slot, n);
+  ring_publish(slot, pos);
 }
 
 static const char *sockaddr_to_string(const struct sockaddr_storage *addr,
@@ -93,24 +571,125 @@ static const char *sockaddr_to_string(const struct sockaddr_storage *addr,
   return buf;
 }
 
-void logger_access(const char *username,
-                   const struct sockaddr_storage *client_addr,
-                   const char *dest_host, uint16_t dest_port, bool success) {
-  if (g_access_file == NULL) {
+// Address bytes (IPv4 in the first 4) and port of a client
+static uint16_t client_address(const struct sockaddr_storage *addr,
+                               uint8_t out[16], uint8_t *flags) {
+  memset(out, 0, 16);
+  if (addr->ss_family == AF_INET) {
+    const struct sockaddr_in *sin = (const struct sockaddr_in *)addr;
+    memcpy(out, &sin->sin_addr, sizeof(sin->sin_addr));
+    return ntohs(sin->sin_port);
+  }
+  if (addr->ss_family == AF_INET6) {
+    const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)addr;
+    memcpy(out, &sin6->sin6_addr, sizeof(sin6->sin6_addr));
+    *flags |= ACCESS_CLIENT_IPV6;
+    return ntohs(sin6->sin6_port);
+  }
+  return 0;
+}
+
+static void access_binary(const struct log_access *entry) {
+  if (!running || __atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+    // names are the writer's alone
+    __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
     return;
   }
 
-  time_t now = time(NULL);
-  struct tm *tm_info = localtime(&now);
-  char time_buf[32];
-  strftime(time_buf, sizeof(time_buf), "%Y-%m-%d %H:%M:%S", tm_info);
+  struct access_record_session rec = {
+      .type = ACCESS_RECORD_SESSION,
+      .status = entry->status,
+      .dest_port = entry->dest_port,
+      .user_id = ACCESS_NO_NAME,
+      .time_ms = unix_time_ms(),
+      .bytes_up = entry->bytes_up,
+      .bytes_down = entry->bytes_down,
+  };
+  const uint64_t duration_ms = entry->duration_us / 1000;
+  rec.duration_ms = duration_ms > UINT32_MAX ? UINT32_MAX : duration_ms;
+  rec.client_port = client_address(entry->client_addr, rec.client_addr,
+                                   &rec.flags);
+
+  const char *host = entry->dest_host ? entry->dest_host : "";
+  size_t hlen = 0;
+  if (inet_pton(AF_INET6, host, rec.dest.addr) == 1) {
+    rec.flags |= ACCESS_DEST_IPV6;
+  } else if (inet_pton(AF_INET, host, rec.dest.addr) != 1) {
+    rec.flags |= ACCESS_DEST_NAME;
+    rec.dest.name_id = ACCESS_NO_NAME;
+    hlen = strlen(host);
+  }
+  size_t ulen = entry->username ? strlen(entry->username) : 0;
+  if (ulen > UINT8_MAX) {
+    ulen = UINT8_MAX; // RFC 1929 names are shorter, never the case
+    rec.flags |= ACCESS_TRUNCATED;
+  }
+
+  // Both names may not fit next to the record. The user always does, and
+  // is kept whole so it keeps its NAME id: the host is cut instead.
+  const size_t room = SLOT_SIZE - sizeof(rec) - 2;
+  if (ulen + hlen > room) {
+    rec.flags |= ACCESS_TRUNCATED;
+    hlen = room - ulen;
+  }
+
+  size_t pos;
+  struct log_slot *slot = ring_claim(&pos);
+  if (slot == NULL) {
+    return;
+  }
+  uint8_t *p = (uint8_t *)slot->data;
+  memcpy(p, &rec, sizeof(rec));
+  p += sizeof(rec);
+  *p++ = (uint8_t)ulen;
+  memcpy(p, entry->username, ulen);
+  p += ulen;
+  *p++ = (uint8_t)hlen;
+  memcpy(p, host, hlen);
+  p += hlen;
+  slot->target = TARGET_ACCESS;
+  slot->len = (uint16_t)(p - (uint8_t *)slot->data);
+  ring_publish(slot, pos);
+}
+
+void logger_access(const struct log_access *entry) {
+  if (g_access_fd < 0) {
+    return;
+  }
+  if (g_access_format == LOG_ACCESS_BINARY) {
+    access_binary(entry);
+    return;
+  }
 
   char client_str[64];
-  sockaddr_to_string(client_addr, client_str, sizeof(client_str));
+  sockaddr_to_string(entry->client_addr, client_str, sizeof(client_str));
+  char status[16] = "OK";
+  if (entry->status != 0) {
+    snprintf(status, sizeof(status), "FAIL(%u)", entry->status);
+  }
+  const char *user = entry->username ? entry->username : "-";
+  const char *host = entry->dest_host ? entry->dest_host : "?";
+  const unsigned long up = entry->bytes_up, down = entry->bytes_down,
+                      ms = entry->duration_us / 1000;
+  const struct stamp *ts = timestamp();
 
-  fprintf(g_access_file, "%s %s %s -> %s:%u %s\n", time_buf,
-          username ? username : "-", client_str, dest_host ? dest_host : "?",
-          dest_port, success ? "OK" : "FAIL");
+  if (!running || __atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+    dprintf(g_access_fd, "%s %s %s -> %s:%u %s up=%lu down=%lu %lums\n",
+            ts->text, user, client_str, host, entry->dest_port, status, up,
+            down, ms);
+    return;
+  }
 
-  fflush(g_access_file);
+  size_t pos;
+  struct log_slot *slot = ring_claim(&pos);
+  if (slot == NULL) {
+    return;
+  }
+  const int n = snprintf(slot->data, LOG_RECORD_SIZE,
+                         "%s %s %s -> %s:%u %s up=%lu down=%lu %lums\n",
+                         ts->text, user, client_str, host, entry->dest_port,
+                         status, up, down, ms);
+  slot->target = TARGET_ACCESS;
+  slot->len = slot_fit(slot, n);
+  ring_publish(slot, pos);
 }
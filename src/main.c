@@ -1,28 +1,43 @@
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE // SO_REUSEPORT
+#endif
+
 #include <arpa/inet.h>
 #include <errno.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "admission.h"
 #include "args.h"
+#include "buffer_pool.h"
 #include "selector.h"
 #include "socks5nio.h"
 #include "metrics.h"
 #include "management.h"
+#include "metrics_http.h"
 #include "logger.h"
+#include "pop3_sniffer.h"
+#include "resolver.h"
+#include "user_db.h"
+#include "user_stats.h"
+#include "verifier.h"
 
 // =============================================================================
 // Global State
 // =============================================================================
 
-static bool done = false;
+// Written from signal handlers and read by every worker thread.
+static volatile sig_atomic_t done = 0;
 struct socks5args socks5args;
 
 // =============================================================================
@@ -32,7 +47,7 @@ struct socks5args socks5args;
 static void sigterm_handler(const int signal) {
   (void)signal;
   LOG_INFO("Received signal %d, initiating shutdown...\n", signal);
-  done = true;
+  done = 1;
 }
 
 static void sigusr1_handler(const int signal) {
@@ -44,6 +59,19 @@ static void sigusr1_handler(const int signal) {
 // Socket Setup Functions
 // =============================================================================
 
+// Each proxied session uses two descriptors; the default soft limit (usually
+// 1024) would cap us far below what the epoll backend can handle.
+static void raise_fd_limit(void) {
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur == rl.rlim_max) {
+    return;
+  }
+  rl.rlim_cur = rl.rlim_max;
+  if (setrlimit(RLIMIT_NOFILE, &rl) < 0) {
+    LOG_WARNING("Failed to raise RLIMIT_NOFILE: %s\n", strerror(errno));
+  }
+}
+
 static int create_udp_socket(const char *addr, unsigned short port) {
     int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
     if (sock < 0) {
@@ -84,7 +112,7 @@ static int create_udp_socket(const char *addr, unsigned short port) {
 }
 
 static int create_passive_socket(const char* addr, unsigned short port,
-                                 int family, bool dual_stack) {
+                                 int family, bool dual_stack, bool reuseport) {
   int sock = -1;
   int ret = -1;
 
@@ -99,6 +127,14 @@ static int create_passive_socket(const char* addr, unsigned short port,
     LOG_WARNING("Failed to set SO_REUSEADDR: %s\n", strerror(errno));
   }
 
+  // Every worker binds its own socket to the same address and the kernel
+  // spreads incoming connections across them.
+  if (reuseport &&
+      setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) < 0) {
+    LOG_ERROR("Failed to set SO_REUSEPORT: %s\n", strerror(errno));
+    goto fail;
+  }
+
   if (family == AF_INET6) {
     int v6only = dual_stack ? 0 : 1;
     if (setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only)) <
@@ -166,6 +202,118 @@ fail:
   return ret;
 }
 
+// =============================================================================
+// Workers
+// =============================================================================
+
+// Each worker runs its own event loop with its own selector, listening
+// sockets and connection pool (see socks5nio.c). Worker 0 runs on the main
+// thread and is the only one that serves the management interface.
+struct worker {
+  unsigned id;
+  pthread_t thread;
+  fd_selector selector;
+  int socks_fd_v4;
+  int socks_fd_v6;
+  int ret;
+};
+
+static struct worker* workers = NULL;
+static unsigned worker_count = 0;
+
+static const struct fd_handler socks5_passive_handler = {
+    .handle_read = socksv5_passive_accept,
+    .handle_write = NULL,
+    .handle_close = NULL,
+    .handle_block = NULL,
+    .handle_timeout = admission_listener_timeout,
+};
+
+// Creates the worker's listening sockets and registers them in its selector.
+// Worker 0 decides whether dual-stack is available; the rest follow it.
+static int worker_listen(struct worker* w, bool reuseport) {
+  static bool dual_stack = true;
+
+  if (dual_stack) {
+    w->socks_fd_v6 = create_passive_socket("::", socks5args.socks_port,
+                                           AF_INET6, true, reuseport);
+    if (w->socks_fd_v6 < 0) {
+      if (w->id != 0) {
+        return -1;
+      }
+      LOG_INFO("Dual-stack not available, falling back to IPv4-only\n");
+      dual_stack = false;
+    } else if (w->id == 0) {
+      LOG_INFO("Listening on [::]:%-5hu (dual-stack IPv4/IPv6)\n",
+               socks5args.socks_port);
+    }
+  }
+
+  if (!dual_stack) {
+    w->socks_fd_v4 =
+        create_passive_socket(socks5args.socks_addr, socks5args.socks_port,
+                              AF_INET, false, reuseport);
+    if (w->socks_fd_v4 < 0) {
+      LOG_ERROR("Failed to create SOCKS listening socket\n");
+      return -1;
+    }
+    if (w->id == 0) {
+      LOG_INFO("Listening on %s:%-5hu (IPv4)\n", socks5args.socks_addr,
+               socks5args.socks_port);
+    }
+  }
+
+  if (w->socks_fd_v6 >= 0 &&
+      selector_register(w->selector, w->socks_fd_v6, &socks5_passive_handler,
+                        OP_READ, NULL) != SELECTOR_SUCCESS) {
+    LOG_ERROR("Failed to register IPv6 SOCKS socket\n");
+    return -1;
+  }
+
+  if (w->socks_fd_v4 >= 0 &&
+      selector_register(w->selector, w->socks_fd_v4, &socks5_passive_handler,
+                        OP_READ, NULL) != SELECTOR_SUCCESS) {
+    LOG_ERROR("Failed to register IPv4 SOCKS socket\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+static void worker_loop(struct worker* w) {
+  // Admission pauses the listeners of the thread that runs them
+  if (w->socks_fd_v6 >= 0) {
+    admission_listener(w->socks_fd_v6);
+  }
+  if (w->socks_fd_v4 >= 0) {
+    admission_listener(w->socks_fd_v4);
+  }
+  while (!done) {
+    selector_status ss = selector_select(w->selector);
+    if (ss != SELECTOR_SUCCESS) {
+      if (errno == EINTR) {
+        continue;
+      }
+      LOG_ERROR("Selector error (worker %u): %s\n", w->id, selector_error(ss));
+      w->ret = 1;
+      done = 1;
+      break;
+    }
+  }
+}
+
+static void* worker_thread(void* arg) {
+  struct worker* w = arg;
+  worker_loop(w);
+  socksv5_pool_destroy();
+  buffer_pool_destroy();
+
+  // A termination signal may have landed on this thread; make sure the main
+  // thread notices instead of waiting for its select timeout.
+  pthread_kill(workers[0].thread, SIGALRM);
+  return NULL;
+}
+
 // =============================================================================
 // Main
 // =============================================================================
@@ -178,6 +326,8 @@ int main(int argc, char* argv[]) {
 
   parse_args(argc, argv, &socks5args);
   // Initialize logging
+  logger_access_format(socks5args.access_log_binary ? LOG_ACCESS_BINARY
+                                                    : LOG_ACCESS_TEXT);
   logger_init(NULL, LOG_INFO);
   metrics_init();
 
@@ -188,6 +338,8 @@ int main(int argc, char* argv[]) {
           socks5args.socks_port);
   LOG_INFO("MANAGEMENT: %s:%hu\n", socks5args.mng_addr,
           socks5args.mng_port);
+  LOG_INFO("WORKERS:    %u\n", socks5args.workers);
+  LOG_INFO("USERS:      %zu\n", user_db_count());
   LOG_INFO("==============================================\n");
 
   struct sigaction sa;
@@ -208,6 +360,15 @@ int main(int argc, char* argv[]) {
 
   signal(SIGPIPE, SIG_IGN);
 
+  selector_backend backend;
+  if (selector_backend_from_name(socks5args.io_backend, &backend) < 0) {
+    LOG_ERROR("Unknown I/O backend: %s\n", socks5args.io_backend);
+    return 1;
+  }
+  if (backend != SELECTOR_BACKEND_SELECT) {
+    raise_fd_limit();
+  }
+
   const struct selector_init selector_config = {
       .signal = SIGALRM,
       .select_timeout =
@@ -215,68 +376,56 @@ int main(int argc, char* argv[]) {
               .tv_sec = 10,
               .tv_nsec = 0,
           },
+      .backend = backend,
   };
 
+  // Also blocks SIGALRM in this thread, so every worker inherits the mask.
   if (selector_init(&selector_config) != SELECTOR_SUCCESS) {
     LOG_ERROR("Failed to initialize selector\n");
     return 1;
   }
 
-  fd_selector selector = selector_new(1024);
-  if (selector == NULL) {
-    LOG_ERROR("Failed to create selector\n");
+  int mng_fd = -1;
+  int metrics_fd = -1;
+  int ret = 0;
+  unsigned started = 0;
+  const bool reuseport = socks5args.workers > 1;
+
+  worker_count = socks5args.workers;
+  workers = calloc(worker_count, sizeof(*workers));
+  if (workers == NULL) {
+    LOG_ERROR("Failed to allocate workers\n");
     selector_close();
     return 1;
   }
+  workers[0].thread = pthread_self();
 
-  int socks_fd_v4 = -1;
-  int socks_fd_v6 = -1;
-  int mng_fd = -1;
-  int ret = 0;
-
-  socks_fd_v6 =
-      create_passive_socket("::", socks5args.socks_port, AF_INET6, true);
+  for (unsigned i = 0; i < worker_count; i++) {
+    struct worker* w = workers + i;
+    w->id = i;
+    w->socks_fd_v4 = -1;
+    w->socks_fd_v6 = -1;
 
-  if (socks_fd_v6 >= 0) {
-    LOG_INFO("Listening on [::]:%-5hu (dual-stack IPv4/IPv6)\n",
-            socks5args.socks_port);
-  } else {
-    LOG_INFO("Dual-stack not available, falling back to IPv4-only\n");
-    socks_fd_v4 = create_passive_socket(socks5args.socks_addr,
-                                        socks5args.socks_port, AF_INET, false);
-    if (socks_fd_v4 < 0) {
-      LOG_ERROR("Failed to create SOCKS listening socket\n");
+    w->selector = selector_new(1024);
+    if (w->selector == NULL) {
+      LOG_ERROR("Failed to create selector\n");
       ret = 1;
       goto cleanup;
     }
-    LOG_INFO("Listening on %s:%-5hu (IPv4)\n", socks5args.socks_addr,
-            socks5args.socks_port);
-  }
-
-  static const struct fd_handler socks5_passive_handler = {
-      .handle_read = socksv5_passive_accept,
-      .handle_write = NULL,
-      .handle_close = NULL,
-      .handle_block = NULL,
-  };
-
-  if (socks_fd_v6 >= 0) {
-    if (selector_register(selector, socks_fd_v6, &socks5_passive_handler,
-                          OP_READ, NULL) != SELECTOR_SUCCESS) {
-      LOG_ERROR("Failed to register IPv6 SOCKS socket\n");
+    if (worker_listen(w, reuseport) < 0) {
       ret = 1;
       goto cleanup;
     }
   }
 
-  if (socks_fd_v4 >= 0) {
-    if (selector_register(selector, socks_fd_v4, &socks5_passive_handler,
-                          OP_READ, NULL) != SELECTOR_SUCCESS) {
-      LOG_ERROR("Failed to register IPv4 SOCKS socket\n");
-      ret = 1;
-      goto cleanup;
-    }
+  if (selector_get_backend(workers[0].selector) != backend) {
+    LOG_WARNING("I/O backend %s not available, using %s\n",
+                selector_backend_name(backend),
+                selector_backend_name(
+                    selector_get_backend(workers[0].selector)));
   }
+  LOG_INFO("I/O backend: %s\n",
+           selector_backend_name(selector_get_backend(workers[0].selector)));
 
   // Management Interface Setup
   mgmt_init();
@@ -291,10 +440,10 @@ int main(int argc, char* argv[]) {
       .handle_read = mgmt_handle_request,
       .handle_write = NULL,
       .handle_close = NULL,
-      .handle_block = NULL,
+      .handle_block = mgmt_handle_block,
   };
 
-  if (selector_register(selector, mng_fd, &management_handler,
+  if (selector_register(workers[0].selector, mng_fd, &management_handler,
                         OP_READ, NULL) != SELECTOR_SUCCESS) {
       LOG_ERROR("Failed to register management socket\n");
       ret = 1;
@@ -303,35 +452,87 @@ int main(int argc, char* argv[]) {
   LOG_INFO("Management interface listening on %s:%hu\n", 
           socks5args.mng_addr, socks5args.mng_port);
 
-  LOG_INFO("Server ready. Waiting for connections...\n");
+  if (socks5args.metrics_port != 0) {
+    const int family = strchr(socks5args.metrics_addr, ':') ? AF_INET6 : AF_INET;
+    metrics_fd = create_passive_socket(socks5args.metrics_addr,
+                                       socks5args.metrics_port, family, false,
+                                       false);
+    if (metrics_fd < 0 ||
+        metrics_http_register(workers[0].selector, metrics_fd) !=
+            SELECTOR_SUCCESS) {
+      LOG_ERROR("Failed to set up the metrics endpoint\n");
+      ret = 1;
+      goto cleanup;
+    }
+    LOG_INFO("Metrics endpoint listening on http://%s:%hu/metrics\n",
+             socks5args.metrics_addr, socks5args.metrics_port);
+  }
 
-  while (!done) {
-    selector_status ss = selector_select(selector);
-    if (ss != SELECTOR_SUCCESS) {
-      if (errno == EINTR) {
-        continue;
-      }
-      LOG_ERROR("Selector error: %s\n", selector_error(ss));
+  if (resolver_init(RESOLVER_DEFAULT_THREADS) < 0) {
+    LOG_ERROR("Failed to start resolver threads\n");
+    ret = 1;
+    goto cleanup;
+  }
+  if (verifier_init(VERIFIER_DEFAULT_THREADS) < 0) {
+    LOG_ERROR("Failed to start verifier threads\n");
+    resolver_destroy();
+    ret = 1;
+    goto cleanup;
+  }
+
+  for (started = 1; started < worker_count; started++) {
+    struct worker* w = workers + started;
+    if (pthread_create(&w->thread, NULL, worker_thread, w) != 0) {
+      LOG_ERROR("Failed to start worker %u\n", started);
       ret = 1;
+      done = 1;
       break;
     }
   }
 
+  LOG_INFO("Server ready. Waiting for connections...\n");
+
+  if (!done) {
+    worker_loop(workers + 0);
+  }
+
   LOG_INFO("Shutting down...\n");
+
+  for (unsigned i = 1; i < started; i++) {
+    pthread_kill(workers[i].thread, SIGALRM);
+  }
+  // Resolver and verifier threads notify worker threads, so they go first
+  resolver_destroy();
+  verifier_destroy();
+  for (unsigned i = 1; i < started; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+
   metrics_print(stdout);
 
 cleanup:
-  if (selector != NULL) {
-    selector_destroy(selector);
+  for (unsigned i = 0; i < worker_count; i++) {
+    struct worker* w = workers + i;
+    if (w->selector != NULL) {
+      selector_destroy(w->selector);
+    }
+    if (w->socks_fd_v4 >= 0) close(w->socks_fd_v4);
+    if (w->socks_fd_v6 >= 0) close(w->socks_fd_v6);
+    ret |= w->ret;
   }
+  free(workers);
   selector_close();
 
-  if (socks_fd_v4 >= 0) close(socks_fd_v4);
-  if (socks_fd_v6 >= 0) close(socks_fd_v6);
   if (mng_fd >= 0) close(mng_fd);
+  if (metrics_fd >= 0) close(metrics_fd);
 
   mgmt_cleanup();
   socksv5_pool_destroy();
+  user_stats_destroy();
+  user_db_destroy();
+  admission_destroy();
+  pop3_sniffer_destroy();
+  buffer_pool_destroy();
   logger_close();
 
   return ret;
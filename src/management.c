@@ -8,9 +8,11 @@
 #include <arpa/inet.h>
 #include <ctype.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/socket.h>
 #include <time.h>
 #include <unistd.h>
@@ -18,6 +20,10 @@
 #include "args.h"
 #include "logger.h"
 #include "metrics.h"
+#include "resolver.h"
+#include "user_db.h"
+#include "user_stats.h"
+#include "verifier.h"
 
 // =============================================================================
 // Helper Functions
@@ -81,23 +87,58 @@ static void format_bytes(uint64_t bytes, char* buf, size_t buflen) {
   }
 }
 
+static void format_duration(uint64_t us, char* buf, size_t buflen) {
+  if (us < 1000) {
+    snprintf(buf, buflen, "%lu us", (unsigned long)us);
+  } else if (us < 1000000) {
+    snprintf(buf, buflen, "%.2f ms", us / 1000.0);
+  } else {
+    snprintf(buf, buflen, "%.2f s", us / 1000000.0);
+  }
+}
+
 // =============================================================================
 // Command Handlers
 // =============================================================================
 
 static int cmd_stats(char* response, size_t resp_len) {
-  struct metrics* m = metrics_get();
+  struct metrics m;
+  metrics_snapshot(&m);
 
   char hist_conns[32], curr_conns[32];
   char bytes_recv[32], bytes_sent[32];
-  char auth_ok[32], auth_fail[32];
-
-  format_number(m->historic_connections, hist_conns, sizeof(hist_conns));
-  format_number(m->current_connections, curr_conns, sizeof(curr_conns));
-  format_bytes(m->bytes_received, bytes_recv, sizeof(bytes_recv));
-  format_bytes(m->bytes_sent, bytes_sent, sizeof(bytes_sent));
-  format_number(m->auth_success, auth_ok, sizeof(auth_ok));
-  format_number(m->auth_failure, auth_fail, sizeof(auth_fail));
+  char auth_ok[32], auth_fail[32], auth_hits[32], auth_kdf[32];
+  char dns_hits[32], dns_misses[32], dns_coalesced[32], dns_evictions[32];
+  char dns_entries[32];
+  char log_dropped[32];
+  char rej_global[32], rej_ip[32], rej_user[32], pauses[32];
+
+  format_number(m.historic_connections, hist_conns, sizeof(hist_conns));
+  format_number(m.current_connections, curr_conns, sizeof(curr_conns));
+  format_bytes(m.bytes_received, bytes_recv, sizeof(bytes_recv));
+  format_bytes(m.bytes_sent, bytes_sent, sizeof(bytes_sent));
+  format_number(m.auth_success, auth_ok, sizeof(auth_ok));
+  format_number(m.auth_failure, auth_fail, sizeof(auth_fail));
+
+  struct verifier_stats verify;
+  verifier_get_stats(&verify);
+  format_number(verify.hits, auth_hits, sizeof(auth_hits));
+  format_number(verify.misses, auth_kdf, sizeof(auth_kdf));
+
+  struct resolver_stats dns;
+  resolver_get_stats(&dns);
+  format_number(dns.hits, dns_hits, sizeof(dns_hits));
+  format_number(dns.misses, dns_misses, sizeof(dns_misses));
+  format_number(dns.coalesced, dns_coalesced, sizeof(dns_coalesced));
+  format_number(dns.evictions, dns_evictions, sizeof(dns_evictions));
+  format_number(dns.entries, dns_entries, sizeof(dns_entries));
+  format_number(logger_dropped(), log_dropped, sizeof(log_dropped));
+  format_number(m.rejected[METRICS_REJECTED_GLOBAL], rej_global,
+                sizeof(rej_global));
+  format_number(m.rejected[METRICS_REJECTED_PER_IP], rej_ip, sizeof(rej_ip));
+  format_number(m.rejected[METRICS_REJECTED_PER_USER], rej_user,
+                sizeof(rej_user));
+  format_number(m.listener_pauses, pauses, sizeof(pauses));
 
   time_t now = time(NULL);
   struct tm* tm_info = localtime(&now);
@@ -108,47 +149,273 @@ static int cmd_stats(char* response, size_t resp_len) {
            "%s Server Statistics\n"
            "==============================\n"
            "Time:                 %s\n"
+           "Workers:              %u\n"
            "---------- Connections ----------\n"
            "Historic connections: %s\n"
            "Current connections:  %s\n"
+           "---------- Admission ----------\n"
+           "Rejected (server):    %s\n"
+           "Rejected (per IP):    %s\n"
+           "Rejected (per user):  %s\n"
+           "Listener pauses:      %s\n"
            "---------- Traffic ----------\n"
            "Bytes received:       %s\n"
            "Bytes sent:           %s\n"
            "---------- Authentication ----------\n"
            "Auth successes:       %s\n"
            "Auth failures:        %s\n"
+           "Cached successes:     %s\n"
+           "Password hashes run:  %s\n"
+           "---------- DNS cache ----------\n"
+           "Hits:                 %s\n"
+           "Misses:               %s\n"
+           "Coalesced:            %s\n"
+           "Evictions:            %s\n"
+           "Entries:              %s\n"
+           "---------- Logging ----------\n"
+           "Dropped records:      %s\n"
            "==============================\n",
-           MGMT_STATUS_OK, time_str, hist_conns, curr_conns, bytes_recv,
-           bytes_sent, auth_ok, auth_fail);
+           MGMT_STATUS_OK, time_str, socks5args.workers, hist_conns, curr_conns, rej_global,
+           rej_ip, rej_user, pauses, bytes_recv,
+           bytes_sent, auth_ok, auth_fail, auth_hits, auth_kdf, dns_hits, dns_misses, dns_coalesced,
+           dns_evictions, dns_entries, log_dropped);
 
   return 0;
 }
 
+struct users_output {
+  char* response;
+  size_t resp_len;
+  size_t offset;
+  unsigned listed;
+  unsigned omitted; // didn't fit in the response
+};
+
+static void users_row(const char* name, void* data) {
+  struct users_output* o = data;
+  // keep room for the trailer
+  const size_t room = o->resp_len - o->offset;
+  const int n = snprintf(o->response + o->offset, room, "  %u. %s\n",
+                         o->listed + 1, name);
+  if (o->omitted > 0 || n < 0 || (size_t)n >= room ||
+      room - (size_t)n < 96) {
+    o->response[o->offset] = '\0';
+    o->omitted++;
+    return;
+  }
+  o->offset += (size_t)n;
+  o->listed++;
+}
+
 static int cmd_users(char* response, size_t resp_len) {
+  struct users_output o = {.response = response, .resp_len = resp_len};
+  o.offset = snprintf(response, resp_len,
+                      "%s Registered Users (%zu)\n"
+                      "==============================\n",
+                      MGMT_STATUS_OK, user_db_count());
+
+  user_db_foreach(users_row, &o);
+  if (o.listed == 0 && o.omitted == 0) {
+    o.offset += snprintf(response + o.offset, resp_len - o.offset,
+                         "(no users configured)\n");
+  }
+  if (o.omitted > 0) {
+    o.offset += snprintf(response + o.offset, resp_len - o.offset,
+                         "(%u more not shown)\n", o.omitted);
+  }
+
+  snprintf(response + o.offset, resp_len - o.offset,
+           "==============================\n");
+
+  return 0;
+}
+
+static int cmd_buffers(char* response, size_t resp_len) {
+  struct metrics m;
+  metrics_snapshot(&m);
+
+  char min[32], max[32], grows[32], shrinks[32];
+  format_bytes(socks5args.buffer_min, min, sizeof(min));
+  format_bytes(socks5args.buffer_max, max, sizeof(max));
+  format_number(m.relay_buffer_grows, grows, sizeof(grows));
+  format_number(m.relay_buffer_shrinks, shrinks, sizeof(shrinks));
+
   int offset = snprintf(response, resp_len,
-                        "%s Registered Users (%d)\n"
-                        "==============================\n",
-                        MGMT_STATUS_OK, socks5args.user_count);
+                        "%s Relay Buffers\n"
+                        "==============================\n"
+                        "Minimum size:         %s\n"
+                        "Maximum size:         %s\n"
+                        "Grown:                %s\n"
+                        "Shrunk:               %s\n"
+                        "---------- In use by size ----------\n",
+                        MGMT_STATUS_OK, min, max, grows, shrinks);
+
+  uint64_t total = 0;
+  for (unsigned c = 0; c < METRICS_BUFFER_CLASSES; c++) {
+    const uint64_t n = m.relay_buffers[c];
+    if (n == 0) {
+      continue;
+    }
+    char size[32], count[32];
+    format_bytes((uint64_t)1 << (METRICS_BUFFER_MIN_SHIFT + c), size,
+                 sizeof(size));
+    format_number(n, count, sizeof(count));
+    offset += snprintf(response + offset, resp_len - offset,
+                       "%-21s %s\n", size, count);
+    total += n;
+  }
+  if (total == 0) {
+    offset += snprintf(response + offset, resp_len - offset, "(none)\n");
+  }
 
-  if (socks5args.user_count == 0) {
+  snprintf(response + offset, resp_len - offset,
+           "==============================\n");
+
+  return 0;
+}
+
+static int cmd_latency(char* response, size_t resp_len) {
+  static const double percentiles[] = {50, 90, 99, 99.9};
+
+  int offset = snprintf(response, resp_len,
+                        "%s Latency\n"
+                        "==============================\n"
+                        "%-11s %9s %9s %9s %9s %9s %9s\n",
+                        MGMT_STATUS_OK, "Phase", "Count", "p50", "p90", "p99",
+                        "p99.9", "Max");
+
+  for (unsigned l = 0; l < METRICS_LATENCY_COUNT; l++) {
+    struct metrics_histogram h;
+    metrics_latency_snapshot(l, &h);
+
+    char count[32], values[5][32];
+    format_number(h.count, count, sizeof(count));
+    for (unsigned p = 0; p < 4; p++) {
+      format_duration(metrics_histogram_percentile(&h, percentiles[p]),
+                      values[p], sizeof(values[p]));
+    }
+    format_duration(h.max, values[4], sizeof(values[4]));
     offset += snprintf(response + offset, resp_len - offset,
-                       "(no users configured)\n");
+                       "%-11s %9s %9s %9s %9s %9s %9s\n",
+                       metrics_latency_name(l), count, values[0], values[1],
+                       values[2], values[3], values[4]);
+  }
+
+  snprintf(response + offset, resp_len - offset,
+           "==============================\n");
+
+  return 0;
+}
+
+struct userstats_output {
+  char* response;
+  size_t resp_len;
+  size_t offset;
+  unsigned users;
+  unsigned omitted; // didn't fit in the response
+};
+
+static void userstats_row(const struct user_stats_view* u, void* data) {
+  struct userstats_output* o = data;
+  char in[32], out[32], active[32], total[32], failures[32];
+  format_bytes(u->bytes_received, in, sizeof(in));
+  format_bytes(u->bytes_sent, out, sizeof(out));
+  format_number(u->active_sessions, active, sizeof(active));
+  format_number(u->total_sessions, total, sizeof(total));
+  format_number(u->auth_failures, failures, sizeof(failures));
+
+  o->users++;
+  // keep room for the trailer
+  const size_t room = o->resp_len - o->offset;
+  const int n = snprintf(o->response + o->offset, room,
+                         "%-16.16s %10s %10s %7s %9s %9s\n", u->name, in, out,
+                         active, total, failures);
+  if (n < 0 || (size_t)n >= room || room - (size_t)n < 96) {
+    o->response[o->offset] = '\0';
+    o->omitted++;
+    return;
+  }
+  o->offset += (size_t)n;
+}
+
+static int cmd_userstats(const char* args, char* response, size_t resp_len) {
+  struct userstats_output o = {.response = response, .resp_len = resp_len};
+  o.offset = snprintf(response, resp_len,
+                      "%s User Statistics\n"
+                      "==============================\n"
+                      "%-16s %10s %10s %7s %9s %9s\n",
+                      MGMT_STATUS_OK, "User", "Received", "Sent", "Active",
+                      "Sessions", "AuthFail");
+
+  if (args != NULL && *args != '\0') {
+    struct user_stats_view u;
+    if (!user_stats_find(args, &u)) {
+      snprintf(response, resp_len, "%s No statistics for user '%s'\n",
+               MGMT_STATUS_ERROR, args);
+      return -1;
+    }
+    userstats_row(&u, &o);
   } else {
-    for (int i = 0; i < socks5args.user_count && i < MAX_USERS; i++) {
-      if (socks5args.users[i].name != NULL) {
-        offset += snprintf(response + offset, resp_len - offset, "  %d. %s\n",
-                           i + 1, socks5args.users[i].name);
-      }
+    user_stats_foreach(userstats_row, &o);
+    if (o.users == 0) {
+      o.offset += snprintf(response + o.offset, resp_len - o.offset,
+                           "(no user has logged in yet)\n");
     }
   }
+  if (o.omitted > 0) {
+    o.offset += snprintf(response + o.offset, resp_len - o.offset,
+                         "(%u more, ask for them by name)\n", o.omitted);
+  }
 
-  snprintf(response + offset, resp_len - offset,
+  snprintf(response + o.offset, resp_len - o.offset,
            "==============================\n");
 
   return 0;
 }
 
-static int cmd_add(const char* args, char* response, size_t resp_len) {
+// ADDs whose password is being hashed on a verifier thread, answered from
+// mgmt_handle_block() once it is
+static struct pending_add {
+  struct verifier_job* job; // NULL if the slot is free
+  char name[256];
+  size_t name_len;
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+} pending_adds[MGMT_MAX_PENDING_ADDS];
+
+// cmd_add() didn't answer yet
+#define MGMT_DEFERRED 1
+
+static int add_result(enum user_db_status status, const char* name,
+                      size_t ulen, char* response, size_t resp_len) {
+  switch (status) {
+    case USER_DB_OK:
+      break;
+    case USER_DB_EXISTS:
+      snprintf(response, resp_len, "%s User '%.*s' already exists\n",
+               MGMT_STATUS_ERROR, (int)ulen, name);
+      return -1;
+    case USER_DB_BAD_HASH:
+      snprintf(response, resp_len, "%s Malformed password hash\n",
+               MGMT_STATUS_ERROR);
+      return -1;
+    default:
+      snprintf(response, resp_len, "%s Memory allocation failed\n",
+               MGMT_STATUS_ERROR);
+      return -1;
+  }
+
+  LOG_INFO("User '%.*s' added via management interface\n", (int)ulen, name);
+
+  snprintf(response, resp_len, "%s User '%.*s' added successfully\n",
+           MGMT_STATUS_OK, (int)ulen, name);
+
+  return 0;
+}
+
+static int cmd_add(struct selector_key* key, const char* args,
+                   const struct sockaddr_storage* addr, socklen_t addr_len,
+                   char* response, size_t resp_len) {
   if (args == NULL || *args == '\0') {
     snprintf(response, resp_len, "%s Usage: ADD <username>:<password>\n",
              MGMT_STATUS_ERROR);
@@ -177,46 +444,33 @@ static int cmd_add(const char* args, char* response, size_t resp_len) {
     return -1;
   }
 
-  for (int i = 0; i < socks5args.user_count; i++) {
-    if (socks5args.users[i].name != NULL &&
-        strncmp(socks5args.users[i].name, args, ulen) == 0 &&
-        socks5args.users[i].name[ulen] == '\0') {
-      snprintf(response, resp_len, "%s User '%.*s' already exists\n",
-               MGMT_STATUS_ERROR, (int)ulen, args);
-      return -1;
-    }
+  if (user_db_hashed(password)) {
+    return add_result(user_db_add(args, ulen, password), args, ulen, response,
+                      resp_len);
   }
 
-  if (socks5args.user_count >= MAX_USERS) {
-    snprintf(response, resp_len, "%s Maximum users reached (%d)\n",
-             MGMT_STATUS_ERROR, MAX_USERS);
-    return -1;
+  // Hashing a plain-text password takes as long as checking one: it would
+  // stall every tunnel of this loop
+  struct pending_add* p = NULL;
+  for (unsigned i = 0; i < MGMT_MAX_PENDING_ADDS && p == NULL; i++) {
+    if (pending_adds[i].job == NULL) {
+      p = pending_adds + i;
+    }
   }
-
-  int idx = socks5args.user_count;
-  socks5args.users[idx].name = strndup(args, ulen);
-  socks5args.users[idx].pass = strdup(password);
-  socks5args.users[idx].from_cmd = false;
-
-  if (socks5args.users[idx].name == NULL ||
-      socks5args.users[idx].pass == NULL) {
-    free(socks5args.users[idx].name);
-    free(socks5args.users[idx].pass);
-    snprintf(response, resp_len, "%s Memory allocation failed\n",
+  if (p != NULL) {
+    p->job = verifier_submit_derive(key->s, key->fd, password);
+  }
+  if (p == NULL || p->job == NULL) {
+    snprintf(response, resp_len,
+             "%s Too many users being added, try again later\n",
              MGMT_STATUS_ERROR);
     return -1;
   }
-
-  socks5args.user_count++;
-  socks5args.auth_required = true;
-
-  LOG_INFO("User '%s' added via management interface\n",
-           socks5args.users[idx].name);
-
-  snprintf(response, resp_len, "%s User '%s' added successfully\n",
-           MGMT_STATUS_OK, socks5args.users[idx].name);
-
-  return 0;
+  memcpy(p->name, args, ulen);
+  p->name_len = ulen;
+  memcpy(&p->addr, addr, addr_len);
+  p->addr_len = addr_len;
+  return MGMT_DEFERRED;
 }
 
 static int cmd_del(const char* args, char* response, size_t resp_len) {
@@ -226,45 +480,68 @@ static int cmd_del(const char* args, char* response, size_t resp_len) {
     return -1;
   }
 
-  int found = -1;
-  for (int i = 0; i < socks5args.user_count; i++) {
-    if (socks5args.users[i].name != NULL &&
-        strcmp(socks5args.users[i].name, args) == 0) {
-      found = i;
-      break;
-    }
-  }
-
-  if (found < 0) {
+  if (user_db_del(args) != USER_DB_OK) {
     snprintf(response, resp_len, "%s User '%s' not found\n", MGMT_STATUS_ERROR,
              args);
     return -1;
   }
 
-  char* deleted_name = socks5args.users[found].name;
-  if (!socks5args.users[found].from_cmd) {
-    free(socks5args.users[found].pass);
-    free(deleted_name);
-  }
+  LOG_INFO("User '%s' deleted via management interface\n", args);
 
-  for (int i = found; i < socks5args.user_count - 1; i++) {
-    socks5args.users[i] = socks5args.users[i + 1];
-  }
-
-  socks5args.user_count--;
+  snprintf(response, resp_len, "%s User '%s' deleted successfully\n",
+           MGMT_STATUS_OK, args);
 
-  socks5args.users[socks5args.user_count].name = NULL;
-  socks5args.users[socks5args.user_count].pass = NULL;
+  return 0;
+}
 
-  if (socks5args.user_count == 0) {
-    socks5args.auth_required = false;
+static int cmd_rate(char* args, uint64_t now, char* response,
+                    size_t resp_len) {
+  // The name may have spaces, the rate can't
+  char* space = args != NULL ? strrchr(args, ' ') : NULL;
+  if (space == NULL) {
+    snprintf(response, resp_len,
+             "%s Usage: RATE <username> <bytes/s[K|M|G]|unlimited|default>\n",
+             MGMT_STATUS_ERROR);
+    return -1;
+  }
+  *space = '\0';
+  const char* name = trim(args);
+  const char* value = space + 1;
+
+  uint64_t rate;
+  if (strcasecmp(value, "unlimited") == 0) {
+    rate = 0;
+  } else if (strcasecmp(value, "default") == 0) {
+    rate = USER_DB_RATE_DEFAULT;
+  } else if (!shaper_parse_rate(value, &rate)) {
+    snprintf(response, resp_len,
+             "%s Invalid rate '%s': bytes per second up to %" PRIu64
+             ", optionally with a K, M or G suffix\n",
+             MGMT_STATUS_ERROR, value, SHAPER_MAX_RATE);
+    return -1;
   }
 
-  LOG_INFO("User '%s' deleted via management interface\n", deleted_name);
+  if (user_db_set_rate(name, rate) != USER_DB_OK) {
+    snprintf(response, resp_len, "%s User '%s' not found\n", MGMT_STATUS_ERROR,
+             name);
+    return -1;
+  }
+  // Sessions already open follow the new cap right away
+  const uint64_t effective = user_db_rate(name);
+  user_stats_set_rate(user_stats_get(name), effective, now);
 
-  snprintf(response, resp_len, "%s User '%s' deleted successfully\n",
-           MGMT_STATUS_OK, deleted_name);
+  LOG_INFO("User '%s' rate set to %" PRIu64 " bytes/s via management "
+           "interface\n",
+           name, effective);
 
+  if (effective == 0) {
+    snprintf(response, resp_len, "%s User '%s' is not rate limited\n",
+             MGMT_STATUS_OK, name);
+  } else {
+    snprintf(response, resp_len,
+             "%s User '%s' limited to %" PRIu64 " bytes/s each way\n",
+             MGMT_STATUS_OK, name, effective);
+  }
   return 0;
 }
 
@@ -283,12 +560,26 @@ static int cmd_help(char* response, size_t resp_len) {
            "\n"
            "  USERS              List registered users\n"
            "\n"
+           "  BUFFERS            Show relay buffer sizes in use\n"
+           "\n"
+           "  LATENCY            Show p50/p90/p99/p99.9 latency per phase\n"
+           "                     - auth, resolve, connect, first-byte,\n"
+           "                       session\n"
+           "\n"
+           "  USERSTATS [user]   Show traffic and sessions per user\n"
+           "                     Example: USERSTATS alice\n"
+           "\n"
            "  ADD <user>:<pass>  Add a new user\n"
            "                     Example: ADD alice:secret123\n"
            "\n"
            "  DEL <user>         Delete a user\n"
            "                     Example: DEL alice\n"
            "\n"
+           "  RATE <user> <rate> Cap each direction of a user's traffic,\n"
+           "                     in bytes/s with an optional K, M or G\n"
+           "                     suffix, 'unlimited' or 'default'\n"
+           "                     Example: RATE alice 512K\n"
+           "\n"
            "  HELP               Show this help message\n"
            "\n"
            "==========================================\n"
@@ -353,10 +644,21 @@ void mgmt_handle_request(struct selector_key* key) {
     cmd_stats(response, sizeof(response));
   } else if (strcmp(cmd, MGMT_CMD_USERS) == 0) {
     cmd_users(response, sizeof(response));
+  } else if (strcmp(cmd, MGMT_CMD_BUFFERS) == 0) {
+    cmd_buffers(response, sizeof(response));
+  } else if (strcmp(cmd, MGMT_CMD_LATENCY) == 0) {
+    cmd_latency(response, sizeof(response));
+  } else if (strcmp(cmd, MGMT_CMD_USERSTATS) == 0) {
+    cmd_userstats(args, response, sizeof(response));
   } else if (strcmp(cmd, MGMT_CMD_ADD) == 0) {
-    cmd_add(args, response, sizeof(response));
+    if (cmd_add(key, args, &client_addr, addr_len, response,
+                sizeof(response)) == MGMT_DEFERRED) {
+      return;
+    }
   } else if (strcmp(cmd, MGMT_CMD_DEL) == 0) {
     cmd_del(args, response, sizeof(response));
+  } else if (strcmp(cmd, MGMT_CMD_RATE) == 0) {
+    cmd_rate(args, selector_now(key->s), response, sizeof(response));
   } else if (strcmp(cmd, MGMT_CMD_HELP) == 0) {
     cmd_help(response, sizeof(response));
   } else if (strcmp(cmd, MGMT_CMD_QUIT) == 0 || strcmp(cmd, "EXIT") == 0) {
@@ -374,6 +676,36 @@ void mgmt_handle_request(struct selector_key* key) {
          addr_len);
 }
 
+void mgmt_handle_block(struct selector_key* key) {
+  for (unsigned i = 0; i < MGMT_MAX_PENDING_ADDS; i++) {
+    struct pending_add* p = pending_adds + i;
+    struct user_credential cred;
+    bool derived;
+    if (p->job == NULL || !verifier_poll_derive(p->job, &derived, &cred)) {
+      continue;
+    }
+    p->job = NULL;
+
+    char response[MGMT_MAX_RESP_LEN];
+    if (derived) {
+      add_result(user_db_add_credential(p->name, p->name_len, &cred), p->name,
+                 p->name_len, response, sizeof(response));
+    } else {
+      snprintf(response, sizeof(response), "%s Server shutting down\n",
+               MGMT_STATUS_ERROR);
+    }
+    sendto(key->fd, response, strlen(response), 0,
+           (struct sockaddr*)&p->addr, p->addr_len);
+  }
+}
+
 void mgmt_init(void) { LOG_INFO("Management interface initialized\n"); }
 
-void mgmt_cleanup(void) {}
+void mgmt_cleanup(void) {
+  for (unsigned i = 0; i < MGMT_MAX_PENDING_ADDS; i++) {
+    if (pending_adds[i].job != NULL) {
+      verifier_cancel(pending_adds[i].job);
+      pending_adds[i].job = NULL;
+    }
+  }
+}
@@ -1,57 +1,289 @@
-
 #include "metrics.h"
+#include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+
+// =============================================================================
+// Shards
+// =============================================================================
+
+// Enough for every worker plus the main and helper threads; any thread
+// beyond this shares one overflow shard and pays for atomic adds.
+#define MAX_SHARDS 128
+
+struct shard {
+  _Alignas(METRICS_CACHE_LINE) struct metrics counters;
+  struct metrics_histogram latency[METRICS_LATENCY_COUNT];
+};
+
+static struct shard shards[MAX_SHARDS + 1]; // the last one is the overflow
+static unsigned shards_used = 0;
+
+static _Thread_local struct shard *local = NULL;
+static _Thread_local bool shared = false;
+
+static struct shard *shard(void) {
+  if (local == NULL) {
+    const unsigned i = __atomic_fetch_add(&shards_used, 1, __ATOMIC_RELAXED);
+    shared = i >= MAX_SHARDS;
+    local = &shards[shared ? MAX_SHARDS : i];
+  }
+  return local;
+}
+
+static struct metrics *counters(void) { return &shard()->counters; }
+
+// Shards in use, the overflow included once anyone spilled into it
+static unsigned shards_in_use(void) {
+  const unsigned used = __atomic_load_n(&shards_used, __ATOMIC_RELAXED);
+  return used > MAX_SHARDS ? MAX_SHARDS + 1 : used;
+}
+
+// Only the owning thread writes its shard, so a relaxed load and store
+// (a plain add) suffice; readers on other threads still see whole values.
+static void add(uint64_t *counter, uint64_t n) {
+  if (shared) {
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+  } else {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n,
+                     __ATOMIC_RELAXED);
+  }
+}
 
-static struct metrics g_metrics;
+// Only the shards handed out so far, so the pages of the rest (mostly
+// histograms) are never touched
+void metrics_init(void) {
+  memset(shards, 0, shards_in_use() * sizeof(shards[0]));
+}
+
+void metrics_snapshot(struct metrics *out) {
+  memset(out, 0, sizeof(*out));
+  uint64_t *sum = (uint64_t *)out;
+  const size_t n = sizeof(*out) / sizeof(uint64_t);
 
-void metrics_init(void) { memset(&g_metrics, 0, sizeof(g_metrics)); }
+  const unsigned used = shards_in_use();
+  for (unsigned s = 0; s < used; s++) {
+    const uint64_t *c = (const uint64_t *)&shards[s].counters;
+    for (size_t i = 0; i < n; i++) {
+      sum[i] += __atomic_load_n(&c[i], __ATOMIC_RELAXED);
+    }
+  }
+}
 
-struct metrics *metrics_get(void) { return &g_metrics; }
+// =============================================================================
+// Counters
+// =============================================================================
 
 void metrics_new_connection(void) {
-  __sync_add_and_fetch(&g_metrics.historic_connections, 1);
-  __sync_add_and_fetch(&g_metrics.current_connections, 1);
+  struct metrics *m = counters();
+  add(&m->historic_connections, 1);
+  add(&m->current_connections, 1);
 }
 
 void metrics_close_connection(void) {
-  __sync_sub_and_fetch(&g_metrics.current_connections, 1);
+  add(&counters()->current_connections, (uint64_t)-1);
 }
 
 void metrics_add_bytes_sent(size_t bytes) {
-  __sync_add_and_fetch(&g_metrics.bytes_sent, bytes);
+  add(&counters()->bytes_sent, bytes);
 }
 
 void metrics_add_bytes_received(size_t bytes) {
-  __sync_add_and_fetch(&g_metrics.bytes_received, bytes);
+  add(&counters()->bytes_received, bytes);
+}
+
+void metrics_auth_success(void) { add(&counters()->auth_success, 1); }
+
+void metrics_auth_failure(void) { add(&counters()->auth_failure, 1); }
+
+static unsigned buffer_class(size_t size) {
+  unsigned c = 0;
+  while (c < METRICS_BUFFER_CLASSES - 1 &&
+         ((size_t)1 << (METRICS_BUFFER_MIN_SHIFT + c)) < size) {
+    c++;
+  }
+  return c;
 }
 
-void metrics_auth_success(void) {
-  __sync_add_and_fetch(&g_metrics.auth_success, 1);
+void metrics_relay_buffer_attached(size_t size) {
+  add(&counters()->relay_buffers[buffer_class(size)], 1);
 }
 
-void metrics_auth_failure(void) {
-  __sync_add_and_fetch(&g_metrics.auth_failure, 1);
+void metrics_relay_buffer_detached(size_t size) {
+  add(&counters()->relay_buffers[buffer_class(size)], (uint64_t)-1);
 }
 
+void metrics_relay_buffer_resized(size_t old_size, size_t new_size) {
+  struct metrics *m = counters();
+  if (new_size > old_size) {
+    add(&m->relay_buffer_grows, 1);
+  } else {
+    add(&m->relay_buffer_shrinks, 1);
+  }
+}
+
+void metrics_admission_rejected(enum metrics_rejection why) {
+  add(&counters()->rejected[why], 1);
+}
+
+void metrics_listener_paused(void) { add(&counters()->listener_pauses, 1); }
+
+void metrics_session_state(int from, int to) {
+  struct metrics *m = counters();
+  if (from >= 0 && from < METRICS_SESSION_STATES) {
+    add(&m->sessions[from], (uint64_t)-1);
+  }
+  if (to >= 0 && to < METRICS_SESSION_STATES) {
+    add(&m->sessions[to], 1);
+  }
+}
+
+// =============================================================================
+// Latency
+// =============================================================================
+
+#define SUB_BUCKETS (1u << METRICS_HISTOGRAM_SUB_BITS)
+
+static unsigned histogram_bucket(uint64_t us) {
+  if (us < SUB_BUCKETS) {
+    return (unsigned)us;
+  }
+  const unsigned e = 63 - (unsigned)__builtin_clzll(us);
+  if (e >= METRICS_HISTOGRAM_MAX_SHIFT) {
+    return METRICS_HISTOGRAM_BUCKETS - 1;
+  }
+  const unsigned sub = (unsigned)(us >> (e - METRICS_HISTOGRAM_SUB_BITS)) &
+                       (SUB_BUCKETS - 1);
+  return ((e - METRICS_HISTOGRAM_SUB_BITS + 1) << METRICS_HISTOGRAM_SUB_BITS) +
+         sub;
+}
+
+// Largest value that falls in `bucket'
+static uint64_t histogram_bucket_max(unsigned bucket) {
+  if (bucket < SUB_BUCKETS) {
+    return bucket;
+  }
+  const unsigned e =
+      (bucket >> METRICS_HISTOGRAM_SUB_BITS) + METRICS_HISTOGRAM_SUB_BITS - 1;
+  const uint64_t sub = bucket & (SUB_BUCKETS - 1);
+  const unsigned shift = e - METRICS_HISTOGRAM_SUB_BITS;
+  return ((SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+uint64_t metrics_clock_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+void metrics_latency_record(enum metrics_latency phase, uint64_t us) {
+  struct metrics_histogram *h = &shard()->latency[phase];
+  add(&h->count, 1);
+  add(&h->sum, us);
+  add(&h->buckets[histogram_bucket(us)], 1);
+  if (us > __atomic_load_n(&h->max, __ATOMIC_RELAXED)) {
+    // only the overflow shard has concurrent writers; a lost race there
+    // just under-reports the maximum a little
+    __atomic_store_n(&h->max, us, __ATOMIC_RELAXED);
+  }
+}
+
+uint64_t metrics_latency_since(enum metrics_latency phase, uint64_t start) {
+  const uint64_t now = metrics_clock_us();
+  metrics_latency_record(phase, now > start ? now - start : 0);
+  return now;
+}
+
+void metrics_latency_snapshot(enum metrics_latency phase,
+                              struct metrics_histogram *out) {
+  memset(out, 0, sizeof(*out));
+  const unsigned used = shards_in_use();
+  for (unsigned s = 0; s < used; s++) {
+    const struct metrics_histogram *h = &shards[s].latency[phase];
+    out->count += __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+    out->sum += __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+    const uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    if (max > out->max) {
+      out->max = max;
+    }
+    for (unsigned b = 0; b < METRICS_HISTOGRAM_BUCKETS; b++) {
+      out->buckets[b] += __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+    }
+  }
+}
+
+uint64_t metrics_histogram_percentile(const struct metrics_histogram *h,
+                                      double percentile) {
+  uint64_t total = 0;
+  for (unsigned b = 0; b < METRICS_HISTOGRAM_BUCKETS; b++) {
+    total += h->buckets[b];
+  }
+  if (total == 0) {
+    return 0;
+  }
+
+  // rank of the sample we're after, 1-based
+  uint64_t rank = (uint64_t)(percentile / 100.0 * (double)total + 0.5);
+  rank = rank < 1 ? 1 : rank > total ? total : rank;
+
+  uint64_t seen = 0;
+  for (unsigned b = 0; b < METRICS_HISTOGRAM_BUCKETS; b++) {
+    seen += h->buckets[b];
+    if (seen >= rank) {
+      const uint64_t v = histogram_bucket_max(b);
+      return v < h->max ? v : h->max;
+    }
+  }
+  return h->max;
+}
+
+uint64_t metrics_histogram_count_le(const struct metrics_histogram *h,
+                                    uint64_t us) {
+  uint64_t n = 0;
+  for (unsigned b = 0;
+       b < METRICS_HISTOGRAM_BUCKETS && histogram_bucket_max(b) <= us; b++) {
+    n += h->buckets[b];
+  }
+  return n;
+}
+
+const char *metrics_latency_name(enum metrics_latency phase) {
+  static const char *const names[METRICS_LATENCY_COUNT] = {
+      [METRICS_LATENCY_AUTH] = "auth",
+      [METRICS_LATENCY_RESOLVE] = "resolve",
+      [METRICS_LATENCY_CONNECT] = "connect",
+      [METRICS_LATENCY_FIRST_BYTE] = "first-byte",
+      [METRICS_LATENCY_SESSION] = "session",
+  };
+  return phase < METRICS_LATENCY_COUNT ? names[phase] : "unknown";
+}
+
+// =============================================================================
+// Report
+// =============================================================================
+
 void metrics_print(FILE *fp) {
+  struct metrics m;
+  metrics_snapshot(&m);
+
   fprintf(fp, "\n");
   fprintf(fp, "╔══════════════════════════════════════════╗\n");
   fprintf(fp, "║          SERVER STATISTICS               ║\n");
   fprintf(fp, "╠══════════════════════════════════════════╣\n");
   fprintf(fp, "║   CONNECTIONS                            ║\n");
   fprintf(fp, "║  ├─ Historic: %-20lu       ║\n",
-          g_metrics.historic_connections);
+          m.historic_connections);
   fprintf(fp, "║  └─ Current:  %-20lu       ║\n",
-          g_metrics.current_connections);
+          m.current_connections);
   fprintf(fp, "╠══════════════════════════════════════════╣\n");
   fprintf(fp, "║   TRAFFIC                                ║\n");
-  fprintf(fp, "║  ├─ Received: %-20lu       ║\n", g_metrics.bytes_received);
-  fprintf(fp, "║  └─ Sent:     %-20lu       ║\n", g_metrics.bytes_sent);
+  fprintf(fp, "║  ├─ Received: %-20lu       ║\n", m.bytes_received);
+  fprintf(fp, "║  └─ Sent:     %-20lu       ║\n", m.bytes_sent);
   fprintf(fp, "╠══════════════════════════════════════════╣\n");
   fprintf(fp, "║  AUTHENTICATION                          ║\n");
-  fprintf(fp, "║  ├─ Success:  %-20lu       ║\n", g_metrics.auth_success);
-  fprintf(fp, "║  └─ Failures: %-20lu       ║\n", g_metrics.auth_failure);
+  fprintf(fp, "║  ├─ Success:  %-20lu       ║\n", m.auth_success);
+  fprintf(fp, "║  └─ Failures: %-20lu       ║\n", m.auth_failure);
   fprintf(fp, "╚══════════════════════════════════════════╝\n");
   fprintf(fp, "\n");
 }
@@ -0,0 +1,494 @@
+#include "metrics_http.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "args.h"
+#include "logger.h"
+#include "metrics.h"
+#include "resolver.h"
+#include "socks5nio.h"
+#include "user_stats.h"
+
+// =============================================================================
+// Rendering
+// =============================================================================
+
+struct output {
+  char *buf;
+  size_t len;
+  size_t cap;
+  bool overflow;
+};
+
+static void emit(struct output *o, const char *fmt, ...) {
+  if (o->overflow) {
+    return;
+  }
+  va_list ap;
+  va_start(ap, fmt);
+  const int n = vsnprintf(o->buf + o->len, o->cap - o->len, fmt, ap);
+  va_end(ap);
+  if (n < 0 || (size_t)n >= o->cap - o->len) {
+    o->overflow = true;
+    return;
+  }
+  o->len += (size_t)n;
+}
+
+static void family(struct output *o, const char *name, const char *type,
+                   const char *help) {
+  emit(o, "# TYPE %s %s\n# HELP %s %s\n", name, type, name, help);
+}
+
+static const char *const state_names[] = {
+    [HELLO_READ] = "hello_read",
+    [HELLO_WRITE] = "hello_write",
+    [AUTH_READ] = "auth_read",
+    [AUTH_VERIFYING] = "auth_verifying",
+    [AUTH_WRITE] = "auth_write",
+    [REQUEST_READ] = "request_read",
+    [REQUEST_RESOLVING] = "request_resolving",
+    [REQUEST_CONNECTING] = "request_connecting",
+    [REQUEST_WRITE] = "request_write",
+    [COPY] = "copy",
+};
+
+// Bucket bounds exposed for the latency histograms, in microseconds and as
+// printed. The internal buckets are much finer; each bound counts the ones
+// entirely below it (see metrics_histogram_count_le()).
+static const struct {
+  uint64_t us;
+  const char *le;
+} latency_bounds[] = {
+    {100, "0.0001"},      {250, "0.00025"},    {500, "0.0005"},
+    {1000, "0.001"},      {2500, "0.0025"},    {5000, "0.005"},
+    {10000, "0.01"},      {25000, "0.025"},    {50000, "0.05"},
+    {100000, "0.1"},      {250000, "0.25"},    {500000, "0.5"},
+    {1000000, "1.0"},     {2500000, "2.5"},    {5000000, "5.0"},
+    {10000000, "10.0"},   {30000000, "30.0"},  {60000000, "60.0"},
+    {300000000, "300.0"},
+};
+
+#define N(x) (sizeof(x) / sizeof((x)[0]))
+
+static void render_latency(struct output *o) {
+  const char *name = "socks5_phase_duration_seconds";
+  family(o, name, "histogram", "Time spent in each phase of a session.");
+  emit(o, "# UNIT %s seconds\n", name);
+
+  for (unsigned l = 0; l < METRICS_LATENCY_COUNT; l++) {
+    // one snapshot at a time, so they live on the stack
+    struct metrics_histogram h;
+    metrics_latency_snapshot(l, &h);
+    const char *phase = metrics_latency_name(l);
+
+    uint64_t total = 0;
+    for (unsigned b = 0; b < METRICS_HISTOGRAM_BUCKETS; b++) {
+      total += h.buckets[b];
+    }
+    for (unsigned i = 0; i < N(latency_bounds); i++) {
+      emit(o, "%s_bucket{phase=\"%s\",le=\"%s\"} %lu\n", name, phase,
+           latency_bounds[i].le,
+           (unsigned long)metrics_histogram_count_le(&h, latency_bounds[i].us));
+    }
+    emit(o, "%s_bucket{phase=\"%s\",le=\"+Inf\"} %lu\n", name, phase,
+         (unsigned long)total);
+    emit(o, "%s_count{phase=\"%s\"} %lu\n", name, phase, (unsigned long)total);
+    emit(o, "%s_sum{phase=\"%s\"} %lu.%06lu\n", name, phase,
+         (unsigned long)(h.sum / 1000000), (unsigned long)(h.sum % 1000000));
+  }
+}
+
+// Label values may hold any byte a client sent as its username
+static void emit_label(struct output *o, const char *value) {
+  for (const char *c = value; *c != '\0' && !o->overflow; c++) {
+    switch (*c) {
+      case '\\':
+        emit(o, "\\\\");
+        break;
+      case '"':
+        emit(o, "\\\"");
+        break;
+      case '\n':
+        emit(o, "\\n");
+        break;
+      default:
+        emit(o, "%c", *c);
+    }
+  }
+}
+
+enum user_family {
+  USER_BYTES,
+  USER_OPEN_SESSIONS,
+  USER_SESSIONS,
+  USER_AUTH_FAILURES,
+};
+
+struct user_output {
+  struct output *o;
+  enum user_family family;
+  unsigned left; // users still to render
+};
+
+static void render_user(const struct user_stats_view *u, void *data) {
+  struct user_output *uo = data;
+  if (uo->left == 0) {
+    return;
+  }
+  uo->left--;
+  struct output *o = uo->o;
+  static const char *const names[] = {
+      [USER_BYTES] = "socks5_user_client_bytes_total",
+      [USER_OPEN_SESSIONS] = "socks5_user_open_sessions",
+      [USER_SESSIONS] = "socks5_user_sessions_total",
+      [USER_AUTH_FAILURES] = "socks5_user_auth_failures_total",
+  };
+
+  emit(o, "%s{user=\"", names[uo->family]);
+  emit_label(o, u->name);
+  switch (uo->family) {
+    case USER_BYTES:
+      emit(o, "\",direction=\"received\"} %lu\n",
+           (unsigned long)u->bytes_received);
+      emit(o, "%s{user=\"", names[uo->family]);
+      emit_label(o, u->name);
+      emit(o, "\",direction=\"sent\"} %lu\n", (unsigned long)u->bytes_sent);
+      break;
+    case USER_OPEN_SESSIONS:
+      emit(o, "\"} %lu\n", (unsigned long)u->active_sessions);
+      break;
+    case USER_SESSIONS:
+      emit(o, "\"} %lu\n", (unsigned long)u->total_sessions);
+      break;
+    default:
+      emit(o, "\"} %lu\n", (unsigned long)u->auth_failures);
+      break;
+  }
+}
+
+static void render_user_family(struct output *o, enum user_family f,
+                               const char *name, const char *type,
+                               const char *help) {
+  family(o, name, type, help);
+  // users are only ever appended, so every family gets the same ones
+  struct user_output uo = {
+      .o = o, .family = f, .left = socks5args.metrics_users};
+  user_stats_foreach(render_user, &uo);
+}
+
+#define END "# EOF\n"
+
+// A family's samples must be contiguous, so users are walked once per
+// family. They go last, leaving room for END: if they don't all fit, none
+// is served rather than none of the exposition.
+static void render_users(struct output *o) {
+  if (socks5args.metrics_users == 0 || o->overflow ||
+      o->cap - o->len < sizeof(END)) {
+    return;
+  }
+  const size_t start = o->len, cap = o->cap;
+  o->cap -= sizeof(END) - 1;
+  render_user_family(o, USER_BYTES, "socks5_user_client_bytes", "counter",
+                     "Bytes exchanged with clients by user.");
+  render_user_family(o, USER_OPEN_SESSIONS, "socks5_user_open_sessions",
+                     "gauge", "Authenticated sessions open by user.");
+  render_user_family(o, USER_SESSIONS, "socks5_user_sessions", "counter",
+                     "Authenticated sessions by user.");
+  render_user_family(o, USER_AUTH_FAILURES, "socks5_user_auth_failures",
+                     "counter", "Wrong passwords given for an existing user.");
+  if (o->overflow) {
+    static bool warned = false;
+    if (!warned) {
+      LOG_WARNING("Per-user metrics don't fit in /metrics, leaving them "
+                  "out; lower --metrics-users\n");
+      warned = true;
+    }
+    o->len = start;
+    o->overflow = false;
+  }
+  o->cap = cap;
+}
+
+size_t metrics_http_render(char *buf, size_t len) {
+  struct output o = {.buf = buf, .cap = len};
+  struct metrics m;
+  metrics_snapshot(&m);
+  struct resolver_stats dns;
+  resolver_get_stats(&dns);
+
+  family(&o, "socks5_connections", "counter", "Client connections accepted.");
+  emit(&o, "socks5_connections_total %lu\n",
+       (unsigned long)m.historic_connections);
+
+  family(&o, "socks5_open_connections", "gauge", "Client connections open.");
+  emit(&o, "socks5_open_connections %lu\n",
+       (unsigned long)m.current_connections);
+
+  family(&o, "socks5_admission_rejections", "counter",
+         "Connections and sessions refused by admission control.");
+  emit(&o, "socks5_admission_rejections_total{cap=\"global\"} %lu\n",
+       (unsigned long)m.rejected[METRICS_REJECTED_GLOBAL]);
+  emit(&o, "socks5_admission_rejections_total{cap=\"ip\"} %lu\n",
+       (unsigned long)m.rejected[METRICS_REJECTED_PER_IP]);
+  emit(&o, "socks5_admission_rejections_total{cap=\"user\"} %lu\n",
+       (unsigned long)m.rejected[METRICS_REJECTED_PER_USER]);
+
+  family(&o, "socks5_listener_pauses", "counter",
+         "Times a worker stopped accepting because the server was full.");
+  emit(&o, "socks5_listener_pauses_total %lu\n",
+       (unsigned long)m.listener_pauses);
+
+  family(&o, "socks5_sessions", "gauge", "Open sessions by state.");
+  for (unsigned st = 0; st < N(state_names); st++) {
+    emit(&o, "socks5_sessions{state=\"%s\"} %lu\n", state_names[st],
+         (unsigned long)m.sessions[st]);
+  }
+
+  family(&o, "socks5_client_bytes", "counter",
+         "Bytes exchanged with clients through tunnels.");
+  emit(&o, "socks5_client_bytes_total{direction=\"received\"} %lu\n",
+       (unsigned long)m.bytes_received);
+  emit(&o, "socks5_client_bytes_total{direction=\"sent\"} %lu\n",
+       (unsigned long)m.bytes_sent);
+
+  family(&o, "socks5_auth", "counter", "Username/password authentications.");
+  emit(&o, "socks5_auth_total{result=\"success\"} %lu\n",
+       (unsigned long)m.auth_success);
+  emit(&o, "socks5_auth_total{result=\"failure\"} %lu\n",
+       (unsigned long)m.auth_failure);
+
+  family(&o, "socks5_dns_lookups", "counter",
+         "Name lookups by how the resolver cache served them.");
+  emit(&o, "socks5_dns_lookups_total{result=\"hit\"} %lu\n",
+       (unsigned long)dns.hits);
+  emit(&o, "socks5_dns_lookups_total{result=\"miss\"} %lu\n",
+       (unsigned long)dns.misses);
+  emit(&o, "socks5_dns_lookups_total{result=\"coalesced\"} %lu\n",
+       (unsigned long)dns.coalesced);
+
+  family(&o, "socks5_dns_cache_evictions", "counter",
+         "Resolver cache entries dropped for age or space.");
+  emit(&o, "socks5_dns_cache_evictions_total %lu\n",
+       (unsigned long)dns.evictions);
+
+  family(&o, "socks5_dns_cache_entries", "gauge",
+         "Names cached or being looked up.");
+  emit(&o, "socks5_dns_cache_entries %lu\n", (unsigned long)dns.entries);
+
+  family(&o, "socks5_relay_buffers", "gauge", "Relay buffers in use by size.");
+  for (unsigned c = 0; c < METRICS_BUFFER_CLASSES; c++) {
+    emit(&o, "socks5_relay_buffers{size=\"%lu\"} %lu\n",
+         1UL << (METRICS_BUFFER_MIN_SHIFT + c),
+         (unsigned long)m.relay_buffers[c]);
+  }
+
+  family(&o, "socks5_relay_buffer_resizes", "counter",
+         "Relay buffer size changes.");
+  emit(&o, "socks5_relay_buffer_resizes_total{direction=\"grow\"} %lu\n",
+       (unsigned long)m.relay_buffer_grows);
+  emit(&o, "socks5_relay_buffer_resizes_total{direction=\"shrink\"} %lu\n",
+       (unsigned long)m.relay_buffer_shrinks);
+
+  family(&o, "socks5_log_dropped_records", "counter",
+         "Log records lost because the logger's ring was full.");
+  emit(&o, "socks5_log_dropped_records_total %lu\n",
+       (unsigned long)logger_dropped());
+
+  render_latency(&o);
+  render_users(&o);
+  emit(&o, END);
+
+  return o.overflow ? 0 : o.len;
+}
+
+// =============================================================================
+// Connections
+// =============================================================================
+
+// Room in front of the body for the status line and headers, which are
+// only known once the body is rendered
+#define HEADER_ROOM 256
+
+struct scrape {
+  bool used;
+  char request[2048];
+  size_t request_len;
+  char response[HEADER_ROOM + METRICS_HTTP_BODY_SIZE];
+  const char *out; // next byte to send
+  size_t out_len;  // bytes left to send
+};
+
+static struct scrape scrapes[METRICS_HTTP_MAX_CLIENTS];
+
+static void scrape_read(struct selector_key *key);
+static void scrape_write(struct selector_key *key);
+static void scrape_close(struct selector_key *key);
+static void scrape_timeout(struct selector_key *key);
+
+static const struct fd_handler scrape_handler = {
+    .handle_read = scrape_read,
+    .handle_write = scrape_write,
+    .handle_close = scrape_close,
+    .handle_timeout = scrape_timeout,
+};
+
+static void scrape_respond(struct scrape *c, const char *status,
+                           const char *type, const char *body,
+                           size_t body_len) {
+  char header[HEADER_ROOM];
+  const int n = snprintf(header, sizeof(header),
+                         "HTTP/1.1 %s\r\n"
+                         "Content-Type: %s\r\n"
+                         "Content-Length: %zu\r\n"
+                         "Connection: close\r\n"
+                         "\r\n",
+                         status, type, body_len);
+  char *body_at = c->response + HEADER_ROOM;
+  if (body != body_at) {
+    memcpy(body_at, body, body_len);
+  }
+  memcpy(body_at - n, header, (size_t)n);
+  c->out = body_at - n;
+  c->out_len = (size_t)n + body_len;
+}
+
+static void scrape_error(struct scrape *c, const char *status) {
+  char body[64];
+  const int n = snprintf(body, sizeof(body), "%s\n", status);
+  scrape_respond(c, status, "text/plain; charset=utf-8", body, (size_t)n);
+}
+
+// Answers the request line; the headers are ignored
+static void scrape_handle(struct scrape *c) {
+  const char *r = c->request;
+  const bool head = strncmp(r, "HEAD ", 5) == 0;
+  if (!head && strncmp(r, "GET ", 4) != 0) {
+    scrape_error(c, "405 Method Not Allowed");
+    return;
+  }
+  const char *path = r + (head ? 5 : 4);
+  const size_t path_len = strcspn(path, " ?\r\n");
+  if (path_len != strlen("/metrics") ||
+      strncmp(path, "/metrics", path_len) != 0) {
+    scrape_error(c, "404 Not Found");
+    return;
+  }
+
+  char *body = c->response + HEADER_ROOM;
+  const size_t len = metrics_http_render(body, METRICS_HTTP_BODY_SIZE);
+  if (len == 0) {
+    LOG_ERROR("Metrics exposition doesn't fit in %d bytes\n",
+              METRICS_HTTP_BODY_SIZE);
+    scrape_error(c, "500 Internal Server Error");
+    return;
+  }
+  scrape_respond(c,
+                 "200 OK",
+                 "application/openmetrics-text; version=1.0.0; charset=utf-8",
+                 body, len);
+  if (head) {
+    c->out_len -= len;
+  }
+}
+
+static void scrape_read(struct selector_key *key) {
+  struct scrape *c = key->data;
+  const size_t room = sizeof(c->request) - 1 - c->request_len;
+  const ssize_t n = recv(key->fd, c->request + c->request_len, room, 0);
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return;
+  }
+  if (n <= 0) {
+    selector_unregister_fd(key->s, key->fd);
+    return;
+  }
+  c->request_len += (size_t)n;
+  c->request[c->request_len] = '\0';
+
+  if (strstr(c->request, "\r\n\r\n") != NULL) {
+    scrape_handle(c);
+  } else if (c->request_len == sizeof(c->request) - 1) {
+    scrape_error(c, "431 Request Header Fields Too Large");
+  } else {
+    return;
+  }
+  selector_set_interest_key(key, OP_WRITE);
+}
+
+static void scrape_write(struct selector_key *key) {
+  struct scrape *c = key->data;
+  const ssize_t n = send(key->fd, c->out, c->out_len, MSG_NOSIGNAL);
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return;
+  }
+  if (n < 0) {
+    selector_unregister_fd(key->s, key->fd);
+    return;
+  }
+  c->out += n;
+  c->out_len -= (size_t)n;
+  if (c->out_len == 0) {
+    selector_unregister_fd(key->s, key->fd);
+  }
+}
+
+static void scrape_close(struct selector_key *key) {
+  struct scrape *c = key->data;
+  close(key->fd);
+  c->used = false;
+}
+
+static void scrape_timeout(struct selector_key *key) {
+  LOG_DEBUG("Metrics scrape on fd %d timed out\n", key->fd);
+  selector_unregister_fd(key->s, key->fd);
+}
+
+// =============================================================================
+// Listener
+// =============================================================================
+
+static void metrics_http_accept(struct selector_key *key) {
+  const int fd = accept(key->fd, NULL, NULL);
+  if (fd < 0) {
+    return;
+  }
+
+  struct scrape *c = NULL;
+  for (unsigned i = 0; i < METRICS_HTTP_MAX_CLIENTS; i++) {
+    if (!scrapes[i].used) {
+      c = scrapes + i;
+      break;
+    }
+  }
+  if (c == NULL) {
+    LOG_WARNING("Too many metrics scrapes at once, dropping one\n");
+    close(fd);
+    return;
+  }
+
+  if (selector_fd_set_nio(fd) < 0 ||
+      selector_register(key->s, fd, &scrape_handler, OP_READ, c) !=
+          SELECTOR_SUCCESS) {
+    close(fd);
+    return;
+  }
+  c->used = true;
+  c->request_len = 0;
+  c->out_len = 0;
+  selector_set_timeout(key->s, fd, METRICS_HTTP_TIMEOUT_MS);
+}
+
+static const struct fd_handler metrics_http_handler = {
+    .handle_read = metrics_http_accept,
+};
+
+selector_status metrics_http_register(fd_selector s, int fd) {
+  return selector_register(s, fd, &metrics_http_handler, OP_READ, NULL);
+}
@@ -0,0 +1,181 @@
+#include "pop3_sniffer.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "parser_utils.h"
+#include "token_scan.h"
+
+// =============================================================================
+// Keywords
+// =============================================================================
+
+// Built once and shared by every session and worker
+static struct parser_definition *user_def = NULL;
+static struct parser_definition *pass_def = NULL;
+static struct parser_table *user_table = NULL;
+static struct parser_table *pass_table = NULL;
+static struct token_scan keywords; // where skipped lines may end
+static pthread_once_t defs_once = PTHREAD_ONCE_INIT;
+
+// A parser_utils_strcmpi() machine on the heap, since its fields are const
+static struct parser_definition *keyword(const char *s) {
+  const struct parser_definition def = parser_utils_strcmpi(s);
+  if (def.states == NULL) {
+    return NULL;
+  }
+  struct parser_definition *ret = malloc(sizeof(*ret));
+  if (ret == NULL) {
+    parser_utils_strcmpi_destroy(&def);
+    return NULL;
+  }
+  memcpy(ret, &def, sizeof(def));
+  return ret;
+}
+
+static void keyword_destroy(struct parser_definition *def) {
+  if (def != NULL) {
+    parser_utils_strcmpi_destroy(def);
+    free(def);
+  }
+}
+
+static void defs_init(void) {
+  static const char *const literals[] = {"USER ", "PASS "};
+  if (!token_scan_init(&keywords, literals, 2)) {
+    return;
+  }
+  user_def = keyword(literals[0]);
+  pass_def = keyword(literals[1]);
+  // Without them the matchers still work, only slower
+  if (user_def != NULL && pass_def != NULL) {
+    user_table = parser_table_compile(parser_no_classes(), user_def);
+    pass_table = parser_table_compile(parser_no_classes(), pass_def);
+  }
+}
+
+void pop3_sniffer_destroy(void) {
+  parser_table_destroy(user_table);
+  parser_table_destroy(pass_table);
+  user_table = pass_table = NULL;
+  keyword_destroy(user_def);
+  keyword_destroy(pass_def);
+  user_def = pass_def = NULL;
+}
+
+// =============================================================================
+// Sniffer
+// =============================================================================
+
+static void line_start(struct pop3_sniffer *p) {
+  parser_reset(&p->user_cmd);
+  parser_reset(&p->pass_cmd);
+  p->state = POP3_COMMAND;
+}
+
+void pop3_sniffer_init(struct pop3_sniffer *p, uint16_t port) {
+  pthread_once(&defs_once, defs_init);
+  if (user_def == NULL || pass_def == NULL) {
+    pop3_sniffer_stop(p);
+    return;
+  }
+  p->budget = port == POP3_PORT ? POP3_SNIFF_PORT_BYTES
+                                : POP3_SNIFF_PROBE_BYTES;
+  p->arg_len = 0;
+  p->user[0] = '\0';
+  parser_init_at(&p->user_cmd, parser_no_classes(), user_def);
+  parser_init_at(&p->pass_cmd, parser_no_classes(), pass_def);
+  parser_use_table(&p->user_cmd, user_table);
+  parser_use_table(&p->pass_cmd, pass_table);
+  line_start(p);
+}
+
+void pop3_sniffer_stop(struct pop3_sniffer *p) { p->budget = 0; }
+
+// Feeds the keyword matchers one byte of the line's start
+static void command(struct pop3_sniffer *p, uint8_t c) {
+  if (c == '\n') {
+    line_start(p);
+    return;
+  }
+  const unsigned user = parser_feed(&p->user_cmd, c)->type;
+  const unsigned pass = parser_feed(&p->pass_cmd, c)->type;
+  if (user == STRING_CMP_EQ || pass == STRING_CMP_EQ) {
+    p->state = POP3_ARGUMENT;
+    p->pass = pass == STRING_CMP_EQ;
+    p->arg_len = 0;
+  } else if (user == STRING_CMP_NEQ && pass == STRING_CMP_NEQ) {
+    p->state = POP3_SKIP;
+  }
+}
+
+static void argument_done(struct pop3_sniffer *p) {
+  p->arg[p->arg_len] = '\0';
+  if (!p->pass) {
+    memcpy(p->user, p->arg, p->arg_len + 1);
+  } else if (p->user[0] != '\0' && p->on_credentials != NULL) {
+    p->on_credentials(p, p->user, p->arg);
+  }
+}
+
+// Copies the argument up to the end of the line; returns what it used
+static size_t argument(struct pop3_sniffer *p, const uint8_t *b, size_t n) {
+  size_t i = 0;
+  while (i < n && b[i] != '\r' && b[i] != '\n') {
+    if (p->arg_len + 1 == POP3_ARG_MAX) {
+      // Too long to be one, or to be kept whole
+      p->state = POP3_SKIP;
+      return i;
+    }
+    p->arg[p->arg_len++] = (char)b[i++];
+  }
+  if (i < n) {
+    argument_done(p);
+    // The '\r' or '\n' ends the line as well
+    p->state = POP3_SKIP;
+  }
+  return i;
+}
+
+// Jumps to the next line that starts like a keyword; returns what it used.
+// Whatever started the line being skipped is behind b, so a keyword at b[0]
+// isn't at a line start.
+static size_t skip(struct pop3_sniffer *p, const uint8_t *b, size_t n) {
+  size_t i = 0;
+  while ((i += token_scan_find(&keywords, b + i, n - i)) < n) {
+    if (i > 0 && b[i - 1] == '\n') {
+      line_start(p);
+      return i;
+    }
+    i++;
+  }
+  // The next read may start a line
+  if (n > 0 && b[n - 1] == '\n') {
+    line_start(p);
+  }
+  return n;
+}
+
+void pop3_sniffer_feed(struct pop3_sniffer *p, const uint8_t *bytes,
+                       size_t n) {
+  if (n > p->budget) {
+    n = p->budget;
+  }
+  p->budget -= n;
+
+  const uint8_t *end = bytes + n;
+  while (bytes < end) {
+    switch (p->state) {
+      case POP3_COMMAND:
+        command(p, *bytes++);
+        break;
+      case POP3_ARGUMENT:
+        bytes += argument(p, bytes, end - bytes);
+        break;
+      default:
+        bytes += skip(p, bytes, end - bytes);
+        break;
+    }
+  }
+}
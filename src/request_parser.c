@@ -0,0 +1,166 @@
+#include "request_parser.h"
+
+#include <string.h>
+
+//+----+-----+-------+------+----------+----------+
+//|VER | CMD |  RSV  | ATYP | DST.ADDR | DST.PORT |
+//+----+-----+-------+------+----------+----------+
+//| 1  |  1  | X'00' |  1   | Variable |    2     |
+//+----+-----+-------+------+----------+----------+
+
+static void request_process_version(struct request_st* r, uint8_t byte) {
+  r->state = (byte == SOCKS_VERSION) ? REQUEST_CMD : REQUEST_ERROR;
+}
+
+static void request_process_cmd(struct request_st* r, uint8_t byte) {
+  r->cmd = byte;
+  if (byte != SOCKS_CMD_CONNECT) {
+    r->reply = SOCKS_REPLY_CMD_NOT_SUPPORTED;
+    r->state = REQUEST_ERROR;
+  } else {
+    r->state = REQUEST_RSV;
+  }
+}
+
+static void request_process_rsv(struct request_st* r, uint8_t byte) {
+  (void)byte;
+  r->state = REQUEST_ATYP;
+}
+
+static void request_process_atyp(struct request_st* r, uint8_t byte) {
+  r->atyp = byte;
+  r->addr_index = 0;
+  if (byte == SOCKS_ATYP_IPV4 || byte == SOCKS_ATYP_IPV6 ||
+      byte == SOCKS_ATYP_DOMAIN) {
+    r->state = REQUEST_DSTADDR;
+  } else {
+    r->reply = SOCKS_REPLY_ATYP_NOT_SUPPORTED;
+    r->state = REQUEST_ERROR;
+  }
+}
+
+static void request_process_dstaddr(struct request_st* r, uint8_t byte) {
+  if (r->atyp == SOCKS_ATYP_IPV4) {
+    ((uint8_t*)&r->dest_addr.ipv4)[r->addr_index++] = byte;
+    if (r->addr_index >= SOCKS_IPV4_ADDR_SIZE) {
+      r->state = REQUEST_DSTPORT;
+      r->addr_index = 0;
+    }
+  } else if (r->atyp == SOCKS_ATYP_IPV6) {
+    r->dest_addr.ipv6.s6_addr[r->addr_index++] = byte;
+    if (r->addr_index >= SOCKS_IPV6_ADDR_SIZE) {
+      r->state = REQUEST_DSTPORT;
+      r->addr_index = 0;
+    }
+  } else if (r->atyp == SOCKS_ATYP_DOMAIN) {
+    if (r->addr_index == 0) {
+      r->fqdn_len = byte;
+      r->addr_index = 1;
+      if (byte == 0) {
+        // Nothing to resolve
+        r->state = REQUEST_ERROR;
+      }
+    } else {
+      r->dest_addr.fqdn[r->addr_index - 1] = byte;
+      if (++r->addr_index > r->fqdn_len) {
+        r->dest_addr.fqdn[r->fqdn_len] = 0;
+        r->state = REQUEST_DSTPORT;
+        r->addr_index = 0;
+      }
+    }
+  }
+}
+
+static void request_process_dstport(struct request_st* r, uint8_t byte) {
+  if (r->addr_index == 0) {
+    r->dest_port = byte << 8;
+    r->addr_index = 1;
+  } else {
+    r->dest_port |= byte;
+    r->state = REQUEST_DONE;
+  }
+}
+
+// Bytes DST.ADDR takes after ATYP, given the bytes that follow ATYP; 0 if
+// they don't say yet or say it is empty
+static size_t request_addr_size(uint8_t atyp, const uint8_t* ptr, size_t n) {
+  switch (atyp) {
+    case SOCKS_ATYP_IPV4:
+      return SOCKS_IPV4_ADDR_SIZE;
+    case SOCKS_ATYP_IPV6:
+      return SOCKS_IPV6_ADDR_SIZE;
+    case SOCKS_ATYP_DOMAIN:
+      return n > 0 && ptr[0] > 0 ? 1 + (size_t)ptr[0] : 0;
+    default:
+      return 0;
+  }
+}
+
+// The whole request from the buffer, if it is all there and valid; nothing
+// is consumed otherwise
+static bool request_consume_message(struct request_st* r) {
+  size_t n;
+  const uint8_t* ptr = buffer_read_ptr(r->rb, &n);
+  if (n < 4 || ptr[0] != SOCKS_VERSION || ptr[1] != SOCKS_CMD_CONNECT) {
+    return false;
+  }
+  const uint8_t atyp = ptr[3];
+  const size_t addr = request_addr_size(atyp, ptr + 4, n - 4);
+  if (addr == 0 || n < 4 + addr + SOCKS_PORT_SIZE) {
+    return false;
+  }
+
+  r->version = ptr[0];
+  r->cmd = ptr[1];
+  r->rsv = ptr[2];
+  r->atyp = atyp;
+  const uint8_t* a = ptr + 4;
+  if (atyp == SOCKS_ATYP_IPV4) {
+    memcpy(&r->dest_addr.ipv4, a, SOCKS_IPV4_ADDR_SIZE);
+  } else if (atyp == SOCKS_ATYP_IPV6) {
+    memcpy(&r->dest_addr.ipv6, a, SOCKS_IPV6_ADDR_SIZE);
+  } else {
+    r->fqdn_len = a[0];
+    memcpy(r->dest_addr.fqdn, a + 1, r->fqdn_len);
+    r->dest_addr.fqdn[r->fqdn_len] = 0;
+  }
+  r->dest_port = (uint16_t)(a[addr] << 8 | a[addr + 1]);
+  r->addr_index = 0;
+  buffer_read_adv(r->rb, 4 + addr + SOCKS_PORT_SIZE);
+  r->state = REQUEST_DONE;
+  return true;
+}
+
+enum request_state request_consume(struct request_st* r) {
+  if (r->state == REQUEST_VERSION && request_consume_message(r)) {
+    return r->state;
+  }
+
+  while (buffer_can_read(r->rb) && r->state != REQUEST_DONE &&
+         r->state != REQUEST_ERROR) {
+    uint8_t byte = buffer_read(r->rb);
+    switch (r->state) {
+      case REQUEST_VERSION:
+        request_process_version(r, byte);
+        break;
+      case REQUEST_CMD:
+        request_process_cmd(r, byte);
+        break;
+      case REQUEST_RSV:
+        request_process_rsv(r, byte);
+        break;
+      case REQUEST_ATYP:
+        request_process_atyp(r, byte);
+        break;
+      case REQUEST_DSTADDR:
+        request_process_dstaddr(r, byte);
+        break;
+      case REQUEST_DSTPORT:
+        request_process_dstport(r, byte);
+        break;
+      default:
+        break;
+    }
+  }
+  return r->state;
+}
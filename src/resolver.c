@@ -0,0 +1,421 @@
+#if !defined(_POSIX_C_SOURCE) || _POSIX_C_SOURCE < 200809L
+#undef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "resolver.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include "logger.h"
+
+// =============================================================================
+// State
+// =============================================================================
+
+#define CACHE_BUCKETS 256 // power of two
+
+// One name being looked up or cached. While `answer' is NULL the lookup is
+// in flight and sessions asking for it wait in `waiters'.
+struct dns_entry {
+  char host[256];
+  char port[6];
+  uint32_t hash;
+
+  struct resolver_answer *answer;
+  time_t expires;
+  struct resolver_job *waiters;
+
+  struct dns_entry *bucket_next;
+  struct dns_entry *lru_prev, *lru_next; // answered entries only
+  struct dns_entry *queue_next;
+};
+
+struct resolver_job {
+  fd_selector selector;
+  int fd;
+  struct dns_entry *entry;        // while waiting
+  struct resolver_answer *answer; // once done
+  struct resolver_job *next;      // entry->waiters link
+};
+
+// A single lock covers the queue, the cache and every job's state: lookups
+// take milliseconds, the critical sections a handful of instructions.
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pending = PTHREAD_COND_INITIALIZER;
+
+static struct dns_entry *queue_head = NULL;
+static struct dns_entry *queue_tail = NULL;
+static unsigned queued = 0;
+
+static struct dns_entry *buckets[CACHE_BUCKETS];
+static struct dns_entry *lru_head = NULL; // most recently used
+static struct dns_entry *lru_tail = NULL;
+static struct resolver_stats stats;
+
+static pthread_t *threads = NULL;
+static unsigned thread_count = 0;
+static bool stopping = false;
+
+static time_t now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+// =============================================================================
+// Answers
+// =============================================================================
+
+static struct resolver_answer *answer_ref(struct resolver_answer *a) {
+  a->refs++;
+  return a;
+}
+
+static void answer_unref(struct resolver_answer *a) {
+  if (--a->refs == 0) {
+    if (a->list != NULL) {
+      freeaddrinfo(a->list);
+    }
+    free(a);
+  }
+}
+
+void resolver_answer_release(struct resolver_answer *answer) {
+  if (answer == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&lock);
+  answer_unref(answer);
+  pthread_mutex_unlock(&lock);
+}
+
+// =============================================================================
+// Cache
+// =============================================================================
+
+// FNV-1a over the lowercased host and the port
+static uint32_t entry_hash(const char *host, const char *port) {
+  uint32_t h = 2166136261u;
+  for (const char *c = host; *c; c++) {
+    h = (h ^ (uint8_t)tolower((unsigned char)*c)) * 16777619u;
+  }
+  for (const char *c = port; *c; c++) {
+    h = (h ^ (uint8_t)*c) * 16777619u;
+  }
+  return h;
+}
+
+static void lru_unlink(struct dns_entry *e) {
+  if (e->lru_prev != NULL) {
+    e->lru_prev->lru_next = e->lru_next;
+  } else {
+    lru_head = e->lru_next;
+  }
+  if (e->lru_next != NULL) {
+    e->lru_next->lru_prev = e->lru_prev;
+  } else {
+    lru_tail = e->lru_prev;
+  }
+  e->lru_prev = e->lru_next = NULL;
+}
+
+static void lru_push_front(struct dns_entry *e) {
+  e->lru_prev = NULL;
+  e->lru_next = lru_head;
+  if (lru_head != NULL) {
+    lru_head->lru_prev = e;
+  } else {
+    lru_tail = e;
+  }
+  lru_head = e;
+}
+
+static struct dns_entry *cache_find(const char *host, const char *port,
+                                    uint32_t hash) {
+  for (struct dns_entry *e = buckets[hash & (CACHE_BUCKETS - 1)]; e != NULL;
+       e = e->bucket_next) {
+    if (e->hash == hash && strcmp(e->port, port) == 0 &&
+        strcasecmp(e->host, host) == 0) {
+      return e;
+    }
+  }
+  return NULL;
+}
+
+// Drops an answered entry; sessions holding its answer keep their reference
+static void cache_evict(struct dns_entry *e) {
+  struct dns_entry **p = &buckets[e->hash & (CACHE_BUCKETS - 1)];
+  while (*p != e) {
+    p = &(*p)->bucket_next;
+  }
+  *p = e->bucket_next;
+
+  lru_unlink(e);
+  answer_unref(e->answer);
+  free(e);
+  stats.entries--;
+  stats.evictions++;
+}
+
+static struct dns_entry *cache_insert(const char *host, const char *port,
+                                      uint32_t hash) {
+  if (stats.entries >= RESOLVER_CACHE_SIZE && lru_tail != NULL) {
+    cache_evict(lru_tail);
+  }
+
+  struct dns_entry *e = calloc(1, sizeof(*e));
+  if (e == NULL) {
+    return NULL;
+  }
+  snprintf(e->host, sizeof(e->host), "%s", host);
+  snprintf(e->port, sizeof(e->port), "%s", port);
+  e->hash = hash;
+
+  struct dns_entry **bucket = &buckets[hash & (CACHE_BUCKETS - 1)];
+  e->bucket_next = *bucket;
+  *bucket = e;
+  stats.entries++;
+  return e;
+}
+
+// =============================================================================
+// Resolver threads
+// =============================================================================
+
+static void queue_push(struct dns_entry *e) {
+  e->queue_next = NULL;
+  if (queue_tail != NULL) {
+    queue_tail->queue_next = e;
+  } else {
+    queue_head = e;
+  }
+  queue_tail = e;
+  queued++;
+}
+
+static struct dns_entry *queue_pop(void) {
+  struct dns_entry *e = queue_head;
+  if (e != NULL) {
+    queue_head = e->queue_next;
+    if (queue_head == NULL) {
+      queue_tail = NULL;
+    }
+    queued--;
+  }
+  return e;
+}
+
+// Publishes the answer of an in-flight entry and wakes everyone waiting.
+static void entry_complete(struct dns_entry *e, struct resolver_answer *a) {
+  e->answer = a; // the cache's reference
+  e->expires = now() + (a->error == 0 ? RESOLVER_CACHE_TTL
+                                      : RESOLVER_NEGATIVE_TTL);
+  lru_push_front(e);
+
+  struct resolver_job *j = e->waiters;
+  e->waiters = NULL;
+  while (j != NULL) {
+    struct resolver_job *next = j->next;
+    j->entry = NULL;
+    j->answer = answer_ref(a);
+    // The selector hands the notification to its thread without calling
+    // back into us, so doing this under our lock can't deadlock.
+    if (selector_notify_block(j->selector, j->fd) != SELECTOR_SUCCESS) {
+      LOG_ERROR("Failed to notify resolution of fd %d\n", j->fd);
+    }
+    j = next;
+  }
+}
+
+static void *resolver_thread(void *arg) {
+  (void)arg;
+  const struct addrinfo hints = {
+      .ai_family = AF_UNSPEC,
+      .ai_socktype = SOCK_STREAM,
+      .ai_protocol = IPPROTO_TCP,
+  };
+
+  pthread_mutex_lock(&lock);
+  while (true) {
+    while (queue_head == NULL && !stopping) {
+      pthread_cond_wait(&pending, &lock);
+    }
+    if (stopping) {
+      break;
+    }
+    // In-flight entries are never evicted, so `e' stays valid unlocked
+    struct dns_entry *e = queue_pop();
+    pthread_mutex_unlock(&lock);
+
+    struct resolver_answer *a = calloc(1, sizeof(*a));
+    if (a != NULL) {
+      a->refs = 1;
+      a->error = getaddrinfo(e->host, e->port, &hints, &a->list);
+      if (a->error != 0) {
+        a->list = NULL;
+      }
+    }
+
+    pthread_mutex_lock(&lock);
+    if (a == NULL) {
+      // can't even report the failure; requeue and try again later
+      queue_push(e);
+      continue;
+    }
+    entry_complete(e, a);
+  }
+  pthread_mutex_unlock(&lock);
+  return NULL;
+}
+
+int resolver_init(unsigned n) {
+  threads = calloc(n, sizeof(*threads));
+  if (threads == NULL) {
+    return -1;
+  }
+
+  stopping = false;
+  for (thread_count = 0; thread_count < n; thread_count++) {
+    if (pthread_create(&threads[thread_count], NULL, resolver_thread, NULL) !=
+        0) {
+      LOG_WARNING("Started only %u of %u resolver threads\n", thread_count, n);
+      break;
+    }
+  }
+  return thread_count > 0 ? 0 : -1;
+}
+
+void resolver_destroy(void) {
+  pthread_mutex_lock(&lock);
+  stopping = true;
+  pthread_cond_broadcast(&pending);
+  pthread_mutex_unlock(&lock);
+
+  for (unsigned i = 0; i < thread_count; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+  threads = NULL;
+  thread_count = 0;
+
+  pthread_mutex_lock(&lock);
+  // Lookups nobody will run fail, so their sessions stop waiting
+  struct dns_entry *e;
+  while ((e = queue_pop()) != NULL) {
+    struct resolver_answer *a = calloc(1, sizeof(*a));
+    if (a == NULL) {
+      continue;
+    }
+    a->refs = 1;
+    a->error = EAI_AGAIN;
+    entry_complete(e, a);
+  }
+  while (lru_tail != NULL) {
+    cache_evict(lru_tail);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+// =============================================================================
+// Jobs
+// =============================================================================
+
+struct resolver_job *resolver_submit(fd_selector s, int fd, const char *host,
+                                     uint16_t port) {
+  struct resolver_job *job = calloc(1, sizeof(*job));
+  if (job == NULL) {
+    return NULL;
+  }
+  job->selector = s;
+  job->fd = fd;
+
+  char port_str[6];
+  snprintf(port_str, sizeof(port_str), "%u", port);
+  const uint32_t hash = entry_hash(host, port_str);
+
+  pthread_mutex_lock(&lock);
+  if (thread_count == 0 || stopping) {
+    goto fail;
+  }
+
+  struct dns_entry *e = cache_find(host, port_str, hash);
+  if (e != NULL && e->answer != NULL && e->expires <= now()) {
+    cache_evict(e);
+    e = NULL;
+  }
+
+  if (e != NULL && e->answer != NULL) {
+    stats.hits++;
+    lru_unlink(e);
+    lru_push_front(e);
+    job->answer = answer_ref(e->answer);
+  } else if (e != NULL) {
+    stats.coalesced++;
+    job->entry = e;
+    job->next = e->waiters;
+    e->waiters = job;
+  } else {
+    if (queued >= RESOLVER_MAX_QUEUED) {
+      goto fail;
+    }
+    e = cache_insert(host, port_str, hash);
+    if (e == NULL) {
+      goto fail;
+    }
+    stats.misses++;
+    job->entry = e;
+    e->waiters = job;
+    queue_push(e);
+    pthread_cond_signal(&pending);
+  }
+  pthread_mutex_unlock(&lock);
+  return job;
+
+fail:
+  pthread_mutex_unlock(&lock);
+  free(job);
+  return NULL;
+}
+
+bool resolver_poll(struct resolver_job *job, struct resolver_answer **answer) {
+  pthread_mutex_lock(&lock);
+  const bool done = job->answer != NULL;
+  pthread_mutex_unlock(&lock);
+
+  if (!done) {
+    return false;
+  }
+  *answer = job->answer;
+  free(job);
+  return true;
+}
+
+void resolver_cancel(struct resolver_job *job) {
+  pthread_mutex_lock(&lock);
+  if (job->answer != NULL) {
+    answer_unref(job->answer);
+  } else {
+    struct resolver_job **p = &job->entry->waiters;
+    while (*p != job) {
+      p = &(*p)->next;
+    }
+    *p = job->next;
+  }
+  pthread_mutex_unlock(&lock);
+  free(job);
+}
+
+void resolver_get_stats(struct resolver_stats *out) {
+  pthread_mutex_lock(&lock);
+  *out = stats;
+  pthread_mutex_unlock(&lock);
+}
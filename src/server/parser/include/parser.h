@@ -57,6 +57,27 @@ struct parser_definition {
     const unsigned                         start_state;
 };
 
+/**
+ * CDT del parser. Se expone solo para poder embeberlo en otras estructuras
+ * (ver `parser_init_at'); sus campos no deben accederse directamente.
+ */
+struct parser {
+    /** tipificación para cada caracter */
+    const unsigned *classes;
+    /** definición de estados */
+    const struct parser_definition *def;
+
+    /* estado actual */
+    unsigned state;
+    /** tabla compilada de `def', o NULL (ver `parser_use_table') */
+    const struct parser_table *table;
+
+    /* evento que se retorna */
+    struct parser_event e1;
+    /* evento que se retorna */
+    struct parser_event e2;
+};
+
 /**
  * inicializa el parser.
  *
@@ -66,6 +87,15 @@ struct parser *
 parser_init    (const unsigned *classes,
                 const struct parser_definition *def);
 
+/**
+ * como `parser_init' pero sobre memoria del usuario, sin reservar nada.
+ * Un parser inicializado así no se destruye con `parser_destroy'.
+ */
+void
+parser_init_at (struct parser *p,
+                const unsigned *classes,
+                const struct parser_definition *def);
+
 /** destruye el parser */
 void
 parser_destroy  (struct parser *p);
@@ -82,6 +112,58 @@ parser_reset    (struct parser *p);
 const struct parser_event *
 parser_feed     (struct parser *p, const uint8_t c);
 
+/**
+ * Tabla densa de una definición ya compilada: para cada estado y cada
+ * byte, el estado destino, la transición que aplica y los tipos de evento
+ * que emite. Con ella avanzar un byte es un acceso a memoria en lugar de
+ * recorrer la lista de transiciones del estado.
+ */
+struct parser_table;
+
+/**
+ * Compila `def' con la caracterización `classes'. Se hace una vez y la
+ * tabla se comparte entre todos los parsers de esa definición.
+ *
+ * Para conocer los eventos de antemano se ejecutan las acciones de cada
+ * transición con cada byte, así que éstas deben depender solo del byte
+ * recibido (como todas las de parser_utils). Retorna NULL si no hay
+ * memoria o la definición tiene más de 65535 estados o transiciones.
+ */
+struct parser_table *
+parser_table_compile(const unsigned *classes,
+                     const struct parser_definition *def);
+
+/** libera una tabla de `parser_table_compile' */
+void
+parser_table_destroy(struct parser_table *t);
+
+/**
+ * hace que `p' use la tabla `t', compilada a partir de la misma definición
+ * y las mismas clases con las que se inicializó. NULL vuelve a recorrer
+ * las transiciones.
+ */
+void
+parser_use_table(struct parser *p, const struct parser_table *t);
+
+/** máscara de `parser_feed_buffer' que incluye los eventos de tipo `type' */
+#define PARSER_EVENT_BIT(type) (1u << (type))
+
+/**
+ * alimenta el parser con hasta `n' bytes de `b', deteniéndose luego del
+ * primero que produce un evento cuyo tipo está en la máscara `events'
+ * (ver PARSER_EVENT_BIT; los tipos desde 32 en adelante detienen siempre).
+ * Los demás eventos no se materializan.
+ *
+ * Retorna la cantidad de bytes consumidos. Si se detuvo, `*e' apunta al
+ * evento (con la misma semántica que `parser_feed'); si no, es NULL.
+ *
+ * Con una tabla (ver `parser_use_table') el recorrido solo consulta la
+ * tabla y ejecuta acciones únicamente al detenerse.
+ */
+size_t
+parser_feed_buffer(struct parser *p, const uint8_t *b, size_t n,
+                   unsigned events, const struct parser_event **e);
+
 /**
  * En caso de la aplicacion no necesite clases caracteres, se
  * provee dicho arreglo para ser usando en `parser_init'
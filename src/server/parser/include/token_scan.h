@@ -0,0 +1,67 @@
+#ifndef TOKEN_SCAN_H_q7TnV2cXe9RkLw4ZmB8sJdYa
+#define TOKEN_SCAN_H_q7TnV2cXe9RkLw4ZmB8sJdYa
+
+/**
+ * token_scan.c -- búsqueda vectorizada de varios literales a la vez.
+ *
+ * Encuentra en un bloque de bytes dónde empieza alguno de un conjunto de
+ * literales (por ejemplo "USER ", "PASS ", "AUTH "), sin distinguir
+ * mayúsculas de minúsculas, para que un parser con estado (ver parser.h)
+ * solo tenga que mirar esos puntos en lugar de cada byte.
+ *
+ * Con SSE2 o AVX2 se comparan 16 o 32 posiciones por vez contra los dos
+ * primeros caracteres de cada literal y solo los candidatos se verifican
+ * completos. La implementación se elige al inicializar según lo que
+ * soporte el procesador; sin ninguna de las dos se recorre byte a byte.
+ */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** literales por scanner */
+#define TOKEN_SCAN_MAX 8
+/** largo máximo de cada literal */
+#define TOKEN_SCAN_LEN_MAX 16
+
+enum token_scan_impl {
+    TOKEN_SCAN_SCALAR,
+    TOKEN_SCAN_SSE2,
+    TOKEN_SCAN_AVX2,
+};
+
+struct token_scan {
+    enum token_scan_impl impl;
+    unsigned n;
+    /** literales en minúscula y sus largos */
+    uint8_t literal[TOKEN_SCAN_MAX][TOKEN_SCAN_LEN_MAX];
+    uint8_t len[TOKEN_SCAN_MAX];
+    /** por cada byte, los literales (bit i) que empiezan con él */
+    uint8_t starts[256];
+};
+
+/**
+ * Inicializa `s' con los `n' literales de `literals' y la mejor
+ * implementación disponible. Cada literal debe tener entre 2 y
+ * TOKEN_SCAN_LEN_MAX caracteres ASCII.
+ *
+ * Retorna false si hay más de TOKEN_SCAN_MAX literales o alguno no cumple.
+ */
+bool
+token_scan_init(struct token_scan *s, const char *const *literals, unsigned n);
+
+/**
+ * Fuerza una implementación. Retorna false (y no cambia nada) si el
+ * procesador no la soporta.
+ */
+bool
+token_scan_use(struct token_scan *s, enum token_scan_impl impl);
+
+/**
+ * Retorna la posición del primer literal que aparece en los `n' bytes de
+ * `b', o `n' si no aparece ninguno. Un literal cortado por el final del
+ * bloque también cuenta: su resto puede llegar en el próximo.
+ */
+size_t
+token_scan_find(const struct token_scan *s, const uint8_t *b, size_t n);
+
+#endif
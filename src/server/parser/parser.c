@@ -1,80 +1,217 @@
 #include <assert.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "include/parser.h"
 
-/* CDT del parser */
-struct parser {
-  /** tipificación para cada caracter */
-  const unsigned *classes;
-  /** definición de estados */
-  const struct parser_definition *def;
-
-  /* estado actual */
-  unsigned state;
-
-  /* evento que se retorna */
-  struct parser_event e1;
-  /* evento que se retorna */
-  struct parser_event e2;
-};
-
 void parser_destroy(struct parser *p) {
   if (p != NULL) {
     free(p);
   }
 }
 
+void parser_init_at(struct parser *p, const unsigned *classes,
+                    const struct parser_definition *def) {
+  memset(p, 0, sizeof(*p));
+  p->classes = classes;
+  p->def = def;
+  p->state = def->start_state;
+}
+
 struct parser *parser_init(const unsigned *classes,
                            const struct parser_definition *def) {
   struct parser *ret = malloc(sizeof(*ret));
   if (ret != NULL) {
-    memset(ret, 0, sizeof(*ret));
-    ret->classes = classes;
-    ret->def = def;
-    ret->state = def->start_state;
+    parser_init_at(ret, classes, def);
   }
   return ret;
 }
 
 void parser_reset(struct parser *p) { p->state = p->def->start_state; }
 
-const struct parser_event *parser_feed(struct parser *p, const uint8_t c) {
-  const unsigned type = p->classes[c];
-
-  p->e1.next = p->e2.next = 0;
-
-  const struct parser_state_transition *state = p->def->states[p->state];
-  const size_t n = p->def->states_n[p->state];
+/* transición de `state' que aplica a `c', o NULL si ninguna */
+static const struct parser_state_transition *
+match(const unsigned *classes, const struct parser_definition *def,
+      unsigned state, const uint8_t c) {
+  const unsigned type = classes[c];
+  const struct parser_state_transition *t = def->states[state];
+  const size_t n = def->states_n[state];
   bool matched = false;
 
   for (unsigned i = 0; i < n; i++) {
-    const int when = state[i].when;
-    if (state[i].when <= 0xFF) {
+    const int when = t[i].when;
+    if (t[i].when <= 0xFF) {
       matched = (c == when);
-    } else if (state[i].when == ANY) {
+    } else if (t[i].when == ANY) {
       matched = true;
-    } else if (state[i].when > 0xFF) {
+    } else if (t[i].when > 0xFF) {
       matched = (type & when);
     } else {
       matched = false;
     }
 
     if (matched) {
-      state[i].act1(&p->e1, c);
-      if (state[i].act2 != NULL) {
-        p->e1.next = &p->e2;
-        state[i].act2(&p->e2, c);
+      return t + i;
+    }
+  }
+  return NULL;
+}
+
+static void apply(struct parser *p, const struct parser_state_transition *t,
+                  const uint8_t c) {
+  t->act1(&p->e1, c);
+  if (t->act2 != NULL) {
+    p->e1.next = &p->e2;
+    t->act2(&p->e2, c);
+  }
+  p->state = t->dest;
+}
+
+/* tablas compiladas */
+
+#define BYTES 0x100
+
+struct parser_table {
+  unsigned states_count;
+  /* todas indexadas por [estado * BYTES + byte] */
+  /* tipos de evento emitidos, como máscara de PARSER_EVENT_BIT */
+  uint32_t *emits;
+  /* estado destino */
+  uint16_t *next;
+  /* índice + 1 de la transición en def->states[estado], 0 si ninguna */
+  uint16_t *transition;
+};
+
+static uint32_t event_bit(const unsigned type) {
+  return type < 32 ? PARSER_EVENT_BIT(type) : UINT32_MAX;
+}
+
+struct parser_table *parser_table_compile(const unsigned *classes,
+                                          const struct parser_definition *def) {
+  const size_t n = def->states_count;
+  if (n == 0 || n > UINT16_MAX) {
+    return NULL;
+  }
+  for (size_t st = 0; st < n; st++) {
+    if (def->states_n[st] >= UINT16_MAX) {
+      return NULL;
+    }
+  }
+
+  /* un solo bloque: la estructura y luego las tablas, de mayor a menor
+   * alineación */
+  const size_t entries = n * BYTES;
+  struct parser_table *t =
+      malloc(sizeof(*t) + entries * (sizeof(*t->emits) + sizeof(*t->next) +
+                                     sizeof(*t->transition)));
+  if (t == NULL) {
+    return NULL;
+  }
+  t->states_count = n;
+  t->emits = (uint32_t *)(t + 1);
+  t->next = (uint16_t *)(t->emits + entries);
+  t->transition = t->next + entries;
+
+  for (size_t st = 0; st < n; st++) {
+    for (unsigned c = 0; c < BYTES; c++) {
+      const size_t at = st * BYTES + c;
+      const struct parser_state_transition *tr =
+          match(classes, def, st, (uint8_t)c);
+      if (tr == NULL) {
+        t->emits[at] = 0;
+        t->next[at] = st;
+        t->transition[at] = 0;
+        continue;
       }
-      p->state = state[i].dest;
-      break;
+      struct parser_event e = {0};
+      tr->act1(&e, (uint8_t)c);
+      t->emits[at] = event_bit(e.type);
+      if (tr->act2 != NULL) {
+        tr->act2(&e, (uint8_t)c);
+        t->emits[at] |= event_bit(e.type);
+      }
+      t->next[at] = tr->dest;
+      t->transition[at] = (tr - def->states[st]) + 1;
     }
   }
+  return t;
+}
+
+void parser_table_destroy(struct parser_table *t) { free(t); }
+
+void parser_use_table(struct parser *p, const struct parser_table *t) {
+  p->table = t;
+}
+
+/* avanza un byte; retorna si alguna transición aplicó */
+static bool step(struct parser *p, const uint8_t c) {
+  p->e1.next = p->e2.next = 0;
+
+  const struct parser_state_transition *t;
+  if (p->table != NULL) {
+    const uint16_t i = p->table->transition[p->state * BYTES + c];
+    t = i == 0 ? NULL : p->def->states[p->state] + (i - 1);
+  } else {
+    t = match(p->classes, p->def, p->state, c);
+  }
+  if (t == NULL) {
+    return false;
+  }
+  apply(p, t, c);
+  return true;
+}
+
+const struct parser_event *parser_feed(struct parser *p, const uint8_t c) {
+  step(p, c);
   return &p->e1;
 }
 
-static const unsigned classes[0xFF] = {0x00};
+static size_t feed_table(struct parser *p, const uint8_t *b, const size_t n,
+                         const unsigned events,
+                         const struct parser_event **e) {
+  const uint32_t *emits = p->table->emits;
+  const uint16_t *next = p->table->next;
+  unsigned state = p->state;
+
+  for (size_t i = 0; i < n; i++) {
+    const size_t at = state * BYTES + b[i];
+    if (emits[at] & events) {
+      p->state = state;
+      *e = parser_feed(p, b[i]);
+      return i + 1;
+    }
+    state = next[at];
+  }
+  p->state = state;
+  *e = NULL;
+  return n;
+}
+
+size_t parser_feed_buffer(struct parser *p, const uint8_t *b, size_t n,
+                          unsigned events, const struct parser_event **e) {
+  if (p->table != NULL) {
+    return feed_table(p, b, n, events, e);
+  }
+  for (size_t i = 0; i < n; i++) {
+    if (!step(p, b[i])) {
+      continue;
+    }
+    uint32_t emitted = event_bit(p->e1.type);
+    if (p->e1.next != NULL) {
+      emitted |= event_bit(p->e2.type);
+    }
+    if (emitted & events) {
+      *e = &p->e1;
+      return i + 1;
+    }
+  }
+  *e = NULL;
+  return n;
+}
+
+/* uno por cada valor posible de un byte, 0xFF incluido */
+static const unsigned classes[0x100] = {0x00};
 
 const unsigned *parser_no_classes(void) { return classes; }
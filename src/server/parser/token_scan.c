@@ -0,0 +1,196 @@
+#include <string.h>
+
+#include "include/token_scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TOKEN_SCAN_X86
+#endif
+
+/* minúscula de `c' si es una letra ASCII */
+static inline uint8_t fold(const uint8_t c) {
+  return (unsigned)(c - 'A') < 26u ? c | 0x20 : c;
+}
+
+/* si en `p' empieza (o empieza y se corta) el literal `k' */
+static bool matches_literal(const struct token_scan *s, const unsigned k,
+                            const uint8_t *p, const size_t avail) {
+  const size_t m = s->len[k] < avail ? s->len[k] : avail;
+  for (size_t j = 0; j < m; j++) {
+    if (fold(p[j]) != s->literal[k][j]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool matches(const struct token_scan *s, const uint8_t *p,
+                    const size_t avail) {
+  for (unsigned mask = s->starts[p[0]]; mask != 0; mask &= mask - 1) {
+    if (matches_literal(s, __builtin_ctz(mask), p, avail)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static size_t find_scalar(const struct token_scan *s, const uint8_t *b,
+                          const size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    if (s->starts[b[i]] != 0 && matches(s, b + i, n - i)) {
+      return i;
+    }
+  }
+  return n;
+}
+
+/*
+ * Las versiones vectoriales comparan cada posición i y la siguiente contra
+ * los dos primeros caracteres de cada literal. Un OR con 0x20 pasa las
+ * letras a minúscula (y a algunos otros bytes los confunde con otros, lo
+ * que solo agrega candidatos), así que solo los candidatos se verifican
+ * byte a byte. Como miran b[i + 1], las últimas posiciones van por la
+ * versión escalar.
+ */
+#ifdef TOKEN_SCAN_X86
+
+__attribute__((target("sse2"))) static size_t
+find_sse2(const struct token_scan *s, const uint8_t *b, const size_t n) {
+  const __m128i lower = _mm_set1_epi8(0x20);
+  __m128i first[TOKEN_SCAN_MAX], second[TOKEN_SCAN_MAX];
+  for (unsigned k = 0; k < s->n; k++) {
+    first[k] = _mm_set1_epi8((char)(s->literal[k][0] | 0x20));
+    second[k] = _mm_set1_epi8((char)(s->literal[k][1] | 0x20));
+  }
+
+  size_t i = 0;
+  for (; i + 16 < n; i += 16) {
+    const __m128i v0 =
+        _mm_or_si128(_mm_loadu_si128((const __m128i *)(b + i)), lower);
+    const __m128i v1 =
+        _mm_or_si128(_mm_loadu_si128((const __m128i *)(b + i + 1)), lower);
+    __m128i hits = _mm_setzero_si128();
+    for (unsigned k = 0; k < s->n; k++) {
+      hits = _mm_or_si128(hits, _mm_and_si128(_mm_cmpeq_epi8(v0, first[k]),
+                                              _mm_cmpeq_epi8(v1, second[k])));
+    }
+    for (unsigned mask = _mm_movemask_epi8(hits); mask != 0;
+         mask &= mask - 1) {
+      const size_t at = i + __builtin_ctz(mask);
+      if (matches(s, b + at, n - at)) {
+        return at;
+      }
+    }
+  }
+  return i + find_scalar(s, b + i, n - i);
+}
+
+__attribute__((target("avx2"))) static size_t
+find_avx2(const struct token_scan *s, const uint8_t *b, const size_t n) {
+  const __m256i lower = _mm256_set1_epi8(0x20);
+  __m256i first[TOKEN_SCAN_MAX], second[TOKEN_SCAN_MAX];
+  for (unsigned k = 0; k < s->n; k++) {
+    first[k] = _mm256_set1_epi8((char)(s->literal[k][0] | 0x20));
+    second[k] = _mm256_set1_epi8((char)(s->literal[k][1] | 0x20));
+  }
+
+  size_t i = 0;
+  for (; i + 32 < n; i += 32) {
+    const __m256i v0 = _mm256_or_si256(
+        _mm256_loadu_si256((const __m256i *)(b + i)), lower);
+    const __m256i v1 = _mm256_or_si256(
+        _mm256_loadu_si256((const __m256i *)(b + i + 1)), lower);
+    __m256i hits = _mm256_setzero_si256();
+    for (unsigned k = 0; k < s->n; k++) {
+      hits = _mm256_or_si256(
+          hits, _mm256_and_si256(_mm256_cmpeq_epi8(v0, first[k]),
+                                 _mm256_cmpeq_epi8(v1, second[k])));
+    }
+    for (uint32_t mask = (uint32_t)_mm256_movemask_epi8(hits); mask != 0;
+         mask &= mask - 1) {
+      const size_t at = i + __builtin_ctz(mask);
+      if (matches(s, b + at, n - at)) {
+        return at;
+      }
+    }
+  }
+  /* lo que queda puede todavía aprovechar un bloque de SSE2 */
+  return i + find_sse2(s, b + i, n - i);
+}
+
+#endif
+
+static bool supported(const enum token_scan_impl impl) {
+  switch (impl) {
+    case TOKEN_SCAN_SCALAR:
+      return true;
+#ifdef TOKEN_SCAN_X86
+    case TOKEN_SCAN_SSE2:
+      __builtin_cpu_init();
+      return __builtin_cpu_supports("sse2");
+    case TOKEN_SCAN_AVX2:
+      __builtin_cpu_init();
+      return __builtin_cpu_supports("avx2");
+#endif
+    default:
+      return false;
+  }
+}
+
+bool token_scan_use(struct token_scan *s, const enum token_scan_impl impl) {
+  if (!supported(impl)) {
+    return false;
+  }
+  s->impl = impl;
+  return true;
+}
+
+bool token_scan_init(struct token_scan *s, const char *const *literals,
+                     const unsigned n) {
+  if (n > TOKEN_SCAN_MAX) {
+    return false;
+  }
+  memset(s, 0, sizeof(*s));
+  for (unsigned k = 0; k < n; k++) {
+    const size_t len = strlen(literals[k]);
+    if (len < 2 || len > TOKEN_SCAN_LEN_MAX) {
+      return false;
+    }
+    for (size_t j = 0; j < len; j++) {
+      if ((uint8_t)literals[k][j] > 0x7F) {
+        return false;
+      }
+      s->literal[k][j] = fold((uint8_t)literals[k][j]);
+    }
+    s->len[k] = len;
+  }
+  s->n = n;
+
+  for (unsigned c = 0; c < 256; c++) {
+    for (unsigned k = 0; k < n; k++) {
+      if (fold(c) == s->literal[k][0]) {
+        s->starts[c] |= 1u << k;
+      }
+    }
+  }
+
+  if (!token_scan_use(s, TOKEN_SCAN_AVX2) &&
+      !token_scan_use(s, TOKEN_SCAN_SSE2)) {
+    s->impl = TOKEN_SCAN_SCALAR;
+  }
+  return true;
+}
+
+size_t token_scan_find(const struct token_scan *s, const uint8_t *b,
+                       const size_t n) {
+  switch (s->impl) {
+#ifdef TOKEN_SCAN_X86
+    case TOKEN_SCAN_AVX2:
+      return find_avx2(s, b, n);
+    case TOKEN_SCAN_SSE2:
+      return find_sse2(s, b, n);
+#endif
+    default:
+      return find_scalar(s, b, n);
+  }
+}
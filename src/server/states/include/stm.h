@@ -56,6 +56,12 @@ struct state_definition {
   unsigned (*on_write_ready)(struct selector_key *key);
   /** ejecutado cuando hay una resolución de nombres lista */
   unsigned (*on_block_ready)(struct selector_key *key);
+  /** ejecutado cuando vence un timeout (ver `selector_set_timeout') */
+  unsigned (*on_timeout)(struct selector_key *key);
+  /** ejecutado cuando completa un `selector_recv' con resultado `n' */
+  unsigned (*on_recv_done)(struct selector_key *key, ssize_t n);
+  /** ejecutado cuando completa un `selector_send' con resultado `n' */
+  unsigned (*on_send_done)(struct selector_key *key, ssize_t n);
 };
 
 /** inicializa el la máquina */
@@ -73,6 +79,18 @@ unsigned stm_handler_write(struct state_machine *stm, struct selector_key *key);
 /** indica que ocurrió el evento block. retorna nuevo id de nuevo estado. */
 unsigned stm_handler_block(struct state_machine *stm, struct selector_key *key);
 
+/** indica que ocurrió el evento timeout. retorna nuevo id de nuevo estado. */
+unsigned stm_handler_timeout(struct state_machine *stm,
+                             struct selector_key *key);
+
+/** indica que completó una recepción. retorna nuevo id de nuevo estado. */
+unsigned stm_handler_recv(struct state_machine *stm, struct selector_key *key,
+                          ssize_t n);
+
+/** indica que completó un envío. retorna nuevo id de nuevo estado. */
+unsigned stm_handler_send(struct state_machine *stm, struct selector_key *key,
+                          ssize_t n);
+
 /** indica que ocurrió el evento close. retorna nuevo id de nuevo estado. */
 void stm_handler_close(struct state_machine *stm, struct selector_key *key);
 
@@ -84,6 +84,42 @@ unsigned stm_handler_block(struct state_machine *stm,
   return ret;
 }
 
+unsigned stm_handler_timeout(struct state_machine *stm,
+                             struct selector_key *key) {
+  handle_first(stm, key);
+  if (stm->current->on_timeout == 0) {
+    abort();
+  }
+  const unsigned int ret = stm->current->on_timeout(key);
+  jump(stm, ret, key);
+
+  return ret;
+}
+
+unsigned stm_handler_recv(struct state_machine *stm, struct selector_key *key,
+                          ssize_t n) {
+  handle_first(stm, key);
+  if (stm->current->on_recv_done == 0) {
+    abort();
+  }
+  const unsigned int ret = stm->current->on_recv_done(key, n);
+  jump(stm, ret, key);
+
+  return ret;
+}
+
+unsigned stm_handler_send(struct state_machine *stm, struct selector_key *key,
+                          ssize_t n) {
+  handle_first(stm, key);
+  if (stm->current->on_send_done == 0) {
+    abort();
+  }
+  const unsigned int ret = stm->current->on_send_done(key, n);
+  jump(stm, ret, key);
+
+  return ret;
+}
+
 void stm_handler_close(struct state_machine *stm, struct selector_key *key) {
   if (stm->current != NULL && stm->current->on_departure != NULL) {
     stm->current->on_departure(stm->current->state, key);
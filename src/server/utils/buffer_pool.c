@@ -0,0 +1,71 @@
+/**
+ * buffer_pool.c - bloques de memoria reutilizables para buffers grandes.
+ */
+#include <stdlib.h>
+
+#include "include/buffer_pool.h"
+
+/** log2 de BUFFER_POOL_MIN_SIZE */
+#define MIN_SHIFT 12
+/** cantidad de clases entre BUFFER_POOL_MIN_SIZE y BUFFER_POOL_MAX_SIZE */
+#define N_CLASSES 11
+
+/** mientras está libre, el bloque mismo guarda el enlace a la lista */
+struct free_block {
+  struct free_block *next;
+};
+
+static _Thread_local struct free_block *free_lists[N_CLASSES];
+static _Thread_local size_t cached_bytes = 0;
+
+static unsigned class_of(size_t size) {
+  unsigned c = 0;
+  while (c < N_CLASSES - 1 && ((size_t)1 << (MIN_SHIFT + c)) < size) {
+    c++;
+  }
+  return c;
+}
+
+size_t buffer_pool_class_size(size_t size) {
+  return (size_t)1 << (MIN_SHIFT + class_of(size));
+}
+
+uint8_t *buffer_pool_get(size_t size) {
+  const unsigned c = class_of(size);
+  struct free_block *b = free_lists[c];
+  if (b != NULL) {
+    free_lists[c] = b->next;
+    cached_bytes -= (size_t)1 << (MIN_SHIFT + c);
+    return (uint8_t *)b;
+  }
+  return malloc((size_t)1 << (MIN_SHIFT + c));
+}
+
+void buffer_pool_put(uint8_t *block, size_t size) {
+  if (block == NULL) {
+    return;
+  }
+  const unsigned c = class_of(size);
+  const size_t bytes = (size_t)1 << (MIN_SHIFT + c);
+  if (cached_bytes + bytes > BUFFER_POOL_MAX_CACHED) {
+    free(block);
+    return;
+  }
+  struct free_block *b = (struct free_block *)block;
+  b->next = free_lists[c];
+  free_lists[c] = b;
+  cached_bytes += bytes;
+}
+
+void buffer_pool_destroy(void) {
+  for (unsigned c = 0; c < N_CLASSES; c++) {
+    struct free_block *b = free_lists[c];
+    while (b != NULL) {
+      struct free_block *next = b->next;
+      free(b);
+      b = next;
+    }
+    free_lists[c] = NULL;
+  }
+  cached_bytes = 0;
+}
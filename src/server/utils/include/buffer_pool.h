@@ -0,0 +1,40 @@
+#ifndef BUFFER_POOL_H_Wq7LrT2cXn9bKd4VzHs1mPyJ
+#define BUFFER_POOL_H_Wq7LrT2cXn9bKd4VzHs1mPyJ
+
+/**
+ * buffer_pool.c - bloques de memoria reutilizables para los buffers grandes
+ *                 (ver buffer.h) que solo algunas conexiones necesitan a la
+ *                 vez.
+ *
+ * Los bloques se agrupan en clases de tamaño potencia de dos, entre
+ * BUFFER_POOL_MIN_SIZE y BUFFER_POOL_MAX_SIZE. Cada hilo mantiene su propia
+ * lista de bloques libres por clase (hasta BUFFER_POOL_MAX_CACHED bytes en
+ * total), así que pedir y devolver un bloque no requiere locks ni, en
+ * régimen, llamar a malloc(3).
+ *
+ * Un bloque se debe devolver desde el mismo hilo que lo pidió, indicando el
+ * tamaño retornado por `buffer_pool_class_size'.
+ */
+#include <stddef.h>
+#include <stdint.h>
+
+#define BUFFER_POOL_MIN_SIZE (4 * 1024)
+#define BUFFER_POOL_MAX_SIZE (4 * 1024 * 1024)
+#define BUFFER_POOL_MAX_CACHED (32 * 1024 * 1024)
+
+/** tamaño real del bloque que se entrega al pedir `size' bytes */
+size_t buffer_pool_class_size(size_t size);
+
+/**
+ * retorna un bloque de al menos `size' bytes (a lo sumo
+ * BUFFER_POOL_MAX_SIZE), o NULL si no hay memoria.
+ */
+uint8_t *buffer_pool_get(size_t size);
+
+/** devuelve un bloque obtenido con `buffer_pool_get(size)' */
+void buffer_pool_put(uint8_t *block, size_t size);
+
+/** libera los bloques que el hilo actual tiene guardados */
+void buffer_pool_destroy(void);
+
+#endif
@@ -3,7 +3,9 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <sys/time.h>
+#include <sys/types.h>
 
 /**
  * selector.c - un muliplexor de entrada salida
@@ -12,6 +14,7 @@
  * de file descriptors de forma no bloqueante.
  *
  * Esconde la implementación final (select(2) / poll(2) / epoll(2) / ..)
+ * La implementación se elige al iniciar la librería (ver `selector_backend').
  *
  * El usuario registra para un file descriptor especificando:
  *  1. un handler: provee funciones callback que manejarán los eventos de
@@ -31,6 +34,17 @@
  * Dicha señalización se realiza mediante señales, y es por eso que al
  * iniciar la librería `selector_init' se debe configurar una señal a utilizar.
  *
+ * Cada file descriptor puede tener además un timeout (`selector_set_timeout')
+ * que, al vencer, se presenta al handler como `handle_timeout'. Los timeouts
+ * viven en una rueda de temporizadores (ver timer_wheel.h), así que armarlos
+ * y cancelarlos cuesta O(1), y el selector no se bloquea más allá del
+ * próximo vencimiento.
+ *
+ * Con io_uring además se puede operar por completions en lugar de por
+ * disponibilidad (`selector_recv' / `selector_send'): el kernel hace el
+ * recv(2) o send(2) sobre el buffer indicado y el resultado se presenta al
+ * handler como `handle_recv' / `handle_send', sin una syscall por operación.
+ *
  * Todos métodos retornan su estado (éxito / error) de forma uniforme.
  * Puede utilizar `selector_error' para obtener una representación human
  * del estado. Si el valor es `SELECTOR_IO' puede obtener información adicional
@@ -64,13 +78,51 @@ typedef enum {
 /** retorna una descripción humana del fallo */
 const char *selector_error(const selector_status status);
 
+/**
+ * mecanismo de multiplexación que utilizan los selectores.
+ *
+ * SELECTOR_BACKEND_SELECT está limitado a FD_SETSIZE descriptores y cada
+ * iteración recorre todos los descriptores hasta el máximo registrado.
+ * SELECTOR_BACKEND_EPOLL no tiene dicho límite y cada iteración cuesta
+ * proporcional a la cantidad de descriptores listos.
+ * SELECTOR_BACKEND_IO_URING se comporta como epoll pero acumula los cambios
+ * de interés como SQEs y los envía junto con la espera en una única
+ * syscall por iteración. Es el único que admite operaciones por
+ * completion (ver `selector_recv'). Si el kernel no lo soporta se utiliza
+ * epoll.
+ */
+typedef enum {
+  SELECTOR_BACKEND_SELECT = 0,
+  SELECTOR_BACKEND_EPOLL,
+  SELECTOR_BACKEND_IO_URING,
+} selector_backend;
+
+/** retorna el nombre del backend (por ejemplo "epoll") */
+const char *selector_backend_name(const selector_backend backend);
+
+/**
+ * obtiene el backend a partir de su nombre.
+ *
+ * @return 0 si el nombre es conocido, -1 en otro caso.
+ */
+int selector_backend_from_name(const char *name, selector_backend *backend);
+
 /** opciones de inicialización del selector */
 struct selector_init {
   /** señal a utilizar para notificaciones internas */
   const int signal;
 
-  /** tiempo máximo de bloqueo durante `selector_iteratate' */
+  /**
+   * tiempo máximo de bloqueo durante `selector_iteratate' (menos, si antes
+   * vence algún timeout)
+   */
   struct timespec select_timeout;
+
+  /**
+   * backend preferido. Si la plataforma no lo soporta se degrada
+   * (io_uring -> epoll -> select).
+   */
+  selector_backend backend;
 };
 
 /** inicializa la librería */
@@ -85,6 +137,9 @@ fd_selector selector_new(const size_t initial_elements);
 /** destruye un selector creado por _new. Tolera NULLs */
 void selector_destroy(fd_selector s);
 
+/** retorna el backend que efectivamente utiliza el selector */
+selector_backend selector_get_backend(fd_selector s);
+
 /**
  * Intereses sobre un file descriptor (quiero leer, quiero escribir, …)
  *
@@ -123,6 +178,15 @@ typedef struct fd_handler {
   void (*handle_read)(struct selector_key *key);
   void (*handle_write)(struct selector_key *key);
   void (*handle_block)(struct selector_key *key);
+  /** llamado cuando vence el timeout del fd (ver `selector_set_timeout') */
+  void (*handle_timeout)(struct selector_key *key);
+
+  /**
+   * llamados al completarse un `selector_recv' / `selector_send' sobre el
+   * fd. `n' es lo que hubiera retornado recv(2) / send(2), o -errno.
+   */
+  void (*handle_recv)(struct selector_key *key, ssize_t n);
+  void (*handle_send)(struct selector_key *key, ssize_t n);
 
   /**
    * llamado cuando se se desregistra el fd
@@ -159,6 +223,37 @@ selector_status selector_set_interest(fd_selector s, int fd, fd_interest i);
 selector_status selector_set_interest_key(struct selector_key *key,
                                           fd_interest i);
 
+/**
+ * arma (o rearma) el timeout de `fd': si en `ms' milisegundos no se volvió a
+ * llamar, se invoca `handle_timeout'. Con `ms' en 0 lo cancela. Un timeout
+ * vence una sola vez; desregistrar el fd también lo cancela.
+ */
+selector_status selector_set_timeout(fd_selector s, int fd, unsigned ms);
+
+/** indica si el selector admite `selector_recv' y `selector_send' */
+bool selector_has_completions(fd_selector s);
+
+/**
+ * inicia un recv(2) de hasta `len' bytes de `fd' sobre `buf'; el resultado
+ * llega en `handle_recv'. Hasta entonces `buf' es del kernel: no se debe
+ * tocar ni liberar.
+ *
+ * Se admite una recepción en curso por fd (SELECTOR_FDINUSE si ya la hay).
+ * Desregistrar el fd cancela lo que esté en curso y espera a que el kernel
+ * suelte los buffers, sin invocar a los handlers.
+ */
+selector_status selector_recv(fd_selector s, int fd, void *buf, size_t len);
+
+/** como `selector_recv', pero un send(2) con `flags'; llega en `handle_send' */
+selector_status selector_send(fd_selector s, int fd, const void *buf,
+                              size_t len, int flags);
+
+/**
+ * milisegundos de CLOCK_MONOTONIC al despertar de la última espera. Sirve
+ * como reloj barato para los handlers; los timeouts se miden con él.
+ */
+uint64_t selector_now(fd_selector s);
+
 /**
  * se bloquea hasta que hay eventos disponible y los despacha.
  * Retorna luego de cada iteración, o al llegar al timeout.
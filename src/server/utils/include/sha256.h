@@ -0,0 +1,50 @@
+#ifndef SHA256_H_Jq7VdX2mRb9TzLc4WnE6HsKy
+#define SHA256_H_Jq7VdX2mRb9TzLc4WnE6HsKy
+
+/**
+ * sha256.c - SHA-256, HMAC-SHA256 y PBKDF2-HMAC-SHA256.
+ *
+ * Implementación portable (FIPS 180-4, RFC 2104 y RFC 8018), sin
+ * dependencias externas. Alcanza para derivar y verificar claves de
+ * usuario; no intenta ser resistente a canales laterales más allá de
+ * no depender de los datos en sus saltos.
+ */
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_BLOCK_SIZE 64
+#define SHA256_DIGEST_SIZE 32
+
+struct sha256 {
+  uint32_t state[8];
+  /** bytes procesados en total */
+  uint64_t length;
+  uint8_t block[SHA256_BLOCK_SIZE];
+  /** bytes pendientes en `block' */
+  size_t used;
+};
+
+void sha256_init(struct sha256 *ctx);
+
+void sha256_update(struct sha256 *ctx, const void *data, size_t len);
+
+/** escribe el digest en `out' y deja `ctx' inutilizable */
+void sha256_final(struct sha256 *ctx, uint8_t out[SHA256_DIGEST_SIZE]);
+
+/** SHA-256 de `len' bytes de `data' */
+void sha256(const void *data, size_t len, uint8_t out[SHA256_DIGEST_SIZE]);
+
+/** HMAC-SHA256 de `msg' con la clave `key' */
+void hmac_sha256(const void *key, size_t key_len, const void *msg,
+                 size_t msg_len, uint8_t out[SHA256_DIGEST_SIZE]);
+
+/**
+ * PBKDF2 con HMAC-SHA256 como función pseudoaleatoria: deriva `out_len'
+ * bytes de `pass' y `salt' con `iterations' iteraciones (al menos 1).
+ * El costo es lineal en `iterations' por cada 32 bytes de salida.
+ */
+void pbkdf2_sha256(const void *pass, size_t pass_len, const void *salt,
+                   size_t salt_len, uint32_t iterations, uint8_t *out,
+                   size_t out_len);
+
+#endif
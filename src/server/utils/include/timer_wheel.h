@@ -0,0 +1,86 @@
+#ifndef TIMER_WHEEL_H_Zr4HcQ8wTn2LyEv6KbM1sXoPd
+#define TIMER_WHEEL_H_Zr4HcQ8wTn2LyEv6KbM1sXoPd
+
+/**
+ * timer_wheel.c - rueda de temporizadores jerárquica.
+ *
+ * Agenda, cancela y reprograma temporizadores en O(1), sin importar
+ * cuántos haya. El tiempo se mide en milisegundos (típicamente de
+ * CLOCK_MONOTONIC) y lo provee el usuario.
+ *
+ * La rueda tiene TIMER_WHEEL_LEVELS niveles de TIMER_WHEEL_SLOTS ranuras.
+ * El nivel 0 tiene resolución de 1ms y cubre los próximos 64ms; cada nivel
+ * siguiente cubre 64 veces más con 64 veces menos resolución. Cuando el
+ * tiempo alcanza una ranura de un nivel superior, sus temporizadores se
+ * redistribuyen ("cascada") en los niveles inferiores, de modo que cada
+ * uno vence en su milisegundo exacto. Los vencimientos más allá del
+ * alcance de la rueda (~4.6 horas) se reubican al llegar al último nivel.
+ *
+ * Los temporizadores son intrusivos: el usuario los embebe en sus propias
+ * estructuras y la rueda nunca aloca memoria.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+
+struct timer {
+  /** vencimiento, en milisegundos */
+  uint64_t expires;
+
+  /* uso interno */
+  struct timer *next, *prev;
+  uint8_t level, slot;
+  bool armed;
+};
+
+struct timer_wheel {
+  /** último milisegundo procesado */
+  uint64_t now;
+  /** temporizadores armados */
+  uint64_t count;
+  /** ranuras no vacías, un bit por ranura */
+  uint64_t occupied[TIMER_WHEEL_LEVELS];
+  struct timer *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+};
+
+/** inicializa una rueda vacía cuyo tiempo actual es `now' */
+void timer_wheel_init(struct timer_wheel *w, uint64_t now);
+
+/** inicializa un temporizador (desarmado) */
+void timer_init(struct timer *t);
+
+/** indica si `t' está agendado */
+bool timer_armed(const struct timer *t);
+
+/**
+ * agenda `t' para que venza en `expires'. Si ya estaba agendado se
+ * reprograma. Un vencimiento que ya pasó se cumple en el próximo
+ * milisegundo.
+ */
+void timer_wheel_schedule(struct timer_wheel *w, struct timer *t,
+                          uint64_t expires);
+
+/** desagenda `t'. Tolera temporizadores desarmados. */
+void timer_wheel_cancel(struct timer_wheel *w, struct timer *t);
+
+/**
+ * milisegundos hasta que la rueda tenga trabajo (un vencimiento o una
+ * cascada), o -1 si está vacía. Nunca es más tarde que el próximo
+ * vencimiento, aunque puede ser antes.
+ */
+int64_t timer_wheel_next(const struct timer_wheel *w);
+
+/**
+ * avanza el tiempo hasta `now' llamando a `expired' con cada temporizador
+ * vencido, en orden de vencimiento. Al llamarlo el temporizador ya está
+ * desarmado; `expired' puede volver a agendarlo o manipular cualquier
+ * otro temporizador de la rueda.
+ */
+void timer_wheel_advance(struct timer_wheel *w, uint64_t now,
+                         void (*expired)(struct timer *t, void *data),
+                         void *data);
+
+#endif
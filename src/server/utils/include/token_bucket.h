@@ -0,0 +1,58 @@
+#ifndef TOKEN_BUCKET_H_Hn3WqR8cLx5VbT1mKe7YsDa9
+#define TOKEN_BUCKET_H_Hn3WqR8cLx5VbT1mKe7YsDa9
+
+/**
+ * token_bucket.c - limitador de tasa por balde de tokens.
+ *
+ * El balde se llena a `rate' bytes por segundo hasta `burst' bytes; cada
+ * byte que pasa se lleva un token. Sirve para acotar el caudal promedio
+ * permitiendo ráfagas cortas.
+ *
+ * El tiempo se mide en milisegundos (típicamente selector_now()) y lo
+ * provee el usuario. Los tokens se cuentan en milésimas de byte, así que
+ * reabastecer seguido no pierde las fracciones de cada milisegundo.
+ *
+ * No es thread safe: si varios hilos comparten un balde deben
+ * serializar el acceso.
+ */
+#include <stdint.h>
+
+struct token_bucket {
+  /** bytes por segundo; 0 es sin límite */
+  uint64_t rate;
+  /** bytes que se pueden acumular */
+  uint64_t burst;
+
+  /* uso interno */
+  uint64_t tokens; // milésimas de byte
+  uint64_t last;   // último reabastecimiento, en milisegundos
+};
+
+/** inicializa un balde lleno, con el tiempo actual en `now' */
+void token_bucket_init(struct token_bucket *b, uint64_t rate, uint64_t burst,
+                       uint64_t now);
+
+/**
+ * cambia la tasa y la ráfaga conservando los tokens acumulados (hasta la
+ * nueva ráfaga)
+ */
+void token_bucket_set_rate(struct token_bucket *b, uint64_t rate,
+                           uint64_t burst, uint64_t now);
+
+/**
+ * toma hasta `max' bytes de tokens. Retorna cuántos otorgó, que es 0 si
+ * el balde está vacío y `max' si no tiene límite.
+ */
+uint64_t token_bucket_take(struct token_bucket *b, uint64_t now,
+                           uint64_t max);
+
+/** devuelve `n' bytes tomados de más (sin pasar de la ráfaga) */
+void token_bucket_refund(struct token_bucket *b, uint64_t n);
+
+/**
+ * milisegundos hasta que haya al menos `n' bytes de tokens (como mucho la
+ * ráfaga), contando desde el último token_bucket_take(). 0 si ya los hay.
+ */
+uint64_t token_bucket_wait(const struct token_bucket *b, uint64_t n);
+
+#endif
@@ -0,0 +1,87 @@
+#ifndef URING_H_qH5NnVb0cYkR1x8TqLZpWd3sMf
+#define URING_H_qH5NnVb0cYkR1x8TqLZpWd3sMf
+
+/**
+ * uring.c - envoltorio mínimo de io_uring(7) sin depender de liburing.
+ *
+ * Expone solo lo que necesita el selector:
+ *  - obtener SQEs y publicarlos (`uring_get_sqe' / `uring_commit_sqe')
+ *  - enviarlos y esperar completions con timeout y máscara de señales,
+ *    igual que pselect(2) (`uring_wait')
+ *  - recorrer las completions disponibles (`uring_peek_cqe' /
+ *    `uring_cqe_seen')
+ *
+ * Los SQEs obtenidos se acumulan y se envían todos juntos en la próxima
+ * llamada a `uring_wait' (o antes, si la cola se llena), de modo que
+ * varios cambios de interés cuestan una sola syscall.
+ */
+#include <signal.h>
+#include <stddef.h>
+#include <time.h>
+
+#include <linux/io_uring.h>
+
+struct uring {
+  int fd;
+
+  /* submission queue */
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+
+  /* completion queue */
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  /* regiones mapeadas */
+  void *ring_ptr;
+  size_t ring_len;
+  size_t sqes_len;
+};
+
+/**
+ * crea un anillo con `entries' SQEs.
+ *
+ * Falla (retorna -1 y deja detalles en errno) si el kernel no soporta
+ * io_uring o le faltan las características que necesitamos.
+ */
+int uring_init(struct uring *r, unsigned entries);
+
+/** libera los recursos del anillo. Tolera anillos no inicializados. */
+void uring_close(struct uring *r);
+
+/**
+ * retorna un SQE en blanco listo para completar. Si la cola está llena
+ * envía lo pendiente al kernel antes.
+ *
+ * El SQE no es visible para el kernel hasta `uring_commit_sqe', que debe
+ * llamarse antes de pedir otro.
+ *
+ * retorna NULL si no se pudo obtener lugar.
+ */
+struct io_uring_sqe *uring_get_sqe(struct uring *r);
+
+/** publica el SQE ya completado que retornó `uring_get_sqe' */
+void uring_commit_sqe(struct uring *r);
+
+/**
+ * envía los SQEs pendientes y se bloquea hasta que haya al menos una
+ * completion, se cumpla `timeout' o llegue una señal no bloqueada en
+ * `mask' (NULL mantiene la máscara del hilo).
+ *
+ * retorna 0 o -1 dejando detalles en errno (EINTR y ETIME son esperables).
+ */
+int uring_wait(struct uring *r, const struct timespec *timeout,
+               const sigset_t *mask);
+
+/** retorna la próxima completion disponible o NULL si no hay */
+struct io_uring_cqe *uring_peek_cqe(struct uring *r);
+
+/** marca como consumida la completion retornada por `uring_peek_cqe' */
+void uring_cqe_seen(struct uring *r);
+
+#endif
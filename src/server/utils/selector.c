@@ -15,8 +15,18 @@
 #include <sys/signal.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "timer_wheel.h"
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/epoll.h>
+
+#include "uring.h"
+#endif
+
 #define N(x) (sizeof(x) / sizeof((x)[0]))
 
 #define ERROR_DEFAULT_MSG "something failed"
@@ -46,6 +56,38 @@ const char *selector_error(const selector_status status) {
   return msg;
 }
 
+const char *selector_backend_name(const selector_backend backend) {
+  const char *name;
+  switch (backend) {
+  case SELECTOR_BACKEND_EPOLL:
+    name = "epoll";
+    break;
+  case SELECTOR_BACKEND_IO_URING:
+    name = "io_uring";
+    break;
+  case SELECTOR_BACKEND_SELECT:
+  default:
+    name = "select";
+    break;
+  }
+  return name;
+}
+
+int selector_backend_from_name(const char *name, selector_backend *backend) {
+  static const selector_backend all[] = {
+      SELECTOR_BACKEND_SELECT,
+      SELECTOR_BACKEND_EPOLL,
+      SELECTOR_BACKEND_IO_URING,
+  };
+  for (unsigned i = 0; name != NULL && i < N(all); i++) {
+    if (0 == strcmp(name, selector_backend_name(all[i]))) {
+      *backend = all[i];
+      return 0;
+    }
+  }
+  return -1;
+}
+
 static void wake_handler(const int signal) {
   (void)signal; // nada que hacer. está solo para interrumpir el select
 }
@@ -96,11 +138,39 @@ selector_status selector_close(void) {
 }
 
 // estructuras internas
+/** timeout de un fd */
+struct fd_timer {
+  struct timer timer;
+  int fd;
+};
+
 struct item {
   int fd;
   fd_interest interest;
   const fd_handler *handler;
   void *data;
+  /**
+   * intereses que conoce el kernel (epoll / io_uring). Se mantiene para
+   * evitar syscalls (o SQEs) cuando el interés no cambió.
+   */
+  fd_interest registered;
+  /**
+   * generación del registro. Permite descartar eventos que quedaron
+   * pendientes para un fd que se cerró y se volvió a registrar durante la
+   * misma iteración. Con io_uring identifica además a cada poll armado.
+   */
+  uint32_t gen;
+  /**
+   * operaciones por completion en curso (io_uring), un bit por
+   * `enum uring_op'. Mientras haya alguna el kernel usa un buffer del
+   * handler.
+   */
+  uint8_t inflight;
+  /**
+   * timeout del fd. Se aloca la primera vez que se arma y queda asociado a
+   * la posición de la tabla para los siguientes registros del mismo fd.
+   */
+  struct fd_timer *timer;
 };
 
 /* tarea bloqueante */
@@ -117,6 +187,14 @@ struct blocking_job {
   struct blocking_job *next;
 };
 
+#ifdef __linux__
+/** completion retirada del anillo que queda por despachar */
+struct uring_completion {
+  uint64_t user_data;
+  int32_t res;
+};
+#endif
+
 /** marca para usar en item->fd para saber que no está en uso */
 static const int FD_UNUSED = -1;
 
@@ -129,6 +207,29 @@ struct fdselector {
   // esto podría mejorarse utilizando otra estructura de datos
   struct item *fds;
   size_t fd_size; // cantidad de elementos posibles de fds
+  /** límite de fds que soporta el backend */
+  size_t max_size;
+
+  /** mecanismo de multiplexación en uso */
+  selector_backend backend;
+  /** contador para `item.gen' */
+  uint32_t next_gen;
+
+  /** instancia de epoll(7) (solo SELECTOR_BACKEND_EPOLL) */
+  int epfd;
+#ifdef __linux__
+  /** eventos retornados por epoll_pwait(2) */
+  struct epoll_event *events;
+  /** anillo de io_uring(7) (solo SELECTOR_BACKEND_IO_URING) */
+  struct uring ring;
+  /**
+   * completions de operaciones que se retiraron del anillo mientras se
+   * desregistraba otro fd (ver `uring_drain'). Hay a lo sumo dos por fd,
+   * así que se dimensiona junto con `fds' y nunca falta lugar.
+   */
+  struct uring_completion *stash;
+  size_t stash_head, stash_len;
+#endif
 
   /** fd maximo para usar en select() */
   int max_fd; // max(.fds[].fd)
@@ -143,6 +244,11 @@ struct fdselector {
   /** tambien select() puede cambiar el valor */
   struct timespec slave_t;
 
+  /** timeouts de los fds */
+  struct timer_wheel timers;
+  /** ver `selector_now' */
+  uint64_t now;
+
   // notificaciónes entre blocking jobs y el selector
   volatile pthread_t selector_thread;
   /** protege el acceso a resolutions jobs */
@@ -157,14 +263,45 @@ struct fdselector {
 /** cantidad máxima de file descriptors que la plataforma puede manejar */
 #define ITEMS_MAX_SIZE FD_SETSIZE
 
-// en esta implementación el máximo está dado por el límite natural de
-// select(2).
+// con select(2) el máximo está dado por su límite natural. epoll(7) no
+// tiene ese límite; acotamos la jump table a un valor que alcanza para
+// cientos de miles de conexiones (el límite real lo impone RLIMIT_NOFILE).
+#define EPOLL_ITEMS_MAX_SIZE (1 << 20)
+
+/** cantidad de eventos que se obtienen como máximo por epoll_pwait(2) */
+#define EPOLL_MAX_EVENTS 1024
+
+/** tamaño de la cola de envío de io_uring */
+#define URING_ENTRIES 4096
+
+/** user_data de los SQEs cuya completion no nos interesa */
+#define URING_IGNORE UINT64_MAX
+
+/**
+ * el user_data de los demás SQEs lleva el fd en los bits bajos, encima el
+ * tipo de operación y, en los 32 bits altos, la generación del poll.
+ */
+#define URING_OP_SHIFT 30
+#define URING_FD_MASK ((UINT32_C(1) << URING_OP_SHIFT) - 1)
+
+enum uring_op {
+  URING_POLL = 0,
+  URING_RECV = 1,
+  URING_SEND = 2,
+};
+
+#define URING_OP_BIT(op) (1U << (op))
+
+static uint64_t uring_user_data(uint32_t gen, enum uring_op op, int fd) {
+  return ((uint64_t)gen << 32) | ((uint32_t)op << URING_OP_SHIFT) |
+         (uint32_t)fd;
+}
 
 /**
  * determina el tamaño a crecer, generando algo de slack para no tener
- * que realocar constantemente.
+ * que realocar constantemente. Nunca supera `max'.
  */
-static size_t next_capacity(const size_t n) {
+static size_t next_capacity_max(const size_t n, const size_t max) {
   unsigned bits = 0;
   size_t tmp = n;
   while (tmp != 0) {
@@ -174,8 +311,8 @@ static size_t next_capacity(const size_t n) {
   tmp = 1UL << bits;
 
   assert(tmp >= n);
-  if (tmp > ITEMS_MAX_SIZE) {
-    tmp = ITEMS_MAX_SIZE;
+  if (tmp > max) {
+    tmp = max;
   }
 
   return tmp + 1;
@@ -191,9 +328,17 @@ static void items_init(fd_selector s, const size_t last) {
   assert(last <= s->fd_size);
   for (size_t i = last; i < s->fd_size; i++) {
     item_init(s->fds + i);
+    // realloc(3) no blanquea la memoria nueva
+    s->fds[i].timer = NULL;
   }
 }
 
+static uint64_t monotonic_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
 /**
  * calcula el fd maximo para ser utilizado en select()
  */
@@ -210,7 +355,192 @@ static int items_max_fd(fd_selector s) {
   return max;
 }
 
-static void items_update_fdset_for_fd(fd_selector s, const struct item *item) {
+#ifdef __linux__
+/**
+ * sincroniza los intereses de `item' con la instancia de epoll.
+ * Un fd sin intereses se quita del conjunto: de lo contrario epoll seguiría
+ * reportando EPOLLHUP/EPOLLERR y el loop giraría en vacío.
+ */
+static selector_status items_update_epoll_for_fd(fd_selector s,
+                                                 struct item *item) {
+  const fd_interest want = ITEM_USED(item) ? item->interest : OP_NOOP;
+  if (want == item->registered) {
+    return SELECTOR_SUCCESS;
+  }
+
+  struct epoll_event ev = {
+      .events = ((want & OP_READ) ? EPOLLIN : 0) |
+                ((want & OP_WRITE) ? EPOLLOUT : 0),
+      .data.u64 = ((uint64_t)item->gen << 32) | (uint32_t)item->fd,
+  };
+
+  int op;
+  if (want == OP_NOOP) {
+    op = EPOLL_CTL_DEL;
+  } else if (item->registered == OP_NOOP) {
+    op = EPOLL_CTL_ADD;
+  } else {
+    op = EPOLL_CTL_MOD;
+  }
+
+  if (-1 == epoll_ctl(s->epfd, op, item->fd, &ev) && op != EPOLL_CTL_DEL) {
+    // un DEL que falla es porque el fd ya se cerró: el kernel lo quitó solo
+    return SELECTOR_IO;
+  }
+  item->registered = want;
+  return SELECTOR_SUCCESS;
+}
+
+/**
+ * sincroniza los intereses de `item' con io_uring.
+ *
+ * Se usan polls de un solo disparo (IORING_OP_POLL_ADD): al armarse
+ * completan en el acto si el fd ya está listo, lo que da la misma semántica
+ * level-triggered que select(2). Luego de cada completion el poll queda
+ * desarmado y se vuelve a armar tras despachar los handlers.
+ *
+ * Nada de esto hace syscalls: los SQEs se envían en `selector_select'.
+ */
+static selector_status items_update_uring_for_fd(fd_selector s,
+                                                 struct item *item) {
+  const fd_interest want = ITEM_USED(item) ? item->interest : OP_NOOP;
+  if (want == item->registered) {
+    return SELECTOR_SUCCESS;
+  }
+
+  struct io_uring_sqe *sqe;
+  if (item->registered != OP_NOOP) {
+    // el poll armado no coincide con lo deseado: lo cancelamos
+    sqe = uring_get_sqe(&s->ring);
+    if (sqe == NULL) {
+      return SELECTOR_IO;
+    }
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = uring_user_data(item->gen, URING_POLL, item->fd);
+    sqe->user_data = URING_IGNORE;
+    uring_commit_sqe(&s->ring);
+    item->registered = OP_NOOP;
+  }
+
+  if (want != OP_NOOP) {
+    sqe = uring_get_sqe(&s->ring);
+    if (sqe == NULL) {
+      return SELECTOR_IO;
+    }
+    item->gen = s->next_gen++;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = item->fd;
+    sqe->poll32_events = ((want & OP_READ) ? POLLIN : 0) |
+                         ((want & OP_WRITE) ? POLLOUT : 0);
+    sqe->user_data = uring_user_data(item->gen, URING_POLL, item->fd);
+    uring_commit_sqe(&s->ring);
+    item->registered = want;
+  }
+  return SELECTOR_SUCCESS;
+}
+
+/**
+ * cancela las operaciones en curso de `item' y espera a que el kernel las
+ * complete: hasta entonces puede estar usando buffers que el handler
+ * libera al cerrarse.
+ *
+ * Las completions de operaciones de otros fds que llegan mientras tanto se
+ * guardan para `handle_iteration_uring'. Los polls que completan se
+ * rearman: como son level-triggered se vuelven a reportar.
+ */
+static void uring_drain(fd_selector s, struct item *item) {
+  // las que ya completaron pero no se despacharon no llegan a handlers; de
+  // paso compactamos, así lo guardado nunca supera dos por fd en uso
+  size_t len = 0;
+  for (size_t i = s->stash_head; i < s->stash_len; i++) {
+    const uint64_t u64 = s->stash[i].user_data;
+    if (u64 == URING_IGNORE) {
+      continue;
+    }
+    if ((int)(u64 & URING_FD_MASK) == item->fd) {
+      item->inflight &= ~URING_OP_BIT((u64 >> URING_OP_SHIFT) & 3);
+      continue;
+    }
+    s->stash[len++] = s->stash[i];
+  }
+  s->stash_head = 0;
+  s->stash_len = len;
+
+  for (enum uring_op op = URING_RECV; op <= URING_SEND; op++) {
+    if (!(item->inflight & URING_OP_BIT(op))) {
+      continue;
+    }
+    struct io_uring_sqe *sqe = uring_get_sqe(&s->ring);
+    if (sqe == NULL) {
+      // sin lugar para cancelarla la terminamos cortando el socket
+      shutdown(item->fd, SHUT_RDWR);
+      continue;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = uring_user_data(0, op, item->fd);
+    sqe->user_data = URING_IGNORE;
+    uring_commit_sqe(&s->ring);
+  }
+
+  const struct timespec wait = {.tv_sec = 1};
+  while (item->inflight != 0) {
+    if (-1 == uring_wait(&s->ring, &wait, NULL)) {
+      if (errno == ETIME) {
+        // la cancelación no la alcanzó (ya estaba en curso): cortar el
+        // socket la termina
+        shutdown(item->fd, SHUT_RDWR);
+      } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        break; // el anillo ya no responde; no hay a quién esperar
+      }
+    }
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_peek_cqe(&s->ring)) != NULL) {
+      const uint64_t u64 = cqe->user_data;
+      const int32_t res = cqe->res;
+      uring_cqe_seen(&s->ring);
+
+      if (u64 == URING_IGNORE) {
+        continue;
+      }
+      const int fd = (int)(u64 & URING_FD_MASK);
+      const enum uring_op op = (u64 >> URING_OP_SHIFT) & 3;
+      if ((size_t)fd >= s->fd_size) {
+        continue;
+      }
+      struct item *other = s->fds + fd;
+      if (op == URING_POLL) {
+        if (res != -ECANCELED && ITEM_USED(other) &&
+            other->gen == (uint32_t)(u64 >> 32)) {
+          other->registered = OP_NOOP;
+          if (other != item) {
+            items_update_uring_for_fd(s, other);
+          }
+        }
+      } else if (other == item) {
+        item->inflight &= ~URING_OP_BIT(op);
+      } else {
+        s->stash[s->stash_len++] = (struct uring_completion){
+            .user_data = u64,
+            .res = res,
+        };
+      }
+    }
+  }
+}
+#endif
+
+static selector_status items_update_fdset_for_fd(fd_selector s,
+                                                 struct item *item) {
+#ifdef __linux__
+  if (s->backend == SELECTOR_BACKEND_EPOLL) {
+    return items_update_epoll_for_fd(s, item);
+  }
+  if (s->backend == SELECTOR_BACKEND_IO_URING) {
+    return items_update_uring_for_fd(s, item);
+  }
+#endif
   FD_CLR(item->fd, &s->master_r);
   FD_CLR(item->fd, &s->master_w);
 
@@ -223,6 +553,7 @@ static void items_update_fdset_for_fd(fd_selector s, const struct item *item) {
       FD_SET(item->fd, &(s->master_w));
     }
   }
+  return SELECTOR_SUCCESS;
 }
 
 /**
@@ -237,12 +568,12 @@ static selector_status ensure_capacity(fd_selector s, const size_t n) {
   if (n < s->fd_size) {
     // nada para hacer, entra...
     ret = SELECTOR_SUCCESS;
-  } else if (n > ITEMS_MAX_SIZE) {
+  } else if (n > s->max_size) {
     // me estás pidiendo más de lo que se puede.
     ret = SELECTOR_MAXFD;
   } else if (NULL == s->fds) {
     // primera vez.. alocamos
-    const size_t new_size = next_capacity(n);
+    const size_t new_size = next_capacity_max(n, s->max_size);
 
     s->fds = calloc(new_size, element_size);
     if (NULL == s->fds) {
@@ -253,7 +584,7 @@ static selector_status ensure_capacity(fd_selector s, const size_t n) {
     }
   } else {
     // hay que agrandar...
-    const size_t new_size = next_capacity(n);
+    const size_t new_size = next_capacity_max(n, s->max_size);
     if (new_size > SIZE_MAX / element_size) { // ver MEM07-C
       ret = SELECTOR_ENOMEM;
     } else {
@@ -270,6 +601,19 @@ static selector_status ensure_capacity(fd_selector s, const size_t n) {
     }
   }
 
+#ifdef __linux__
+  if (ret == SELECTOR_SUCCESS && s->backend == SELECTOR_BACKEND_IO_URING &&
+      s->fds != NULL) {
+    // dos operaciones por fd a lo sumo (ver `stash')
+    struct uring_completion *tmp =
+        realloc(s->stash, 2 * s->fd_size * sizeof(*s->stash));
+    if (NULL == tmp) {
+      ret = SELECTOR_ENOMEM;
+    } else {
+      s->stash = tmp;
+    }
+  }
+#endif
   return ret;
 }
 
@@ -280,9 +624,34 @@ fd_selector selector_new(const size_t initial_elements) {
     memset(ret, 0x00, size);
     ret->master_t.tv_sec = conf.select_timeout.tv_sec;
     ret->master_t.tv_nsec = conf.select_timeout.tv_nsec;
+    ret->now = monotonic_ms();
+    timer_wheel_init(&ret->timers, ret->now);
     assert(ret->max_fd == 0);
     ret->resolution_jobs = 0;
     pthread_mutex_init(&ret->resolution_mutex, 0);
+    ret->backend = SELECTOR_BACKEND_SELECT;
+    ret->max_size = ITEMS_MAX_SIZE;
+    ret->epfd = -1;
+#ifdef __linux__
+    ret->ring.fd = -1;
+    if (conf.backend == SELECTOR_BACKEND_IO_URING) {
+      if (0 == uring_init(&ret->ring, URING_ENTRIES)) {
+        ret->backend = SELECTOR_BACKEND_IO_URING;
+        ret->max_size = EPOLL_ITEMS_MAX_SIZE;
+      }
+      // si el kernel no soporta io_uring, seguimos con epoll(7)
+    }
+    if (conf.backend != SELECTOR_BACKEND_SELECT &&
+        ret->backend == SELECTOR_BACKEND_SELECT) {
+      ret->epfd = epoll_create1(EPOLL_CLOEXEC);
+      ret->events = malloc(EPOLL_MAX_EVENTS * sizeof(*ret->events));
+      if (ret->epfd != -1 && ret->events != NULL) {
+        ret->backend = SELECTOR_BACKEND_EPOLL;
+        ret->max_size = EPOLL_ITEMS_MAX_SIZE;
+      }
+      // si no se pudo, seguimos con select(2)
+    }
+#endif
     if (0 != ensure_capacity(ret, initial_elements)) {
       selector_destroy(ret);
       ret = NULL;
@@ -300,6 +669,9 @@ void selector_destroy(fd_selector s) {
           selector_unregister_fd(s, i);
         }
       }
+      for (size_t i = 0; i < s->fd_size; i++) {
+        free(s->fds[i].timer);
+      }
       pthread_mutex_destroy(&s->resolution_mutex);
       struct blocking_job *j = s->resolution_jobs;
       while (j != NULL) {
@@ -311,24 +683,34 @@ void selector_destroy(fd_selector s) {
       s->fds = NULL;
       s->fd_size = 0;
     }
+    if (s->epfd != -1) {
+      close(s->epfd);
+    }
+#ifdef __linux__
+    free(s->events);
+    uring_close(&s->ring);
+    free(s->stash);
+#endif
     free(s);
   }
 }
 
-#define INVALID_FD(fd) ((fd) < 0 || (fd) >= ITEMS_MAX_SIZE)
+selector_backend selector_get_backend(fd_selector s) { return s->backend; }
+
+#define INVALID_FD(s, fd) ((fd) < 0 || (size_t)(fd) >= (s)->max_size)
 
 selector_status selector_register(fd_selector s, const int fd,
                                   const fd_handler *handler,
                                   const fd_interest interest, void *data) {
   selector_status ret = SELECTOR_SUCCESS;
   // 0. validación de argumentos
-  if (s == NULL || INVALID_FD(fd) || handler == NULL) {
+  if (s == NULL || INVALID_FD(s, fd) || handler == NULL) {
     ret = SELECTOR_IARGS;
     goto finally;
   }
   // 1. tenemos espacio?
   size_t ufd = (size_t)fd;
-  if (ufd > s->fd_size) {
+  if (ufd >= s->fd_size) {
     ret = ensure_capacity(s, ufd);
     if (SELECTOR_SUCCESS != ret) {
       goto finally;
@@ -345,12 +727,22 @@ selector_status selector_register(fd_selector s, const int fd,
     item->handler = handler;
     item->interest = interest;
     item->data = data;
+    item->registered = OP_NOOP;
+    item->gen = s->next_gen++;
+
+    ret = items_update_fdset_for_fd(s, item);
+    if (SELECTOR_SUCCESS != ret) {
+      struct fd_timer *timer = item->timer;
+      memset(item, 0x00, sizeof(*item));
+      item_init(item);
+      item->timer = timer;
+      goto finally;
+    }
 
     // actualizo colaterales
     if (fd > s->max_fd) {
       s->max_fd = fd;
     }
-    items_update_fdset_for_fd(s, item);
   }
 
 finally:
@@ -360,7 +752,7 @@ finally:
 selector_status selector_unregister_fd(fd_selector s, const int fd) {
   selector_status ret = SELECTOR_SUCCESS;
 
-  if (NULL == s || INVALID_FD(fd)) {
+  if (NULL == s || INVALID_FD(s, fd) || (size_t)fd >= s->fd_size) {
     ret = SELECTOR_IARGS;
     goto finally;
   }
@@ -371,6 +763,12 @@ selector_status selector_unregister_fd(fd_selector s, const int fd) {
     goto finally;
   }
 
+#ifdef __linux__
+  if (item->inflight != 0) {
+    uring_drain(s, item);
+  }
+#endif
+
   if (item->handler->handle_close != NULL) {
     struct selector_key key = {
         .s = s,
@@ -380,12 +778,22 @@ selector_status selector_unregister_fd(fd_selector s, const int fd) {
     item->handler->handle_close(&key);
   }
 
+  // handle_close pudo registrar otros fds y redimensionar la tabla
+  item = s->fds + fd;
   item->interest = OP_NOOP;
   items_update_fdset_for_fd(s, item);
 
+  struct fd_timer *timer = item->timer;
+  if (timer != NULL) {
+    timer_wheel_cancel(&s->timers, &timer->timer);
+  }
   memset(item, 0x00, sizeof(*item));
   item_init(item);
-  s->max_fd = items_max_fd(s);
+  item->timer = timer;
+  if (s->backend == SELECTOR_BACKEND_SELECT) {
+    // solo select(2) necesita el máximo; evitamos recorrer la tabla
+    s->max_fd = items_max_fd(s);
+  }
 
 finally:
   return ret;
@@ -394,7 +802,7 @@ finally:
 selector_status selector_set_interest(fd_selector s, int fd, fd_interest i) {
   selector_status ret = SELECTOR_SUCCESS;
 
-  if (NULL == s || INVALID_FD(fd)) {
+  if (NULL == s || INVALID_FD(s, fd) || (size_t)fd >= s->fd_size) {
     ret = SELECTOR_IARGS;
     goto finally;
   }
@@ -404,16 +812,102 @@ selector_status selector_set_interest(fd_selector s, int fd, fd_interest i) {
     goto finally;
   }
   item->interest = i;
-  items_update_fdset_for_fd(s, item);
+  ret = items_update_fdset_for_fd(s, item);
+finally:
+  return ret;
+}
+
+selector_status selector_set_timeout(fd_selector s, int fd, unsigned ms) {
+  selector_status ret = SELECTOR_SUCCESS;
+
+  if (NULL == s || INVALID_FD(s, fd) || (size_t)fd >= s->fd_size) {
+    ret = SELECTOR_IARGS;
+    goto finally;
+  }
+  struct item *item = s->fds + fd;
+  if (!ITEM_USED(item)) {
+    ret = SELECTOR_IARGS;
+    goto finally;
+  }
+  if (ms == 0) {
+    if (item->timer != NULL) {
+      timer_wheel_cancel(&s->timers, &item->timer->timer);
+    }
+    goto finally;
+  }
+  if (item->timer == NULL) {
+    item->timer = malloc(sizeof(*item->timer));
+    if (item->timer == NULL) {
+      ret = SELECTOR_ENOMEM;
+      goto finally;
+    }
+    timer_init(&item->timer->timer);
+    item->timer->fd = fd;
+  }
+  timer_wheel_schedule(&s->timers, &item->timer->timer, s->now + ms);
 finally:
   return ret;
 }
 
+uint64_t selector_now(fd_selector s) { return s->now; }
+
+bool selector_has_completions(fd_selector s) {
+  return s->backend == SELECTOR_BACKEND_IO_URING;
+}
+
+#ifdef __linux__
+/** encola un IORING_OP_RECV / IORING_OP_SEND; se envía con la próxima espera */
+static selector_status uring_submit(fd_selector s, int fd, enum uring_op op,
+                                    const void *buf, size_t len, int flags) {
+  if (NULL == s || INVALID_FD(s, fd) || (size_t)fd >= s->fd_size ||
+      s->backend != SELECTOR_BACKEND_IO_URING) {
+    return SELECTOR_IARGS;
+  }
+  struct item *item = s->fds + fd;
+  if (!ITEM_USED(item)) {
+    return SELECTOR_IARGS;
+  }
+  if (item->inflight & URING_OP_BIT(op)) {
+    return SELECTOR_FDINUSE;
+  }
+  struct io_uring_sqe *sqe = uring_get_sqe(&s->ring);
+  if (sqe == NULL) {
+    return SELECTOR_IO;
+  }
+  sqe->opcode = op == URING_RECV ? IORING_OP_RECV : IORING_OP_SEND;
+  sqe->fd = fd;
+  sqe->addr = (uintptr_t)buf;
+  sqe->len = len < UINT32_MAX ? (uint32_t)len : UINT32_MAX;
+  sqe->msg_flags = (uint32_t)flags;
+  sqe->user_data = uring_user_data(0, op, fd);
+  uring_commit_sqe(&s->ring);
+  item->inflight |= URING_OP_BIT(op);
+  return SELECTOR_SUCCESS;
+}
+#endif
+
+selector_status selector_recv(fd_selector s, int fd, void *buf, size_t len) {
+#ifdef __linux__
+  return uring_submit(s, fd, URING_RECV, buf, len, 0);
+#else
+  return SELECTOR_IARGS;
+#endif
+}
+
+selector_status selector_send(fd_selector s, int fd, const void *buf,
+                              size_t len, int flags) {
+#ifdef __linux__
+  return uring_submit(s, fd, URING_SEND, buf, len, flags);
+#else
+  return SELECTOR_IARGS;
+#endif
+}
+
 selector_status selector_set_interest_key(struct selector_key *key,
                                           fd_interest i) {
   selector_status ret;
 
-  if (NULL == key || NULL == key->s || INVALID_FD(key->fd)) {
+  if (NULL == key || NULL == key->s || INVALID_FD(key->s, key->fd)) {
     ret = SELECTOR_IARGS;
   } else {
     ret = selector_set_interest(key->s, key->fd, i);
@@ -422,6 +916,39 @@ selector_status selector_set_interest_key(struct selector_key *key,
   return ret;
 }
 
+/**
+ * calcula en `slave_t' cuánto esperar: `master_t', salvo que antes venza
+ * algún timeout.
+ */
+static void wait_timeout(fd_selector s) {
+  s->slave_t = s->master_t;
+  const int64_t next = timer_wheel_next(&s->timers);
+  if (next >= 0 && (uint64_t)next < (uint64_t)s->master_t.tv_sec * 1000 +
+                                        s->master_t.tv_nsec / 1000000) {
+    s->slave_t.tv_sec = next / 1000;
+    s->slave_t.tv_nsec = (next % 1000) * 1000000;
+  }
+}
+
+static void handle_timeout(struct timer *t, void *data) {
+  fd_selector s = data;
+  const int fd = ((struct fd_timer *)t)->fd;
+  struct item *item = s->fds + fd;
+  if (ITEM_USED(item) && item->handler->handle_timeout != NULL) {
+    struct selector_key key = {
+        .s = s,
+        .fd = item->fd,
+        .data = item->data,
+    };
+    item->handler->handle_timeout(&key);
+  }
+}
+
+/** despacha los timeouts que vencieron hasta `now' */
+static void handle_timeouts(fd_selector s) {
+  timer_wheel_advance(&s->timers, s->now, handle_timeout, s);
+}
+
 /**
  * se encarga de manejar los resultados del select.
  * se encuentra separado para facilitar el testing
@@ -446,7 +973,9 @@ static void handle_iteration(fd_selector s) {
           }
         }
       }
-      if (FD_ISSET(i, &s->slave_w)) {
+      // el handler pudo haber redimensionado la tabla
+      item = s->fds + i;
+      if (ITEM_USED(item) && FD_ISSET(i, &s->slave_w)) {
         if (OP_WRITE & item->interest) {
           if (0 == item->handler->handle_write) {
             assert(("OP_WRITE arrived but no handler. bug!" == 0));
@@ -459,27 +988,251 @@ static void handle_iteration(fd_selector s) {
   }
 }
 
+#ifdef __linux__
+/**
+ * despacha los eventos obtenidos de epoll_pwait(2). El costo es
+ * proporcional a la cantidad de eventos, no al máximo fd registrado.
+ */
+static void handle_iteration_epoll(fd_selector s, const int n) {
+  struct selector_key key = {
+      .s = s,
+  };
+
+  for (int i = 0; i < n; i++) {
+    const uint64_t u64 = s->events[i].data.u64;
+    const uint32_t events = s->events[i].events;
+    const int fd = (int)(uint32_t)u64;
+    const uint32_t gen = (uint32_t)(u64 >> 32);
+
+    // al igual que select(2), un error o hangup se presenta como listo
+    // para leer y escribir: el handler se enterará al operar.
+    const bool readable = events & (EPOLLIN | EPOLLHUP | EPOLLERR);
+    const bool writable = events & (EPOLLOUT | EPOLLHUP | EPOLLERR);
+
+    struct item *item = s->fds + fd;
+    if (!ITEM_USED(item) || item->gen != gen) {
+      continue;
+    }
+    key.fd = item->fd;
+    key.data = item->data;
+    if (readable && (OP_READ & item->interest)) {
+      if (0 == item->handler->handle_read) {
+        assert(("OP_READ arrived but no handler. bug!" == 0));
+      } else {
+        item->handler->handle_read(&key);
+      }
+    }
+
+    item = s->fds + fd;
+    if (!ITEM_USED(item) || item->gen != gen) {
+      continue;
+    }
+    if (writable && (OP_WRITE & item->interest)) {
+      if (0 == item->handler->handle_write) {
+        assert(("OP_WRITE arrived but no handler. bug!" == 0));
+      } else {
+        item->handler->handle_write(&key);
+      }
+    }
+  }
+}
+
+static int timespec_to_ms(const struct timespec *t) {
+  return (int)(t->tv_sec * 1000 + t->tv_nsec / 1000000);
+}
+
+/**
+ * retira la próxima completion a despachar: primero las que guardó
+ * `uring_drain', luego las del anillo.
+ */
+static bool uring_next(fd_selector s, uint64_t *user_data, int32_t *res) {
+  if (s->stash_head < s->stash_len) {
+    *user_data = s->stash[s->stash_head].user_data;
+    *res = s->stash[s->stash_head].res;
+    if (++s->stash_head == s->stash_len) {
+      s->stash_head = s->stash_len = 0;
+    }
+    return true;
+  }
+  struct io_uring_cqe *cqe = uring_peek_cqe(&s->ring);
+  if (cqe == NULL) {
+    return false;
+  }
+  *user_data = cqe->user_data;
+  *res = cqe->res;
+  uring_cqe_seen(&s->ring);
+  return true;
+}
+
+/** presenta a los handlers un poll que completó */
+static void uring_dispatch_poll(fd_selector s, const int fd,
+                                const uint32_t gen, const int32_t res) {
+  struct item *item = s->fds + fd;
+  if (res == -ECANCELED || !ITEM_USED(item) || item->gen != gen) {
+    return; // completion de un poll ya cancelado
+  }
+  // el poll era de un solo disparo
+  item->registered = OP_NOOP;
+
+  // un error (por ejemplo, EBADF) se presenta como listo para todo: el
+  // handler se enterará al operar.
+  const unsigned mask = res < 0 ? (POLLIN | POLLOUT) : (unsigned)res;
+  const bool readable = mask & (POLLIN | POLLHUP | POLLERR);
+  const bool writable = mask & (POLLOUT | POLLHUP | POLLERR);
+
+  struct selector_key key = {
+      .s = s,
+      .fd = item->fd,
+      .data = item->data,
+  };
+  if (readable && (OP_READ & item->interest)) {
+    if (0 == item->handler->handle_read) {
+      assert(("OP_READ arrived but no handler. bug!" == 0));
+    } else {
+      item->handler->handle_read(&key);
+    }
+  }
+
+  item = s->fds + fd;
+  if (!ITEM_USED(item) || item->gen != gen) {
+    return;
+  }
+  if (writable && (OP_WRITE & item->interest)) {
+    if (0 == item->handler->handle_write) {
+      assert(("OP_WRITE arrived but no handler. bug!" == 0));
+    } else {
+      item->handler->handle_write(&key);
+    }
+  }
+
+  // rearmamos si los handlers no cambiaron el interés (si lo cambiaron,
+  // ya quedó armado con el nuevo interés)
+  item = s->fds + fd;
+  if (ITEM_USED(item)) {
+    items_update_uring_for_fd(s, item);
+  }
+}
+
+/** presenta a los handlers un recv o send que completó */
+static void uring_dispatch_op(fd_selector s, const int fd,
+                              const enum uring_op op, const int32_t res) {
+  struct item *item = s->fds + fd;
+  if (!ITEM_USED(item) || !(item->inflight & URING_OP_BIT(op))) {
+    return;
+  }
+  item->inflight &= ~URING_OP_BIT(op);
+
+  struct selector_key key = {
+      .s = s,
+      .fd = item->fd,
+      .data = item->data,
+  };
+  void (*handler)(struct selector_key *, ssize_t) =
+      op == URING_RECV ? item->handler->handle_recv
+                       : item->handler->handle_send;
+  if (0 == handler) {
+    assert(("completion arrived but no handler. bug!" == 0));
+  } else {
+    handler(&key, res);
+  }
+}
+
+/**
+ * despacha las completions de io_uring. Igual que con epoll el costo es
+ * proporcional a la cantidad de fds listos; además se procesan todas las
+ * completions disponibles en tanda sin volver al kernel.
+ */
+static void handle_iteration_uring(fd_selector s) {
+  uint64_t u64;
+  int32_t res;
+  while (uring_next(s, &u64, &res)) {
+    if (u64 == URING_IGNORE) {
+      continue;
+    }
+    const int fd = (int)(u64 & URING_FD_MASK);
+    const enum uring_op op = (u64 >> URING_OP_SHIFT) & 3;
+    if ((size_t)fd >= s->fd_size) {
+      continue;
+    }
+    if (op == URING_POLL) {
+      uring_dispatch_poll(s, fd, (uint32_t)(u64 >> 32), res);
+    } else {
+      uring_dispatch_op(s, fd, op, res);
+    }
+  }
+}
+
+static selector_status selector_select_uring(fd_selector s) {
+  selector_status ret = SELECTOR_SUCCESS;
+
+  s->selector_thread = pthread_self();
+
+  wait_timeout(s);
+  if (s->stash_head < s->stash_len) {
+    // quedan completions guardadas: solo recogemos lo que ya esté listo
+    s->slave_t.tv_sec = 0;
+    s->slave_t.tv_nsec = 0;
+  }
+  const int rc = uring_wait(&s->ring, &s->slave_t, &emptyset);
+  s->now = monotonic_ms();
+  if (-1 == rc) {
+    if (errno != EINTR && errno != EAGAIN && errno != ETIME &&
+        errno != EBUSY) {
+      ret = SELECTOR_IO;
+    }
+  }
+  if (ret == SELECTOR_SUCCESS) {
+    handle_iteration_uring(s);
+  }
+  return ret;
+}
+
+static selector_status selector_select_epoll(fd_selector s) {
+  selector_status ret = SELECTOR_SUCCESS;
+
+  s->selector_thread = pthread_self();
+
+  wait_timeout(s);
+  const int n = epoll_pwait(s->epfd, s->events, EPOLL_MAX_EVENTS,
+                            timespec_to_ms(&s->slave_t), &emptyset);
+  s->now = monotonic_ms();
+  if (-1 == n) {
+    if (errno != EINTR && errno != EAGAIN) {
+      ret = SELECTOR_IO;
+    }
+  } else {
+    handle_iteration_epoll(s, n);
+  }
+  return ret;
+}
+#endif
+
 static void handle_block_notifications(fd_selector s) {
   struct selector_key key = {
       .s = s,
   };
+  // tomamos la lista entera y la procesamos sin el lock, así los hilos que
+  // notifican no esperan a los handlers
   pthread_mutex_lock(&s->resolution_mutex);
   struct blocking_job *j = s->resolution_jobs;
-  while (j != NULL) {
+  s->resolution_jobs = 0;
+  pthread_mutex_unlock(&s->resolution_mutex);
 
-    struct item *item = s->fds + j->fd;
-    if (ITEM_USED(item)) {
-      key.fd = item->fd;
-      key.data = item->data;
-      item->handler->handle_block(&key);
+  while (j != NULL) {
+    // el fd pudo cerrarse (o reutilizarse) mientras se resolvía el trabajo
+    if (j->fd >= 0 && (size_t)j->fd < s->fd_size) {
+      struct item *item = s->fds + j->fd;
+      if (ITEM_USED(item) && item->handler->handle_block != NULL) {
+        key.fd = item->fd;
+        key.data = item->data;
+        item->handler->handle_block(&key);
+      }
     }
 
     struct blocking_job *aux = j;
     j = j->next;
     free(aux);
   }
-  s->resolution_jobs = 0;
-  pthread_mutex_unlock(&s->resolution_mutex);
 }
 
 selector_status selector_notify_block(fd_selector s, const int fd) {
@@ -510,14 +1263,27 @@ finally:
 selector_status selector_select(fd_selector s) {
   selector_status ret = SELECTOR_SUCCESS;
 
+#ifdef __linux__
+  if (s->backend != SELECTOR_BACKEND_SELECT) {
+    ret = s->backend == SELECTOR_BACKEND_EPOLL ? selector_select_epoll(s)
+                                               : selector_select_uring(s);
+    if (ret == SELECTOR_SUCCESS) {
+      handle_block_notifications(s);
+      handle_timeouts(s);
+    }
+    return ret;
+  }
+#endif
+
   memcpy(&s->slave_r, &s->master_r, sizeof(s->slave_r));
   memcpy(&s->slave_w, &s->master_w, sizeof(s->slave_w));
-  memcpy(&s->slave_t, &s->master_t, sizeof(s->slave_t));
+  wait_timeout(s);
 
   s->selector_thread = pthread_self();
 
   int fds = pselect(s->max_fd + 1, &s->slave_r, &s->slave_w, 0, &s->slave_t,
                     &emptyset);
+  s->now = monotonic_ms();
   if (-1 == fds) {
     switch (errno) {
     case EAGAIN:
@@ -545,6 +1311,7 @@ selector_status selector_select(fd_selector s) {
   }
   if (ret == SELECTOR_SUCCESS) {
     handle_block_notifications(s);
+    handle_timeouts(s);
   }
 finally:
   return ret;
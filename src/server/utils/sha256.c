@@ -0,0 +1,235 @@
+/**
+ * sha256.c - SHA-256, HMAC-SHA256 y PBKDF2-HMAC-SHA256.
+ */
+#include <string.h>
+
+#include "include/sha256.h"
+
+static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static const uint32_t H0[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static uint32_t load_be32(const uint8_t *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+         (uint32_t)p[3];
+}
+
+static void store_be32(uint8_t *p, uint32_t v) {
+  p[0] = (uint8_t)(v >> 24);
+  p[1] = (uint8_t)(v >> 16);
+  p[2] = (uint8_t)(v >> 8);
+  p[3] = (uint8_t)v;
+}
+
+/** procesa un bloque de 64 bytes */
+static void compress(uint32_t state[8], const uint8_t block[64]) {
+  uint32_t w[64];
+  for (unsigned i = 0; i < 16; i++) {
+    w[i] = load_be32(block + 4 * i);
+  }
+  for (unsigned i = 16; i < 64; i++) {
+    const uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^
+                        (w[i - 15] >> 3);
+    const uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^
+                        (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+
+  uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+  uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+  for (unsigned i = 0; i < 64; i++) {
+    const uint32_t t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) +
+                        ((e & f) ^ (~e & g)) + K[i] + w[i];
+    const uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) +
+                        ((a & b) ^ (a & c) ^ (b & c));
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+  state[5] += f;
+  state[6] += g;
+  state[7] += h;
+}
+
+void sha256_init(struct sha256 *ctx) {
+  memcpy(ctx->state, H0, sizeof(H0));
+  ctx->length = 0;
+  ctx->used = 0;
+}
+
+void sha256_update(struct sha256 *ctx, const void *data, size_t len) {
+  const uint8_t *p = data;
+  ctx->length += len;
+  if (ctx->used > 0) {
+    size_t n = SHA256_BLOCK_SIZE - ctx->used;
+    if (n > len) {
+      n = len;
+    }
+    memcpy(ctx->block + ctx->used, p, n);
+    ctx->used += n;
+    p += n;
+    len -= n;
+    if (ctx->used < SHA256_BLOCK_SIZE) {
+      return;
+    }
+    compress(ctx->state, ctx->block);
+    ctx->used = 0;
+  }
+  for (; len >= SHA256_BLOCK_SIZE; p += SHA256_BLOCK_SIZE,
+                                   len -= SHA256_BLOCK_SIZE) {
+    compress(ctx->state, p);
+  }
+  memcpy(ctx->block, p, len);
+  ctx->used = len;
+}
+
+void sha256_final(struct sha256 *ctx, uint8_t out[SHA256_DIGEST_SIZE]) {
+  const uint64_t bits = ctx->length * 8;
+  ctx->block[ctx->used++] = 0x80;
+  if (ctx->used > SHA256_BLOCK_SIZE - 8) {
+    memset(ctx->block + ctx->used, 0, SHA256_BLOCK_SIZE - ctx->used);
+    compress(ctx->state, ctx->block);
+    ctx->used = 0;
+  }
+  memset(ctx->block + ctx->used, 0, SHA256_BLOCK_SIZE - 8 - ctx->used);
+  store_be32(ctx->block + 56, (uint32_t)(bits >> 32));
+  store_be32(ctx->block + 60, (uint32_t)bits);
+  compress(ctx->state, ctx->block);
+  for (unsigned i = 0; i < 8; i++) {
+    store_be32(out + 4 * i, ctx->state[i]);
+  }
+}
+
+void sha256(const void *data, size_t len, uint8_t out[SHA256_DIGEST_SIZE]) {
+  struct sha256 ctx;
+  sha256_init(&ctx);
+  sha256_update(&ctx, data, len);
+  sha256_final(&ctx, out);
+}
+
+// =============================================================================
+// HMAC
+// =============================================================================
+
+/**
+ * deja en `inner' y `outer' el estado tras procesar la clave con ipad y
+ * opad, que es lo único que depende de ella
+ */
+static void hmac_prepare(const void *key, size_t key_len, struct sha256 *inner,
+                         struct sha256 *outer) {
+  uint8_t k[SHA256_BLOCK_SIZE] = {0};
+  if (key_len > SHA256_BLOCK_SIZE) {
+    sha256(key, key_len, k);
+  } else {
+    memcpy(k, key, key_len);
+  }
+
+  uint8_t pad[SHA256_BLOCK_SIZE];
+  for (unsigned i = 0; i < SHA256_BLOCK_SIZE; i++) {
+    pad[i] = k[i] ^ 0x36;
+  }
+  sha256_init(inner);
+  sha256_update(inner, pad, sizeof(pad));
+  for (unsigned i = 0; i < SHA256_BLOCK_SIZE; i++) {
+    pad[i] = k[i] ^ 0x5c;
+  }
+  sha256_init(outer);
+  sha256_update(outer, pad, sizeof(pad));
+}
+
+void hmac_sha256(const void *key, size_t key_len, const void *msg,
+                 size_t msg_len, uint8_t out[SHA256_DIGEST_SIZE]) {
+  struct sha256 inner, outer;
+  hmac_prepare(key, key_len, &inner, &outer);
+  sha256_update(&inner, msg, msg_len);
+  sha256_final(&inner, out);
+  sha256_update(&outer, out, SHA256_DIGEST_SIZE);
+  sha256_final(&outer, out);
+}
+
+// =============================================================================
+// PBKDF2
+// =============================================================================
+
+/**
+ * Cada iteración es un HMAC de 32 bytes: tanto el hash interno como el
+ * externo son un único bloque (digest, relleno y largo de 64 + 32 bytes),
+ * así que se arman una vez y se comprimen directo sobre los estados
+ * precalculados de la clave, sin pasar por sha256_update().
+ */
+void pbkdf2_sha256(const void *pass, size_t pass_len, const void *salt,
+                   size_t salt_len, uint32_t iterations, uint8_t *out,
+                   size_t out_len) {
+  struct sha256 inner, outer;
+  hmac_prepare(pass, pass_len, &inner, &outer);
+
+  uint8_t block[SHA256_BLOCK_SIZE] = {0};
+  block[SHA256_DIGEST_SIZE] = 0x80;
+  store_be32(block + 60, (SHA256_BLOCK_SIZE + SHA256_DIGEST_SIZE) * 8);
+
+  for (uint32_t index = 1; out_len > 0; index++) {
+    // U1 = HMAC(pass, salt || INT(index))
+    uint8_t be_index[4], u[SHA256_DIGEST_SIZE], t[SHA256_DIGEST_SIZE];
+    store_be32(be_index, index);
+    struct sha256 ctx = inner;
+    sha256_update(&ctx, salt, salt_len);
+    sha256_update(&ctx, be_index, sizeof(be_index));
+    sha256_final(&ctx, u);
+    ctx = outer;
+    sha256_update(&ctx, u, sizeof(u));
+    sha256_final(&ctx, u);
+    memcpy(t, u, sizeof(t));
+
+    // Uj = HMAC(pass, Uj-1), T = U1 ^ U2 ^ ...
+    for (uint32_t j = 1; j < iterations; j++) {
+      uint32_t state[8];
+      memcpy(block, u, sizeof(u));
+      memcpy(state, inner.state, sizeof(state));
+      compress(state, block);
+      for (unsigned i = 0; i < 8; i++) {
+        store_be32(block + 4 * i, state[i]);
+      }
+      memcpy(state, outer.state, sizeof(state));
+      compress(state, block);
+      for (unsigned i = 0; i < 8; i++) {
+        store_be32(u + 4 * i, state[i]);
+        t[4 * i] ^= u[4 * i];
+        t[4 * i + 1] ^= u[4 * i + 1];
+        t[4 * i + 2] ^= u[4 * i + 2];
+        t[4 * i + 3] ^= u[4 * i + 3];
+      }
+    }
+
+    const size_t n = out_len < sizeof(t) ? out_len : sizeof(t);
+    memcpy(out, t, n);
+    out += n;
+    out_len -= n;
+  }
+}
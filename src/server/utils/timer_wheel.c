@@ -0,0 +1,166 @@
+/**
+ * timer_wheel.c - rueda de temporizadores jerárquica.
+ */
+#include <string.h>
+
+#include "include/timer_wheel.h"
+
+#define MASK (TIMER_WHEEL_SLOTS - 1)
+
+/** bits de tiempo que descarta el índice de `level' */
+#define SHIFT(level) ((level) * TIMER_WHEEL_BITS)
+
+/** alcance de la rueda: ningún vencimiento se ubica más allá */
+#define SPAN ((uint64_t)1 << SHIFT(TIMER_WHEEL_LEVELS))
+
+void timer_wheel_init(struct timer_wheel *w, uint64_t now) {
+  memset(w, 0, sizeof(*w));
+  w->now = now;
+}
+
+void timer_init(struct timer *t) { memset(t, 0, sizeof(*t)); }
+
+bool timer_armed(const struct timer *t) { return t->armed; }
+
+/**
+ * ubica `t' según su vencimiento, nunca antes de `earliest' (que es el
+ * milisegundo actual en una cascada, cuya ranura se procesa a
+ * continuación, o el siguiente al agendar).
+ */
+static void wheel_link(struct timer_wheel *w, struct timer *t,
+                       uint64_t earliest) {
+  uint64_t expires = t->expires > earliest ? t->expires : earliest;
+  if (expires - w->now >= SPAN) {
+    // queda en el último nivel y se reubica al llegar su cascada
+    expires = w->now + SPAN - 1;
+  }
+
+  // el menor nivel que alcanza a cubrir la distancia
+  const uint64_t delta = expires - w->now;
+  unsigned level = 0;
+  while (delta >= (uint64_t)1 << SHIFT(level + 1)) {
+    level++;
+  }
+  const unsigned slot = (expires >> SHIFT(level)) & MASK;
+
+  t->level = level;
+  t->slot = slot;
+  t->prev = NULL;
+  t->next = w->slots[level][slot];
+  if (t->next != NULL) {
+    t->next->prev = t;
+  }
+  w->slots[level][slot] = t;
+  w->occupied[level] |= (uint64_t)1 << slot;
+}
+
+static void wheel_unlink(struct timer_wheel *w, struct timer *t) {
+  if (t->prev != NULL) {
+    t->prev->next = t->next;
+  } else {
+    w->slots[t->level][t->slot] = t->next;
+    if (t->next == NULL) {
+      w->occupied[t->level] &= ~((uint64_t)1 << t->slot);
+    }
+  }
+  if (t->next != NULL) {
+    t->next->prev = t->prev;
+  }
+  t->next = t->prev = NULL;
+}
+
+void timer_wheel_schedule(struct timer_wheel *w, struct timer *t,
+                          uint64_t expires) {
+  if (t->armed) {
+    wheel_unlink(w, t);
+  } else {
+    t->armed = true;
+    w->count++;
+  }
+  t->expires = expires;
+  wheel_link(w, t, w->now + 1);
+}
+
+void timer_wheel_cancel(struct timer_wheel *w, struct timer *t) {
+  if (!t->armed) {
+    return;
+  }
+  wheel_unlink(w, t);
+  t->armed = false;
+  w->count--;
+}
+
+/**
+ * cuántas ranuras después de `from' está la próxima ocupada de `bits'
+ * (entre 1 y TIMER_WHEEL_SLOTS; la propia `from' cuenta como la última).
+ * `bits' no puede ser 0.
+ */
+static unsigned next_occupied(uint64_t bits, unsigned from) {
+  const unsigned start = (from + 1) & MASK;
+  const uint64_t rotated =
+      start == 0 ? bits
+                 : (bits >> start) | (bits << (TIMER_WHEEL_SLOTS - start));
+  return (unsigned)__builtin_ctzll(rotated) + 1;
+}
+
+int64_t timer_wheel_next(const struct timer_wheel *w) {
+  if (w->count == 0) {
+    return -1;
+  }
+  uint64_t best = UINT64_MAX;
+  for (unsigned level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+    if (w->occupied[level] == 0) {
+      continue;
+    }
+    // una ranura se procesa cuando el tiempo llega a su comienzo
+    const uint64_t base = w->now >> SHIFT(level);
+    const unsigned k = next_occupied(w->occupied[level], base & MASK);
+    const uint64_t when = (base + k) << SHIFT(level);
+    if (when < best) {
+      best = when;
+    }
+  }
+  return (int64_t)(best - w->now);
+}
+
+/** redistribuye la ranura `slot' de `level' en los niveles inferiores */
+static void cascade(struct timer_wheel *w, unsigned level, unsigned slot) {
+  struct timer *t = w->slots[level][slot];
+  w->slots[level][slot] = NULL;
+  w->occupied[level] &= ~((uint64_t)1 << slot);
+  while (t != NULL) {
+    struct timer *next = t->next;
+    wheel_link(w, t, w->now);
+    t = next;
+  }
+}
+
+void timer_wheel_advance(struct timer_wheel *w, uint64_t now,
+                         void (*expired)(struct timer *t, void *data),
+                         void *data) {
+  while (w->now < now) {
+    // saltamos de una los milisegundos en los que no hay nada que hacer
+    const int64_t wait = timer_wheel_next(w);
+    if (wait < 0 || w->now + (uint64_t)wait > now) {
+      w->now = now;
+      break;
+    }
+    w->now += (uint64_t)wait;
+
+    for (unsigned level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+      if ((w->now & (((uint64_t)1 << SHIFT(level)) - 1)) != 0) {
+        break;
+      }
+      cascade(w, level, (w->now >> SHIFT(level)) & MASK);
+    }
+
+    // `expired' puede agendar o cancelar temporizadores (incluso de esta
+    // misma ranura), así que tomamos de a uno
+    struct timer **slot = &w->slots[0][w->now & MASK];
+    struct timer *t;
+    while ((t = *slot) != NULL) {
+      timer_wheel_cancel(w, t);
+      expired(t, data);
+    }
+  }
+}
@@ -0,0 +1,76 @@
+/**
+ * token_bucket.c - limitador de tasa por balde de tokens.
+ */
+#include "include/token_bucket.h"
+
+/** agrega los tokens acumulados desde el último reabastecimiento */
+static void refill(struct token_bucket *b, uint64_t now) {
+  if (now <= b->last) {
+    return;
+  }
+  const uint64_t elapsed = now - b->last;
+  const uint64_t cap = b->burst * 1000;
+  b->last = now;
+  // con mucho tiempo de por medio el producto podría desbordar
+  if (elapsed > cap / b->rate) {
+    b->tokens = cap;
+    return;
+  }
+  b->tokens += elapsed * b->rate;
+  if (b->tokens > cap) {
+    b->tokens = cap;
+  }
+}
+
+void token_bucket_init(struct token_bucket *b, uint64_t rate, uint64_t burst,
+                       uint64_t now) {
+  b->rate = rate;
+  b->burst = burst;
+  b->tokens = burst * 1000;
+  b->last = now;
+}
+
+void token_bucket_set_rate(struct token_bucket *b, uint64_t rate,
+                           uint64_t burst, uint64_t now) {
+  if (b->rate == 0) {
+    token_bucket_init(b, rate, burst, now);
+    return;
+  }
+  refill(b, now);
+  b->rate = rate;
+  b->burst = burst;
+  if (b->tokens > burst * 1000) {
+    b->tokens = burst * 1000;
+  }
+}
+
+uint64_t token_bucket_take(struct token_bucket *b, uint64_t now,
+                           uint64_t max) {
+  if (b->rate == 0) {
+    return max;
+  }
+  refill(b, now);
+  const uint64_t available = b->tokens / 1000;
+  const uint64_t granted = available < max ? available : max;
+  b->tokens -= granted * 1000;
+  return granted;
+}
+
+void token_bucket_refund(struct token_bucket *b, uint64_t n) {
+  if (b->rate == 0) {
+    return;
+  }
+  const uint64_t cap = b->burst * 1000;
+  b->tokens = n > (cap - b->tokens) / 1000 ? cap : b->tokens + n * 1000;
+}
+
+uint64_t token_bucket_wait(const struct token_bucket *b, uint64_t n) {
+  if (b->rate == 0) {
+    return 0;
+  }
+  const uint64_t need = (n < b->burst ? n : b->burst) * 1000;
+  if (b->tokens >= need) {
+    return 0;
+  }
+  return (need - b->tokens + b->rate - 1) / b->rate;
+}
@@ -0,0 +1,182 @@
+/**
+ * uring.c - envoltorio mínimo de io_uring(7) sin depender de liburing.
+ */
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE // syscall(2)
+#endif
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "include/uring.h"
+
+/** características del kernel sin las cuales no usamos io_uring */
+#define URING_REQUIRED_FEATURES                                                \
+  (IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG)
+
+static int sys_setup(unsigned entries, struct io_uring_params *p) {
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete,
+                     unsigned flags, const void *arg, size_t argsz) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                      arg, argsz);
+}
+
+int uring_init(struct uring *r, unsigned entries) {
+  memset(r, 0, sizeof(*r));
+  r->fd = -1;
+
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  // las completions pendientes pueden superar a los SQEs en vuelo
+  p.flags = IORING_SETUP_CQSIZE;
+  p.cq_entries = entries * 4;
+
+  const int fd = sys_setup(entries, &p);
+  if (fd < 0) {
+    return -1;
+  }
+  if ((p.features & URING_REQUIRED_FEATURES) != URING_REQUIRED_FEATURES) {
+    close(fd);
+    errno = ENOSYS;
+    return -1;
+  }
+  r->fd = fd;
+
+  // con IORING_FEAT_SINGLE_MMAP ambos anillos comparten un mapeo
+  const size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  const size_t cq_len =
+      p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  r->ring_len = sq_len > cq_len ? sq_len : cq_len;
+  r->ring_ptr = mmap(NULL, r->ring_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (r->ring_ptr == MAP_FAILED) {
+    r->ring_ptr = NULL;
+    goto fail;
+  }
+
+  r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED) {
+    r->sqes = NULL;
+    goto fail;
+  }
+
+  char *ring = r->ring_ptr;
+  r->sq_head = (unsigned *)(ring + p.sq_off.head);
+  r->sq_tail = (unsigned *)(ring + p.sq_off.tail);
+  r->sq_mask = (unsigned *)(ring + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *)(ring + p.sq_off.array);
+  r->cq_head = (unsigned *)(ring + p.cq_off.head);
+  r->cq_tail = (unsigned *)(ring + p.cq_off.tail);
+  r->cq_mask = (unsigned *)(ring + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+
+  // el array de indirección queda fijo: la entrada i usa el SQE i
+  for (unsigned i = 0; i < p.sq_entries; i++) {
+    r->sq_array[i] = i;
+  }
+  return 0;
+
+fail:
+  uring_close(r);
+  return -1;
+}
+
+void uring_close(struct uring *r) {
+  if (r->sqes != NULL) {
+    munmap(r->sqes, r->sqes_len);
+    r->sqes = NULL;
+  }
+  if (r->ring_ptr != NULL) {
+    munmap(r->ring_ptr, r->ring_len);
+    r->ring_ptr = NULL;
+  }
+  if (r->fd >= 0) {
+    close(r->fd);
+    r->fd = -1;
+  }
+}
+
+/** SQEs publicados que el kernel todavía no consumió */
+static unsigned uring_pending(struct uring *r) {
+  return *r->sq_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+}
+
+/** envía al kernel los SQEs pendientes, sin esperar completions */
+static int uring_flush(struct uring *r) {
+  unsigned pending;
+  while ((pending = uring_pending(r)) > 0) {
+    if (sys_enter(r->fd, pending, 0, 0, NULL, 0) < 0 && errno != EINTR) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *r) {
+  const unsigned mask = *r->sq_mask;
+  unsigned tail = *r->sq_tail;
+  unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+
+  if (tail - head > mask) {
+    // cola llena: enviamos lo acumulado para hacer lugar
+    if (uring_flush(r) < 0) {
+      return NULL;
+    }
+    head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (tail - head > mask) {
+      return NULL;
+    }
+  }
+
+  struct io_uring_sqe *sqe = r->sqes + (tail & mask);
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+void uring_commit_sqe(struct uring *r) {
+  // el release ordena el contenido del SQE antes del tail: con SQPOLL el
+  // kernel puede tomarlo en cuanto lo ve, sin esperar a io_uring_enter(2).
+  __atomic_store_n(r->sq_tail, *r->sq_tail + 1, __ATOMIC_RELEASE);
+}
+
+int uring_wait(struct uring *r, const struct timespec *timeout,
+               const sigset_t *mask) {
+  struct __kernel_timespec ts = {
+      .tv_sec = timeout->tv_sec,
+      .tv_nsec = timeout->tv_nsec,
+  };
+  struct io_uring_getevents_arg arg = {
+      .sigmask = (uintptr_t)mask,
+      .sigmask_sz = _NSIG / 8,
+      .ts = (uintptr_t)&ts,
+  };
+
+  // si nos interrumpe una señal los SQEs igual quedan enviados: el kernel
+  // avanza sq_head por lo que consumió.
+  return sys_enter(r->fd, uring_pending(r), 1,
+                   IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg,
+                   sizeof(arg)) < 0
+             ? -1
+             : 0;
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *r) {
+  const unsigned head = *r->cq_head;
+  if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+    return NULL;
+  }
+  return r->cqes + (head & *r->cq_mask);
+}
+
+void uring_cqe_seen(struct uring *r) {
+  __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,113 @@
+#include "shaper.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdlib.h>
+
+bool shaper_parse_rate(const char *s, uint64_t *rate) {
+  if (!isdigit((unsigned char)*s)) {
+    return false;
+  }
+  char *end;
+  errno = 0;
+  const unsigned long long n = strtoull(s, &end, 10);
+  unsigned shift = 0;
+  switch (toupper((unsigned char)*end)) {
+    case 'G':
+      shift += 10;
+      // fall through
+    case 'M':
+      shift += 10;
+      // fall through
+    case 'K':
+      shift += 10;
+      end++;
+      break;
+    default:
+      break;
+  }
+  if (*end != '\0' || errno == ERANGE || n > SHAPER_MAX_RATE >> shift) {
+    return false;
+  }
+  *rate = (uint64_t)n << shift;
+  return true;
+}
+
+static uint64_t burst(uint64_t rate) {
+  const uint64_t b = rate * SHAPER_BURST_MS / 1000;
+  return b > SHAPER_MIN_BURST ? b : SHAPER_MIN_BURST;
+}
+
+// What a paused direction waits for
+static uint64_t tick(const struct token_bucket *b) {
+  const uint64_t n = b->rate * SHAPER_TICK_MS / 1000;
+  return n > 0 ? n : 1;
+}
+
+void shaper_init(struct shaper *s, uint64_t rate, uint64_t now_ms) {
+  token_bucket_init(&s->bucket, rate, burst(rate), now_ms);
+}
+
+void shaper_shared_init(struct shaper_shared *s) {
+  pthread_mutex_init(&s->lock, NULL);
+  s->limited = false;
+  token_bucket_init(&s->bucket, 0, 0, 0);
+}
+
+void shaper_shared_set_rate(struct shaper_shared *s, uint64_t rate,
+                            uint64_t now_ms) {
+  pthread_mutex_lock(&s->lock);
+  if (rate != s->bucket.rate) {
+    token_bucket_set_rate(&s->bucket, rate, burst(rate), now_ms);
+  }
+  __atomic_store_n(&s->limited, rate > 0, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&s->lock);
+}
+
+void shaper_shared_destroy(struct shaper_shared *s) {
+  pthread_mutex_destroy(&s->lock);
+}
+
+static bool shared_limited(const struct shaper_shared *s) {
+  return s != NULL && __atomic_load_n(&s->limited, __ATOMIC_RELAXED);
+}
+
+bool shaper_limited(const struct shaper *own,
+                    const struct shaper_shared *shared) {
+  return own->bucket.rate > 0 || shared_limited(shared);
+}
+
+size_t shaper_take(struct shaper *own, struct shaper_shared *shared,
+                   uint64_t now_ms, size_t max, uint64_t *wait_ms) {
+  uint64_t granted = token_bucket_take(&own->bucket, now_ms, max);
+  if (granted == 0) {
+    *wait_ms = token_bucket_wait(&own->bucket, tick(&own->bucket));
+    return 0;
+  }
+  if (!shared_limited(shared)) {
+    return granted;
+  }
+
+  pthread_mutex_lock(&shared->lock);
+  const uint64_t allowed = token_bucket_take(&shared->bucket, now_ms, granted);
+  if (allowed == 0) {
+    *wait_ms = token_bucket_wait(&shared->bucket, tick(&shared->bucket));
+  }
+  pthread_mutex_unlock(&shared->lock);
+
+  token_bucket_refund(&own->bucket, granted - allowed);
+  return allowed;
+}
+
+void shaper_refund(struct shaper *own, struct shaper_shared *shared,
+                   size_t n) {
+  if (n == 0) {
+    return;
+  }
+  token_bucket_refund(&own->bucket, n);
+  if (shared_limited(shared)) {
+    pthread_mutex_lock(&shared->lock);
+    token_bucket_refund(&shared->bucket, n);
+    pthread_mutex_unlock(&shared->lock);
+  }
+}
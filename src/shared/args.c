@@ -2,11 +2,17 @@
 
 #include <errno.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <limits.h> /* LONG_MIN et al */
 #include <stdio.h>  /* for printf */
 #include <stdlib.h> /* for exit */
 #include <string.h> /* memset */
 
+#include "admission.h"
+#include "metrics_http.h"
+#include "shaper.h"
+#include "user_db.h"
+
 static unsigned short port(const char* s) {
   char* end = 0;
   const long sl = strtol(s, &end, 10);
@@ -21,20 +27,153 @@ static unsigned short port(const char* s) {
   return (unsigned short)sl;
 }
 
-static void user(char* s, struct users* user) {
-  char* p = strchr(s, ':');
+static void user(const char* s) {
+  const char* p = strchr(s, ':');
   if (p == NULL) {
     fprintf(stderr, "password not found\n");
     exit(1);
-  } else {
-    *p = 0;
-    p++;
-    user->name = s;
-    user->pass = p;
-    user->from_cmd = true;
   }
+  switch (user_db_add(s, p - s, p + 1)) {
+    case USER_DB_OK:
+      break;
+    case USER_DB_EXISTS:
+      fprintf(stderr, "user given twice: %.*s\n", (int)(p - s), s);
+      exit(1);
+    case USER_DB_BAD_HASH:
+      fprintf(stderr, "malformed password hash for user: %.*s\n",
+              (int)(p - s), s);
+      exit(1);
+    default:
+      fprintf(stderr, "no memory for user: %.*s\n", (int)(p - s), s);
+      exit(1);
+  }
+}
+
+#define MAX_WORKERS 64
+
+static unsigned workers(const char* s) {
+  char* end = 0;
+  errno = 0;
+  const long sl = strtol(s, &end, 10);
+
+  if (end == s || '\0' != *end || ERANGE == errno || sl < 1 ||
+      sl > MAX_WORKERS) {
+    fprintf(stderr, "workers should be in the range of 1-%d: %s\n",
+            MAX_WORKERS, s);
+    exit(1);
+  }
+  return (unsigned)sl;
+}
+
+#define MIN_RELAY_BUFFER (4 * 1024)
+#define MAX_RELAY_BUFFER (4 * 1024 * 1024)
+#define DEFAULT_RELAY_BUFFER_MAX (128 * 1024)
+
+static size_t buffer_size(const char* s) {
+  char* end = 0;
+  errno = 0;
+  const long sl = strtol(s, &end, 10);
+
+  if (end == s || '\0' != *end || ERANGE == errno || sl < MIN_RELAY_BUFFER ||
+      sl > MAX_RELAY_BUFFER) {
+    fprintf(stderr, "buffer size should be in the range of %d-%d: %s\n",
+            MIN_RELAY_BUFFER, MAX_RELAY_BUFFER, s);
+    exit(1);
+  }
+  return (size_t)sl;
+}
+
+#define MAX_TIMEOUT 86400
+
+static unsigned timeout(const char* s) {
+  char* end = 0;
+  errno = 0;
+  const long sl = strtol(s, &end, 10);
+
+  if (end == s || '\0' != *end || ERANGE == errno || sl < 0 ||
+      sl > MAX_TIMEOUT) {
+    fprintf(stderr, "timeout should be in the range of 0-%d seconds: %s\n",
+            MAX_TIMEOUT, s);
+    exit(1);
+  }
+  return (unsigned)sl;
+}
+
+#define MAX_CAP 1000000
+
+static unsigned cap(const char* s) {
+  char* end = 0;
+  errno = 0;
+  const long sl = strtol(s, &end, 10);
+
+  if (end == s || '\0' != *end || ERANGE == errno || sl < 0 ||
+      sl > MAX_CAP) {
+    fprintf(stderr, "limit should be in the range of 0-%d: %s\n", MAX_CAP,
+            s);
+    exit(1);
+  }
+  return (unsigned)sl;
 }
 
+static uint32_t kdf_iterations(const char* s) {
+  char* end = 0;
+  errno = 0;
+  const long sl = strtol(s, &end, 10);
+
+  if (end == s || '\0' != *end || ERANGE == errno || sl < 1 ||
+      sl > USER_DB_MAX_ITERATIONS) {
+    fprintf(stderr, "KDF iterations should be in the range of 1-%d: %s\n",
+            USER_DB_MAX_ITERATIONS, s);
+    exit(1);
+  }
+  return (uint32_t)sl;
+}
+
+static uint64_t rate(const char* s) {
+  uint64_t r;
+  if (!shaper_parse_rate(s, &r)) {
+    fprintf(stderr,
+            "rate should be bytes per second, optionally with a K, M or G "
+            "suffix, up to %" PRIu64 ": %s\n",
+            SHAPER_MAX_RATE, s);
+    exit(1);
+  }
+  return r;
+}
+
+static bool access_log_binary(const char* s) {
+  if (strcmp(s, "text") == 0) {
+    return false;
+  }
+  if (strcmp(s, "binary") == 0) {
+    return true;
+  }
+  fprintf(stderr, "access log format should be text or binary: %s\n", s);
+  exit(1);
+}
+
+// opciones que solo tienen forma larga
+enum long_only_options {
+  OPT_IO_BACKEND = 0x100,
+  OPT_WORKERS,
+  OPT_BUFFER_MIN,
+  OPT_BUFFER_MAX,
+  OPT_HANDSHAKE_TIMEOUT,
+  OPT_CONNECT_TIMEOUT,
+  OPT_IDLE_TIMEOUT,
+  OPT_METRICS_ADDR,
+  OPT_METRICS_PORT,
+  OPT_METRICS_USERS,
+  OPT_ACCESS_LOG_FORMAT,
+  OPT_USERS_FILE,
+  OPT_KDF_ITERATIONS,
+  OPT_CONN_RATE,
+  OPT_USER_RATE,
+  OPT_MAX_CONNS,
+  OPT_MAX_CONNS_PER_IP,
+  OPT_MAX_USER_SESSIONS,
+};
+
 static void version(void) {
   fprintf(stderr,
           "socks5v version 0.0\n"
@@ -50,12 +189,88 @@ static void usage(const char* progname) {
       "   -h               Imprime la ayuda y termina.\n"
       "   -l <SOCKS addr>  Dirección donde servirá el proxy SOCKS.\n"
       "   -L <conf  addr>  Dirección donde servirá el servicio de management.\n"
+      "   -N               Deshabilita los disectores de credenciales. Los "
+      "túneles se\n"
+      "                    reenvían con splice(2), sin copiar a espacio de "
+      "usuario.\n"
       "   -p <SOCKS port>  Puerto entrante conexiones SOCKS.\n"
       "   -P <conf port>   Puerto entrante conexiones configuracion\n"
       "   -u <name>:<pass> Usuario y contraseña de usuario que puede usar el "
-      "proxy. Hasta 10.\n"
+      "proxy.\n"
       "   -v               Imprime información sobre la versión versión y "
       "termina.\n"
+      "   --io-backend <b> Multiplexor de I/O: epoll (default), io_uring o "
+      "select.\n"
+      "   --workers <n>    Cantidad de event loops en paralelo (default 1). "
+      "Con más\n"
+      "                    de uno cada worker escucha con SO_REUSEPORT.\n"
+      "   --buffer-min <n> Tamaño inicial y mínimo, en bytes, del buffer de "
+      "cada\n"
+      "                    sentido de un túnel (default 4096).\n"
+      "   --buffer-max <n> Tamaño máximo al que puede crecer ese buffer "
+      "(default\n"
+      "                    131072).\n"
+      "   --handshake-timeout <s>\n"
+      "                    Segundos para completar saludo, autenticación y "
+      "pedido\n"
+      "                    (default 10, 0 sin límite).\n"
+      "   --connect-timeout <s>\n"
+      "                    Segundos para resolver y conectar al origen "
+      "(default 30).\n"
+      "   --idle-timeout <s>\n"
+      "                    Segundos sin tráfico tras los que se cierra un túnel"
+      "\n"
+      "                    (default 300).\n"
+      "   --metrics-addr <addr>\n"
+      "                    Dirección del endpoint HTTP de métricas (default "
+      "127.0.0.1).\n"
+      "   --metrics-port <port>\n"
+      "                    Sirve /metrics en formato OpenMetrics en ese puerto"
+      "\n"
+      "                    (default deshabilitado).\n"
+      "   --metrics-users <n>\n"
+      "                    Usuarios, los primeros vistos, con series propias "
+      "en\n"
+      "                    /metrics (default 500, 0 ninguno).\n"
+      "   --users-file <archivo>\n"
+      "                    Agrega los usuarios del archivo, uno por línea "
+      "como\n"
+      "                    <name>:<pass>. Ignora líneas vacías y las que "
+      "empiezan\n"
+      "                    con '#'. La contraseña puede estar ya hasheada, "
+      "como\n"
+      "                    $pbkdf2-sha256$<iter>$<salt>$<hash>.\n"
+      "   --kdf-iterations <n>\n"
+      "                    Iteraciones de PBKDF2-SHA256 con que se hashean "
+      "las\n"
+      "                    contraseñas en texto plano (default 100000).\n"
+      "   --conn-rate <n>  Limita cada sentido de cada túnel a <n> bytes por "
+      "segundo.\n"
+      "                    Acepta los sufijos K, M y G (potencias de 1024). "
+      "Default\n"
+      "                    0, sin límite.\n"
+      "   --user-rate <n>  Idem, para el total de los túneles de cada "
+      "usuario. El\n"
+      "                    comando RATE de management lo cambia por "
+      "usuario.\n"
+      "   --max-conns <n>  Conexiones abiertas como máximo (default 500, 0 "
+      "sin\n"
+      "                    límite). Al llegar se deja de aceptar hasta que "
+      "se\n"
+      "                    libere alguna.\n"
+      "   --max-conns-per-ip <n>\n"
+      "                    Conexiones abiertas como máximo desde una misma "
+      "dirección\n"
+      "                    (default 0, sin límite).\n"
+      "   --max-user-sessions <n>\n"
+      "                    Sesiones abiertas como máximo por usuario "
+      "(default 0, sin\n"
+      "                    límite).\n"
+      "   --access-log-format <f>\n"
+      "                    text (default) escribe access.log; binary escribe "
+      "registros\n"
+      "                    de tamaño fijo en access.bin, legibles con "
+      "access_decode.\n"
 
       "\n",
       progname);
@@ -63,9 +278,7 @@ static void usage(const char* progname) {
 }
 
 void parse_args(const int argc, char** argv, struct socks5args* args) {
-  memset(
-      args, 0,
-      sizeof(*args));  // sobre todo para setear en null los punteros de users
+  memset(args, 0, sizeof(*args));
 
   args->socks_addr = "0.0.0.0";
   args->socks_port = 1080;
@@ -73,14 +286,57 @@ void parse_args(const int argc, char** argv, struct socks5args* args) {
   args->mng_addr = "127.0.0.1";
   args->mng_port = 8080;
 
+  args->metrics_addr = "127.0.0.1";
+  args->metrics_port = 0;
+  args->metrics_users = METRICS_HTTP_DEFAULT_USERS;
+
   args->disectors_enabled = true;
 
+  args->io_backend = "epoll";
+  args->workers = 1;
+  args->buffer_min = MIN_RELAY_BUFFER;
+  args->buffer_max = DEFAULT_RELAY_BUFFER_MAX;
+  args->handshake_timeout = 10;
+  args->connect_timeout = 30;
+  args->idle_timeout = 300;
+  args->max_conns = ADMISSION_DEFAULT_MAX_CONNS;
+
+  // -u y --users-file, en orden; se agregan al final
+  struct user_source {
+    bool file;
+    const char* arg;
+  }* users = calloc(argc, sizeof(*users));
+  int user_count = 0;
+  if (users == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+
   int c;
-  int nusers = 0;
 
   while (true) {
     int option_index = 0;
-    static struct option long_options[] = {{0, 0, 0, 0}};
+    static struct option long_options[] = {
+        {"io-backend", required_argument, 0, OPT_IO_BACKEND},
+        {"workers", required_argument, 0, OPT_WORKERS},
+        {"buffer-min", required_argument, 0, OPT_BUFFER_MIN},
+        {"buffer-max", required_argument, 0, OPT_BUFFER_MAX},
+        {"handshake-timeout", required_argument, 0, OPT_HANDSHAKE_TIMEOUT},
+        {"connect-timeout", required_argument, 0, OPT_CONNECT_TIMEOUT},
+        {"idle-timeout", required_argument, 0, OPT_IDLE_TIMEOUT},
+        {"metrics-addr", required_argument, 0, OPT_METRICS_ADDR},
+        {"metrics-port", required_argument, 0, OPT_METRICS_PORT},
+        {"metrics-users", required_argument, 0, OPT_METRICS_USERS},
+        {"access-log-format", required_argument, 0, OPT_ACCESS_LOG_FORMAT},
+        {"users-file", required_argument, 0, OPT_USERS_FILE},
+        {"kdf-iterations", required_argument, 0, OPT_KDF_ITERATIONS},
+        {"conn-rate", required_argument, 0, OPT_CONN_RATE},
+        {"user-rate", required_argument, 0, OPT_USER_RATE},
+        {"max-conns", required_argument, 0, OPT_MAX_CONNS},
+        {"max-conns-per-ip", required_argument, 0, OPT_MAX_CONNS_PER_IP},
+        {"max-user-sessions", required_argument, 0, OPT_MAX_USER_SESSIONS},
+        {0, 0, 0, 0},
+    };
 
     c = getopt_long(argc, argv, "hl:L:Np:P:u:v", long_options, &option_index);
     if (c == -1) break;
@@ -105,27 +361,84 @@ void parse_args(const int argc, char** argv, struct socks5args* args) {
         args->mng_port = port(optarg);
         break;
       case 'u':
-        if (nusers >= MAX_USERS) {
-          fprintf(stderr, "maximun number of command line users reached: %d.\n",
-                  MAX_USERS);
-          exit(1);
-        } else {
-          user(optarg, args->users + nusers);
-          nusers++;
-        }
+      case OPT_USERS_FILE:
+        users[user_count].file = c == OPT_USERS_FILE;
+        users[user_count++].arg = optarg;
         break;
       case 'v':
         version();
         exit(0);
+      case OPT_IO_BACKEND:
+        args->io_backend = optarg;
+        break;
+      case OPT_WORKERS:
+        args->workers = workers(optarg);
+        break;
+      case OPT_BUFFER_MIN:
+        args->buffer_min = buffer_size(optarg);
+        break;
+      case OPT_BUFFER_MAX:
+        args->buffer_max = buffer_size(optarg);
+        break;
+      case OPT_HANDSHAKE_TIMEOUT:
+        args->handshake_timeout = timeout(optarg);
+        break;
+      case OPT_CONNECT_TIMEOUT:
+        args->connect_timeout = timeout(optarg);
+        break;
+      case OPT_IDLE_TIMEOUT:
+        args->idle_timeout = timeout(optarg);
+        break;
+      case OPT_METRICS_ADDR:
+        args->metrics_addr = optarg;
+        break;
+      case OPT_METRICS_PORT:
+        args->metrics_port = port(optarg);
+        break;
+      case OPT_METRICS_USERS:
+        args->metrics_users = cap(optarg);
+        break;
+      case OPT_ACCESS_LOG_FORMAT:
+        args->access_log_binary = access_log_binary(optarg);
+        break;
+      case OPT_KDF_ITERATIONS:
+        user_db_set_iterations(kdf_iterations(optarg));
+        break;
+      case OPT_CONN_RATE:
+        args->conn_rate = rate(optarg);
+        break;
+      case OPT_USER_RATE:
+        user_db_set_default_rate(rate(optarg));
+        break;
+      case OPT_MAX_CONNS:
+        args->max_conns = cap(optarg);
+        break;
+      case OPT_MAX_CONNS_PER_IP:
+        args->max_conns_per_ip = cap(optarg);
+        break;
+      case OPT_MAX_USER_SESSIONS:
+        args->max_user_sessions = cap(optarg);
+        break;
       default:
         fprintf(stderr, "unknown argument %d.\n", c);
         exit(1);
     }
   }
 
-  args->user_count = nusers;
-  if (nusers > 0) {
-    args->auth_required = true;
+  // con las iteraciones ya definidas, sin importar el orden de las opciones
+  for (int i = 0; i < user_count; i++) {
+    if (!users[i].file) {
+      user(users[i].arg);
+    } else if (user_db_load(users[i].arg) < 0) {
+      exit(1);
+    }
+  }
+  free(users);
+
+  if (args->buffer_min > args->buffer_max) {
+    fprintf(stderr, "--buffer-min (%zu) is larger than --buffer-max (%zu)\n",
+            args->buffer_min, args->buffer_max);
+    exit(1);
   }
 
   if (optind < argc) {
@@ -2,14 +2,8 @@
 #define ARGS_H_kFlmYm1tW9p5npzDr2opQJ9jM8
 
 #include <stdbool.h>
-
-#define MAX_USERS 10
-
-struct users {
-  char* name;
-  char* pass;
-  bool from_cmd;
-};
+#include <stddef.h>
+#include <stdint.h>
 
 struct socks5args {
   char* socks_addr;
@@ -18,15 +12,60 @@ struct socks5args {
   char* mng_addr;
   unsigned short mng_port;
 
+  /** endpoint HTTP de métricas (OpenMetrics); puerto 0 lo deshabilita */
+  char* metrics_addr;
+  unsigned short metrics_port;
+  /** usuarios con series propias en /metrics; 0 no exporta ninguno */
+  unsigned metrics_users;
+
   bool disectors_enabled;
-  bool auth_required;
 
-  struct users users[MAX_USERS];
-  int user_count;
+  /** nombre del backend del selector ("epoll", "io_uring", "select") */
+  char* io_backend;
+
+  /** cantidad de event loops, cada uno en su propio thread */
+  unsigned workers;
+
+  /**
+   * límites entre los que se adapta el buffer de cada sentido de un túnel
+   * (ver socks5_copy.c)
+   */
+  size_t buffer_min;
+  size_t buffer_max;
+
+  /**
+   * segundos que puede durar la negociación (HELLO, AUTH y REQUEST), la
+   * conexión al origen (resolución incluida) y un túnel sin tráfico. 0 los
+   * deshabilita.
+   */
+  unsigned handshake_timeout;
+  unsigned connect_timeout;
+  unsigned idle_timeout;
+
+  /**
+   * bytes por segundo a los que se limita cada sentido de cada túnel; 0 es
+   * sin límite. El límite por usuario vive en user_db (ver shaper.h).
+   */
+  uint64_t conn_rate;
+
+  /**
+   * conexiones abiertas en total y desde una misma dirección, y sesiones
+   * abiertas por un mismo usuario; 0 es sin límite (ver admission.h)
+   */
+  unsigned max_conns;
+  unsigned max_conns_per_ip;
+  unsigned max_user_sessions;
+
+  /** access log en registros binarios (access.bin) en vez de texto */
+  bool access_log_binary;
 };
 
 extern struct socks5args socks5args;
 
+/**
+ * los usuarios de -u y --users-file quedan en user_db (ver user_db.h); un
+ * usuario repetido o un archivo inválido terminan el programa.
+ */
 void parse_args(const int argc, char** argv, struct socks5args* args);
 
 #endif
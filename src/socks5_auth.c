@@ -14,12 +14,16 @@
 #include <unistd.h>
 
 #include "args.h"
+#include "auth_parser.h"
 #include "selector.h"
 #include "socks5_internal.h"
 
 #include "metrics.h"
 
 #include "logger.h"
+#include "user_db.h"
+#include "user_stats.h"
+#include "verifier.h"
 
 extern struct socks5args socks5args;
 
@@ -31,55 +35,59 @@ void auth_read_init(const unsigned state, struct selector_key* key) {
   a->wb = &s->write_buffer;
   a->state = AUTH_VERSION;
   a->status = 0xFF;
-  buffer_reset(a->rb);
-  buffer_reset(a->wb);
+  // rb may already hold the credentials and wb the HELLO reply, see
+  // handshake_recv()
 }
 
-unsigned auth_read(struct selector_key* key) {
+// Reports the outcome of a complete request and sends the reply
+static unsigned auth_reply(struct selector_key* key, bool authenticated) {
   struct socks5* s = ATTACHMENT(key);
   struct auth_st* a = &s->client.auth;
-  size_t nbytes;
-  uint8_t* ptr = buffer_write_ptr(a->rb, &nbytes);
-  ssize_t n = recv(key->fd, ptr, nbytes, 0);
+  a->status = authenticated ? 0x00 : 0xFF;
 
-  if (n <= 0) return ERROR;
-  buffer_write_adv(a->rb, n);
-
-  // TODO: emprolijar
-  static uint8_t idx = 0;
-  while (buffer_can_read(a->rb) && a->state != AUTH_DONE &&
-         a->state != AUTH_ERROR) {
-    uint8_t byte = buffer_read(a->rb);
-    switch (a->state) {
-      case AUTH_VERSION:
-        a->state = (byte == 0x01) ? AUTH_ULEN : AUTH_ERROR;
-        break;
-      case AUTH_ULEN:
-        a->ulen = byte;
-        idx = 0;
-        a->state = (byte == 0) ? AUTH_ERROR : AUTH_UNAME;
-        break;
-      case AUTH_UNAME:
-        a->username[idx++] = byte;
-        if (idx >= a->ulen) {
-          a->username[idx] = 0;
-          a->state = AUTH_PLEN;
-        }
-        break;
-      case AUTH_PLEN:
-        a->plen = byte;
-        idx = 0;
-        a->state = (byte == 0) ? AUTH_ERROR : AUTH_PASSWD;
-        break;
-      case AUTH_PASSWD:
-        a->password[idx++] = byte;
-        if (idx >= a->plen) {
-          a->password[idx] = 0;
-          a->state = AUTH_DONE;
-        }
-        break;
+  if (authenticated) {
+    s->username = strdup(a->username);
+    s->user = user_stats_get(a->username);
+    if (user_stats_session_try_open(s->user, socks5args.max_user_sessions)) {
+      // Picks up --user-rate, or a RATE given before the user's first login
+      user_stats_set_rate(s->user, user_db_rate(a->username),
+                          selector_now(key->s));
+    } else {
+      // Refused once the request is in, with a reply that says why
+      s->user = NULL;
+      s->over_user_cap = true;
+      metrics_admission_rejected(METRICS_REJECTED_PER_USER);
+      LOG_WARNING("User '%s' is at its session limit\n", a->username);
     }
+    metrics_auth_success();
+    LOG_INFO("User '%s' authenticated\n", a->username);
+  } else {
+    // Only existing names get an entry, or anyone could make us keep one
+    // per made up name
+    if (a->known_user) {
+      user_stats_auth_failure(user_stats_get(a->username));
+    }
+    metrics_auth_failure();
+    LOG_WARNING("Auth failed for '%s'\n", a->username);
+  }
+
+  buffer_write(a->wb, 0x01);
+  buffer_write(a->wb, a->status);
+  if (authenticated && buffer_can_read(a->rb)) {
+    // The request is already here; this reply goes out with its own
+    selector_set_interest_key(key, OP_READ);
+    return REQUEST_READ;
   }
+  selector_set_interest_key(key, OP_WRITE);
+  return AUTH_WRITE;
+}
+
+unsigned auth_read(struct selector_key* key) {
+  struct socks5* s = ATTACHMENT(key);
+  struct auth_st* a = &s->client.auth;
+  if (!handshake_recv(key, a->rb)) return ERROR;
+
+  auth_consume(a);
 
   if (a->state == AUTH_ERROR) {
     buffer_write(a->wb, 0x01);
@@ -89,30 +97,32 @@ unsigned auth_read(struct selector_key* key) {
   }
 
   if (a->state == AUTH_DONE) {
-    a->status = 0xFF;
-    for (int i = 0; i < MAX_USERS && socks5args.users[i].name; i++) {
-      if (strcmp(a->username, socks5args.users[i].name) == 0 &&
-          strcmp(a->password, socks5args.users[i].pass) == 0) {
-        a->status = 0x00;
-        s->username = strdup(a->username);
-        metrics_auth_success();
-        LOG_INFO("User '%s' authenticated\n", a->username);
-        break;
-      }
-    }
-    if (a->status != 0x00) {
-      metrics_auth_failure();
-      LOG_WARNING("Auth failed for '%s'\n", a->username);
+    struct user_credential cred;
+    a->known_user = user_db_lookup(a->username, &cred);
+    s->verify_job = verifier_submit(key->s, key->fd, &cred, a->password);
+    memset(a->password, 0, sizeof(a->password));
+    if (s->verify_job == NULL) {
+      LOG_WARNING("Can't check the password of '%s' now\n", a->username);
+      return auth_reply(key, false);
     }
-
-    buffer_write(a->wb, 0x01);
-    buffer_write(a->wb, a->status);
-    selector_set_interest_key(key, OP_WRITE);
-    return AUTH_WRITE;
+    // Ready already on a cache hit
+    return auth_verifying(key);
   }
   return AUTH_READ;
 }
 
+unsigned auth_verifying(struct selector_key* key) {
+  struct socks5* s = ATTACHMENT(key);
+  bool authenticated;
+  if (!verifier_poll(s->verify_job, &authenticated)) {
+    // Nothing to read until the client knows the outcome
+    selector_set_interest_key(key, OP_NOOP);
+    return AUTH_VERIFYING;
+  }
+  s->verify_job = NULL;
+  return auth_reply(key, authenticated);
+}
+
 unsigned auth_write(struct selector_key* key) {
   struct socks5* s = ATTACHMENT(key);
   struct auth_st* a = &s->client.auth;
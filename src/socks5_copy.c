@@ -1,35 +1,426 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // splice(2), pipe2(2), F_SETPIPE_SZ
+#endif
+
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
+#include "args.h"
+#include "buffer_pool.h"
+#include "logger.h"
+#include "netutils.h"
+#include "pop3_sniffer.h"
 #include "selector.h"
 #include "socks5_internal.h"
 
 #include "metrics.h"
+#include "user_stats.h"
+
+extern struct socks5args socks5args;
+
+// =============================================================================
+// Relay primitives
+// =============================================================================
+
+// With dissectors disabled nobody needs to look at the payload, so each
+// direction is relayed through a pipe with splice(2) and the bytes never
+// reach user space. Otherwise (or if the pipes can't be created) they go
+// through the session buffers as usual.
+
+static bool splice_pipe_open(struct splice_pipe* p) {
+  int fds[2];
+  if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+    return false;
+  }
+  // Best effort: match the buffered path's window
+  fcntl(fds[1], F_SETPIPE_SZ, BUFFER_SIZE);
+  const int size = fcntl(fds[1], F_GETPIPE_SZ);
+
+  *p = (struct splice_pipe){
+      .rfd = fds[0],
+      .wfd = fds[1],
+      .len = 0,
+      .capacity = size > 0 ? (size_t)size : 65536,
+      .full = false,
+  };
+  return true;
+}
+
+static void splice_pipe_close(struct splice_pipe* p) {
+  close(p->rfd);
+  close(p->wfd);
+  p->rfd = p->wfd = -1;
+}
+
+// Relay buffers are borrowed from the pool when a direction has something
+// to carry and handed back as soon as it drains, so idle tunnels hold none.
+static bool relay_buffer_attach(struct copy_st* conn) {
+  buffer* b = conn->rb;
+  if (b->data != NULL) {
+    return true;
+  }
+  uint8_t* data = buffer_pool_get(conn->buffer_size);
+  if (data == NULL) {
+    return false;
+  }
+  buffer_init(b, conn->buffer_size, data);
+  metrics_relay_buffer_attached(conn->buffer_size);
+  return true;
+}
+
+static void relay_buffer_detach(buffer* b) {
+  if (b->data == NULL) {
+    return;
+  }
+  const size_t size = b->limit - b->data;
+  buffer_pool_put(b->data, size);
+  metrics_relay_buffer_detached(size);
+  memset(b, 0, sizeof(*b));
+}
+
+// Each direction starts at --buffer-min. Reads that keep filling the buffer
+// while the peer keeps up mean a bulk transfer, and double the next buffer
+// up to --buffer-max; a run of small reads (interactive traffic) halves it
+// back. A buffer in use is never resized, the new size applies the next
+// time one is borrowed, which for a busy direction is as soon as it drains.
+#define RELAY_GROW_AFTER 2   // full reads in a row
+#define RELAY_SHRINK_AFTER 8 // small reads in a row
+#define RELAY_SMALL_READ 8   // a read under 1/8 of the buffer is small
+
+static size_t relay_buffer_min(void) {
+  return socks5args.buffer_min > 0 ? socks5args.buffer_min
+                                   : BUFFER_POOL_MIN_SIZE;
+}
+
+static size_t relay_buffer_max(void) {
+  return socks5args.buffer_max > 0 ? socks5args.buffer_max : BUFFER_SIZE;
+}
+
+static void relay_buffer_resize(struct copy_st* conn, size_t size) {
+  metrics_relay_buffer_resized(conn->buffer_size, size);
+  conn->buffer_size = size;
+  conn->full_reads = conn->small_reads = 0;
+}
+
+static void relay_buffer_adapt(struct copy_st* conn, size_t n) {
+  const size_t size = conn->rb->limit - conn->rb->data;
+
+  if (!buffer_can_write(conn->rb)) {
+    conn->small_reads = 0;
+    // Growing doesn't help if the peer can't take what we already have
+    if (!conn->backpressure && ++conn->full_reads >= RELAY_GROW_AFTER &&
+        conn->buffer_size < relay_buffer_max()) {
+      const size_t grown = conn->buffer_size * 2;
+      relay_buffer_resize(conn, grown < relay_buffer_max() ? grown
+                                                           : relay_buffer_max());
+    }
+  } else if (n * RELAY_SMALL_READ < size) {
+    conn->full_reads = 0;
+    if (++conn->small_reads >= RELAY_SHRINK_AFTER &&
+        conn->buffer_size > relay_buffer_min()) {
+      const size_t shrunk = conn->buffer_size / 2;
+      relay_buffer_resize(conn, shrunk > relay_buffer_min()
+                                    ? shrunk
+                                    : relay_buffer_min());
+    }
+  } else {
+    conn->full_reads = conn->small_reads = 0;
+  }
+}
+
+void copy_close(struct socks5* s) {
+  if (s->relay_buffers) {
+    relay_buffer_detach(&s->read_buffer);
+    relay_buffer_detach(&s->write_buffer);
+    s->relay_buffers = false;
+  }
+  if (!s->pipes_open) {
+    return;
+  }
+  splice_pipe_close(&s->pipes[0]);
+  splice_pipe_close(&s->pipes[1]);
+  s->pipes_open = false;
+}
+
+static bool copy_can_read(const struct copy_st* conn) {
+  if (conn->throttled) {
+    return false;
+  }
+  if (conn->pipe != NULL) {
+    return !conn->pipe->full && conn->pipe->len < conn->pipe->capacity;
+  }
+  return conn->rb->data == NULL || buffer_can_write(conn->rb);
+}
+
+static bool copy_can_write(const struct copy_st* conn) {
+  if (conn->other->pipe != NULL) {
+    return conn->other->pipe->len > 0;
+  }
+  return buffer_can_read(conn->wb);
+}
+
+// How much the next read may take, at most what fits in the buffer (or
+// pipe) and the direction's caps allow. 0 means the caps don't allow
+// anything: the direction is throttled and fails with EAGAIN.
+static size_t copy_quota(struct copy_st* conn, uint64_t now) {
+  size_t room;
+  if (conn->pipe != NULL) {
+    room = conn->pipe->capacity - conn->pipe->len;
+  } else if (conn->rb->data == NULL) {
+    room = conn->buffer_size;
+  } else {
+    buffer_write_ptr(conn->rb, &room);
+  }
+  if (room == 0) {
+    errno = EAGAIN;
+    return 0;
+  }
+
+  uint64_t wait = 0;
+  const size_t quota = shaper_take(&conn->shaper, conn->shared, now, room,
+                                   &wait);
+  if (quota == 0) {
+    conn->throttled = true;
+    conn->resume_at = now + (wait > 0 ? wait : 1);
+    errno = EAGAIN;
+  }
+  return quota;
+}
+
+// Reads from *conn->fd whatever fits in its buffer (or pipe) and the caps
+// allow.
+static ssize_t copy_recv(struct copy_st* conn, uint64_t now) {
+  const size_t quota = copy_quota(conn, now);
+  if (quota == 0) {
+    return -1;
+  }
+
+  struct splice_pipe* p = conn->pipe;
+  ssize_t n;
+  if (p == NULL) {
+    if (!relay_buffer_attach(conn)) {
+      shaper_refund(&conn->shaper, conn->shared, quota);
+      errno = ENOMEM;
+      return -1;
+    }
+    size_t capacity;
+    uint8_t* write_ptr = buffer_write_ptr(conn->rb, &capacity);
+    n = recv(*conn->fd, write_ptr, quota < capacity ? quota : capacity, 0);
+    if (n > 0) {
+      buffer_write_adv(conn->rb, n);
+      relay_buffer_adapt(conn, n);
+    }
+  } else {
+    n = splice(*conn->fd, NULL, p->wfd, NULL, quota,
+               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n > 0) {
+      p->len += n;
+    } else if (n < 0 && errno == EAGAIN && p->len > 0) {
+      // The socket was readable, so it's the pipe that is out of slots
+      // (small segments use a page each). Stop reading until the other end
+      // drains it.
+      p->full = true;
+    }
+  }
+
+  const int saved = errno;
+  shaper_refund(&conn->shaper, conn->shared, n > 0 ? quota - n : quota);
+  errno = saved;
+  return n;
+}
+
+// Takes out of wb what a send of its `pending` bytes got through.
+static void relay_buffer_sent(struct copy_st* conn, size_t pending,
+                              ssize_t n) {
+  if (n >= 0 || errno == EAGAIN) {
+    conn->other->backpressure = n < (ssize_t)pending;
+  }
+  if (n > 0) {
+    buffer_read_adv(conn->wb, n);
+    // With completions a direction in the middle of a bulk transfer keeps
+    // it for the read it hands the kernel next (see copy_submit())
+    if (!buffer_can_read(conn->wb) &&
+        !(conn->other->completions && conn->other->full_reads > 0)) {
+      relay_buffer_detach(conn->wb);
+    }
+  }
+}
+
+// Writes to *conn->fd the bytes pending for it.
+static ssize_t copy_send(struct copy_st* conn, int flags) {
+  struct splice_pipe* p = conn->other->pipe;
+  if (p == NULL) {
+    size_t pending_bytes;
+    uint8_t* read_ptr = buffer_read_ptr(conn->wb, &pending_bytes);
+    const ssize_t n = send(*conn->fd, read_ptr, pending_bytes, flags);
+    const int saved = errno;
+    relay_buffer_sent(conn, pending_bytes, n);
+    errno = saved;
+    return n;
+  }
+
+  const ssize_t n = splice(p->rfd, NULL, *conn->fd, NULL, p->len,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  if (n > 0) {
+    p->len -= n;
+    p->full = false;
+  }
+  return n;
+}
+
+// =============================================================================
+// Dissectors
+// =============================================================================
+
+static void on_pop3_credentials(struct pop3_sniffer* p, const char* user,
+                                const char* password) {
+  const struct socks5* data = p->data;
+  char client[SOCKADDR_TO_HUMAN_MIN];
+  sockaddr_to_human(client, sizeof(client),
+                    (const struct sockaddr*)&data->client_addr);
+  // The credentials go first, a long host name is what gets cut
+  LOG_INFO("POP3 credentials user=%s pass=%s (from %s as %s to %s:%u)\n",
+           user, password, client,
+           data->username != NULL ? data->username : "-", data->dest_host,
+           data->dest_port);
+}
+
+// Shows the dissectors the bytes just read from the client, which are
+// still at the end of its buffer.
+static void dissect_client(struct socks5* data, const struct copy_st* conn,
+                           size_t n) {
+  if (conn->pipe == NULL && pop3_sniffer_active(&data->pop3)) {
+    pop3_sniffer_feed(&data->pop3, conn->rb->write - n, n);
+  }
+}
 
 // =============================================================================
 // COPY
 // =============================================================================
 
-static void update_selector_interests(fd_selector sel, struct copy_st* conn) {
+static void copy_arm_timer(fd_selector s, struct socks5* data,
+                           struct copy_st* conn);
+
+// Hands the kernel a read of what fits in rb, which is attached, and the
+// caps allow (see selector_recv()). False if it has to be polled for
+// instead.
+static bool copy_submit_recv(struct selector_key* key, struct copy_st* conn) {
+  const size_t quota = copy_quota(conn, selector_now(key->s));
+  if (quota == 0) {
+    if (conn->throttled) {
+      copy_arm_timer(key->s, ATTACHMENT(key), conn);
+    }
+    return true;
+  }
+  size_t room;
+  uint8_t* ptr = buffer_write_ptr(conn->rb, &room);
+  const size_t len = quota < room ? quota : room;
+  shaper_refund(&conn->shaper, conn->shared, quota - len);
+  if (selector_recv(key->s, *conn->fd, ptr, len) != SELECTOR_SUCCESS) {
+    shaper_refund(&conn->shaper, conn->shared, len);
+    return false;
+  }
+  conn->recv_pending = true;
+  conn->recv_len = len;
+  return true;
+}
+
+// Hands the kernel a send of everything pending in wb. False if it has to
+// be polled for instead.
+static bool copy_submit_send(fd_selector s, struct copy_st* conn) {
+  size_t pending;
+  const uint8_t* ptr = buffer_read_ptr(conn->wb, &pending);
+  if (selector_send(s, *conn->fd, ptr, pending, MSG_NOSIGNAL) !=
+      SELECTOR_SUCCESS) {
+    return false;
+  }
+  conn->send_pending = true;
+  return true;
+}
+
+// Starts in the kernel whatever *conn->fd can do now, and returns what is
+// left to poll for. A buffer is either being filled or drained, never both,
+// so its pointers can't move under an operation in flight: a direction
+// reads again once what it read went out whole.
+//
+// A read in flight holds its buffer until bytes arrive, so only a direction
+// that still has one, because its last read filled it, hands the kernel the
+// next. Others poll and read right away as with epoll: idle and interactive
+// tunnels hold no buffers, bulk transfers run on completions.
+static fd_interest copy_submit(struct selector_key* key,
+                               struct copy_st* conn) {
+  fd_interest interest = OP_NOOP;
+
+  if ((conn->duplex & OP_READ) && !conn->recv_pending &&
+      copy_can_read(conn) && !buffer_can_read(conn->rb)) {
+    if (conn->rb->data == NULL || conn->poll_read ||
+        shaper_limited(&conn->shaper, conn->shared) ||
+        !copy_submit_recv(key, conn)) {
+      interest |= OP_READ;
+    }
+  }
+
+  if ((conn->duplex & OP_WRITE) && !conn->send_pending &&
+      copy_can_write(conn)) {
+    if (conn->poll_write || !copy_submit_send(key->s, conn)) {
+      interest |= OP_WRITE;
+    }
+  }
+  return interest;
+}
+
+static void update_selector_interests(struct selector_key* key,
+                                      struct copy_st* conn) {
   if (conn == NULL || conn->fd == NULL || *conn->fd < 0) {
     return;
   }
 
   fd_interest interest = OP_NOOP;
 
-  if ((conn->duplex & OP_READ) && buffer_can_write(conn->rb)) {
-    interest |= OP_READ;
-  }
+  if (conn->completions) {
+    interest = copy_submit(key, conn);
+  } else {
+    if ((conn->duplex & OP_READ) && copy_can_read(conn)) {
+      interest |= OP_READ;
+    }
 
-  if ((conn->duplex & OP_WRITE) && buffer_can_read(conn->wb)) {
-    interest |= OP_WRITE;
+    if ((conn->duplex & OP_WRITE) && copy_can_write(conn)) {
+      interest |= OP_WRITE;
+    }
   }
 
-  selector_set_interest(sel, *conn->fd, interest);
+  selector_set_interest(key->s, *conn->fd, interest);
+}
+
+// The idle timeout rides on the client fd; once that one is gone the
+// origin's carries it for the rest of the tunnel.
+static bool copy_carries_idle(const struct socks5* data,
+                              const struct copy_st* conn) {
+  return conn->fd == &data->client_fd || data->client_fd == -1;
+}
+
+// Arms *conn->fd's timer for whatever comes first: the end of a pause, or
+// the idle deadline if this end carries it.
+static void copy_arm_timer(fd_selector s, struct socks5* data,
+                           struct copy_st* conn) {
+  const uint64_t now = selector_now(s);
+  uint64_t wait = UINT64_MAX;
+
+  const uint64_t limit = (uint64_t)socks5args.idle_timeout * 1000;
+  if (limit > 0 && copy_carries_idle(data, conn)) {
+    const uint64_t idle = now - data->last_activity;
+    wait = idle < limit ? limit - idle : 1;
+  }
+  if (conn->throttled) {
+    const uint64_t pause = conn->resume_at > now ? conn->resume_at - now : 1;
+    wait = pause < wait ? pause : wait;
+  }
+  selector_set_timeout(s, *conn->fd, wait == UINT64_MAX ? 0 : (unsigned)wait);
 }
 
 static struct copy_st* get_connection_state(struct selector_key* key) {
@@ -41,38 +432,45 @@ static struct copy_st* get_connection_state(struct selector_key* key) {
   }
 }
 
-static unsigned handle_read_eof(struct copy_st* conn, fd_selector s) {
+// Closes whichever end has nothing left to do in either direction. Once
+// both are done the session ends instead: socksv5_done() closes the fds,
+// as unregistering the last one frees the session under us.
+static unsigned close_finished(struct selector_key* key,
+                               struct copy_st* conn) {
+  if (conn->duplex == OP_NOOP && conn->other->duplex == OP_NOOP) {
+    return DONE;
+  }
+
+  // The end left standing keeps a reference, so the session outlives this
+  struct copy_st* finished = conn->duplex == OP_NOOP ? conn : conn->other;
+  struct copy_st* left = finished->other;
+  if (finished->duplex == OP_NOOP && *finished->fd != -1) {
+    selector_unregister_fd(key->s, *finished->fd);
+    close(*finished->fd);
+    *finished->fd = -1;
+    // ...and may have just taken over the idle timeout
+    copy_arm_timer(key->s, ATTACHMENT(key), left);
+  }
+  return COPY;
+}
+
+static unsigned handle_read_eof(struct selector_key* key,
+                                struct copy_st* conn) {
   shutdown(*conn->fd, SHUT_RD);
   conn->duplex &= ~OP_READ;
 
-  if (*conn->other->fd != -1) {
+  // Bytes already read still have to reach the other end; in that case its
+  // write side is shut down by copy_write() once they drain.
+  if (*conn->other->fd != -1 && !copy_can_write(conn->other)) {
     shutdown(*conn->other->fd, SHUT_WR);
     conn->other->duplex &= ~OP_WRITE;
   }
 
-  if (conn->duplex == OP_NOOP) {
-      if (*conn->fd != -1) {
-        selector_unregister_fd(s, *conn->fd);
-        close(*conn->fd);
-        *conn->fd = -1; 
-      }
-  }
-
-  if (conn->other->duplex == OP_NOOP) { 
-        if (*conn->other->fd != -1) {
-            selector_unregister_fd(s, *conn->other->fd);
-            close(*conn->other->fd);
-            *conn->other->fd = -1;
-        }
-  }
-
-  if (conn->duplex == OP_NOOP && conn->other->duplex == OP_NOOP) {
-    return DONE;
-  }
-  return COPY;
+  return close_finished(key, conn);
 }
 
-static unsigned handle_write_error(struct copy_st* conn, fd_selector s) {
+static unsigned handle_write_error(struct selector_key* key,
+                                   struct copy_st* conn) {
   shutdown(*conn->fd, SHUT_WR);
   conn->duplex &= ~OP_WRITE;
 
@@ -81,121 +479,277 @@ static unsigned handle_write_error(struct copy_st* conn, fd_selector s) {
     conn->other->duplex &= ~OP_READ;
   }
 
-  if (conn->duplex == OP_NOOP) {
-      if (*conn->fd != -1) {
-        selector_unregister_fd(s, *conn->fd);
-        close(*conn->fd);
-        *conn->fd = -1;
-      }
-  }
-
-  if (conn->other->duplex == OP_NOOP) {
-     if (*conn->other->fd != -1) {
-        selector_unregister_fd(s, *conn->other->fd);
-        close(*conn->other->fd);
-        *conn->other->fd = -1;
-     }
-  }
+  return close_finished(key, conn);
+}
 
-  if (conn->duplex == OP_NOOP && conn->other->duplex == OP_NOOP) {
-    return DONE;
+// Hands the client's first relay buffer (or pipe) what it sent right behind
+// its request without waiting for the reply, such as a TLS ClientHello. It
+// fits: the handshake buffer is smaller than both.
+static bool copy_early_data(struct socks5* data, const uint8_t* bytes,
+                            size_t n) {
+  struct copy_st* conn = &data->client.copy;
+  if (conn->pipe != NULL) {
+    // Under PIPE_BUF, so written whole into the empty pipe
+    if (write(conn->pipe->wfd, bytes, n) != (ssize_t)n) {
+      return false;
+    }
+    conn->pipe->len += n;
+  } else {
+    if (!relay_buffer_attach(conn)) {
+      return false;
+    }
+    size_t room;
+    uint8_t* ptr = buffer_write_ptr(conn->rb, &room);
+    if (room < n) {
+      return false;
+    }
+    memcpy(ptr, bytes, n);
+    buffer_write_adv(conn->rb, n);
+    dissect_client(data, conn, n);
   }
-  return COPY;
+  metrics_add_bytes_received(n);
+  user_stats_add_bytes_received(data->user, n);
+  data->bytes_up += n;
+  return true;
 }
 
 void copy_init(const unsigned state, struct selector_key* key) {
   (void)state;
   struct socks5* data = ATTACHMENT(key);
 
-  buffer_reset(&data->read_buffer);
-  buffer_reset(&data->write_buffer);
+  // Copied out before the handshake buffer is left behind
+  uint8_t early[HANDSHAKE_BUFFER_SIZE];
+  size_t early_len;
+  const uint8_t* early_ptr = buffer_read_ptr(&data->read_buffer, &early_len);
+  memcpy(early, early_ptr, early_len);
+
+  // Leave the inline handshake storage; relay buffers come from the pool
+  memset(&data->read_buffer, 0, sizeof(data->read_buffer));
+  memset(&data->write_buffer, 0, sizeof(data->write_buffer));
+  data->relay_buffers = true;
+  data->phase_start = metrics_clock_us();
+  data->first_byte = false;
 
   data->client.copy = (struct copy_st){.fd = &data->client_fd,
                                        .rb = &data->read_buffer,
                                        .wb = &data->write_buffer,
                                        .duplex = OP_READ | OP_WRITE,
-                                       .other = &data->origin.copy};
+                                       .other = &data->origin.copy,
+                                       .buffer_size = relay_buffer_min()};
 
   data->origin.copy = (struct copy_st){.fd = &data->origin_fd,
                                        .rb = &data->write_buffer,
                                        .wb = &data->read_buffer,
                                        .duplex = OP_READ | OP_WRITE,
-                                       .other = &data->client.copy};
-
-  selector_set_interest(key->s, data->client_fd, OP_READ);
-  selector_set_interest(key->s, data->origin_fd, OP_READ);
-}
-
-unsigned copy_read(struct selector_key* key) {
-  struct copy_st* conn = get_connection_state(key);
-  size_t capacity;
+                                       .other = &data->client.copy,
+                                       .buffer_size = relay_buffer_min()};
+
+  if (!socks5args.disectors_enabled && !data->pipes_open) {
+    if (splice_pipe_open(&data->pipes[0])) {
+      if (splice_pipe_open(&data->pipes[1])) {
+        data->pipes_open = true;
+      } else {
+        splice_pipe_close(&data->pipes[0]);
+      }
+    }
+    if (!data->pipes_open) {
+      LOG_DEBUG("splice pipes unavailable (%s), relaying through buffers\n",
+                strerror(errno));
+    }
+  }
+  if (data->pipes_open) {
+    data->client.copy.pipe = &data->pipes[0];
+    data->origin.copy.pipe = &data->pipes[1];
+  } else if (selector_has_completions(key->s)) {
+    data->client.copy.completions = data->origin.copy.completions = true;
+  }
 
-  uint8_t* write_ptr = buffer_write_ptr(conn->rb, &capacity);
+  if (socks5args.disectors_enabled) {
+    pop3_sniffer_init(&data->pop3, data->dest_port);
+    data->pop3.data = data;
+    data->pop3.on_credentials = on_pop3_credentials;
+  } else {
+    pop3_sniffer_stop(&data->pop3);
+  }
 
-  ssize_t bytes_read = recv(key->fd, write_ptr, capacity, 0);
+  const uint64_t now = selector_now(key->s);
+  shaper_init(&data->client.copy.shaper, socks5args.conn_rate, now);
+  shaper_init(&data->origin.copy.shaper, socks5args.conn_rate, now);
+  data->client.copy.shared = user_stats_shaper(data->user, USER_STATS_UP);
+  data->origin.copy.shared = user_stats_shaper(data->user, USER_STATS_DOWN);
+
+  if (early_len > 0 && !copy_early_data(data, early, early_len)) {
+    // Relaying the rest without it would corrupt the stream
+    LOG_ERROR("Can't relay the bytes sent with the request, closing\n");
+    shutdown(data->client_fd, SHUT_RDWR);
+    shutdown(data->origin_fd, SHUT_RDWR);
+  }
+  update_selector_interests(key, &data->client.copy);
+  update_selector_interests(key, &data->origin.copy);
+}
 
-  if (bytes_read <= 0) {
-    const unsigned ret = handle_read_eof(conn, key->s);
+// What's left of a read of `bytes_read` from *conn->fd, done here or by the
+// kernel; a failed one left errno set.
+static unsigned copy_received(struct selector_key* key, struct copy_st* conn,
+                              ssize_t bytes_read) {
+  if (bytes_read < 0 && errno == EAGAIN) {
+    // nothing to do (or the splice pipe filled up, or the caps ran out)
+    if (conn->throttled) {
+      copy_arm_timer(key->s, ATTACHMENT(key), conn);
+    }
+  } else if (bytes_read <= 0) {
+    const unsigned ret = handle_read_eof(key, conn);
     if (ret == COPY) {
-      update_selector_interests(key->s, conn);
-      update_selector_interests(key->s, conn->other);
+      update_selector_interests(key, conn);
+      update_selector_interests(key, conn->other);
     }
     return ret;
   } else {
-    buffer_write_adv(conn->rb, bytes_read);
-    
     struct socks5* data = ATTACHMENT(key);
+    data->last_activity = selector_now(key->s);
     if (key->fd == data->client_fd) {
         metrics_add_bytes_received(bytes_read);
+        user_stats_add_bytes_received(data->user, bytes_read);
+        data->bytes_up += bytes_read;
+        dissect_client(data, conn, bytes_read);
+    } else if (!data->first_byte) {
+        data->first_byte = true;
+        metrics_latency_since(METRICS_LATENCY_FIRST_BYTE, data->phase_start);
     }
     
-    if (conn->other->fd != NULL && *conn->other->fd != -1 && (conn->other->duplex & OP_WRITE)) {
-        size_t pending_bytes;
-        uint8_t* read_ptr = buffer_read_ptr(conn->other->wb, &pending_bytes);
-        if (pending_bytes > 0) {
-             ssize_t bytes_sent = send(*conn->other->fd, read_ptr, pending_bytes, MSG_NOSIGNAL | MSG_DONTWAIT);
-             if (bytes_sent > 0) {
-                 buffer_read_adv(conn->other->wb, bytes_sent);
-                 if (*conn->other->fd == data->client_fd) {
-                      metrics_add_bytes_sent(bytes_sent);
-                 }
-             }
+    // With completions the send is handed to the kernel below
+    if (!conn->completions && conn->other->fd != NULL &&
+        *conn->other->fd != -1 && (conn->other->duplex & OP_WRITE)) {
+        ssize_t bytes_sent = copy_send(conn->other, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (bytes_sent > 0 && *conn->other->fd == data->client_fd) {
+            metrics_add_bytes_sent(bytes_sent);
+            user_stats_add_bytes_sent(data->user, bytes_sent);
+            data->bytes_down += bytes_sent;
         }
     }
   }
 
-  update_selector_interests(key->s, conn);
-  update_selector_interests(key->s, conn->other);
+  update_selector_interests(key, conn);
+  update_selector_interests(key, conn->other);
 
   return COPY;
 }
 
-unsigned copy_write(struct selector_key* key) {
+unsigned copy_read(struct selector_key* key) {
   struct copy_st* conn = get_connection_state(key);
-  size_t pending_bytes;
-
-  uint8_t* read_ptr = buffer_read_ptr(conn->wb, &pending_bytes);
+  return copy_received(key, conn, copy_recv(conn, selector_now(key->s)));
+}
 
-  ssize_t bytes_sent = send(key->fd, read_ptr, pending_bytes, MSG_NOSIGNAL);
+unsigned copy_recv_done(struct selector_key* key, ssize_t n) {
+  struct copy_st* conn = get_connection_state(key);
+  conn->recv_pending = false;
+  shaper_refund(&conn->shaper, conn->shared,
+                n > 0 ? conn->recv_len - n : conn->recv_len);
+
+  if (!(conn->duplex & OP_READ)) {
+    // Its read side was shut down meanwhile, nobody wants the bytes
+    if (!buffer_can_read(conn->rb)) {
+      relay_buffer_detach(conn->rb);
+    }
+    update_selector_interests(key, conn);
+    return COPY;
+  }
+  if (n > 0) {
+    buffer_write_adv(conn->rb, n);
+    relay_buffer_adapt(conn, n);
+  } else if (n < 0) {
+    errno = (int)-n;
+    n = -1;
+    if (errno == EAGAIN) {
+      // This kernel doesn't wait on non-blocking sockets, so poll first
+      conn->poll_read = true;
+    }
+  }
+  return copy_received(key, conn, n);
+}
 
-  if (bytes_sent <= 0) {
-    const unsigned ret = handle_write_error(conn, key->s);
+// What's left of a send of `bytes_sent` to *conn->fd, done here or by the
+// kernel; a failed one left errno set.
+static unsigned copy_sent(struct selector_key* key, struct copy_st* conn,
+                          ssize_t bytes_sent) {
+  if (bytes_sent < 0 && errno == EAGAIN) {
+    // socket buffer full, wait for the next write event
+  } else if (bytes_sent <= 0) {
+    const unsigned ret = handle_write_error(key, conn);
     if (ret == COPY) {
-      update_selector_interests(key->s, conn);
-      update_selector_interests(key->s, conn->other);
+      update_selector_interests(key, conn);
+      update_selector_interests(key, conn->other);
     }
     return ret;
   } else {
-    buffer_read_adv(conn->wb, bytes_sent);
-  
     struct socks5* data = ATTACHMENT(key);
+    data->last_activity = selector_now(key->s);
     if (key->fd == data->client_fd) {
         metrics_add_bytes_sent(bytes_sent);
+        user_stats_add_bytes_sent(data->user, bytes_sent);
+        data->bytes_down += bytes_sent;
+    }
+
+    // Finish the half-close deferred by handle_read_eof()
+    if (!copy_can_write(conn) && !(conn->other->duplex & OP_READ)) {
+      shutdown(key->fd, SHUT_WR);
+      conn->duplex &= ~OP_WRITE;
+      const unsigned ret = close_finished(key, conn);
+      if (ret != COPY) {
+        return ret;
+      }
     }
   }
 
-  update_selector_interests(key->s, conn);
-  update_selector_interests(key->s, conn->other);
+  update_selector_interests(key, conn);
+  update_selector_interests(key, conn->other);
+
+  return COPY;
+}
+
+unsigned copy_write(struct selector_key* key) {
+  struct copy_st* conn = get_connection_state(key);
+  return copy_sent(key, conn, copy_send(conn, MSG_NOSIGNAL));
+}
 
+unsigned copy_send_done(struct selector_key* key, ssize_t n) {
+  struct copy_st* conn = get_connection_state(key);
+  conn->send_pending = false;
+
+  size_t pending;
+  buffer_read_ptr(conn->wb, &pending);
+  if (n < 0) {
+    errno = (int)-n;
+    n = -1;
+    if (errno == EAGAIN) {
+      conn->poll_write = true; // as in copy_recv_done()
+    }
+  }
+  const int saved = errno;
+  relay_buffer_sent(conn, pending, n);
+  errno = saved;
+  return copy_sent(key, conn, n);
+}
+
+// Traffic doesn't touch the timer, it only records when it happened; when
+// the timer fires early because of that it is pushed back by what's left.
+// The same timer ends the pauses of a throttled end.
+unsigned copy_timeout(struct selector_key* key) {
+  struct socks5* data = ATTACHMENT(key);
+  struct copy_st* conn = get_connection_state(key);
+  const uint64_t now = selector_now(key->s);
+
+  if (conn->throttled && now >= conn->resume_at) {
+    conn->throttled = false;
+    update_selector_interests(key, conn);
+  }
+
+  const uint64_t limit = (uint64_t)socks5args.idle_timeout * 1000;
+  if (limit > 0 && copy_carries_idle(data, conn) &&
+      now - data->last_activity >= limit) {
+    LOG_INFO("Closing tunnel idle for %u seconds\n", socks5args.idle_timeout);
+    return DONE;
+  }
+  copy_arm_timer(key->s, data, conn);
   return COPY;
 }
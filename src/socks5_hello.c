@@ -6,15 +6,13 @@
 #include <sys/socket.h>
 #include <unistd.h>
 
-#include "args.h"
 #include "hello_parser.h"
 #include "selector.h"
 #include "socks5_internal.h"
-
-extern struct socks5args socks5args;
+#include "user_db.h"
 
 static void on_hello_method(struct hello_parser* p, const uint8_t method) {
-  bool auth_required = (socks5args.users[0].name != NULL);
+  bool auth_required = user_db_count() > 0;
   uint8_t* selected = (uint8_t*)p->data;
   if (method == SOCKS_AUTH_NONE && !auth_required) {
     *selected = SOCKS_AUTH_NONE;
@@ -23,6 +21,20 @@ static void on_hello_method(struct hello_parser* p, const uint8_t method) {
   }
 }
 
+bool handshake_recv(struct selector_key* key, buffer* rb) {
+  if (buffer_can_read(rb)) {
+    return true;
+  }
+  size_t nbytes;
+  uint8_t* ptr = buffer_write_ptr(rb, &nbytes);
+  const ssize_t n = recv(key->fd, ptr, nbytes, 0);
+  if (n <= 0) {
+    return false;
+  }
+  buffer_write_adv(rb, n);
+  return true;
+}
+
 void hello_read_init(const unsigned state, struct selector_key* key) {
   (void)state;
   struct socks5* s = ATTACHMENT(key);
@@ -38,12 +50,7 @@ void hello_read_init(const unsigned state, struct selector_key* key) {
 unsigned hello_read(struct selector_key* key) {
   struct socks5* s = ATTACHMENT(key);
   struct hello_st* h = &s->client.hello;
-  size_t nbytes;
-  uint8_t* ptr = buffer_write_ptr(h->rb, &nbytes);
-  ssize_t n = recv(key->fd, ptr, nbytes, 0);
-
-  if (n <= 0) return ERROR;
-  buffer_write_adv(h->rb, n);
+  if (!handshake_recv(key, h->rb)) return ERROR;
 
   bool error = false;
   enum hello_state st = hello_consume(h->rb, &h->parser, &error);
@@ -57,6 +64,10 @@ unsigned hello_read(struct selector_key* key) {
     if (hello__build_reply(h->wb, reply_method) == -1) {
       return ERROR;
     }
+    if (h->method != SOCKS_AUTH_NO_ACCEPTABLE && buffer_can_read(h->rb)) {
+      // The client didn't wait for the reply; it goes out with the next one
+      return (h->method == SOCKS_AUTH_USERPASS) ? AUTH_READ : REQUEST_READ;
+    }
     selector_set_interest_key(key, OP_WRITE);
     return HELLO_WRITE;
   }
@@ -10,6 +10,9 @@
 #include "selector.h"
 #include "socks5_internal.h"
 #include "logger.h"
+#include "metrics.h"
+#include "request_parser.h"
+#include "resolver.h"
 
 extern struct socks5args socks5args;
 
@@ -26,7 +29,8 @@ static unsigned request_marshall_reply(struct selector_key* key,
   struct request_st* r = &s->client.request;
 
   r->reply = reply_code;
-  buffer_reset(r->wb);
+  s->reply = reply_code;
+  // Appended to the HELLO and AUTH replies of a pipelined handshake
   buffer_write(r->wb, SOCKS_VERSION);
   buffer_write(r->wb, reply_code);
   buffer_write(r->wb, SOCKS_RSV);
@@ -46,269 +50,330 @@ void request_read_init(const unsigned state, struct selector_key* key) {
   r->wb = &s->write_buffer;
   r->state = REQUEST_VERSION;
   r->reply = SOCKS_REPLY_GENERAL_FAILURE;
-  buffer_reset(r->rb);
-  buffer_reset(r->wb);
+  s->phase_start = metrics_latency_since(METRICS_LATENCY_AUTH, s->accepted_at);
+  // rb may already hold the request, see handshake_recv()
 }
 
-static void request_process_version(struct request_st* r, uint8_t byte) {
-  r->state = (byte == SOCKS_VERSION) ? REQUEST_CMD : REQUEST_ERROR;
-}
-
-static void request_process_cmd(struct request_st* r, uint8_t byte) {
-  r->cmd = byte;
-  if (byte != SOCKS_CMD_CONNECT) {
-    r->reply = SOCKS_REPLY_CMD_NOT_SUPPORTED;
-    r->state = REQUEST_ERROR;
-  } else {
-    r->state = REQUEST_RSV;
-  }
-}
-
-static void request_process_rsv(struct request_st* r, uint8_t byte) {
-  (void)byte;
-  r->state = REQUEST_ATYP;
-}
-
-static void request_process_atyp(struct request_st* r, uint8_t byte) {
-  r->atyp = byte;
-  r->addr_index = 0;
-  if (byte == SOCKS_ATYP_IPV4 || byte == SOCKS_ATYP_IPV6 ||
-      byte == SOCKS_ATYP_DOMAIN) {
-    r->state = REQUEST_DSTADDR;
-  } else {
-    r->reply = SOCKS_REPLY_ATYP_NOT_SUPPORTED;
-    r->state = REQUEST_ERROR;
-  }
-}
-
-static void request_process_dstaddr(struct request_st* r, uint8_t byte) {
-  if (r->atyp == SOCKS_ATYP_IPV4) {
-    ((uint8_t*)&r->dest_addr.ipv4)[r->addr_index++] = byte;
-    if (r->addr_index >= SOCKS_IPV4_ADDR_SIZE) {
-      r->state = REQUEST_DSTPORT;
-      r->addr_index = 0;
-    }
-  } else if (r->atyp == SOCKS_ATYP_IPV6) {
-    r->dest_addr.ipv6.s6_addr[r->addr_index++] = byte;
-    if (r->addr_index >= SOCKS_IPV6_ADDR_SIZE) {
-      r->state = REQUEST_DSTPORT;
-      r->addr_index = 0;
-    }
-  } else if (r->atyp == SOCKS_ATYP_DOMAIN) {
-    if (r->addr_index == 0) {
-      r->fqdn_len = byte;
-      r->addr_index = 1;
-    } else {
-      r->dest_addr.fqdn[r->addr_index - 1] = byte;
-      if (++r->addr_index > r->fqdn_len) {
-        r->dest_addr.fqdn[r->fqdn_len] = 0;
-        r->state = REQUEST_DSTPORT;
-        r->addr_index = 0;
-      }
-    }
-  }
-}
-
-static void request_process_dstport(struct request_st* r, uint8_t byte) {
-  if (r->addr_index == 0) {
-    r->dest_port = byte << 8;
-    r->addr_index = 1;
-  } else {
-    r->dest_port |= byte;
-    r->state = REQUEST_DONE;
-  }
+// Keeps the destination for the access log, which is written when the
+// session ends and the request is long gone
+static void request_access_dest(struct socks5* s, const struct request_st* r) {
+  if (r->atyp == SOCKS_ATYP_DOMAIN)
+    snprintf(s->dest_host, sizeof(s->dest_host), "%s", r->dest_addr.fqdn);
+  else if (r->atyp == SOCKS_ATYP_IPV4)
+    inet_ntop(AF_INET, &r->dest_addr.ipv4, s->dest_host, sizeof(s->dest_host));
+  else
+    inet_ntop(AF_INET6, &r->dest_addr.ipv6, s->dest_host,
+              sizeof(s->dest_host));
+  s->dest_port = r->dest_port;
+  s->reply = SOCKS_REPLY_GENERAL_FAILURE; // until a reply is sent
 }
 
-// EXAMPLE REQUEST PACKET
-//+----+-----+-------+------+----------+----------+
-//|VER | CMD |  RSV  | ATYP | DST.ADDR | DST.PORT |
-//+----+-----+-------+------+----------+----------+
-//| 1  |  1  | X'00' |  1   | Variable |    2     |
-//+----+-----+-------+------+----------+----------+
-
 unsigned request_read(struct selector_key* key) {
   struct socks5* s = ATTACHMENT(key);
   struct request_st* r = &s->client.request;
-  size_t nbytes;
-  uint8_t* ptr = buffer_write_ptr(r->rb, &nbytes);
-  ssize_t n = recv(key->fd, ptr, nbytes, 0);
+  if (!handshake_recv(key, r->rb)) return ERROR;
 
-  if (n <= 0) return ERROR;
-  buffer_write_adv(r->rb, n);
-
-  while (buffer_can_read(r->rb) && r->state != REQUEST_DONE &&
-         r->state != REQUEST_ERROR) {
-    uint8_t byte = buffer_read(r->rb);
-    switch (r->state) {
-      case REQUEST_VERSION:
-        request_process_version(r, byte);
-        break;
-      case REQUEST_CMD:
-        request_process_cmd(r, byte);
-        break;
-      case REQUEST_RSV:
-        request_process_rsv(r, byte);
-        break;
-      case REQUEST_ATYP:
-        request_process_atyp(r, byte);
-        break;
-      case REQUEST_DSTADDR:
-        request_process_dstaddr(r, byte);
-        break;
-      case REQUEST_DSTPORT:
-        request_process_dstport(r, byte);
-        break;
-      default:
-        break;
-    }
-  }
+  request_consume(r);
 
   if (r->state == REQUEST_ERROR) return request_marshall_reply(key, r->reply);
-  if (r->state == REQUEST_DONE)
+  if (r->state == REQUEST_DONE) {
+    request_access_dest(s, r);
+    if (s->over_user_cap) {
+      return request_marshall_reply(key, SOCKS_REPLY_NOT_ALLOWED);
+    }
     return (r->atyp == SOCKS_ATYP_DOMAIN) ? request_start_resolve(key)
                                           : request_start_connect(key);
+  }
   return REQUEST_READ;
 }
 
+// The lookup runs on a resolver thread (unless the answer is cached); we
+// wait in REQUEST_RESOLVING with no interest on the client until
+// request_resolving() is notified.
 static unsigned request_start_resolve(struct selector_key* key) {
   struct socks5* s = ATTACHMENT(key);
   struct request_st* r = &s->client.request;
-  struct addrinfo hints = {.ai_family = AF_UNSPEC,
-                           .ai_socktype = SOCK_STREAM,
-                           .ai_protocol = IPPROTO_TCP};
-  char port_str[SOCKS_PORT_STR_LEN];
-  snprintf(port_str, sizeof(port_str), "%u", r->dest_port);
-
-  int err =
-      getaddrinfo(r->dest_addr.fqdn, port_str, &hints, &s->origin_resolution);
-  if (err != 0 || s->origin_resolution == NULL) {
-    return request_marshall_reply(key, SOCKS_REPLY_HOST_UNREACHABLE);
+
+  s->phase_start = metrics_clock_us();
+  s->resolve_job =
+      resolver_submit(key->s, key->fd, r->dest_addr.fqdn, r->dest_port);
+  if (s->resolve_job == NULL) {
+    LOG_WARNING("Resolver busy, rejecting request for %s\n",
+                r->dest_addr.fqdn);
+    return request_marshall_reply(key, SOCKS_REPLY_GENERAL_FAILURE);
   }
-  s->current_origin_addr = s->origin_resolution;
-  return request_start_connect(key);
+  selector_set_interest_key(key, OP_NOOP);
+  return request_resolving(key);
 }
 
-static int setup_address(struct socks5* s, struct request_st* r,
-                         struct sockaddr_storage* addr, socklen_t* addr_len) {
-  memset(addr, 0, sizeof(*addr));
-  *addr_len = 0;
+// =============================================================================
+// CONNECT (Happy Eyeballs, RFC 8305)
+// =============================================================================
+//
+// Candidate addresses are tried in an order that alternates families. A new
+// attempt starts every HE_ATTEMPT_DELAY_MS, or as soon as one fails, while
+// the earlier ones keep going; the first socket to connect wins and the
+// rest are closed. A blackholed address thus costs a few hundred
+// milliseconds instead of a kernel connect timeout.
 
-  if (s->origin_resolution) {
-    if (!s->current_origin_addr) {
-      return -1;
+static int create_socket(int family) {
+  int fd = socket(family, SOCK_STREAM, IPPROTO_TCP);
+  if (fd < 0) return -1;
+  if (selector_fd_set_nio(fd) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// RFC 8305 section 4: start with the family of the first answer, then
+// alternate between families keeping the resolver's order within each.
+static void connect_sort_candidates(struct connect_st* c,
+                                    struct addrinfo* list) {
+  const struct addrinfo* first[HE_MAX_CANDIDATES];
+  const struct addrinfo* second[HE_MAX_CANDIDATES];
+  unsigned nfirst = 0, nsecond = 0;
+
+  for (const struct addrinfo* ai = list; ai != NULL; ai = ai->ai_next) {
+    if (ai->ai_family == list->ai_family) {
+      if (nfirst < HE_MAX_CANDIDATES) first[nfirst++] = ai;
+    } else if (ai->ai_family == AF_INET || ai->ai_family == AF_INET6) {
+      if (nsecond < HE_MAX_CANDIDATES) second[nsecond++] = ai;
     }
-    memcpy(addr, s->current_origin_addr->ai_addr,
-           s->current_origin_addr->ai_addrlen);
-    *addr_len = s->current_origin_addr->ai_addrlen;
-  } else if (r->atyp == SOCKS_ATYP_IPV4) {
-    struct sockaddr_in* sin = (struct sockaddr_in*)addr;
+  }
+
+  c->ncandidates = 0;
+  for (unsigned i = 0; c->ncandidates < HE_MAX_CANDIDATES &&
+                       (i < nfirst || i < nsecond);
+       i++) {
+    if (i < nfirst) c->candidates[c->ncandidates++] = first[i];
+    if (i < nsecond && c->ncandidates < HE_MAX_CANDIDATES)
+      c->candidates[c->ncandidates++] = second[i];
+  }
+}
+
+// Wraps an IP literal from the request as the only candidate
+static void connect_literal_candidate(struct connect_st* c,
+                                      struct request_st* r) {
+  memset(&c->literal_addr, 0, sizeof(c->literal_addr));
+  memset(&c->literal, 0, sizeof(c->literal));
+
+  if (r->atyp == SOCKS_ATYP_IPV4) {
+    struct sockaddr_in* sin = (struct sockaddr_in*)&c->literal_addr;
     sin->sin_family = AF_INET;
     sin->sin_addr = r->dest_addr.ipv4;
     sin->sin_port = htons(r->dest_port);
-    *addr_len = sizeof(*sin);
-  } else if (r->atyp == SOCKS_ATYP_IPV6) {
-    struct sockaddr_in6* sin6 = (struct sockaddr_in6*)addr;
+    c->literal.ai_addrlen = sizeof(*sin);
+  } else {
+    struct sockaddr_in6* sin6 = (struct sockaddr_in6*)&c->literal_addr;
     sin6->sin6_family = AF_INET6;
     sin6->sin6_addr = r->dest_addr.ipv6;
     sin6->sin6_port = htons(r->dest_port);
-    *addr_len = sizeof(*sin6);
+    c->literal.ai_addrlen = sizeof(*sin6);
   }
-  return 0;
+  c->literal.ai_family = c->literal_addr.ss_family;
+  c->literal.ai_addr = (struct sockaddr*)&c->literal_addr;
+  c->candidates[0] = &c->literal;
+  c->ncandidates = 1;
 }
 
-static int create_socket(int family) {
-  int fd = socket(family, SOCK_STREAM, IPPROTO_TCP);
-  if (fd < 0) return -1;
-  if (selector_fd_set_nio(fd) < 0) {
-    close(fd);
-    return -1;
+static void connect_drop_fd(fd_selector sel, int* fd) {
+  if (*fd >= 0) {
+    // the selector's close handler drops the reference the fd held
+    selector_unregister_fd(sel, *fd);
+    close(*fd);
+    *fd = -1;
   }
-  return fd;
 }
 
-static unsigned request_start_connect(struct selector_key* key) {
-  struct socks5* s = ATTACHMENT(key);
-  struct request_st* r = &s->client.request;
-  struct sockaddr_storage addr;
-  socklen_t addr_len = 0;
+// The next attempt is due when the newest one's timeout fires (see
+// request_timeout()); earlier attempts keep none.
+static void connect_schedule_next(struct connect_st* c, fd_selector sel,
+                                  int newest) {
+  for (unsigned i = 0; i < HE_MAX_ATTEMPTS; i++) {
+    if (c->attempts[i] >= 0 && c->attempts[i] != newest) {
+      selector_set_timeout(sel, c->attempts[i], 0);
+    }
+  }
+  if (newest >= 0 && c->next < c->ncandidates &&
+      c->inflight < HE_MAX_ATTEMPTS) {
+    selector_set_timeout(sel, newest, HE_ATTEMPT_DELAY_MS);
+  }
+}
 
-  if (setup_address(s, r, &addr, &addr_len) < 0) {
-    return request_marshall_reply(key, SOCKS_REPLY_HOST_UNREACHABLE);
+static uint8_t connect_error_reply(int error) {
+  switch (error) {
+    case ENETUNREACH:
+      return SOCKS_REPLY_NETWORK_UNREACHABLE;
+    case EHOSTUNREACH:
+    case ETIMEDOUT:
+      return SOCKS_REPLY_HOST_UNREACHABLE;
+    default:
+      return SOCKS_REPLY_CONNECTION_REFUSED;
   }
+}
 
-  int origin_fd = create_socket(addr.ss_family);
-  if (origin_fd < 0) {
-    return request_marshall_reply(key, SOCKS_REPLY_GENERAL_FAILURE);
+// Starts the next candidate (skipping those that fail right away) unless
+// the attempt limit is reached, and schedules the one after it.
+static unsigned connect_launch(struct selector_key* key) {
+  struct socks5* s = ATTACHMENT(key);
+  struct connect_st* c = &s->client.request.connect;
+  int newest = -1;
+
+  while (c->next < c->ncandidates && c->inflight < HE_MAX_ATTEMPTS) {
+    const struct addrinfo* ai = c->candidates[c->next++];
+
+    int fd = create_socket(ai->ai_family);
+    if (fd < 0) {
+      c->last_error = errno;
+      continue;
+    }
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) < 0 &&
+        errno != EINPROGRESS) {
+      c->last_error = errno;
+      close(fd);
+      continue;
+    }
+
+    s->references++;
+    if (selector_register(key->s, fd, &socks5_handler, OP_WRITE, s) !=
+        SELECTOR_SUCCESS) {
+      s->references--;
+      c->last_error = ENOMEM;
+      close(fd);
+      continue;
+    }
+    for (unsigned i = 0; i < HE_MAX_ATTEMPTS; i++) {
+      if (c->attempts[i] < 0) {
+        c->attempts[i] = fd;
+        break;
+      }
+    }
+    c->inflight++;
+    newest = fd;
+    break;
   }
 
-  if (connect(origin_fd, (struct sockaddr*)&addr, addr_len) < 0 &&
-      errno != EINPROGRESS) {
-    close(origin_fd);
-    if (s->origin_resolution &&
-        (s->current_origin_addr = s->current_origin_addr->ai_next))
-      return request_start_connect(key);
-    return request_marshall_reply(key, SOCKS_REPLY_CONNECTION_REFUSED);
+  if (newest >= 0) {
+    connect_schedule_next(c, key->s, newest);
   }
 
-  s->origin_fd = origin_fd;
-  s->references++;
-  if (selector_register(key->s, origin_fd, &socks5_handler, OP_WRITE, s) !=
-      SELECTOR_SUCCESS) {
-    s->references--;
-    close(origin_fd);
-    s->origin_fd = -1;
-    return request_marshall_reply(key, SOCKS_REPLY_GENERAL_FAILURE);
+  if (c->inflight == 0) {
+    return request_marshall_reply(key, connect_error_reply(c->last_error));
   }
-  selector_set_interest_key(key, OP_NOOP);
   return REQUEST_CONNECTING;
 }
 
-unsigned request_resolving(struct selector_key* key) {
+static unsigned request_start_connect(struct selector_key* key) {
   struct socks5* s = ATTACHMENT(key);
+  struct request_st* r = &s->client.request;
+  struct connect_st* c = &r->connect;
+
+  c->next = 0;
+  c->inflight = 0;
+  c->last_error = ECONNREFUSED;
+  for (unsigned i = 0; i < HE_MAX_ATTEMPTS; i++) {
+    c->attempts[i] = -1;
+  }
+
   if (s->origin_resolution) {
-    s->current_origin_addr = s->origin_resolution;
-    return request_start_connect(key);
+    connect_sort_candidates(c, s->origin_resolution);
+  } else {
+    connect_literal_candidate(c, r);
   }
-  return ERROR;
+
+  selector_set_interest(key->s, s->client_fd, OP_NOOP);
+  s->phase_start = metrics_clock_us();
+  return connect_launch(key);
+}
+
+unsigned request_resolving(struct selector_key* key) {
+  struct socks5* s = ATTACHMENT(key);
+  struct resolver_answer* answer = NULL;
+
+  // A notification meant for a previous user of this fd lands here too
+  if (s->resolve_job == NULL || !resolver_poll(s->resolve_job, &answer)) {
+    return REQUEST_RESOLVING;
+  }
+  s->resolve_job = NULL;
+  s->origin_answer = answer;
+  metrics_latency_since(METRICS_LATENCY_RESOLVE, s->phase_start);
+
+  if (answer->error != 0 || answer->list == NULL) {
+    return request_marshall_reply(key, SOCKS_REPLY_HOST_UNREACHABLE);
+  }
+  s->origin_resolution = answer->list;
+  return request_start_connect(key);
 }
 
 unsigned request_connecting(struct selector_key* key) {
   struct socks5* s = ATTACHMENT(key);
   struct request_st* r = &s->client.request;
+  struct connect_st* c = &r->connect;
 
-  if (key->fd != s->origin_fd) return REQUEST_CONNECTING;
+  unsigned slot = HE_MAX_ATTEMPTS;
+  for (unsigned i = 0; i < HE_MAX_ATTEMPTS; i++) {
+    if (c->attempts[i] == key->fd) {
+      slot = i;
+      break;
+    }
+  }
+  if (slot == HE_MAX_ATTEMPTS) return REQUEST_CONNECTING;
 
   int error = 0;
   socklen_t len = sizeof(error);
-  if (getsockopt(s->origin_fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 ||
+  if (getsockopt(key->fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 ||
       error != 0) {
-    selector_unregister_fd(key->s, s->origin_fd);
-    close(s->origin_fd);
-    s->origin_fd = -1;
-    s->references--;
-    if (s->origin_resolution &&
-        (s->current_origin_addr = s->current_origin_addr->ai_next)) {
-      selector_set_interest(key->s, s->client_fd, OP_READ);
-      return request_start_connect(key);
-    }
-    return request_marshall_reply(key, SOCKS_REPLY_CONNECTION_REFUSED);
+    c->last_error = error != 0 ? error : errno;
+    connect_drop_fd(key->s, &c->attempts[slot]);
+    c->inflight--;
+    // don't wait for the timer to try the next one
+    return connect_launch(key);
   }
 
-  for (int i = 0; i < SOCKS_IPV4_ADDR_SIZE + SOCKS_PORT_SIZE; i++)
-    buffer_write(r->wb, 0x00);
+  // We have a winner; request_connecting_departure() drops the rest
+  metrics_latency_since(METRICS_LATENCY_CONNECT, s->phase_start);
+  s->origin_fd = key->fd;
+  c->attempts[slot] = -1;
+  c->inflight--;
 
-  char dest_str[SOCKS_DOMAIN_MAX_LEN] = "unknown";
-  if (r->atyp == SOCKS_ATYP_DOMAIN)
-    snprintf(dest_str, sizeof(dest_str), "%s", r->dest_addr.fqdn);
-  else if (r->atyp == SOCKS_ATYP_IPV4)
-    inet_ntop(AF_INET, &r->dest_addr.ipv4, dest_str, sizeof(dest_str));
-
-  logger_access(s->username, &s->client_addr, dest_str, r->dest_port, true);
   selector_set_interest(key->s, s->client_fd, OP_WRITE);
   selector_set_interest(key->s, s->origin_fd, OP_NOOP);
   return request_marshall_reply(key, SOCKS_REPLY_SUCCEEDED);
 }
 
+void request_connecting_departure(const unsigned state,
+                                  struct selector_key* key) {
+  (void)state;
+  struct socks5* s = ATTACHMENT(key);
+  struct connect_st* c = &s->client.request.connect;
+
+  for (unsigned i = 0; i < HE_MAX_ATTEMPTS; i++) {
+    connect_drop_fd(key->s, &c->attempts[i]);
+  }
+  c->inflight = 0;
+}
+
+// On an attempt's fd it means the next attempt is due; on the client's, that
+// resolving and connecting took longer than --connect-timeout.
+unsigned request_timeout(struct selector_key* key) {
+  struct socks5* s = ATTACHMENT(key);
+  struct request_st* r = &s->client.request;
+
+  if (key->fd != s->client_fd) {
+    return connect_launch(key);
+  }
+
+  LOG_INFO("Connection to %s:%u timed out\n",
+           r->atyp == SOCKS_ATYP_DOMAIN ? r->dest_addr.fqdn : "origin",
+           r->dest_port);
+  if (s->resolve_job != NULL) {
+    resolver_cancel(s->resolve_job);
+    s->resolve_job = NULL;
+  }
+  return request_marshall_reply(key, SOCKS_REPLY_TTL_EXPIRED);
+}
+
 unsigned request_write(struct selector_key* key) {
   struct socks5* s = ATTACHMENT(key);
   struct request_st* r = &s->client.request;
@@ -5,19 +5,28 @@
 #include <sys/socket.h>
 #include <unistd.h>
 
+#include "admission.h"
+#include "args.h"
 #include "selector.h"
 #include "socks5_internal.h"
 #include "socks5nio.h"
 #include "metrics.h"
+#include "user_stats.h"
 #include "logger.h"
+#include "resolver.h"
+#include "verifier.h"
+
+extern struct socks5args socks5args;
 
 // =============================================================================
 // Connection Pool
 // =============================================================================
 
+// Each worker thread keeps its own pool, so sessions are recycled without
+// any locking (see --workers in main.c).
 static const unsigned max_pool = 50;
-static unsigned pool_size = 0;
-static struct socks5 *pool = NULL;
+static _Thread_local unsigned pool_size = 0;
+static _Thread_local struct socks5 *pool = NULL;
 
 static struct socks5 *socks5_new(int client_fd) {
   struct socks5 *s = pool;
@@ -34,25 +43,66 @@ static struct socks5 *socks5_new(int client_fd) {
   s->client_fd = client_fd;
   s->origin_fd = -1;
   s->references = 1;
-  buffer_init(&s->read_buffer, BUFFER_SIZE, s->read_buffer_data);
-  buffer_init(&s->write_buffer, BUFFER_SIZE, s->write_buffer_data);
+  buffer_init(&s->read_buffer, HANDSHAKE_BUFFER_SIZE, s->handshake_read_data);
+  buffer_init(&s->write_buffer, HANDSHAKE_BUFFER_SIZE,
+              s->handshake_write_data);
   return s;
 }
 
 static void socks5_destroy_(struct socks5 *s) {
-  if (s->origin_resolution)
-    freeaddrinfo(s->origin_resolution);
   if (s->username)
     free(s->username);
   free(s);
 }
 
-static void socks5_destroy(struct socks5 *s) {
+// One access log record per session that got to send a request, written
+// when its last fd is gone (whether the state machine or the tunnel closed
+// it)
+static void socks5_log_access(const struct socks5 *s) {
+  if (s->dest_host[0] == '\0')
+    return;
+  logger_access(&(struct log_access){
+      .username = s->username,
+      .client_addr = &s->client_addr,
+      .dest_host = s->dest_host,
+      .dest_port = s->dest_port,
+      .status = s->reply,
+      .bytes_up = s->bytes_up,
+      .bytes_down = s->bytes_down,
+      .duration_us = metrics_clock_us() - s->accepted_at,
+  });
+}
+
+// Gives back what an accepted session took, once its last fd is gone:
+// nothing may read the session after that (see socksv5_done())
+static void socks5_account_close(fd_selector sel, const struct socks5 *s) {
+  if (s->accepted_at == 0)
+    return;
+  metrics_latency_since(METRICS_LATENCY_SESSION, s->accepted_at);
+  metrics_session_state(s->state, -1);
+  user_stats_session_close(s->user);
+  admission_release(sel, &s->client_addr);
+  metrics_close_connection();
+}
+
+static void socks5_destroy(fd_selector sel, struct socks5 *s) {
   if (!s)
     return;
   if (s->references == 1) {
-    if (s->origin_resolution) {
-      freeaddrinfo(s->origin_resolution);
+    socks5_log_access(s);
+    socks5_account_close(sel, s);
+    copy_close(s);
+    if (s->resolve_job) {
+      resolver_cancel(s->resolve_job);
+      s->resolve_job = NULL;
+    }
+    if (s->verify_job) {
+      verifier_cancel(s->verify_job);
+      s->verify_job = NULL;
+    }
+    if (s->origin_answer) {
+      resolver_answer_release(s->origin_answer);
+      s->origin_answer = NULL;
       s->origin_resolution = NULL;
     }
     if (s->username) {
@@ -96,29 +146,129 @@ static void error_arrival(const unsigned state, struct selector_key *key) {
   (void)key;
 }
 
+// A client that stalls before the tunnel is up only gets to waste its slot
+// until the deadline.
+static unsigned handshake_timeout(struct selector_key *key) {
+  LOG_INFO("Client fd %d timed out during the handshake\n", key->fd);
+  return ERROR;
+}
+
 static const struct state_definition client_states[] = {
     {.state = HELLO_READ,
      .on_arrival = hello_read_init,
-     .on_read_ready = hello_read},
-    {.state = HELLO_WRITE, .on_write_ready = hello_write},
+     .on_read_ready = hello_read,
+     .on_timeout = handshake_timeout},
+    {.state = HELLO_WRITE,
+     .on_write_ready = hello_write,
+     .on_timeout = handshake_timeout},
     {.state = AUTH_READ,
      .on_arrival = auth_read_init,
-     .on_read_ready = auth_read},
-    {.state = AUTH_WRITE, .on_write_ready = auth_write},
+     .on_read_ready = auth_read,
+     .on_timeout = handshake_timeout},
+    {.state = AUTH_VERIFYING,
+     .on_block_ready = auth_verifying,
+     .on_timeout = handshake_timeout},
+    {.state = AUTH_WRITE,
+     .on_write_ready = auth_write,
+     .on_timeout = handshake_timeout},
     {.state = REQUEST_READ,
      .on_arrival = request_read_init,
-     .on_read_ready = request_read},
-    {.state = REQUEST_RESOLVING, .on_block_ready = request_resolving},
-    {.state = REQUEST_CONNECTING, .on_write_ready = request_connecting},
-    {.state = REQUEST_WRITE, .on_write_ready = request_write},
+     .on_read_ready = request_read,
+     .on_timeout = handshake_timeout},
+    {.state = REQUEST_RESOLVING,
+     .on_block_ready = request_resolving,
+     .on_timeout = request_timeout},
+    {.state = REQUEST_CONNECTING,
+     .on_write_ready = request_connecting,
+     .on_departure = request_connecting_departure,
+     .on_timeout = request_timeout},
+    {.state = REQUEST_WRITE,
+     .on_write_ready = request_write,
+     .on_timeout = handshake_timeout},
     {.state = COPY,
      .on_arrival = copy_init,
      .on_read_ready = copy_read,
-     .on_write_ready = copy_write},
+     .on_write_ready = copy_write,
+     .on_timeout = copy_timeout,
+     .on_recv_done = copy_recv_done,
+     .on_send_done = copy_send_done},
     {.state = DONE, .on_arrival = done_arrival},
     {.state = ERROR, .on_arrival = error_arrival},
 };
 
+// =============================================================================
+// Deadlines
+// =============================================================================
+
+// Deadline each state of client_states runs under. States in a row under the
+// same one share it, so a client trickling bytes can't stretch the handshake
+// by spreading them over HELLO, AUTH and REQUEST.
+static const uint8_t state_deadlines[] = {
+    [HELLO_READ] = DEADLINE_HANDSHAKE,
+    [HELLO_WRITE] = DEADLINE_HANDSHAKE,
+    [AUTH_READ] = DEADLINE_HANDSHAKE,
+    [AUTH_VERIFYING] = DEADLINE_HANDSHAKE,
+    [AUTH_WRITE] = DEADLINE_HANDSHAKE,
+    [REQUEST_READ] = DEADLINE_HANDSHAKE,
+    [REQUEST_RESOLVING] = DEADLINE_CONNECT,
+    [REQUEST_CONNECTING] = DEADLINE_CONNECT,
+    [REQUEST_WRITE] = DEADLINE_HANDSHAKE,
+    [COPY] = DEADLINE_IDLE,
+    [DONE] = DEADLINE_NONE,
+    [ERROR] = DEADLINE_NONE,
+};
+
+static unsigned deadline_ms(enum session_deadline d) {
+  switch (d) {
+    case DEADLINE_HANDSHAKE:
+      return socks5args.handshake_timeout * 1000;
+    case DEADLINE_CONNECT:
+      return socks5args.connect_timeout * 1000;
+    case DEADLINE_IDLE:
+      return socks5args.idle_timeout * 1000;
+    default:
+      return 0;
+  }
+}
+
+// Arms the client fd's timeout when the session moves under a new deadline
+static void session_deadline(struct selector_key *key,
+                             enum socks5_state st) {
+  struct socks5 *s = ATTACHMENT(key);
+  const enum session_deadline d = state_deadlines[st];
+  if (d == s->deadline) {
+    return;
+  }
+  s->deadline = d;
+  if (d == DEADLINE_IDLE) {
+    s->last_activity = selector_now(key->s);
+  }
+  if (s->client_fd >= 0) {
+    selector_set_timeout(key->s, s->client_fd, deadline_ms(d));
+  }
+}
+
+// =============================================================================
+// Pipelined handshakes
+// =============================================================================
+
+// Clients may send HELLO, the credentials and the request back to back
+// without waiting for the replies. Whatever arrives behind a message stays
+// in read_buffer for the next state, which parses it before reading again
+// (see handshake_recv()), and meanwhile the replies pile up in write_buffer
+// to go out in one send.
+
+// The selector won't wake up a reading state for bytes that were already
+// read, so they are parsed in the same wakeup that moved into it.
+static unsigned handshake_pipelined(struct selector_key *key, unsigned st) {
+  struct socks5 *s = ATTACHMENT(key);
+  while ((st == AUTH_READ || st == REQUEST_READ) &&
+         buffer_can_read(&s->read_buffer)) {
+    st = stm_handler_read(&s->stm, key);
+  }
+  return st;
+}
+
 // =============================================================================
 // Connection Handlers
 // =============================================================================
@@ -127,12 +277,18 @@ static void socksv5_read(struct selector_key *key);
 static void socksv5_write(struct selector_key *key);
 static void socksv5_close(struct selector_key *key);
 static void socksv5_block(struct selector_key *key);
+static void socksv5_timeout(struct selector_key *key);
+static void socksv5_recv(struct selector_key *key, ssize_t n);
+static void socksv5_send(struct selector_key *key, ssize_t n);
 
 const struct fd_handler socks5_handler = {
     .handle_read = socksv5_read,
     .handle_write = socksv5_write,
     .handle_close = socksv5_close,
     .handle_block = socksv5_block,
+    .handle_timeout = socksv5_timeout,
+    .handle_recv = socksv5_recv,
+    .handle_send = socksv5_send,
 };
 
 const struct fd_handler *socks5_get_handler(void) { return &socks5_handler; }
@@ -143,71 +299,126 @@ static void socksv5_done(struct selector_key *key) {
     return;
   s->done = true;
 
-  if (s->client_fd >= 0) {
-    selector_unregister_fd(key->s, s->client_fd);
-    close(s->client_fd);
-    s->client_fd = -1;
+  // Unregistering the last fd frees or pools s, which is accounted for
+  // there (see socks5_destroy()), so it isn't touched once that starts
+  const int fds[] = {s->client_fd, s->origin_fd};
+  s->client_fd = -1;
+  s->origin_fd = -1;
+  for (unsigned i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+    if (fds[i] >= 0) {
+      selector_unregister_fd(key->s, fds[i]);
+      close(fds[i]);
+    }
   }
-  if (s->origin_fd >= 0) {
-    selector_unregister_fd(key->s, s->origin_fd);
-    close(s->origin_fd);
-    s->origin_fd = -1;
+}
+
+_Static_assert(ERROR < METRICS_SESSION_STATES, "states don't fit metrics");
+
+static void session_state(struct socks5 *s, enum socks5_state st) {
+  if (st != s->state) {
+    metrics_session_state(s->state, st);
+    s->state = st;
+  }
+}
+
+static void socksv5_dispatched(struct selector_key *key,
+                               enum socks5_state st) {
+  if (st == DONE || st == ERROR) {
+    socksv5_done(key);
+  } else {
+    session_state(ATTACHMENT(key), st);
+    session_deadline(key, st);
   }
-  metrics_close_connection();
 }
 
 static void socksv5_read(struct selector_key *key) {
   struct state_machine *stm = &ATTACHMENT(key)->stm;
-  const enum socks5_state st = stm_handler_read(stm, key);
-  if (st == DONE || st == ERROR)
-    socksv5_done(key);
+  socksv5_dispatched(key,
+                     handshake_pipelined(key, stm_handler_read(stm, key)));
 }
 
 static void socksv5_write(struct selector_key *key) {
   struct state_machine *stm = &ATTACHMENT(key)->stm;
-  const enum socks5_state st = stm_handler_write(stm, key);
-  if (st == DONE || st == ERROR)
-    socksv5_done(key);
+  socksv5_dispatched(key, stm_handler_write(stm, key));
 }
 
 static void socksv5_block(struct selector_key *key) {
   struct state_machine *stm = &ATTACHMENT(key)->stm;
-  const enum socks5_state st = stm_handler_block(stm, key);
-  if (st == DONE || st == ERROR)
-    socksv5_done(key);
+  // Password checks and resolutions are the only blocking work; a late
+  // notification for a session that moved on (or for a recycled fd) is
+  // simply dropped.
+  const unsigned state = stm_state(stm);
+  if (state != AUTH_VERIFYING && state != REQUEST_RESOLVING)
+    return;
+  socksv5_dispatched(key,
+                     handshake_pipelined(key, stm_handler_block(stm, key)));
+}
+
+static void socksv5_timeout(struct selector_key *key) {
+  struct state_machine *stm = &ATTACHMENT(key)->stm;
+  socksv5_dispatched(key, stm_handler_timeout(stm, key));
+}
+
+// Only COPY hands reads and sends to the kernel, and leaving it unregisters
+// both fds, which cancels whatever was still in flight.
+static void socksv5_recv(struct selector_key *key, ssize_t n) {
+  struct state_machine *stm = &ATTACHMENT(key)->stm;
+  if (stm_state(stm) != COPY)
+    return;
+  socksv5_dispatched(key, stm_handler_recv(stm, key, n));
+}
+
+static void socksv5_send(struct selector_key *key, ssize_t n) {
+  struct state_machine *stm = &ATTACHMENT(key)->stm;
+  if (stm_state(stm) != COPY)
+    return;
+  socksv5_dispatched(key, stm_handler_send(stm, key, n));
 }
 
 static void socksv5_close(struct selector_key *key) {
-  socks5_destroy(ATTACHMENT(key));
+  socks5_destroy(key->s, ATTACHMENT(key));
 }
 
-void socksv5_passive_accept(struct selector_key *key) {
+// Takes the connection waiting on the listener, if admission lets it in.
+// Returns false when there's nothing more to accept for now.
+static bool socksv5_accept_one(struct selector_key *key) {
   struct sockaddr_storage client_addr;
   socklen_t client_addr_len = sizeof(client_addr);
 
+  if (admission_pause_if_full(key->s))
+    return false;
+
   int client_fd =
       accept(key->fd, (struct sockaddr *)&client_addr, &client_addr_len);
   if (client_fd < 0)
-    return;
+    return false;
 
-  struct metrics *m = metrics_get();
-  if (m->current_connections >= 500) {
-    LOG_WARNING("Connection limit reached, rejecting client\n");
-    close(client_fd);
-    return;
+  switch (admission_acquire(&client_addr)) {
+    case ADMISSION_OK:
+      break;
+    case ADMISSION_IP_FULL:
+      LOG_DEBUG("Per address connection limit reached, rejecting client\n");
+      admission_refuse(client_fd);
+      return true;
+    default:
+      LOG_DEBUG("Connection limit reached, rejecting client\n");
+      admission_refuse(client_fd);
+      return false;
   }
 
   if (selector_fd_set_nio(client_fd) < 0) {
     LOG_ERROR("Failed to set client socket non-blocking\n");
+    admission_release(key->s, &client_addr);
     close(client_fd);
-    return;
+    return true;
   }
 
   struct socks5 *s = socks5_new(client_fd);
   if (s == NULL) {
     LOG_ERROR("Failed to allocate connection state\n");
+    admission_release(key->s, &client_addr);
     close(client_fd);
-    return;
+    return true;
   }
 
   memcpy(&s->client_addr, &client_addr, client_addr_len);
@@ -220,10 +431,26 @@ void socksv5_passive_accept(struct selector_key *key) {
   if (selector_register(key->s, client_fd, &socks5_handler, OP_READ, s) !=
       SELECTOR_SUCCESS) {
     LOG_ERROR("Failed to register client socket\n");
-    socks5_destroy(s);
+    admission_release(key->s, &client_addr);
+    socks5_destroy(key->s, s);
     close(client_fd);
-    return;
+    return true;
   }
+  s->accepted_at = metrics_clock_us();
+  s->state = HELLO_READ;
+  metrics_session_state(-1, HELLO_READ);
+  s->deadline = DEADLINE_HANDSHAKE;
+  selector_set_timeout(key->s, client_fd, deadline_ms(DEADLINE_HANDSHAKE));
   metrics_new_connection();
   LOG_DEBUG("New client connection accepted (fd=%d)\n", client_fd);
+  return true;
+}
+
+// A burst of clients is taken in one wakeup, up to ACCEPT_BATCH, rather
+// than one per trip through the selector
+#define ACCEPT_BATCH 32
+
+void socksv5_passive_accept(struct selector_key *key) {
+  for (int i = 0; i < ACCEPT_BATCH && socksv5_accept_one(key); i++) {
+  }
 }
@@ -100,6 +100,73 @@ START_TEST(test_basic) {
 }
 END_TEST
 
+START_TEST(test_init_at) {
+  struct parser parser;
+  parser_init_at(&parser, parser_no_classes(), &definition);
+  assert_eq(FOO, 'f', parser_feed(&parser, 'f'));
+  assert_eq(BAR, 'B', parser_feed(&parser, 'B'));
+  // 0xFF también tiene clase
+  assert_eq(BAR, 0xFF, parser_feed(&parser, 0xFF));
+
+  parser_reset(&parser);
+  assert_eq(FOO, 'F', parser_feed(&parser, 'F'));
+}
+END_TEST
+
+START_TEST(test_table) {
+  struct parser_table *t = parser_table_compile(parser_no_classes(), &definition);
+  ck_assert_ptr_ne(NULL, t);
+
+  // la tabla tiene que dar los mismos eventos que la lista de transiciones
+  struct parser slow, fast;
+  parser_init_at(&slow, parser_no_classes(), &definition);
+  parser_init_at(&fast, parser_no_classes(), &definition);
+  parser_use_table(&fast, t);
+  for (unsigned i = 0; i < 2 * 0x100; i++) {
+    const uint8_t c = (i * 7) & 0xFF;
+    const struct parser_event *e = parser_feed(&slow, c);
+    assert_eq(e->type, c, parser_feed(&fast, c));
+  }
+
+  parser_table_destroy(t);
+}
+END_TEST
+
+START_TEST(test_feed_buffer) {
+  struct parser_table *t = parser_table_compile(parser_no_classes(), &definition);
+  const uint8_t in[] = "xxFyyyfFz";
+  const struct parser_event *e;
+
+  for (int compiled = 0; compiled < 2; compiled++) {
+    struct parser parser;
+    parser_init_at(&parser, parser_no_classes(), &definition);
+    parser_use_table(&parser, compiled ? t : NULL);
+
+    // se detiene solo en los eventos pedidos
+    size_t n = parser_feed_buffer(&parser, in, sizeof(in) - 1,
+                                  PARSER_EVENT_BIT(FOO), &e);
+    ck_assert_uint_eq(3, n);
+    assert_eq(FOO, 'F', e);
+    n += parser_feed_buffer(&parser, in + n, sizeof(in) - 1 - n,
+                            PARSER_EVENT_BIT(FOO), &e);
+    ck_assert_uint_eq(7, n);
+    assert_eq(FOO, 'f', e);
+    n += parser_feed_buffer(&parser, in + n, sizeof(in) - 1 - n,
+                            PARSER_EVENT_BIT(FOO), &e);
+    ck_assert_uint_eq(8, n);
+
+    // sin eventos pedidos consume todo y el estado queda al día
+    n += parser_feed_buffer(&parser, in + n, sizeof(in) - 1 - n,
+                            PARSER_EVENT_BIT(FOO), &e);
+    ck_assert_uint_eq(sizeof(in) - 1, n);
+    ck_assert_ptr_eq(NULL, e);
+    assert_eq(BAR, 'q', parser_feed(&parser, 'q'));
+  }
+
+  parser_table_destroy(t);
+}
+END_TEST
+
 Suite *suite(void) {
   Suite *s;
   TCase *tc;
@@ -110,6 +177,9 @@ Suite *suite(void) {
   tc = tcase_create("parser_utils");
 
   tcase_add_test(tc, test_basic);
+  tcase_add_test(tc, test_init_at);
+  tcase_add_test(tc, test_table);
+  tcase_add_test(tc, test_feed_buffer);
   suite_add_tcase(s, tc);
 
   return s;
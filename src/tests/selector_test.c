@@ -37,7 +37,7 @@ START_TEST (test_next_capacity) {
         ITEMS_MAX_SIZE + 1, ITEMS_MAX_SIZE,
     };
     for(unsigned i = 0; i < N(data) / 2; i++ ) {
-        ck_assert_uint_eq(data[i * 2 + 1] + 1, next_capacity(data[i*2]));
+        ck_assert_uint_eq(data[i * 2 + 1] + 1, next_capacity_max(data[i*2], ITEMS_MAX_SIZE));
     }
 }
 END_TEST
@@ -151,6 +151,252 @@ START_TEST (test_selector_register_unregister_register) {
 }
 END_TEST
 
+static unsigned read_count = 0;
+static void
+read_callback(struct selector_key *key) {
+    char c;
+    ck_assert_int_eq(1, read(key->fd, &c, 1));
+    ck_assert_ptr_eq(data_mark, key->data);
+    read_count++;
+}
+
+START_TEST (test_epoll_ensure_capacity) {
+    conf.backend = SELECTOR_BACKEND_EPOLL;
+    fd_selector s = selector_new(INITIAL_SIZE);
+    conf.backend = SELECTOR_BACKEND_SELECT;
+    ck_assert_ptr_nonnull(s);
+    ck_assert_int_eq(SELECTOR_BACKEND_EPOLL, selector_get_backend(s));
+
+    // epoll no está atado a FD_SETSIZE
+    ck_assert_int_eq(SELECTOR_SUCCESS, ensure_capacity(s, ITEMS_MAX_SIZE + 1));
+    ck_assert_uint_gt(s->fd_size, ITEMS_MAX_SIZE + 1);
+    ck_assert_int_eq(SELECTOR_MAXFD,
+                     ensure_capacity(s, EPOLL_ITEMS_MAX_SIZE + 1));
+
+    selector_destroy(s);
+}
+END_TEST
+
+static void
+check_select_dispatch(const selector_backend backend) {
+    read_count = 0;
+    conf.backend = backend;
+    conf.select_timeout.tv_sec  = 0;
+    conf.select_timeout.tv_nsec = 10 * 1000 * 1000;
+    fd_selector s = selector_new(INITIAL_SIZE);
+    conf.backend = SELECTOR_BACKEND_SELECT;
+    ck_assert_ptr_nonnull(s);
+
+    int p[2];
+    ck_assert_int_eq(0, pipe(p));
+    const struct fd_handler h = {
+        .handle_read   = read_callback,
+    };
+    // sin interés no hay eventos
+    ck_assert_uint_eq(SELECTOR_SUCCESS,
+                      selector_register(s, p[0], &h, OP_NOOP, data_mark));
+    ck_assert_int_eq(1, write(p[1], "x", 1));
+    ck_assert_uint_eq(SELECTOR_SUCCESS, selector_select(s));
+    ck_assert_uint_eq(0, read_count);
+
+    ck_assert_uint_eq(SELECTOR_SUCCESS, selector_set_interest(s, p[0], OP_READ));
+    ck_assert_uint_eq(SELECTOR_SUCCESS, selector_select(s));
+    ck_assert_uint_eq(1, read_count);
+
+    // nada pendiente: timeout sin despachar
+    ck_assert_uint_eq(SELECTOR_SUCCESS, selector_select(s));
+    ck_assert_uint_eq(1, read_count);
+
+    // level-triggered: lo que quede sin leer se vuelve a reportar
+    ck_assert_int_eq(2, write(p[1], "xy", 2));
+    ck_assert_uint_eq(SELECTOR_SUCCESS, selector_select(s));
+    ck_assert_uint_eq(SELECTOR_SUCCESS, selector_select(s));
+    ck_assert_uint_eq(3, read_count);
+
+    ck_assert_uint_eq(SELECTOR_SUCCESS, selector_unregister_fd(s, p[0]));
+    close(p[0]);
+    close(p[1]);
+    selector_destroy(s);
+}
+
+START_TEST (test_epoll_select_dispatch) {
+    check_select_dispatch(SELECTOR_BACKEND_EPOLL);
+
+    // un fd cerrado no puede registrarse en epoll
+    conf.backend = SELECTOR_BACKEND_EPOLL;
+    fd_selector s = selector_new(INITIAL_SIZE);
+    conf.backend = SELECTOR_BACKEND_SELECT;
+    int p[2];
+    ck_assert_int_eq(0, pipe(p));
+    close(p[0]);
+    close(p[1]);
+    const struct fd_handler h = {
+        .handle_read   = read_callback,
+    };
+    ck_assert_uint_eq(SELECTOR_IO,
+                      selector_register(s, p[0], &h, OP_READ, data_mark));
+    ck_assert_int_eq(FD_UNUSED, s->fds[p[0]].fd);
+    selector_destroy(s);
+}
+END_TEST
+
+START_TEST (test_uring_select_dispatch) {
+    conf.backend = SELECTOR_BACKEND_IO_URING;
+    fd_selector s = selector_new(INITIAL_SIZE);
+    conf.backend = SELECTOR_BACKEND_SELECT;
+    ck_assert_ptr_nonnull(s);
+    // sin soporte del kernel se degrada a epoll
+    const selector_backend backend = selector_get_backend(s);
+    ck_assert(backend == SELECTOR_BACKEND_IO_URING
+           || backend == SELECTOR_BACKEND_EPOLL);
+    selector_destroy(s);
+
+    check_select_dispatch(SELECTOR_BACKEND_IO_URING);
+}
+END_TEST
+
+static unsigned op_count = 0;
+static ssize_t op_result = 0;
+static void
+op_callback(struct selector_key *key, ssize_t n) {
+    ck_assert_ptr_eq(data_mark, key->data);
+    op_result = n;
+    op_count++;
+}
+
+static void
+select_until_ops(fd_selector s, unsigned n) {
+    for (int i = 0; i < 100 && op_count < n; i++) {
+        ck_assert_uint_eq(SELECTOR_SUCCESS, selector_select(s));
+    }
+    ck_assert_uint_eq(n, op_count);
+}
+
+START_TEST (test_uring_completions) {
+    op_count = 0;
+    conf.backend = SELECTOR_BACKEND_IO_URING;
+    conf.select_timeout.tv_sec  = 0;
+    conf.select_timeout.tv_nsec = 10 * 1000 * 1000;
+    fd_selector s = selector_new(INITIAL_SIZE);
+    conf.backend = SELECTOR_BACKEND_SELECT;
+    ck_assert_ptr_nonnull(s);
+    if (!selector_has_completions(s)) {
+        // sin io_uring no hay operaciones por completion
+        ck_assert_uint_eq(SELECTOR_IARGS, selector_recv(s, 0, NULL, 0));
+        selector_destroy(s);
+        return;
+    }
+
+    int a[2], b[2];
+    ck_assert_int_eq(0, socketpair(AF_UNIX, SOCK_STREAM, 0, a));
+    ck_assert_int_eq(0, socketpair(AF_UNIX, SOCK_STREAM, 0, b));
+    const struct fd_handler h = {
+        .handle_recv = op_callback,
+        .handle_send = op_callback,
+    };
+    ck_assert_uint_eq(SELECTOR_SUCCESS,
+                      selector_register(s, a[0], &h, OP_NOOP, data_mark));
+    ck_assert_uint_eq(SELECTOR_SUCCESS,
+                      selector_register(s, b[0], &h, OP_NOOP, data_mark));
+
+    // el kernel recibe sobre el buffer cuando llegan los datos
+    char buf[8];
+    ck_assert_uint_eq(SELECTOR_SUCCESS,
+                      selector_recv(s, a[0], buf, sizeof(buf)));
+    ck_assert_uint_eq(SELECTOR_FDINUSE,
+                      selector_recv(s, a[0], buf, sizeof(buf)));
+    ck_assert_uint_eq(SELECTOR_SUCCESS, selector_select(s));
+    ck_assert_uint_eq(0, op_count);
+    ck_assert_int_eq(4, write(a[1], "hola", 4));
+    select_until_ops(s, 1);
+    ck_assert_int_eq(4, op_result);
+    ck_assert_int_eq(0, memcmp(buf, "hola", 4));
+
+    ck_assert_uint_eq(SELECTOR_SUCCESS,
+                      selector_send(s, a[0], "chau", 4, MSG_NOSIGNAL));
+    select_until_ops(s, 2);
+    ck_assert_int_eq(4, op_result);
+    ck_assert_int_eq(4, read(a[1], buf, sizeof(buf)));
+    ck_assert_int_eq(0, memcmp(buf, "chau", 4));
+
+    // desregistrar cancela lo que está en curso sin llamar al handler, y
+    // lo que completa mientras tanto en otro fd se despacha después
+    char other[8];
+    ck_assert_uint_eq(SELECTOR_SUCCESS,
+                      selector_recv(s, a[0], buf, sizeof(buf)));
+    ck_assert_uint_eq(SELECTOR_SUCCESS,
+                      selector_recv(s, b[0], other, sizeof(other)));
+    ck_assert_int_eq(1, write(b[1], "x", 1));
+    ck_assert_uint_eq(SELECTOR_SUCCESS, selector_unregister_fd(s, a[0]));
+    ck_assert_uint_eq(2, op_count);
+    ck_assert_uint_eq(1, s->stash_len);
+    select_until_ops(s, 3);
+    ck_assert_int_eq(1, op_result);
+    ck_assert_uint_eq(0, s->stash_len);
+
+    ck_assert_uint_eq(SELECTOR_SUCCESS, selector_unregister_fd(s, b[0]));
+    close(a[0]);
+    close(a[1]);
+    close(b[0]);
+    close(b[1]);
+    selector_destroy(s);
+}
+END_TEST
+
+static unsigned timeout_count = 0;
+static void
+timeout_callback(struct selector_key *key) {
+    ck_assert_ptr_eq(data_mark, key->data);
+    timeout_count++;
+}
+
+static void
+check_select_timeout(const selector_backend backend) {
+    timeout_count = 0;
+    conf.backend = backend;
+    conf.select_timeout.tv_sec  = 5;
+    conf.select_timeout.tv_nsec = 0;
+    fd_selector s = selector_new(INITIAL_SIZE);
+    conf.backend = SELECTOR_BACKEND_SELECT;
+    ck_assert_ptr_nonnull(s);
+
+    int p[2];
+    ck_assert_int_eq(0, pipe(p));
+    const struct fd_handler h = {
+        .handle_timeout = timeout_callback,
+    };
+    ck_assert_uint_eq(SELECTOR_SUCCESS,
+                      selector_register(s, p[0], &h, OP_NOOP, data_mark));
+    ck_assert_uint_eq(SELECTOR_IARGS, selector_set_timeout(s, p[1], 20));
+    ck_assert_uint_eq(SELECTOR_SUCCESS, selector_set_timeout(s, p[0], 20));
+
+    // el selector no espera los 5 segundos sino hasta el vencimiento
+    const uint64_t start = monotonic_ms();
+    while (timeout_count == 0) {
+        ck_assert_uint_eq(SELECTOR_SUCCESS, selector_select(s));
+    }
+    ck_assert_uint_ge(selector_now(s) - start, 20);
+    ck_assert_uint_lt(selector_now(s) - start, 1000);
+    ck_assert_uint_eq(1, timeout_count);
+    ck_assert_int_eq(-1, timer_wheel_next(&s->timers));
+
+    // desregistrar lo cancela
+    ck_assert_uint_eq(SELECTOR_SUCCESS, selector_set_timeout(s, p[0], 1));
+    ck_assert_uint_eq(SELECTOR_SUCCESS, selector_unregister_fd(s, p[0]));
+    ck_assert_int_eq(-1, timer_wheel_next(&s->timers));
+
+    close(p[0]);
+    close(p[1]);
+    selector_destroy(s);
+}
+
+START_TEST (test_select_timeout) {
+    check_select_timeout(SELECTOR_BACKEND_SELECT);
+    check_select_timeout(SELECTOR_BACKEND_EPOLL);
+    check_select_timeout(SELECTOR_BACKEND_IO_URING);
+}
+END_TEST
+
 Suite * 
 suite(void) {
     Suite *s  = suite_create("nio");
@@ -161,6 +407,11 @@ suite(void) {
     tcase_add_test(tc, test_ensure_capacity);
     tcase_add_test(tc, test_selector_register_fd);
     tcase_add_test(tc, test_selector_register_unregister_register);
+    tcase_add_test(tc, test_epoll_ensure_capacity);
+    tcase_add_test(tc, test_epoll_select_dispatch);
+    tcase_add_test(tc, test_uring_select_dispatch);
+    tcase_add_test(tc, test_uring_completions);
+    tcase_add_test(tc, test_select_timeout);
     suite_add_tcase(s, tc);
 
     return s;
@@ -0,0 +1,109 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// asi se puede probar las funciones internas
+#include "sha256.c"
+
+// compara `len' bytes con su representación hexadecimal
+static void assert_hex(const char *expected, const uint8_t *got, size_t len) {
+  char hex[2 * 64 + 1];
+  ck_assert_uint_le(len, 64);
+  for (size_t i = 0; i < len; i++) {
+    sprintf(hex + 2 * i, "%02x", got[i]);
+  }
+  ck_assert_str_eq(expected, hex);
+}
+
+START_TEST(test_sha256_vectors) {
+  uint8_t out[SHA256_DIGEST_SIZE];
+
+  sha256("", 0, out);
+  assert_hex("e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855",
+             out, sizeof(out));
+  sha256("abc", 3, out);
+  assert_hex("ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad",
+             out, sizeof(out));
+
+  // 56 bytes: el relleno no entra en el mismo bloque
+  const char *two_blocks =
+      "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+  sha256(two_blocks, strlen(two_blocks), out);
+  assert_hex("248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1",
+             out, sizeof(out));
+
+  // un millón de 'a', de a pedazos que no coinciden con los bloques
+  struct sha256 ctx;
+  char a[997];
+  memset(a, 'a', sizeof(a));
+  sha256_init(&ctx);
+  size_t left = 1000000;
+  while (left > 0) {
+    const size_t n = left < sizeof(a) ? left : sizeof(a);
+    sha256_update(&ctx, a, n);
+    left -= n;
+  }
+  sha256_final(&ctx, out);
+  assert_hex("cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0",
+             out, sizeof(out));
+}
+END_TEST
+
+START_TEST(test_hmac_sha256_vectors) {
+  // RFC 4231, casos 1 y 6
+  uint8_t out[SHA256_DIGEST_SIZE];
+  uint8_t key[131];
+
+  memset(key, 0x0b, 20);
+  hmac_sha256(key, 20, "Hi There", 8, out);
+  assert_hex("b0344c61d8db38535ca8afceaf0bf12b881dc200c9833da726e9376c2e32cff7",
+             out, sizeof(out));
+
+  // clave más larga que un bloque
+  const char *msg = "Test Using Larger Than Block-Size Key - Hash Key First";
+  memset(key, 0xaa, sizeof(key));
+  hmac_sha256(key, sizeof(key), msg, strlen(msg), out);
+  assert_hex("60e431591ee0b67f0d8a26aacbf5b77f8e0bc6213728c5140546040f0ee37f54",
+             out, sizeof(out));
+}
+END_TEST
+
+START_TEST(test_pbkdf2_sha256_vectors) {
+  // RFC 7914, sección 11: dos bloques de salida
+  uint8_t out[64];
+  pbkdf2_sha256("passwd", 6, "salt", 4, 1, out, sizeof(out));
+  assert_hex("55ac046e56e3089fec1691c22544b605f94185216dde0465e68b9d57c20dacbc"
+             "49ca9cccf179b645991664b39d77ef317c71b845b1e30bd509112041d3a19783",
+             out, sizeof(out));
+  pbkdf2_sha256("Password", 8, "NaCl", 4, 80000, out, sizeof(out));
+  assert_hex("4ddcd8f60b98be21830cee5ef22701f9641a4418d04c0414aeff08876b34ab56"
+             "a1d425a1225833549adb841b51c9b3176a272bdebba1d078478f62b397f33c8d",
+             out, sizeof(out));
+
+  // salida más corta que un digest
+  pbkdf2_sha256("password", 8, "salt", 4, 4096, out, 20);
+  assert_hex("c5e478d59288c841aa530db6845c4c8d962893a0", out, 20);
+}
+END_TEST
+
+Suite *suite(void) {
+  Suite *s = suite_create("sha256");
+  TCase *tc = tcase_create("sha256");
+
+  tcase_add_test(tc, test_sha256_vectors);
+  tcase_add_test(tc, test_hmac_sha256_vectors);
+  tcase_add_test(tc, test_pbkdf2_sha256_vectors);
+  suite_add_tcase(s, tc);
+
+  return s;
+}
+
+int main(void) {
+  SRunner *sr = srunner_create(suite());
+  int number_failed;
+
+  srunner_run_all(sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
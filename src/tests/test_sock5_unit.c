@@ -1,15 +1,35 @@
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <time.h>
 #include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <arpa/inet.h>
 #include <sys/select.h>
 
 #include "socks5_internal.h"
 #include "args.h"
+#include "resolver.h"
 #include "buffer.h"
+#include "metrics.h"
+#include "metrics_http.h"
+#include "user_db.h"
+#include "user_stats.h"
+#include "verifier.h"
+#include "logger.h"
+#include "management.h"
+#include "access_log.h"
+#include "admission.h"
+#include "pop3_sniffer.h"
+#include "auth_parser.h"
+#include "request_parser.h"
 
 // =============================================================================
 // MOCKS (Stubs for dependencies)
@@ -36,22 +56,86 @@ selector_status selector_set_interest(fd_selector s, int fd, fd_interest i) {
     return SELECTOR_SUCCESS;
 }
 selector_status selector_set_interest_key(struct selector_key *key, fd_interest i) { (void)key; (void)i; return SELECTOR_SUCCESS; }
-selector_status selector_register(fd_selector s, int fd, const struct fd_handler *handler, fd_interest interest, void *data) { (void)s; (void)fd; (void)handler; (void)interest; (void)data; return SELECTOR_SUCCESS; }
-selector_status selector_unregister_fd(fd_selector s, int fd) {
+// Whole sessions, from socksv5_passive_accept() on, once a test turns the
+// registry on: registered fds are kept, pump() stands in for the selector
+// loop and unregistering closes them like the selector does
+static bool mock_registry = false;
+static const struct fd_handler *handler_by_fd[FD_SETSIZE];
+static void *data_by_fd[FD_SETSIZE];
+selector_status selector_register(fd_selector s, int fd, const struct fd_handler *handler, fd_interest interest, void *data) {
     (void)s;
+    if (mock_registry && fd >= 0 && fd < FD_SETSIZE) {
+        handler_by_fd[fd] = handler;
+        data_by_fd[fd] = data;
+        interest_by_fd[fd] = interest;
+    }
+    return SELECTOR_SUCCESS;
+}
+selector_status selector_unregister_fd(fd_selector s, int fd) {
     if (fd >= 0 && fd < FD_SETSIZE) {
         interest_by_fd[fd] = OP_NOOP;
+        const struct fd_handler *h = handler_by_fd[fd];
+        handler_by_fd[fd] = NULL;
+        if (h != NULL && h->handle_close != NULL) {
+            struct selector_key key = {.s = s, .fd = fd, .data = data_by_fd[fd]};
+            h->handle_close(&key);
+        }
+    }
+    return SELECTOR_SUCCESS;
+}
+int selector_fd_set_nio(int fd) {
+    if (!mock_registry) {
+        return 0;
+    }
+    return fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+// Timeouts: the clock is driven by the tests, armed timeouts are recorded
+static uint64_t mock_now = 0;
+static unsigned timeout_by_fd[FD_SETSIZE];
+selector_status selector_set_timeout(fd_selector s, int fd, unsigned ms) {
+    (void)s;
+    if (fd >= 0 && fd < FD_SETSIZE) {
+        timeout_by_fd[fd] = ms;
     }
     return SELECTOR_SUCCESS;
 }
-int selector_fd_set_nio(int fd) { (void)fd; return 0; }
+uint64_t selector_now(fd_selector s) { (void)s; return mock_now; }
 
-// Mock socks5_handler
-const struct fd_handler socks5_handler = {
-    .handle_read = NULL,
-    .handle_write = NULL,
-    .handle_close = NULL,
+// Reads and sends handed to the kernel, once a test turns completions on;
+// the test plays the kernel and clears `pending` before reporting back
+struct mock_op {
+    const uint8_t *buf;
+    size_t len;
+    bool pending;
 };
+static bool mock_completions = false;
+static struct mock_op recv_by_fd[FD_SETSIZE], send_by_fd[FD_SETSIZE];
+bool selector_has_completions(fd_selector s) { (void)s; return mock_completions; }
+static selector_status mock_submit(struct mock_op *op, const void *buf, size_t len) {
+    if (op->pending) {
+        return SELECTOR_FDINUSE;
+    }
+    *op = (struct mock_op){.buf = buf, .len = len, .pending = true};
+    return SELECTOR_SUCCESS;
+}
+selector_status selector_recv(fd_selector s, int fd, void *buf, size_t len) {
+    (void)s;
+    return mock_submit(&recv_by_fd[fd], buf, len);
+}
+selector_status selector_send(fd_selector s, int fd, const void *buf, size_t len, int flags) {
+    (void)s; (void)flags;
+    return mock_submit(&send_by_fd[fd], buf, len);
+}
+
+// Records which fd the resolver or verifier woke up (called from one of their
+// threads)
+static volatile int notified_fd = -1;
+selector_status selector_notify_block(fd_selector s, const int fd) {
+    (void)s;
+    __atomic_store_n(&notified_fd, fd, __ATOMIC_SEQ_CST);
+    return SELECTOR_SUCCESS;
+}
 
 // =============================================================================
 // TEST HARNESS
@@ -85,8 +169,8 @@ void setup_env(struct test_env *env) {
     
     // Initialize the socks5 struct
     memset(&env->data, 0, sizeof(env->data));
-    buffer_init(&env->data.read_buffer, BUFFER_SIZE, env->data.read_buffer_data);
-    buffer_init(&env->data.write_buffer, BUFFER_SIZE, env->data.write_buffer_data);
+    buffer_init(&env->data.read_buffer, HANDSHAKE_BUFFER_SIZE, env->data.handshake_read_data);
+    buffer_init(&env->data.write_buffer, HANDSHAKE_BUFFER_SIZE, env->data.handshake_write_data);
     
     // Setup the selector key
     env->key.fd = env->server_fd;
@@ -120,8 +204,8 @@ static void setup_copy_env(struct copy_test_env *env) {
     memset(&env->data, 0, sizeof(env->data));
     env->data.client_fd = env->client_proxy_fd;
     env->data.origin_fd = env->origin_proxy_fd;
-    buffer_init(&env->data.read_buffer, BUFFER_SIZE, env->data.read_buffer_data);
-    buffer_init(&env->data.write_buffer, BUFFER_SIZE, env->data.write_buffer_data);
+    buffer_init(&env->data.read_buffer, HANDSHAKE_BUFFER_SIZE, env->data.handshake_read_data);
+    buffer_init(&env->data.write_buffer, HANDSHAKE_BUFFER_SIZE, env->data.handshake_write_data);
 
     env->key_client.fd = env->client_proxy_fd;
     env->key_client.data = &env->data;
@@ -148,6 +232,27 @@ void write_msg(int fd, const void *buf, size_t count) {
     }
 }
 
+// Waits for a resolver or verifier thread to notify
+static void wait_notified(void) {
+    for (int i = 0; i < 500 && __atomic_load_n(&notified_fd, __ATOMIC_SEQ_CST) < 0; i++) {
+        nanosleep(&(struct timespec){.tv_nsec = 10000000}, NULL);
+    }
+}
+
+// Runs auth_read() and, if the password went to a verifier thread, waits
+// for it and resumes like the selector would
+static unsigned auth_read_verified(struct test_env *env) {
+    notified_fd = -1;
+    unsigned st = auth_read(&env->key);
+    if (st == AUTH_VERIFYING) {
+        wait_notified();
+        assert(notified_fd == env->server_fd);
+        st = auth_verifying(&env->key);
+    }
+    notified_fd = -1;
+    return st;
+}
+
 // =============================================================================
 // UNIT TESTS
 // =============================================================================
@@ -181,8 +286,7 @@ void test_hello_read_user_pass() {
     setup_env(&env);
     
     // Configure server to require a user
-    socks5args.users[0].name = "admin";
-    socks5args.users[0].pass = "1234";
+    user_db_add("admin", 5, "1234");
     
     hello_read_init(HELLO_READ, &env.key);
     
@@ -195,8 +299,7 @@ void test_hello_read_user_pass() {
     assert(ret == HELLO_WRITE);
     assert(env.data.client.hello.method == 0x02); // Should select User/Pass
     
-    // Reset args
-    socks5args.users[0].name = NULL;
+    user_db_destroy();
     teardown_env(&env);
     printf("PASSED\n");
 }
@@ -206,8 +309,7 @@ void test_auth_read_success() {
     struct test_env env;
     setup_env(&env);
     
-    socks5args.users[0].name = "user";
-    socks5args.users[0].pass = "pass";
+    user_db_add("user", 4, "pass");
     
     auth_read_init(AUTH_READ, &env.key);
     
@@ -215,13 +317,13 @@ void test_auth_read_success() {
     uint8_t msg[] = { 0x01, 0x04, 'u', 's', 'e', 'r', 0x04, 'p', 'a', 's', 's' };
     write_msg(env.client_fd, msg, sizeof(msg));
     
-    unsigned ret = auth_read(&env.key);
+    unsigned ret = auth_read_verified(&env);
     
     assert(ret == AUTH_WRITE);
     assert(env.data.client.auth.status == 0x00); // Success
     assert(strcmp(env.data.username, "user") == 0);
     
-    socks5args.users[0].name = NULL;
+    user_db_destroy();
     teardown_env(&env);
     printf("PASSED\n");
 }
@@ -231,8 +333,7 @@ void test_auth_read_failure() {
     struct test_env env;
     setup_env(&env);
     
-    socks5args.users[0].name = "user";
-    socks5args.users[0].pass = "pass";
+    user_db_add("user", 4, "pass");
     
     auth_read_init(AUTH_READ, &env.key);
     
@@ -240,12 +341,12 @@ void test_auth_read_failure() {
     uint8_t msg[] = { 0x01, 0x04, 'u', 's', 'e', 'r', 0x05, 'W', 'R', 'O', 'N', 'G' };
     write_msg(env.client_fd, msg, sizeof(msg));
     
-    unsigned ret = auth_read(&env.key);
+    unsigned ret = auth_read_verified(&env);
     
     assert(ret == AUTH_WRITE);
     assert(env.data.client.auth.status != 0x00); // Failure
     
-    socks5args.users[0].name = NULL;
+    user_db_destroy();
     teardown_env(&env);
     printf("PASSED\n");
 }
@@ -277,6 +378,219 @@ void test_request_parse_ipv4() {
     printf("PASSED\n");
 }
 
+// Feeds msg to a parser in pieces of `step` bytes (all at once if 0) and
+// returns the state it ends in; `extra` trailing bytes must be left unread
+struct parse_run {
+    buffer b;
+    uint8_t data[1024];
+};
+
+static void parse_run_init(struct parse_run *run) {
+    buffer_init(&run->b, sizeof(run->data), run->data);
+}
+
+static void parse_run_add(struct parse_run *run, const uint8_t *msg, size_t n) {
+    size_t room;
+    uint8_t *ptr = buffer_write_ptr(&run->b, &room);
+    assert(room >= n);
+    memcpy(ptr, msg, n);
+    buffer_write_adv(&run->b, n);
+}
+
+static enum auth_state auth_parse(const uint8_t *msg, size_t n, size_t step,
+                                  struct auth_st *a, size_t *left) {
+    struct parse_run run;
+    parse_run_init(&run);
+    memset(a, 0, sizeof(*a));
+    a->rb = &run.b;
+    a->state = AUTH_VERSION;
+    for (size_t i = 0; i < n; i += step == 0 ? n : step) {
+        const size_t len = step == 0 || i + step > n ? n - i : step;
+        parse_run_add(&run, msg + i, len);
+        auth_consume(a);
+    }
+    buffer_read_ptr(&run.b, left);
+    return a->state;
+}
+
+static enum request_state request_parse(const uint8_t *msg, size_t n,
+                                        size_t step, struct request_st *r,
+                                        size_t *left) {
+    struct parse_run run;
+    parse_run_init(&run);
+    memset(r, 0, sizeof(*r));
+    r->rb = &run.b;
+    r->state = REQUEST_VERSION;
+    r->reply = SOCKS_REPLY_GENERAL_FAILURE;
+    for (size_t i = 0; i < n; i += step == 0 ? n : step) {
+        const size_t len = step == 0 || i + step > n ? n - i : step;
+        parse_run_add(&run, msg + i, len);
+        request_consume(r);
+    }
+    buffer_read_ptr(&run.b, left);
+    return r->state;
+}
+
+static void count_method(struct hello_parser *p, const uint8_t method) {
+    ((uint8_t *)p->data)[method]++;
+}
+
+void test_handshake_parsers_whole_and_split() {
+    printf("[TEST] HELLO/AUTH/REQUEST parse the same whole or fragmented... ");
+    // Each message followed by a byte of whatever comes next
+    const uint8_t hello[] = {0x05, 0x03, 0x00, 0x02, 0x02, 0xAA};
+    const uint8_t auth[] = {0x01, 0x03, 'f', 'o', 'o', 0x04, 'p', 'a', 's', 's', 0xAA};
+    const uint8_t ipv6[] = {0x05, 0x01, 0x00, 0x04, 0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0,
+                            0, 0, 0, 0, 0, 0, 0, 1, 0x01, 0xBB, 0xAA};
+    const uint8_t fqdn[] = {0x05, 0x01, 0x00, 0x03, 0x0b, 'e', 'x', 'a', 'm', 'p', 'l',
+                            'e', '.', 'c', 'o', 'm', 0x00, 0x50, 0xAA};
+
+    for (size_t step = 0; step <= 3; step++) {
+        struct parse_run run;
+        parse_run_init(&run);
+        struct hello_parser hp;
+        hello_parser_init(&hp);
+        uint8_t seen[256] = {0};
+        hp.data = seen;
+        hp.on_authentication_method = count_method;
+        bool error;
+        for (size_t i = 0; i < sizeof(hello); i += step == 0 ? sizeof(hello) : step) {
+            const size_t len = step == 0 || i + step > sizeof(hello) ? sizeof(hello) - i : step;
+            parse_run_add(&run, hello + i, len);
+            hello_consume(&run.b, &hp, &error);
+        }
+        size_t left;
+        buffer_read_ptr(&run.b, &left);
+        assert(hp.state == HELLO_DONE && !error && left == 1);
+        assert(seen[0x00] == 1 && seen[0x02] == 2);
+
+        struct auth_st a;
+        assert(auth_parse(auth, sizeof(auth), step, &a, &left) == AUTH_DONE);
+        assert(strcmp(a.username, "foo") == 0 && strcmp(a.password, "pass") == 0);
+        assert(left == 1);
+
+        struct request_st r;
+        assert(request_parse(ipv6, sizeof(ipv6), step, &r, &left) == REQUEST_DONE);
+        assert(r.atyp == SOCKS_ATYP_IPV6 && r.dest_port == 443 && left == 1);
+        assert(r.dest_addr.ipv6.s6_addr[0] == 0x20 && r.dest_addr.ipv6.s6_addr[15] == 1);
+        assert(request_parse(fqdn, sizeof(fqdn), step, &r, &left) == REQUEST_DONE);
+        assert(strcmp(r.dest_addr.fqdn, "example.com") == 0);
+        assert(r.dest_port == 80 && left == 1);
+    }
+
+    // Malformed ones fail the same way whole or not
+    const uint8_t bad_cmd[] = {0x05, 0x02, 0x00, 0x01, 1, 2, 3, 4, 0, 80};
+    const uint8_t bad_atyp[] = {0x05, 0x01, 0x00, 0x02, 1, 2, 3, 4, 0, 80};
+    const uint8_t empty_fqdn[] = {0x05, 0x01, 0x00, 0x03, 0x00, 0, 80};
+    const uint8_t bad_ulen[] = {0x01, 0x00, 0x01, 'x'};
+    for (size_t step = 0; step <= 1; step++) {
+        struct request_st r;
+        size_t left;
+        assert(request_parse(bad_cmd, sizeof(bad_cmd), step, &r, &left) == REQUEST_ERROR);
+        assert(r.reply == SOCKS_REPLY_CMD_NOT_SUPPORTED);
+        assert(request_parse(bad_atyp, sizeof(bad_atyp), step, &r, &left) == REQUEST_ERROR);
+        assert(r.reply == SOCKS_REPLY_ATYP_NOT_SUPPORTED);
+        assert(request_parse(empty_fqdn, sizeof(empty_fqdn), step, &r, &left) == REQUEST_ERROR);
+        struct auth_st a;
+        assert(auth_parse(bad_ulen, sizeof(bad_ulen), step, &a, &left) == AUTH_ERROR);
+    }
+    printf("PASSED\n");
+}
+
+void test_handshake_pipelined() {
+    printf("[TEST] pipelined HELLO+AUTH+REQUEST parsed without waiting, replies coalesced... ");
+    struct test_env env;
+    setup_env(&env);
+    user_db_add("user", 4, "pass");
+
+    // Everything in one write, followed by the first bytes for the origin
+    uint8_t msg[] = { 0x05, 0x01, 0x02,
+                      0x01, 0x04, 'u', 's', 'e', 'r', 0x04, 'p', 'a', 's', 's',
+                      0x05, 0x01, 0x00, 0x01, 127, 0, 0, 1, 0x00, 0x09,
+                      'h', 'i' };
+    write_msg(env.client_fd, msg, sizeof(msg));
+
+    hello_read_init(HELLO_READ, &env.key);
+    assert(hello_read(&env.key) == AUTH_READ);
+    // Not sent yet: it waits for the AUTH reply
+    assert(buffer_can_read(&env.data.write_buffer));
+
+    // The rest is already in the buffer, nothing more comes from the socket
+    auth_read_init(AUTH_READ, &env.key);
+    assert(auth_read_verified(&env) == REQUEST_READ);
+    assert(env.data.client.auth.status == 0x00);
+
+    request_read_init(REQUEST_READ, &env.key);
+    request_read(&env.key);
+    struct request_st *r = &env.data.client.request;
+    assert(r->state == REQUEST_DONE);
+    assert(r->dest_addr.ipv4.s_addr == inet_addr("127.0.0.1"));
+    assert(r->dest_port == 9);
+    request_connecting_departure(REQUEST_CONNECTING, &env.key);
+
+    size_t n;
+    const uint8_t *replies = buffer_read_ptr(&env.data.write_buffer, &n);
+    assert(n >= 4);
+    assert(memcmp(replies, "\x05\x02\x01\x00", 4) == 0);
+    // Left for the tunnel
+    const uint8_t *early = buffer_read_ptr(&env.data.read_buffer, &n);
+    assert(n == 2 && memcmp(early, "hi", 2) == 0);
+
+    user_db_destroy();
+    teardown_env(&env);
+    printf("PASSED\n");
+}
+
+void test_request_domain_resolves_off_loop() {
+    printf("[TEST] request_read (FQDN resolved asynchronously, then cached)... ");
+    struct test_env env;
+    setup_env(&env);
+    assert(resolver_init(1) == 0);
+
+    request_read_init(REQUEST_READ, &env.key);
+
+    // Client sends: Ver 5, Cmd 1 (Connect), Rsv 0, Atyp 3, "localhost", Port 80
+    uint8_t msg[] = { 0x05, 0x01, 0x00, 0x03, 9,
+                      'l', 'o', 'c', 'a', 'l', 'h', 'o', 's', 't', 0x00, 0x50 };
+    write_msg(env.client_fd, msg, sizeof(msg));
+
+    // The lookup must not run on this thread: either it's still pending or
+    // a resolver thread was quick enough to answer (and notify) already
+    unsigned st = request_read(&env.key);
+    assert(st == REQUEST_RESOLVING || env.data.resolve_job == NULL);
+
+    wait_notified();
+    assert(notified_fd == env.server_fd);
+
+    if (st == REQUEST_RESOLVING) {
+        st = request_resolving(&env.key);
+    }
+    assert(st != REQUEST_RESOLVING);
+    assert(env.data.resolve_job == NULL);
+    assert(env.data.origin_resolution != NULL);
+    if (env.data.origin_fd > 0) close(env.data.origin_fd);
+
+    // Same name again: answered from the cache, sharing the addrinfo list
+    struct resolver_stats before, after;
+    resolver_get_stats(&before);
+    notified_fd = -1;
+    struct resolver_job *job = resolver_submit(NULL, env.server_fd, "LOCALHOST", 80);
+    assert(job != NULL);
+    struct resolver_answer *answer = NULL;
+    assert(resolver_poll(job, &answer));
+    assert(answer == env.data.origin_answer);
+    assert(notified_fd == -1);
+    resolver_get_stats(&after);
+    assert(after.hits == before.hits + 1);
+    assert(after.misses == before.misses);
+
+    resolver_answer_release(answer);
+    resolver_answer_release(env.data.origin_answer);
+    resolver_destroy();
+    teardown_env(&env);
+    printf("PASSED\n");
+}
+
 void test_copy_origin_closes_without_sending() {
     printf("[TEST] copy_read handles origin EOF without spin... ");
     struct copy_test_env env;
@@ -301,14 +615,1320 @@ void test_copy_origin_closes_without_sending() {
     printf("PASSED\n");
 }
 
+void test_copy_borrows_relay_buffers() {
+    printf("[TEST] copy_read borrows relay buffers only while data is in flight... ");
+    struct copy_test_env env;
+    setup_copy_env(&env);
+    reset_interest_tracking();
+    socks5args.disectors_enabled = true; // buffered relay, no splice
+
+    copy_init(COPY, &env.key_client);
+    assert(env.data.read_buffer.data == NULL);
+    assert(env.data.write_buffer.data == NULL);
+
+    write_msg(env.client_remote_fd, "ping", 4);
+    assert(copy_read(&env.key_client) == COPY);
+
+    // Forwarded right away, so the buffer went back to the pool
+    char got[4];
+    assert(read(env.origin_remote_fd, got, sizeof(got)) == 4);
+    assert(memcmp(got, "ping", 4) == 0);
+    assert(env.data.read_buffer.data == NULL);
+    assert(interest_by_fd[env.client_proxy_fd] & OP_READ);
+
+    copy_close(&env.data);
+    socks5args.disectors_enabled = false;
+    teardown_copy_env(&env);
+    printf("PASSED\n");
+}
+
+void test_copy_relays_early_data() {
+    printf("[TEST] copy_init forwards bytes sent along with the request... ");
+    // Spliced, then buffered
+    for (int buffered = 0; buffered < 2; buffered++) {
+        struct copy_test_env env;
+        setup_copy_env(&env);
+        reset_interest_tracking();
+        socks5args.disectors_enabled = buffered;
+
+        for (const char *c = "early"; *c; c++) {
+            buffer_write(&env.data.read_buffer, (uint8_t)*c);
+        }
+        copy_init(COPY, &env.key_client);
+        assert(interest_by_fd[env.origin_proxy_fd] & OP_WRITE);
+        assert(env.data.bytes_up == 5);
+
+        assert(copy_write(&env.key_origin) == COPY);
+        char got[5];
+        assert(read(env.origin_remote_fd, got, sizeof(got)) == 5);
+        assert(memcmp(got, "early", 5) == 0);
+
+        copy_close(&env.data);
+        teardown_copy_env(&env);
+    }
+    socks5args.disectors_enabled = false;
+    printf("PASSED\n");
+}
+
+static void relay_bytes(struct copy_test_env* env, size_t n) {
+    static char data[16384], got[16384];
+    memset(data, 'x', n);
+    write_msg(env->client_remote_fd, data, n);
+    assert(copy_read(&env->key_client) == COPY);
+    size_t total = 0;
+    while (total < n) {
+        const ssize_t r = read(env->origin_remote_fd, got + total, n - total);
+        assert(r > 0);
+        total += r;
+    }
+}
+
+void test_copy_adapts_relay_buffer_size() {
+    printf("[TEST] copy_read grows relay buffers for bulk reads and shrinks them back... ");
+    struct copy_test_env env;
+    setup_copy_env(&env);
+    reset_interest_tracking();
+    socks5args.disectors_enabled = true;
+    socks5args.buffer_min = 4096;
+    socks5args.buffer_max = 16384;
+
+    copy_init(COPY, &env.key_client);
+    assert(env.data.client.copy.buffer_size == 4096);
+
+    // Reads that fill the buffer while the origin keeps up
+    relay_bytes(&env, 4096);
+    assert(env.data.client.copy.buffer_size == 4096);
+    relay_bytes(&env, 4096);
+    assert(env.data.client.copy.buffer_size == 8192);
+    relay_bytes(&env, 8192);
+    relay_bytes(&env, 8192);
+    assert(env.data.client.copy.buffer_size == 16384);
+    relay_bytes(&env, 16384);
+    relay_bytes(&env, 16384);
+    assert(env.data.client.copy.buffer_size == 16384); // capped
+    // The other direction saw nothing
+    assert(env.data.origin.copy.buffer_size == 4096);
+
+    // Keystrokes
+    for (int i = 0; i < 8; i++) {
+        relay_bytes(&env, 1);
+    }
+    assert(env.data.client.copy.buffer_size == 8192);
+
+    copy_close(&env.data);
+    socks5args.disectors_enabled = false;
+    socks5args.buffer_min = socks5args.buffer_max = 0;
+    teardown_copy_env(&env);
+    printf("PASSED\n");
+}
+
+void test_copy_idle_timeout() {
+    printf("[TEST] copy_timeout closes idle tunnels and defers on recent traffic... ");
+    struct copy_test_env env;
+    setup_copy_env(&env);
+    reset_interest_tracking();
+    socks5args.idle_timeout = 60;
+    mock_now = 1000;
+
+    copy_init(COPY, &env.key_client);
+    env.data.last_activity = mock_now;
+
+    // Traffic 20s in only records the time...
+    mock_now += 20000;
+    write_msg(env.client_remote_fd, "x", 1);
+    assert(copy_read(&env.key_client) == COPY);
+    assert(env.data.last_activity == mock_now);
+
+    // ...so when the original deadline fires, it's pushed back by the rest
+    mock_now += 40000;
+    timeout_by_fd[env.client_proxy_fd] = 0;
+    assert(copy_timeout(&env.key_client) == COPY);
+    assert(timeout_by_fd[env.client_proxy_fd] == 20000);
+
+    mock_now += 20000;
+    assert(copy_timeout(&env.key_client) == DONE);
+
+    copy_close(&env.data);
+    socks5args.idle_timeout = 0;
+    teardown_copy_env(&env);
+    printf("PASSED\n");
+}
+
+void test_copy_completions() {
+    printf("[TEST] copy hands bulk reads and sends to the kernel with completions... ");
+    struct copy_test_env env;
+    setup_copy_env(&env);
+    reset_interest_tracking();
+    socks5args.disectors_enabled = true;
+    socks5args.buffer_min = socks5args.buffer_max = 4096;
+    mock_completions = true;
+    const int c = env.client_proxy_fd, o = env.origin_proxy_fd;
+    memset(recv_by_fd, 0, sizeof(recv_by_fd));
+    memset(send_by_fd, 0, sizeof(send_by_fd));
+
+    // Without buffers nothing is handed to the kernel, both ends poll
+    copy_init(COPY, &env.key_client);
+    assert(!recv_by_fd[c].pending && !recv_by_fd[o].pending);
+    assert(interest_by_fd[c] == OP_READ && interest_by_fd[o] == OP_READ);
+
+    // A read that fills the buffer goes out from it through the kernel
+    static char bulk[4096];
+    memset(bulk, 'b', sizeof(bulk));
+    write_msg(env.client_remote_fd, bulk, sizeof(bulk));
+    assert(copy_read(&env.key_client) == COPY);
+    assert(send_by_fd[o].pending && send_by_fd[o].len == sizeof(bulk));
+    assert(interest_by_fd[c] == OP_NOOP && interest_by_fd[o] == OP_READ);
+
+    // A partial send sends the rest; the client isn't read meanwhile
+    send_by_fd[o].pending = false;
+    assert(copy_send_done(&env.key_origin, 1000) == COPY);
+    assert(send_by_fd[o].pending && send_by_fd[o].len == sizeof(bulk) - 1000);
+    assert(!recv_by_fd[c].pending);
+
+    // Once out whole, the buffer is kept for the next read, in the kernel
+    const uint8_t *block = env.data.read_buffer.data;
+    send_by_fd[o].pending = false;
+    assert(copy_send_done(&env.key_origin, sizeof(bulk) - 1000) == COPY);
+    assert(recv_by_fd[c].pending && recv_by_fd[c].buf == block);
+    assert(recv_by_fd[c].len == sizeof(bulk));
+
+    memcpy((uint8_t *)recv_by_fd[c].buf, "ping", 4);
+    recv_by_fd[c].pending = false;
+    assert(copy_recv_done(&env.key_client, 4) == COPY);
+    assert(env.data.bytes_up == sizeof(bulk) + 4);
+    assert(send_by_fd[o].pending && send_by_fd[o].len == 4);
+    assert(memcmp(send_by_fd[o].buf, "ping", 4) == 0);
+
+    // After a small read it goes back to the pool and the client polls
+    send_by_fd[o].pending = false;
+    assert(copy_send_done(&env.key_origin, 4) == COPY);
+    assert(env.data.read_buffer.data == NULL);
+    assert(!recv_by_fd[c].pending && interest_by_fd[c] == OP_READ);
+
+    // A kernel that doesn't wait on non-blocking sockets: poll from then on
+    write_msg(env.client_remote_fd, bulk, sizeof(bulk));
+    assert(copy_read(&env.key_client) == COPY);
+    send_by_fd[o].pending = false;
+    assert(copy_send_done(&env.key_origin, sizeof(bulk)) == COPY);
+    assert(recv_by_fd[c].pending);
+    recv_by_fd[c].pending = false;
+    assert(copy_recv_done(&env.key_client, -EAGAIN) == COPY);
+    assert(env.data.client.copy.poll_read);
+    assert(interest_by_fd[c] == OP_READ && !recv_by_fd[c].pending);
+
+    // The client's EOF closes its read side and the origin's write side
+    close(env.client_remote_fd);
+    assert(copy_read(&env.key_client) == COPY);
+    assert(!(env.data.client.copy.duplex & OP_READ));
+    assert(!(env.data.origin.copy.duplex & OP_WRITE));
+    env.client_remote_fd = open("/dev/null", O_RDONLY);
+
+    copy_close(&env.data);
+    mock_completions = false;
+    socks5args.disectors_enabled = false;
+    socks5args.buffer_min = socks5args.buffer_max = 0;
+    teardown_copy_env(&env);
+    printf("PASSED\n");
+}
+
+// Reads what copy_read() relayed to `fd`, however much that was
+// One turn of the selector loop over the registered fds, including a
+// verifier's wake-up
+static void pump(void) {
+    struct pollfd pfds[FD_SETSIZE];
+    nfds_t n = 0;
+    for (int fd = 0; fd < FD_SETSIZE; fd++) {
+        if (handler_by_fd[fd] != NULL && interest_by_fd[fd] != OP_NOOP) {
+            pfds[n++] = (struct pollfd){
+                .fd = fd,
+                .events = ((interest_by_fd[fd] & OP_READ) ? POLLIN : 0) |
+                          ((interest_by_fd[fd] & OP_WRITE) ? POLLOUT : 0),
+            };
+        }
+    }
+    poll(pfds, n, 10);
+    for (nfds_t i = 0; i < n; i++) {
+        const int fd = pfds[i].fd;
+        struct selector_key key = {.s = NULL, .fd = fd, .data = data_by_fd[fd]};
+        if ((pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) &&
+            handler_by_fd[fd] != NULL && (interest_by_fd[fd] & OP_READ)) {
+            key.data = data_by_fd[fd];
+            handler_by_fd[fd]->handle_read(&key);
+        }
+        if ((pfds[i].revents & (POLLOUT | POLLHUP | POLLERR)) &&
+            handler_by_fd[fd] != NULL && (interest_by_fd[fd] & OP_WRITE)) {
+            key.data = data_by_fd[fd];
+            handler_by_fd[fd]->handle_write(&key);
+        }
+    }
+    const int fd = __atomic_exchange_n(&notified_fd, -1, __ATOMIC_SEQ_CST);
+    if (fd >= 0 && handler_by_fd[fd] != NULL) {
+        struct selector_key key = {.s = NULL, .fd = fd, .data = data_by_fd[fd]};
+        handler_by_fd[fd]->handle_block(&key);
+    }
+}
+
+static int listen_local(struct sockaddr_in *addr) {
+    socklen_t len = sizeof(*addr);
+    *addr = (struct sockaddr_in){.sin_family = AF_INET,
+                                 .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    const int fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(fd >= 0);
+    assert(bind(fd, (struct sockaddr *)addr, len) == 0);
+    assert(listen(fd, 128) == 0);
+    assert(getsockname(fd, (struct sockaddr *)addr, &len) == 0);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+#define CLOSE_TUNNELS 60 // more than socks5nio.c pools
+
+static uint64_t relay_buffers_in_use(void) {
+    struct metrics m;
+    metrics_snapshot(&m);
+    uint64_t n = 0;
+    for (int i = 0; i < METRICS_BUFFER_CLASSES; i++) {
+        n += m.relay_buffers[i];
+    }
+    return n;
+}
+
+void test_copy_closes_more_tunnels_than_pooled() {
+    printf("[TEST] half-closed tunnels end cleanly past the session pool... ");
+    const struct fd_handler listener_handler = {.handle_read = socksv5_passive_accept};
+    struct sockaddr_in proxy_addr, origin_addr;
+    const int proxy = listen_local(&proxy_addr);
+    const int origin = listen_local(&origin_addr);
+    mock_registry = true;
+    reset_interest_tracking();
+    socks5args.disectors_enabled = true;
+    assert(user_db_add("tunnel", 6, "pw") == USER_DB_OK);
+    selector_register(NULL, proxy, &listener_handler, OP_READ, NULL);
+    const uint64_t buffers = relay_buffers_in_use();
+
+    // Client: greeting, credentials, CONNECT and data in one go, then EOF
+    uint8_t hello[] = {0x05, 0x01, 0x02, 0x01, 0x06, 't', 'u', 'n', 'n', 'e', 'l',
+                       0x02, 'p', 'w', 0x05, 0x01, 0x00, 0x01, 0, 0, 0, 0, 0, 0,
+                       'u', 'p'};
+    memcpy(hello + 18, &origin_addr.sin_addr, 4);
+    memcpy(hello + 22, &origin_addr.sin_port, 2);
+
+    int clients[CLOSE_TUNNELS], origins[CLOSE_TUNNELS];
+    uint8_t got[CLOSE_TUNNELS][32];
+    size_t got_len[CLOSE_TUNNELS] = {0};
+    bool client_eof[CLOSE_TUNNELS] = {false}, origin_eof[CLOSE_TUNNELS] = {false};
+    for (int i = 0; i < CLOSE_TUNNELS; i++) {
+        clients[i] = socket(AF_INET, SOCK_STREAM, 0);
+        assert(connect(clients[i], (struct sockaddr *)&proxy_addr, sizeof(proxy_addr)) == 0);
+        write_msg(clients[i], hello, sizeof(hello));
+        shutdown(clients[i], SHUT_WR);
+        // One at a time, so every session is in COPY before any ends
+        for (int t = 0; t < 500 && (origins[i] = accept(origin, NULL, NULL)) < 0; t++) {
+            pump();
+        }
+        assert(origins[i] >= 0);
+    }
+
+    // Origins read "up" and EOF, answer and close; sessions end as they drain
+    unsigned ended = 0;
+    for (int t = 0; t < 2000 && ended < CLOSE_TUNNELS; t++) {
+        pump();
+        for (int i = 0; i < CLOSE_TUNNELS; i++) {
+            char buf[8];
+            if (!origin_eof[i] && recv(origins[i], buf, sizeof(buf), MSG_DONTWAIT) == 0) {
+                origin_eof[i] = true;
+                write_msg(origins[i], "down", 4);
+                close(origins[i]);
+            }
+            if (!client_eof[i]) {
+                const ssize_t r = recv(clients[i], got[i] + got_len[i],
+                                       sizeof(got[i]) - got_len[i], MSG_DONTWAIT);
+                if (r > 0) {
+                    got_len[i] += r;
+                } else if (r == 0) {
+                    client_eof[i] = true;
+                    ended++;
+                }
+            }
+        }
+    }
+    assert(ended == CLOSE_TUNNELS);
+
+    // Method, auth and request replies, then the answer; nothing left open
+    for (int i = 0; i < CLOSE_TUNNELS; i++) {
+        assert(got_len[i] == 2 + 2 + 10 + 4);
+        assert(got[i][3] == 0x00 && got[i][5] == SOCKS_REPLY_SUCCEEDED);
+        assert(memcmp(got[i] + 14, "down", 4) == 0);
+        close(clients[i]);
+    }
+    assert(admission_open() == 0);
+    assert(relay_buffers_in_use() == buffers);
+    for (int fd = 0; fd < FD_SETSIZE; fd++) {
+        assert(handler_by_fd[fd] == NULL || fd == proxy);
+    }
+
+    selector_unregister_fd(NULL, proxy);
+    close(proxy);
+    close(origin);
+    socksv5_pool_destroy();
+    user_db_del("tunnel");
+    socks5args.disectors_enabled = false;
+    mock_registry = false;
+    printf("PASSED\n");
+}
+
+static size_t drain(int fd) {
+    static char got[16384];
+    size_t total = 0;
+    ssize_t r;
+    while ((r = recv(fd, got, sizeof(got), MSG_DONTWAIT)) > 0) {
+        total += r;
+    }
+    return total;
+}
+
+void test_copy_conn_rate() {
+    printf("[TEST] copy_read pauses a capped direction and its timer resumes it... ");
+    struct copy_test_env env;
+    setup_copy_env(&env);
+    reset_interest_tracking();
+    socks5args.disectors_enabled = true;
+    socks5args.conn_rate = 10000; // 1500 bytes of burst, 200 per tick
+    mock_now = 5000;
+
+    copy_init(COPY, &env.key_client);
+    static char data[4000];
+    write_msg(env.client_remote_fd, data, sizeof(data));
+
+    // The burst goes right away, then reading stops until there's a tick
+    assert(copy_read(&env.key_client) == COPY);
+    assert(drain(env.origin_remote_fd) == SHAPER_MIN_BURST);
+    assert(copy_read(&env.key_client) == COPY);
+    assert(drain(env.origin_remote_fd) == 0);
+    assert(!(interest_by_fd[env.client_proxy_fd] & OP_READ));
+    assert(timeout_by_fd[env.client_proxy_fd] == SHAPER_TICK_MS);
+
+    // An early wake up just waits for the rest
+    mock_now += SHAPER_TICK_MS / 2;
+    assert(copy_timeout(&env.key_client) == COPY);
+    assert(!(interest_by_fd[env.client_proxy_fd] & OP_READ));
+    assert(timeout_by_fd[env.client_proxy_fd] == SHAPER_TICK_MS / 2);
+
+    mock_now += SHAPER_TICK_MS / 2;
+    assert(copy_timeout(&env.key_client) == COPY);
+    assert(interest_by_fd[env.client_proxy_fd] & OP_READ);
+    assert(timeout_by_fd[env.client_proxy_fd] == 0);
+    assert(copy_read(&env.key_client) == COPY);
+    assert(drain(env.origin_remote_fd) == 200);
+
+    // The other direction has its own bucket
+    write_msg(env.origin_remote_fd, data, 1000);
+    assert(copy_read(&env.key_origin) == COPY);
+    assert(drain(env.client_remote_fd) == 1000);
+
+    copy_close(&env.data);
+    socks5args.disectors_enabled = false;
+    socks5args.conn_rate = 0;
+    teardown_copy_env(&env);
+    printf("PASSED\n");
+}
+
+void test_copy_user_rate() {
+    printf("[TEST] a user's cap is shared by all of its tunnels... ");
+    assert(user_db_add("capped", 6, "pw") == USER_DB_OK);
+    assert(user_db_rate("capped") == 0);
+    user_db_set_default_rate(50000);
+    assert(user_db_rate("capped") == 50000);
+    assert(user_db_set_rate("capped", 10000) == USER_DB_OK);
+    assert(user_db_rate("capped") == 10000);
+    assert(user_db_set_rate("nobody", 10000) == USER_DB_NOT_FOUND);
+
+    struct user_stats* u = user_stats_get("capped");
+    mock_now = 5000;
+    user_stats_set_rate(u, user_db_rate("capped"), mock_now);
+
+    struct copy_test_env a, b;
+    setup_copy_env(&a);
+    setup_copy_env(&b);
+    reset_interest_tracking();
+    socks5args.disectors_enabled = true;
+    a.data.user = b.data.user = u;
+    copy_init(COPY, &a.key_client);
+    copy_init(COPY, &b.key_client);
+
+    static char data[4000];
+    write_msg(a.client_remote_fd, data, 1000);
+    write_msg(b.client_remote_fd, data, 1000);
+    assert(copy_read(&a.key_client) == COPY);
+    assert(drain(a.origin_remote_fd) == 1000);
+    assert(copy_read(&b.key_client) == COPY);
+    assert(drain(b.origin_remote_fd) == SHAPER_MIN_BURST - 1000);
+    assert(copy_read(&b.key_client) == COPY);
+    assert(!(interest_by_fd[b.client_proxy_fd] & OP_READ));
+
+    // Downloads are capped apart from uploads
+    write_msg(a.origin_remote_fd, data, 1000);
+    assert(copy_read(&a.key_origin) == COPY);
+    assert(drain(a.client_remote_fd) == 1000);
+
+    // Lifting the cap lets the paused tunnel go as soon as it wakes up
+    assert(user_db_set_rate("capped", 0) == USER_DB_OK);
+    user_stats_set_rate(u, user_db_rate("capped"), mock_now);
+    mock_now += timeout_by_fd[b.client_proxy_fd];
+    assert(copy_timeout(&b.key_client) == COPY);
+    assert(copy_read(&b.key_client) == COPY);
+    assert(drain(b.origin_remote_fd) == 500);
+
+    copy_close(&a.data);
+    copy_close(&b.data);
+    socks5args.disectors_enabled = false;
+    user_db_set_default_rate(0);
+    user_db_destroy();
+    teardown_copy_env(&a);
+    teardown_copy_env(&b);
+    printf("PASSED\n");
+}
+
+// Last pair reported by a pop3_sniffer, and how many there were
+static char sniffed_user[POP3_ARG_MAX];
+static char sniffed_pass[POP3_ARG_MAX];
+static int sniffed = 0;
+
+static void on_sniffed(struct pop3_sniffer* p, const char* user,
+                       const char* password) {
+    (void)p;
+    strcpy(sniffed_user, user);
+    strcpy(sniffed_pass, password);
+    sniffed++;
+}
+
+static void sniff(struct pop3_sniffer* p, const char* s) {
+    pop3_sniffer_feed(p, (const uint8_t*)s, strlen(s));
+}
+
+void test_pop3_sniffer() {
+    printf("[TEST] pop3_sniffer finds USER/PASS split across reads... ");
+    struct pop3_sniffer p;
+    pop3_sniffer_init(&p, POP3_PORT);
+    p.on_credentials = on_sniffed;
+    sniffed = 0;
+
+    // Every boundary, including inside the keywords and the CRLF
+    const char* session = "CAPA\r\nuser alice\r\nPaSs s3cr3t pw\r\n";
+    for (size_t i = 0; session[i] != '\0'; i++) {
+        pop3_sniffer_feed(&p, (const uint8_t*)session + i, 1);
+    }
+    assert(sniffed == 1);
+    assert(strcmp(sniffed_user, "alice") == 0);
+    assert(strcmp(sniffed_pass, "s3cr3t pw") == 0);
+
+    // Other commands, keywords mid-line and a PASS with bare LF
+    sniff(&p, "STAT\r\nNOOP USER x\r\nUSERS y\r\nUSER bob\nPASS ");
+    assert(sniffed == 1);
+    sniff(&p, "hunter2\n");
+    assert(sniffed == 2);
+    assert(strcmp(sniffed_user, "bob") == 0);
+    assert(strcmp(sniffed_pass, "hunter2") == 0);
+
+    // An argument too long to keep is dropped, not cut
+    char line[POP3_ARG_MAX + 16] = "PASS ";
+    memset(line + 5, 'a', POP3_ARG_MAX);
+    sniff(&p, line);
+    sniff(&p, "\r\n");
+    assert(sniffed == 2);
+
+    // Other ports only get their first bytes looked at
+    pop3_sniffer_init(&p, 8110);
+    p.on_credentials = on_sniffed;
+    sniff(&p, "USER carol\r\nPASS pw\r\n");
+    assert(sniffed == 3);
+    char junk[POP3_SNIFF_PROBE_BYTES];
+    memset(junk, '\n', sizeof(junk));
+    pop3_sniffer_feed(&p, (const uint8_t*)junk, sizeof(junk));
+    assert(!pop3_sniffer_active(&p));
+    sniff(&p, "USER dave\r\nPASS pw\r\n");
+    assert(sniffed == 3);
+    printf("PASSED\n");
+}
+
+void test_copy_dissects_client_bytes() {
+    printf("[TEST] copy_read shows the dissector what the client sends... ");
+    struct copy_test_env env;
+    setup_copy_env(&env);
+    reset_interest_tracking();
+    socks5args.disectors_enabled = true;
+    env.data.dest_port = POP3_PORT;
+    sniffed = 0;
+
+    copy_init(COPY, &env.key_client);
+    assert(pop3_sniffer_active(&env.data.pop3));
+    env.data.pop3.on_credentials = on_sniffed;
+
+    write_msg(env.client_remote_fd, "USER eve\r\nPA", 12);
+    assert(copy_read(&env.key_client) == COPY);
+    write_msg(env.origin_remote_fd, "+OK\r\nPASS x\r\n", 13);
+    assert(copy_read(&env.key_origin) == COPY);
+    write_msg(env.client_remote_fd, "SS pw\r\n", 7);
+    assert(copy_read(&env.key_client) == COPY);
+    assert(sniffed == 1);
+    assert(strcmp(sniffed_user, "eve") == 0);
+    assert(strcmp(sniffed_pass, "pw") == 0);
+    assert(drain(env.origin_remote_fd) == 19);
+    copy_close(&env.data);
+
+    // -N turns it off
+    socks5args.disectors_enabled = false;
+    copy_init(COPY, &env.key_client);
+    assert(!pop3_sniffer_active(&env.data.pop3));
+
+    copy_close(&env.data);
+    teardown_copy_env(&env);
+    printf("PASSED\n");
+}
+
+#define METRICS_THREADS 4
+#define METRICS_ROUNDS 100000
+
+static void* metrics_worker(void* arg) {
+    (void)arg;
+    for (int i = 0; i < METRICS_ROUNDS; i++) {
+        metrics_new_connection();
+        metrics_add_bytes_sent(3);
+    }
+    // Half of them close on this thread; the rest close on the main one
+    for (int i = 0; i < METRICS_ROUNDS / 2; i++) {
+        metrics_close_connection();
+    }
+    return NULL;
+}
+
+void test_metrics_sum_thread_shards() {
+    printf("[TEST] metrics add up the counters of every thread... ");
+    struct metrics before, after;
+    metrics_snapshot(&before);
+
+    pthread_t threads[METRICS_THREADS];
+    for (int i = 0; i < METRICS_THREADS; i++) {
+        assert(pthread_create(&threads[i], NULL, metrics_worker, NULL) == 0);
+    }
+    for (int i = 0; i < METRICS_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (int i = 0; i < METRICS_THREADS * METRICS_ROUNDS / 2; i++) {
+        metrics_close_connection();
+    }
+
+    metrics_snapshot(&after);
+    const uint64_t n = (uint64_t)METRICS_THREADS * METRICS_ROUNDS;
+    assert(after.historic_connections - before.historic_connections == n);
+    assert(after.current_connections == before.current_connections);
+    assert(after.bytes_sent - before.bytes_sent == 3 * n);
+    printf("PASSED\n");
+}
+
+void test_metrics_latency_percentiles() {
+    printf("[TEST] latency histograms report percentiles within a bucket... ");
+    static struct metrics_histogram before, h;
+    metrics_latency_snapshot(METRICS_LATENCY_SESSION, &before);
+
+    // 1us .. 100ms, uniformly
+    for (uint64_t us = 1; us <= 100000; us++) {
+        metrics_latency_record(METRICS_LATENCY_SESSION, us);
+    }
+    metrics_latency_snapshot(METRICS_LATENCY_SESSION, &h);
+    for (unsigned b = 0; b < METRICS_HISTOGRAM_BUCKETS; b++) {
+        h.buckets[b] -= before.buckets[b];
+    }
+    assert(h.count - before.count == 100000);
+    assert(h.max >= 100000);
+
+    const double percentiles[] = {50, 90, 99, 99.9};
+    for (unsigned i = 0; i < 4; i++) {
+        const double exact = percentiles[i] * 1000;
+        const uint64_t got = metrics_histogram_percentile(&h, percentiles[i]);
+        assert(got >= exact && got <= exact * 1.0625);
+    }
+    assert(metrics_histogram_percentile(&h, 100) == 100000 ||
+           before.max > 100000);
+
+    // Small values get a bucket each; an empty histogram reports 0
+    memset(&h, 0, sizeof(h));
+    h.buckets[7] = 1;
+    h.max = 7;
+    assert(metrics_histogram_percentile(&h, 50) == 7);
+    memset(&h, 0, sizeof(h));
+    assert(metrics_histogram_percentile(&h, 99) == 0);
+    printf("PASSED\n");
+}
+
+void test_metrics_http_renders_openmetrics() {
+    printf("[TEST] /metrics renders OpenMetrics into a fixed buffer... ");
+    static char body[METRICS_HTTP_BODY_SIZE];
+    metrics_new_connection();
+
+    const size_t len = metrics_http_render(body, sizeof(body));
+    assert(len > 0 && len < sizeof(body) && body[len] == '\0');
+    assert(strstr(body, "# TYPE socks5_connections counter\n") != NULL);
+    assert(strstr(body, "\nsocks5_open_connections ") != NULL);
+    assert(strstr(body, "socks5_sessions{state=\"copy\"} ") != NULL);
+    assert(strstr(body, "socks5_phase_duration_seconds_bucket{phase=\"session\","
+                        "le=\"+Inf\"} ") != NULL);
+    assert(strcmp(body + len - 6, "# EOF\n") == 0);
+
+    // Truncated output is never served
+    assert(metrics_http_render(body, len) == 0);
+    assert(metrics_http_render(body, len + 1) == len);
+
+    // Users are exported up to the cap, and left out rather than failing
+    // the scrape when they don't fit
+    user_stats_get("metrics_a");
+    user_stats_get("metrics_b");
+    socks5args.metrics_users = 1000;
+    const size_t with_users = metrics_http_render(body, sizeof(body));
+    assert(strstr(body, "socks5_user_sessions_total{user=\"metrics_b\"}"));
+    assert(metrics_http_render(body, len + 1) == len);
+    assert(strstr(body, "# TYPE socks5_user_sessions ") == NULL);
+    socks5args.metrics_users = 1;
+    const size_t capped = metrics_http_render(body, sizeof(body));
+    assert(capped > len && capped < with_users);
+    socks5args.metrics_users = 0;
+
+    metrics_close_connection();
+    printf("PASSED\n");
+}
+
+static void send_auth(struct test_env* env, const char* name, const char* pass) {
+    uint8_t msg[64] = {0x01};
+    size_t n = 1;
+    msg[n++] = strlen(name);
+    memcpy(msg + n, name, strlen(name));
+    n += strlen(name);
+    msg[n++] = strlen(pass);
+    memcpy(msg + n, pass, strlen(pass));
+    n += strlen(pass);
+    write_msg(env->client_fd, msg, n);
+}
+
+static void auth_as(const char* name, const char* pass) {
+    struct test_env env;
+    setup_env(&env);
+    auth_read_init(AUTH_READ, &env.key);
+    send_auth(&env, name, pass);
+    assert(auth_read_verified(&env) == AUTH_WRITE);
+    teardown_env(&env);
+}
+
+void test_auth_verifies_off_loop() {
+    printf("[TEST] auth_read checks passwords on the verifier pool, caching successes... ");
+    struct verifier_stats before, after;
+    verifier_get_stats(&before);
+    user_db_add("user", 4, "pass");
+
+    // The KDF must not run on this thread: either the check is pending or
+    // a verifier thread was quick enough to finish (and notify) already.
+    // Either way the password doesn't linger in the session.
+    struct test_env env;
+    setup_env(&env);
+    auth_read_init(AUTH_READ, &env.key);
+    send_auth(&env, "user", "pass");
+    notified_fd = -1;
+    unsigned st = auth_read(&env.key);
+    assert(st == AUTH_VERIFYING || st == AUTH_WRITE);
+    assert(env.data.client.auth.password[0] == '\0');
+    wait_notified();
+    assert(notified_fd == env.server_fd);
+    if (st == AUTH_VERIFYING) {
+        assert(env.data.verify_job != NULL);
+        assert(auth_verifying(&env.key) == AUTH_WRITE);
+    }
+    assert(env.data.verify_job == NULL);
+    assert(env.data.client.auth.status == 0x00);
+    notified_fd = -1;
+    teardown_env(&env);
+
+    // Reconnecting with the same password skips the pool
+    setup_env(&env);
+    auth_read_init(AUTH_READ, &env.key);
+    send_auth(&env, "user", "pass");
+    assert(auth_read(&env.key) == AUTH_WRITE);
+    assert(env.data.client.auth.status == 0x00);
+    teardown_env(&env);
+
+    // Failures aren't cached, and a changed password misses the cache
+    setup_env(&env);
+    auth_read_init(AUTH_READ, &env.key);
+    send_auth(&env, "user", "nope");
+    assert(auth_read_verified(&env) == AUTH_WRITE);
+    assert(env.data.client.auth.status == 0xFF);
+    teardown_env(&env);
+    assert(user_db_del("user") == USER_DB_OK);
+    user_db_add("user", 4, "other");
+    setup_env(&env);
+    auth_read_init(AUTH_READ, &env.key);
+    send_auth(&env, "user", "pass");
+    assert(auth_read_verified(&env) == AUTH_WRITE);
+    assert(env.data.client.auth.status == 0xFF);
+    teardown_env(&env);
+
+    verifier_get_stats(&after);
+    assert(after.hits - before.hits == 1);
+    assert(after.misses - before.misses == 3);
+
+    // Sessions may go away with their check queued, running or done
+    struct user_credential cred;
+    assert(user_db_lookup("user", &cred));
+    struct verifier_job* jobs[8];
+    for (int i = 0; i < 8; i++) {
+        jobs[i] = verifier_submit(NULL, 100 + i, &cred, "other");
+        assert(jobs[i] != NULL);
+    }
+    for (int i = 0; i < 8; i += 2) {
+        verifier_cancel(jobs[i]);
+    }
+    for (int i = 1; i < 8; i += 2) {
+        bool ok = false;
+        for (int t = 0; t < 500 && !verifier_poll(jobs[i], &ok); t++) {
+            nanosleep(&(struct timespec){.tv_nsec = 10000000}, NULL);
+        }
+        assert(ok);
+    }
+    notified_fd = -1;
+
+    user_db_destroy();
+    printf("PASSED\n");
+}
+
+void test_user_stats_accounting() {
+    printf("[TEST] per-user accounting of sessions, failures and bytes... ");
+    user_db_add("acct", 4, "pw");
+
+    auth_as("acct", "pw");
+    auth_as("acct", "nope");
+    auth_as("ghost", "pw");
+
+    struct user_stats_view v;
+    assert(user_stats_find("acct", &v));
+    assert(v.total_sessions == 1 && v.active_sessions == 1);
+    assert(v.auth_failures == 1);
+    assert(!user_stats_find("ghost", &v)); // made up names aren't kept
+
+    struct copy_test_env env;
+    setup_copy_env(&env);
+    reset_interest_tracking();
+    socks5args.disectors_enabled = true;
+    env.data.user = user_stats_get("acct");
+    copy_init(COPY, &env.key_client);
+
+    char got[8];
+    write_msg(env.client_remote_fd, "hello", 5);
+    assert(copy_read(&env.key_client) == COPY);
+    assert(read(env.origin_remote_fd, got, sizeof(got)) == 5);
+    write_msg(env.origin_remote_fd, "hey", 3);
+    assert(copy_read(&env.key_origin) == COPY);
+    assert(read(env.client_remote_fd, got, sizeof(got)) == 3);
+
+    assert(user_stats_find("acct", &v));
+    assert(v.bytes_received == 5 && v.bytes_sent == 3);
+
+    user_stats_session_close(env.data.user);
+    assert(user_stats_find("acct", &v) && v.active_sessions == 0);
+
+    // Entries stay put while the table grows under them
+    char name[16];
+    for (int i = 0; i < 1000; i++) {
+        snprintf(name, sizeof(name), "grow%d", i);
+        assert(user_stats_get(name) != NULL);
+    }
+    assert(user_stats_get("acct") == env.data.user);
+    assert(user_stats_find("grow999", &v) && strcmp(v.name, "grow999") == 0);
+
+    copy_close(&env.data);
+    socks5args.disectors_enabled = false;
+    user_db_destroy();
+    teardown_copy_env(&env);
+    printf("PASSED\n");
+}
+
+static struct sockaddr_storage ipv4_client(const char* ip) {
+    struct sockaddr_storage ss = {0};
+    struct sockaddr_in* sin = (struct sockaddr_in*)&ss;
+    sin->sin_family = AF_INET;
+    inet_pton(AF_INET, ip, &sin->sin_addr);
+    return ss;
+}
+
+void test_admission_caps() {
+    printf("[TEST] admission caps connections globally and per address... ");
+    socks5args.max_conns = 3;
+    socks5args.max_conns_per_ip = 2;
+    struct metrics before, after;
+    metrics_snapshot(&before);
+
+    struct sockaddr_storage a = ipv4_client("10.0.0.1");
+    struct sockaddr_storage b = ipv4_client("10.0.0.2");
+    // The same client seen through a dual-stack listener
+    struct sockaddr_storage a6 = {0};
+    struct sockaddr_in6* sin6 = (struct sockaddr_in6*)&a6;
+    sin6->sin6_family = AF_INET6;
+    inet_pton(AF_INET6, "::ffff:10.0.0.1", &sin6->sin6_addr);
+
+    assert(admission_acquire(&a) == ADMISSION_OK);
+    assert(admission_acquire(&a6) == ADMISSION_OK);
+    assert(admission_acquire(&a) == ADMISSION_IP_FULL);
+    assert(admission_acquire(&b) == ADMISSION_OK);
+    assert(admission_acquire(&b) == ADMISSION_FULL);
+    assert(admission_open() == 3);
+
+    // Full: the listener stops being polled and its timer checks back
+    const int listener = 1000;
+    admission_listener(listener);
+    interest_by_fd[listener] = OP_READ;
+    assert(admission_pause_if_full(NULL));
+    assert(interest_by_fd[listener] == OP_NOOP);
+    assert(timeout_by_fd[listener] == ADMISSION_RETRY_MS);
+    struct selector_key key = {.fd = listener};
+    timeout_by_fd[listener] = 0;
+    admission_listener_timeout(&key);
+    assert(timeout_by_fd[listener] == ADMISSION_RETRY_MS);
+
+    // A slot frees up on this worker: polling resumes right away
+    admission_release(NULL, &a);
+    assert(interest_by_fd[listener] == OP_READ);
+    assert(timeout_by_fd[listener] == 0);
+    assert(!admission_pause_if_full(NULL));
+    assert(admission_acquire(&a) == ADMISSION_OK);
+
+    metrics_snapshot(&after);
+    assert(after.rejected[METRICS_REJECTED_GLOBAL] -
+               before.rejected[METRICS_REJECTED_GLOBAL] == 1);
+    assert(after.rejected[METRICS_REJECTED_PER_IP] -
+               before.rejected[METRICS_REJECTED_PER_IP] == 1);
+    assert(after.listener_pauses - before.listener_pauses == 1);
+
+    admission_release(NULL, &a);
+    admission_release(NULL, &a6);
+    admission_release(NULL, &b);
+    assert(admission_open() == 0);
+    socks5args.max_conns = socks5args.max_conns_per_ip = 0;
+    admission_destroy();
+    printf("PASSED\n");
+}
+
+void test_admission_user_sessions() {
+    printf("[TEST] sessions past a user's cap get their request refused... ");
+    socks5args.max_user_sessions = 1;
+    user_db_add("solo", 4, "pw");
+
+    struct test_env first, second;
+    setup_env(&first);
+    auth_read_init(AUTH_READ, &first.key);
+    send_auth(&first, "solo", "pw");
+    assert(auth_read_verified(&first) == AUTH_WRITE);
+    assert(!first.data.over_user_cap);
+
+    // Authenticates (the password is right) but may not open a tunnel
+    setup_env(&second);
+    auth_read_init(AUTH_READ, &second.key);
+    send_auth(&second, "solo", "pw");
+    assert(auth_read_verified(&second) == AUTH_WRITE);
+    assert(second.data.over_user_cap);
+    assert(second.data.client.auth.status == 0x00);
+
+    request_read_init(REQUEST_READ, &second.key);
+    uint8_t msg[] = { 0x05, 0x01, 0x00, 0x01, 127, 0, 0, 1, 0x00, 0x50 };
+    write_msg(second.client_fd, msg, sizeof(msg));
+    assert(request_read(&second.key) == REQUEST_WRITE);
+    assert(second.data.client.request.reply == SOCKS_REPLY_NOT_ALLOWED);
+
+    struct user_stats_view v;
+    assert(user_stats_find("solo", &v) && v.active_sessions == 1);
+    user_stats_session_close(first.data.user);
+    teardown_env(&first);
+    teardown_env(&second);
+
+    auth_as("solo", "pw");
+    assert(user_stats_find("solo", &v) && v.active_sessions == 1);
+
+    socks5args.max_user_sessions = 0;
+    user_db_destroy();
+    printf("PASSED\n");
+}
+
+#define USER_DB_USERS 50000
+
+void test_user_db_table() {
+    printf("[TEST] user_db holds many users and reuses deleted slots... ");
+    char name[32], pass[32];
+    for (int i = 0; i < USER_DB_USERS; i++) {
+        snprintf(name, sizeof(name), "user%d", i);
+        snprintf(pass, sizeof(pass), "pw%d", i);
+        assert(user_db_add(name, strlen(name), pass) == USER_DB_OK);
+    }
+    assert(user_db_count() == USER_DB_USERS);
+    assert(user_db_add("user7", 5, "other") == USER_DB_EXISTS);
+    // only the first name_len bytes are the name
+    assert(user_db_add("user7:x", 5, "other") == USER_DB_EXISTS);
+
+    for (int i = 0; i < USER_DB_USERS; i += 2) {
+        snprintf(name, sizeof(name), "user%d", i);
+        assert(user_db_del(name) == USER_DB_OK);
+    }
+    assert(user_db_del("user0") == USER_DB_NOT_FOUND);
+    assert(user_db_count() == USER_DB_USERS / 2);
+    for (int i = 0; i < USER_DB_USERS; i++) {
+        snprintf(name, sizeof(name), "user%d", i);
+        snprintf(pass, sizeof(pass), "pw%d", i);
+        assert(user_db_check(name, pass) ==
+               (i % 2 ? USER_DB_AUTHENTICATED : USER_DB_UNKNOWN_USER));
+    }
+    assert(user_db_check("user1", "pw2") == USER_DB_WRONG_PASSWORD);
+    assert(user_db_check("USER1", "pw1") == USER_DB_UNKNOWN_USER);
+
+    // Deleting and adding back, over and over, must not grow the table
+    for (int round = 0; round < 4; round++) {
+        for (int i = 0; i < USER_DB_USERS; i += 2) {
+            snprintf(name, sizeof(name), "user%d", i);
+            assert(user_db_add(name, strlen(name), "again") == USER_DB_OK);
+        }
+        for (int i = 0; i < USER_DB_USERS; i += 2) {
+            snprintf(name, sizeof(name), "user%d", i);
+            assert(user_db_del(name) == USER_DB_OK);
+        }
+    }
+    assert(user_db_count() == USER_DB_USERS / 2);
+    assert(user_db_check("user3", "pw3") == USER_DB_AUTHENTICATED);
+
+    user_db_destroy();
+    assert(user_db_count() == 0);
+    assert(user_db_check("user3", "pw3") == USER_DB_UNKNOWN_USER);
+    printf("PASSED\n");
+}
+
+void test_user_db_load() {
+    printf("[TEST] user_db loads name:password files... ");
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/socks5_users_%d", (int)getpid());
+    FILE* f = fopen(path, "w");
+    assert(f != NULL);
+    fputs("# users\n\nalice:secret\r\nbob:p:w\n", f);
+    fclose(f);
+    assert(user_db_load(path) == 2);
+    assert(user_db_check("alice", "secret") == USER_DB_AUTHENTICATED);
+    assert(user_db_check("bob", "p:w") == USER_DB_AUTHENTICATED);
+    user_db_destroy();
+
+    // Passwords may come hashed (passlib's pbkdf2_sha256 format)
+    f = fopen(path, "w");
+    assert(f != NULL);
+    fputs("dave:$pbkdf2-sha256$1000$MDEyMzQ1Njc4OWFiY2RlZg$"
+          "pj4T35D2v4tYmC1sTJ1y5tcMADOdtnQGvuHmyYDQh2g\n", f);
+    fclose(f);
+    assert(user_db_load(path) == 1);
+    assert(user_db_check("dave", "hunter2") == USER_DB_AUTHENTICATED);
+    assert(user_db_check("dave", "hunter3") == USER_DB_WRONG_PASSWORD);
+    assert(user_db_add("eve", 3, "$pbkdf2-sha256$1000$MDEy$short") ==
+           USER_DB_BAD_HASH);
+    assert(user_db_add("eve", 3, "$pbkdf2-sha256$0$MDEy$"
+                       "pj4T35D2v4tYmC1sTJ1y5tcMADOdtnQGvuHmyYDQh2g") ==
+           USER_DB_BAD_HASH);
+    assert(user_db_count() == 1);
+
+    // A bad line stops the load (and says where, on stderr)
+    f = fopen(path, "w");
+    assert(f != NULL);
+    fputs("carol:x\nno-password-here\n", f);
+    fclose(f);
+    assert(user_db_load(path) == -1);
+    assert(user_db_load("/nonexistent/users") == -1);
+
+    unlink(path);
+    user_db_destroy();
+    printf("PASSED\n");
+}
+
+void test_mgmt_add_hashes_off_the_loop() {
+    printf("[TEST] management ADD hashes on a verifier thread... ");
+    const int server = socket(AF_INET, SOCK_DGRAM, 0);
+    const int client = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in addr = {.sin_family = AF_INET};
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    assert(bind(server, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+    socklen_t len = sizeof(addr);
+    assert(getsockname(server, (struct sockaddr*)&addr, &len) == 0);
+    assert(connect(client, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+    struct selector_key key = {.fd = server};
+
+    // No answer until the password is hashed
+    notified_fd = -1;
+    write_msg(client, "ADD newbie:pw", 13);
+    mgmt_handle_request(&key);
+    char reply[MGMT_MAX_RESP_LEN];
+    assert(recv(client, reply, sizeof(reply), MSG_DONTWAIT) < 0);
+    assert(user_db_count() == 0);
+
+    wait_notified();
+    assert(notified_fd == server);
+    notified_fd = -1;
+    mgmt_handle_block(&key);
+    const ssize_t n = recv(client, reply, sizeof(reply) - 1, 0);
+    assert(n > 0);
+    reply[n] = '\0';
+    assert(strncmp(reply, MGMT_STATUS_OK " ", 3) == 0);
+    assert(user_db_check("newbie", "pw") == USER_DB_AUTHENTICATED);
+
+    // The name is only taken once hashed
+    write_msg(client, "ADD newbie:again", 16);
+    mgmt_handle_request(&key);
+    wait_notified();
+    notified_fd = -1;
+    mgmt_handle_block(&key);
+    assert(recv(client, reply, sizeof(reply), 0) > 0);
+    assert(strncmp(reply, MGMT_STATUS_ERROR " ", 4) == 0);
+
+    close(client);
+    close(server);
+    user_db_destroy();
+    printf("PASSED\n");
+}
+
+static bool user_db_readers_stop;
+
+static void* user_db_reader(void* arg) {
+    (void)arg;
+    unsigned long checks = 0;
+    while (!__atomic_load_n(&user_db_readers_stop, __ATOMIC_RELAXED)) {
+        assert(user_db_check("stable", "pw") == USER_DB_AUTHENTICATED);
+        checks++;
+    }
+    return (void*)checks;
+}
+
+void test_user_db_concurrent_changes() {
+    printf("[TEST] user_db lookups race ADD/DEL and rebuilds... ");
+    assert(user_db_add("stable", 6, "pw") == USER_DB_OK);
+    user_db_readers_stop = false;
+    pthread_t readers[4];
+    for (int i = 0; i < 4; i++) {
+        assert(pthread_create(&readers[i], NULL, user_db_reader, NULL) == 0);
+    }
+
+    char name[32];
+    for (int i = 0; i < 20000; i++) {
+        snprintf(name, sizeof(name), "churn%d", i);
+        assert(user_db_add(name, strlen(name), "x") == USER_DB_OK);
+        if (i % 3 == 0) {
+            assert(user_db_del(name) == USER_DB_OK);
+        }
+    }
+
+    __atomic_store_n(&user_db_readers_stop, true, __ATOMIC_RELAXED);
+    for (int i = 0; i < 4; i++) {
+        pthread_join(readers[i], NULL);
+    }
+    assert(user_db_check("stable", "pw") == USER_DB_AUTHENTICATED);
+    user_db_destroy();
+    printf("PASSED\n");
+}
+
+#define LOGGER_THREADS 4
+#define LOGGER_RECORDS 1000
+
+static void* logger_worker(void* arg) {
+    const int id = (int)(intptr_t)arg;
+    for (int i = 0; i < LOGGER_RECORDS; i++) {
+        LOG_INFO("worker %d record %d\n", id, i);
+    }
+    return NULL;
+}
+
+// The logger tests run last: they start and stop the writer thread, and
+// leave their files in a temporary directory
+void test_logger_writes_records_in_order() {
+    printf("[TEST] logger writes every record through its ring, in order... ");
+    char dir[64];
+    snprintf(dir, sizeof(dir), "/tmp/socks5_logger_%d", (int)getpid());
+    assert(mkdir(dir, 0700) == 0);
+    char cwd[4096], path[4200];
+    assert(getcwd(cwd, sizeof(cwd)) != NULL);
+    assert(chdir(dir) == 0); // access.log lands here
+    snprintf(path, sizeof(path), "%s/server.log", dir);
+
+    const uint64_t dropped = logger_dropped();
+    logger_init(path, LOG_INFO);
+    pthread_t threads[LOGGER_THREADS];
+    for (int i = 0; i < LOGGER_THREADS; i++) {
+        assert(pthread_create(&threads[i], NULL, logger_worker,
+                              (void*)(intptr_t)i) == 0);
+    }
+    for (int i = 0; i < LOGGER_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    char longer[2 * LOG_RECORD_SIZE];
+    memset(longer, 'x', sizeof(longer) - 1);
+    longer[sizeof(longer) - 1] = '\0';
+    LOG_INFO("%s\n", longer);
+    logger_close();
+
+    // Whatever didn't fit in the ring was counted, the rest kept its order
+    FILE* f = fopen(path, "r");
+    assert(f != NULL);
+    int next[LOGGER_THREADS] = {0};
+    unsigned written = 0, cut = 0;
+    char line[2 * LOG_RECORD_SIZE];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        int id, i;
+        const char* msg = strstr(line, "] [INFO] ");
+        if (msg != NULL && sscanf(msg, "] [INFO] worker %d record %d", &id, &i) == 2) {
+            assert(id >= 0 && id < LOGGER_THREADS && i >= next[id]);
+            next[id] = i + 1;
+            written++;
+        } else if (strstr(line, "xxx...\n") != NULL) {
+            assert(strlen(line) == LOG_RECORD_SIZE);
+            cut++;
+        }
+    }
+    fclose(f);
+    assert(written + (logger_dropped() - dropped) >= LOGGER_THREADS * LOGGER_RECORDS);
+    assert(cut == 1 || logger_dropped() > dropped);
+
+    assert(chdir(cwd) == 0);
+    printf("PASSED\n");
+}
+
+void test_logger_binary_access_log() {
+    printf("[TEST] binary access log defines each name once... ");
+    char dir[64], cwd[4096];
+    snprintf(dir, sizeof(dir), "/tmp/socks5_access_%d", (int)getpid());
+    assert(mkdir(dir, 0700) == 0);
+    assert(getcwd(cwd, sizeof(cwd)) != NULL);
+    assert(chdir(dir) == 0);
+
+    struct sockaddr_storage client = {0};
+    struct sockaddr_in* sin = (struct sockaddr_in*)&client;
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(4000);
+    inet_pton(AF_INET, "127.0.0.1", &sin->sin_addr);
+
+    logger_access_format(LOG_ACCESS_BINARY);
+    logger_init("server.log", LOG_INFO);
+    logger_access(&(struct log_access){.username = "alice", .client_addr = &client,
+        .dest_host = "example.com", .dest_port = 443, .status = 0,
+        .bytes_up = 10, .bytes_down = 20, .duration_us = 1500000});
+    logger_access(&(struct log_access){.username = "alice", .client_addr = &client,
+        .dest_host = "192.0.2.1", .dest_port = 80, .status = 5});
+    logger_access(&(struct log_access){.client_addr = &client,
+        .dest_host = "example.com", .dest_port = 443});
+    // Too long together: the host is cut, the user kept whole
+    char long_user[256], long_host[256];
+    memset(long_user, 'u', 255);
+    long_user[255] = '\0';
+    memset(long_host, 'h', 255);
+    long_host[255] = '\0';
+    logger_access(&(struct log_access){.username = long_user,
+        .client_addr = &client, .dest_host = long_host, .dest_port = 443});
+    logger_close();
+    logger_access_format(LOG_ACCESS_TEXT);
+
+    uint8_t data[2048];
+    FILE* f = fopen(ACCESS_LOG_FILE, "rb");
+    assert(f != NULL);
+    const size_t len = fread(data, 1, sizeof(data), f);
+    fclose(f);
+    const size_t names = 2 * sizeof(struct access_record_name) + 5 + 11;
+    assert(len == sizeof(struct access_record_start) + names +
+                  2 * sizeof(struct access_record_name) + 255 + 39 +
+                  4 * sizeof(struct access_record_session));
+
+    struct access_record_start start;
+    memcpy(&start, data, sizeof(start));
+    assert(start.type == ACCESS_RECORD_START && start.version == ACCESS_LOG_VERSION);
+    assert(memcmp(start.magic, ACCESS_LOG_MAGIC, 4) == 0);
+
+    // Both names are defined right before the first session using them
+    const uint8_t* p = data + sizeof(start);
+    struct access_record_name name;
+    memcpy(&name, p, sizeof(name));
+    assert(name.type == ACCESS_RECORD_NAME && name.len == 5 && name.id == 0);
+    assert(memcmp(p + sizeof(name), "alice", 5) == 0);
+    p += sizeof(name) + 5;
+    memcpy(&name, p, sizeof(name));
+    assert(name.type == ACCESS_RECORD_NAME && name.len == 11 && name.id == 1);
+    assert(memcmp(p + sizeof(name), "example.com", 11) == 0);
+    p += sizeof(name) + 11;
+
+    struct access_record_session rec;
+    memcpy(&rec, p, sizeof(rec));
+    assert(rec.type == ACCESS_RECORD_SESSION && rec.user_id == 0);
+    assert((rec.flags & ACCESS_DEST_NAME) && rec.dest.name_id == 1);
+    assert(rec.dest_port == 443 && rec.client_port == 4000 && rec.status == 0);
+    assert(rec.bytes_up == 10 && rec.bytes_down == 20 && rec.duration_ms == 1500);
+    assert(memcmp(rec.client_addr, &sin->sin_addr, 4) == 0);
+    p += sizeof(rec);
+
+    // IP literals are kept as addresses
+    memcpy(&rec, p, sizeof(rec));
+    assert(rec.user_id == 0 && rec.status == 5 && rec.flags == 0);
+    const uint8_t literal[4] = {192, 0, 2, 1};
+    assert(memcmp(rec.dest.addr, literal, 4) == 0);
+    p += sizeof(rec);
+
+    memcpy(&rec, p, sizeof(rec));
+    assert(rec.user_id == ACCESS_NO_NAME && rec.dest.name_id == 1);
+    p += sizeof(rec);
+
+    memcpy(&name, p, sizeof(name));
+    assert(name.len == 255 && name.id == 2);
+    assert(memcmp(p + sizeof(name), long_user, 255) == 0);
+    p += sizeof(name) + name.len;
+    memcpy(&name, p, sizeof(name));
+    assert(name.len == 39 && name.id == 3);
+    p += sizeof(name) + name.len;
+    memcpy(&rec, p, sizeof(rec));
+    assert(rec.user_id == 2 && rec.dest.name_id == 3);
+    assert(rec.flags & ACCESS_TRUNCATED);
+
+    assert(chdir(cwd) == 0);
+    printf("PASSED\n");
+}
+
 int main() {
     printf("=== SOCKS5 Unit Tests ===\n");
+    // The KDF's cost is beside the point here
+    user_db_set_iterations(1);
+    assert(verifier_init(1) == 0);
     test_hello_read_no_auth();
     test_hello_read_user_pass();
     test_auth_read_success();
     test_auth_read_failure();
+    test_auth_verifies_off_loop();
     test_request_parse_ipv4();
+    test_handshake_parsers_whole_and_split();
+    test_handshake_pipelined();
+    test_request_domain_resolves_off_loop();
     test_copy_origin_closes_without_sending();
+    test_copy_borrows_relay_buffers();
+    test_copy_relays_early_data();
+    test_copy_adapts_relay_buffer_size();
+    test_copy_idle_timeout();
+    test_copy_completions();
+    test_copy_closes_more_tunnels_than_pooled();
+    test_copy_conn_rate();
+    test_copy_user_rate();
+    test_pop3_sniffer();
+    test_copy_dissects_client_bytes();
+    test_metrics_sum_thread_shards();
+    test_metrics_latency_percentiles();
+    test_metrics_http_renders_openmetrics();
+    test_user_stats_accounting();
+    test_admission_caps();
+    test_admission_user_sessions();
+    test_user_db_table();
+    test_user_db_load();
+    test_mgmt_add_hashes_off_the_loop();
+    test_user_db_concurrent_changes();
+    test_logger_writes_records_in_order();
+    test_logger_binary_access_log();
+    verifier_destroy();
     printf("All tests passed.\n");
     return 0;
 }
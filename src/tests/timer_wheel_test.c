@@ -0,0 +1,136 @@
+#include <check.h>
+#include <stdlib.h>
+
+// asi se puede probar las funciones internas
+#include "timer_wheel.c"
+
+#define N(x) (sizeof(x) / sizeof((x)[0]))
+
+// registra cuándo venció cada temporizador
+struct fired {
+  struct timer_wheel *w;
+  struct timer *timers;
+  uint64_t at[16];
+  unsigned count;
+};
+
+static void record(struct timer *t, void *data) {
+  struct fired *f = data;
+  ck_assert_int_eq(false, timer_armed(t));
+  f->at[t - f->timers] = f->w->now;
+  f->count++;
+}
+
+START_TEST(test_timer_wheel_expires_on_time) {
+  struct timer_wheel w;
+  timer_wheel_init(&w, 1000);
+  ck_assert_int_eq(-1, timer_wheel_next(&w));
+
+  // uno por nivel, y uno más allá del alcance de la rueda
+  const uint64_t delays[] = {1, 63, 64, 100, 4095, 4096, 300000, SPAN + 5};
+  struct timer timers[N(delays)];
+  struct fired f = {.w = &w, .timers = timers};
+  for (unsigned i = 0; i < N(delays); i++) {
+    timer_init(timers + i);
+    timer_wheel_schedule(&w, timers + i, 1000 + delays[i]);
+    ck_assert_int_eq(true, timer_armed(timers + i));
+  }
+  ck_assert_int_eq(1, timer_wheel_next(&w));
+
+  // avanzando de a saltos irregulares, cada uno vence en su milisegundo
+  uint64_t now = 1000;
+  while (f.count < N(delays)) {
+    const int64_t next = timer_wheel_next(&w);
+    ck_assert_int_gt(next, 0);
+    now += (uint64_t)next + (now % 3);
+    timer_wheel_advance(&w, now, record, &f);
+  }
+  for (unsigned i = 0; i < N(delays); i++) {
+    ck_assert_uint_eq(1000 + delays[i], f.at[i]);
+  }
+  ck_assert_uint_eq(0, w.count);
+  ck_assert_int_eq(-1, timer_wheel_next(&w));
+}
+END_TEST
+
+START_TEST(test_timer_wheel_cancel_reschedule) {
+  struct timer_wheel w;
+  timer_wheel_init(&w, 0);
+  struct timer timers[3];
+  struct fired f = {.w = &w, .timers = timers};
+  for (unsigned i = 0; i < N(timers); i++) {
+    timer_init(timers + i);
+    timer_wheel_schedule(&w, timers + i, 10);
+  }
+
+  timer_wheel_cancel(&w, timers + 1);
+  timer_wheel_cancel(&w, timers + 1);
+  ck_assert_int_eq(false, timer_armed(timers + 1));
+  timer_wheel_schedule(&w, timers + 2, 5000);
+  ck_assert_uint_eq(2, w.count);
+
+  timer_wheel_advance(&w, 4999, record, &f);
+  ck_assert_uint_eq(1, f.count);
+  ck_assert_uint_eq(10, f.at[0]);
+
+  // un vencimiento pasado se cumple en el próximo milisegundo
+  timer_wheel_schedule(&w, timers + 1, 3);
+  timer_wheel_advance(&w, 5000, record, &f);
+  ck_assert_uint_eq(3, f.count);
+  ck_assert_uint_eq(5000, f.at[1]);
+  ck_assert_uint_eq(5000, f.at[2]);
+}
+END_TEST
+
+// vuelve a agendar al que vence y cancela al otro
+static void rearm(struct timer *t, void *data) {
+  struct fired *f = data;
+  ck_assert_ptr_eq(f->timers, t);
+  f->at[f->count++] = f->w->now;
+  if (f->count < 3) {
+    timer_wheel_schedule(f->w, t, f->w->now + 100);
+  }
+  timer_wheel_cancel(f->w, f->timers + 1);
+}
+
+START_TEST(test_timer_wheel_callback_changes_wheel) {
+  struct timer_wheel w;
+  timer_wheel_init(&w, 0);
+  struct timer timers[2];
+  struct fired f = {.w = &w, .timers = timers};
+  timer_init(timers + 0);
+  timer_init(timers + 1);
+  timer_wheel_schedule(&w, timers + 0, 50);
+  timer_wheel_schedule(&w, timers + 1, 51);
+
+  timer_wheel_advance(&w, 10000, rearm, &f);
+  ck_assert_uint_eq(3, f.count);
+  ck_assert_uint_eq(50, f.at[0]);
+  ck_assert_uint_eq(150, f.at[1]);
+  ck_assert_uint_eq(250, f.at[2]);
+  ck_assert_int_eq(false, timer_armed(timers + 1));
+  ck_assert_uint_eq(0, w.count);
+}
+END_TEST
+
+Suite *suite(void) {
+  Suite *s = suite_create("timer_wheel");
+  TCase *tc = tcase_create("timer_wheel");
+
+  tcase_add_test(tc, test_timer_wheel_expires_on_time);
+  tcase_add_test(tc, test_timer_wheel_cancel_reschedule);
+  tcase_add_test(tc, test_timer_wheel_callback_changes_wheel);
+  suite_add_tcase(s, tc);
+
+  return s;
+}
+
+int main(void) {
+  SRunner *sr = srunner_create(suite());
+  int number_failed;
+
+  srunner_run_all(sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,106 @@
+#include <check.h>
+#include <stdlib.h>
+
+// asi se puede probar las funciones internas
+#include "token_bucket.c"
+
+START_TEST(test_token_bucket_unlimited) {
+  struct token_bucket b;
+  token_bucket_init(&b, 0, 0, 0);
+  ck_assert_uint_eq(1 << 20, token_bucket_take(&b, 0, 1 << 20));
+  ck_assert_uint_eq(1 << 20, token_bucket_take(&b, 0, 1 << 20));
+  ck_assert_uint_eq(0, token_bucket_wait(&b, 1 << 20));
+}
+END_TEST
+
+START_TEST(test_token_bucket_rate) {
+  struct token_bucket b;
+  token_bucket_init(&b, 1000, 500, 10000);
+
+  // arranca lleno, y no da más que la ráfaga
+  ck_assert_uint_eq(500, token_bucket_take(&b, 10000, 800));
+  ck_assert_uint_eq(0, token_bucket_take(&b, 10000, 800));
+  ck_assert_uint_eq(100, token_bucket_wait(&b, 100));
+  // pedir más que la ráfaga espera a que se llene
+  ck_assert_uint_eq(500, token_bucket_wait(&b, 5000));
+
+  ck_assert_uint_eq(100, token_bucket_take(&b, 10100, 800));
+  ck_assert_uint_eq(0, token_bucket_wait(&b, 0));
+
+  // lo que sobra vuelve, sin pasar de la ráfaga
+  token_bucket_refund(&b, 60);
+  ck_assert_uint_eq(60, token_bucket_take(&b, 10100, 800));
+  token_bucket_refund(&b, 5000);
+  ck_assert_uint_eq(500, token_bucket_take(&b, 10100, 800));
+
+  // un tiempo que retrocede no agrega nada
+  ck_assert_uint_eq(0, token_bucket_take(&b, 9000, 800));
+}
+END_TEST
+
+START_TEST(test_token_bucket_fractions) {
+  // 3 bytes por segundo: un byte cada 333.3ms
+  struct token_bucket b;
+  token_bucket_init(&b, 3, 10, 0);
+  ck_assert_uint_eq(10, token_bucket_take(&b, 0, 10));
+  ck_assert_uint_eq(334, token_bucket_wait(&b, 1));
+  ck_assert_uint_eq(0, token_bucket_take(&b, 333, 10));
+  ck_assert_uint_eq(1, token_bucket_take(&b, 334, 10));
+
+  // consumiendo de a milisegundos, en 10s pasa exactamente lo que debe
+  uint64_t total = 0;
+  token_bucket_init(&b, 123457, 4096, 0);
+  for (uint64_t now = 0; now <= 10000; now++) {
+    total += token_bucket_take(&b, now, 1 << 20);
+  }
+  ck_assert_uint_eq(4096 + 1234570, total);
+}
+END_TEST
+
+START_TEST(test_token_bucket_set_rate) {
+  struct token_bucket b;
+  token_bucket_init(&b, 1000, 1000, 0);
+  ck_assert_uint_eq(1000, token_bucket_take(&b, 0, 1000));
+
+  // lo acumulado a la tasa anterior se conserva
+  token_bucket_set_rate(&b, 10, 100, 50);
+  ck_assert_uint_eq(50, token_bucket_take(&b, 50, 1000));
+  ck_assert_uint_eq(1, token_bucket_take(&b, 150, 1000));
+
+  // a sin límite y de vuelta: arranca lleno
+  token_bucket_set_rate(&b, 0, 0, 200);
+  ck_assert_uint_eq(1 << 20, token_bucket_take(&b, 200, 1 << 20));
+  token_bucket_set_rate(&b, 10, 100, 300);
+  ck_assert_uint_eq(100, token_bucket_take(&b, 300, 1000));
+
+  // mucho tiempo después a una tasa enorme no desborda
+  token_bucket_init(&b, UINT64_C(1) << 40, UINT64_C(1) << 40, 0);
+  ck_assert_uint_eq(UINT64_C(1) << 40,
+                    token_bucket_take(&b, 0, UINT64_C(1) << 41));
+  ck_assert_uint_eq(UINT64_C(1) << 40,
+                    token_bucket_take(&b, UINT64_C(1) << 40, UINT64_C(1) << 41));
+}
+END_TEST
+
+Suite *suite(void) {
+  Suite *s = suite_create("token_bucket");
+  TCase *tc = tcase_create("token_bucket");
+
+  tcase_add_test(tc, test_token_bucket_unlimited);
+  tcase_add_test(tc, test_token_bucket_rate);
+  tcase_add_test(tc, test_token_bucket_fractions);
+  tcase_add_test(tc, test_token_bucket_set_rate);
+  suite_add_tcase(s, tc);
+
+  return s;
+}
+
+int main(void) {
+  SRunner *sr = srunner_create(suite());
+  int number_failed;
+
+  srunner_run_all(sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,136 @@
+#include <check.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+// asi se puede probar las funciones internas
+#include "token_scan.c"
+
+#define N(x) (sizeof(x) / sizeof((x)[0]))
+
+static const char *const keywords[] = {"USER ", "PASS ", "AUTH "};
+
+static const enum token_scan_impl impls[] = {
+    TOKEN_SCAN_SCALAR,
+    TOKEN_SCAN_SSE2,
+    TOKEN_SCAN_AVX2,
+};
+
+static size_t find(struct token_scan *s, enum token_scan_impl impl,
+                   const char *text) {
+  token_scan_use(s, impl);
+  return token_scan_find(s, (const uint8_t *)text, strlen(text));
+}
+
+// posición del primer literal, a la vieja usanza
+static size_t reference(const uint8_t *b, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    for (size_t k = 0; k < N(keywords); k++) {
+      const size_t len = strlen(keywords[k]);
+      const size_t m = len < n - i ? len : n - i;
+      size_t j = 0;
+      while (j < m && tolower(b[i + j]) == tolower(keywords[k][j])) {
+        j++;
+      }
+      if (j == m) {
+        return i;
+      }
+    }
+  }
+  return n;
+}
+
+START_TEST(test_token_scan_find) {
+  struct token_scan s;
+  ck_assert(token_scan_init(&s, keywords, N(keywords)));
+
+  for (size_t i = 0; i < N(impls); i++) {
+    if (!token_scan_use(&s, impls[i])) {
+      continue; // este procesador no la tiene
+    }
+    ck_assert_uint_eq(0, find(&s, impls[i], "USER foo\r\n"));
+    ck_assert_uint_eq(6, find(&s, impls[i], "CAPA\r\npass bar\r\n"));
+    ck_assert_uint_eq(40, find(&s, impls[i],
+                               "0123456789012345678901234567890123456789"
+                               "aUtH PLAIN\r\n"));
+    // parecidos que no son
+    ck_assert_uint_eq(21, find(&s, impls[i], "USERS PASSAUTHuser\r\n "));
+    // `@' y ``' se confunden con OR 0x20 pero no son letras
+    ck_assert_uint_eq(21, find(&s, impls[i], "@UTH `uth @@@@@@@@@@@"));
+    // cortado por el final
+    ck_assert_uint_eq(30, find(&s, impls[i],
+                               "012345678901234567890123456789PAS"));
+    ck_assert_uint_eq(0, find(&s, impls[i], ""));
+  }
+}
+END_TEST
+
+START_TEST(test_token_scan_agrees) {
+  struct token_scan s;
+  ck_assert(token_scan_init(&s, keywords, N(keywords)));
+
+  uint8_t b[256];
+  unsigned seed = 7;
+  for (unsigned round = 0; round < 2000; round++) {
+    // mucho ruido parecido a los literales
+    static const char noise[] = "UuSsEeRrPpAaTtHh @`\r\n\x80\xff";
+    for (size_t i = 0; i < sizeof(b); i++) {
+      seed = seed * 1103515245u + 12345u;
+      b[i] = noise[(seed >> 16) % (sizeof(noise) - 1)];
+    }
+    const size_t start = round % 40;
+    const size_t n = (seed >> 8) % (sizeof(b) - start);
+    const size_t want = reference(b + start, n);
+    for (size_t i = 0; i < N(impls); i++) {
+      if (token_scan_use(&s, impls[i])) {
+        ck_assert_uint_eq(want, token_scan_find(&s, b + start, n));
+      }
+    }
+  }
+}
+END_TEST
+
+START_TEST(test_token_scan_init) {
+  struct token_scan s;
+  const char *const short_one[] = {"USER ", "P"};
+  ck_assert(!token_scan_init(&s, short_one, N(short_one)));
+  const char *const long_one[] = {"ABCDEFGHIJKLMNOPQ"};
+  ck_assert(!token_scan_init(&s, long_one, N(long_one)));
+  const char *const many[TOKEN_SCAN_MAX + 1] = {
+      "aa", "bb", "cc", "dd", "ee", "ff", "gg", "hh", "ii"};
+  ck_assert(!token_scan_init(&s, many, N(many)));
+  ck_assert(token_scan_init(&s, many, TOKEN_SCAN_MAX));
+  ck_assert(token_scan_use(&s, TOKEN_SCAN_SCALAR));
+}
+END_TEST
+
+Suite *suite(void) {
+  Suite *s;
+  TCase *tc;
+
+  s = suite_create("token_scan");
+
+  /* Core test case */
+  tc = tcase_create("token_scan");
+
+  tcase_add_test(tc, test_token_scan_find);
+  tcase_add_test(tc, test_token_scan_agrees);
+  tcase_add_test(tc, test_token_scan_init);
+  suite_add_tcase(s, tc);
+
+  return s;
+}
+
+int main(void) {
+  int number_failed;
+  Suite *s;
+  SRunner *sr;
+
+  s = suite();
+  sr = srunner_create(s);
+
+  srunner_run_all(sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,558 @@
+#if !defined(_POSIX_C_SOURCE) || _POSIX_C_SOURCE < 200809L
+#undef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "user_db.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <unistd.h>
+
+#include "sha256.h"
+
+// =============================================================================
+// Credentials
+// =============================================================================
+
+#define HASH_PREFIX "$pbkdf2-sha256$"
+
+static uint32_t iterations = USER_DB_DEFAULT_ITERATIONS;
+static uint64_t default_rate = 0;
+
+static void random_bytes(void *buf, size_t len) {
+  // Never fails for so few bytes once the pool is initialized, which
+  // getrandom() waits for
+  while (getrandom(buf, len, 0) < 0 && errno == EINTR) {
+  }
+}
+
+static void credential_derive(struct user_credential *c, const char *pass,
+                              uint32_t iter) {
+  c->iterations = iter;
+  c->salt_len = USER_DB_SALT_SIZE;
+  random_bytes(c->salt, c->salt_len);
+  pbkdf2_sha256(pass, strlen(pass), c->salt, c->salt_len, iter, c->key,
+                sizeof(c->key));
+}
+
+// passlib's "adapted base64": '.' instead of '+', no padding
+static int ab64_value(char c) {
+  if (c >= 'A' && c <= 'Z') return c - 'A';
+  if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+  if (c >= '0' && c <= '9') return c - '0' + 52;
+  if (c == '.') return 62;
+  if (c == '/') return 63;
+  return -1;
+}
+
+// Decodes `len` characters of `s` into `out`; returns the bytes written, or
+// -1 if they aren't valid or wouldn't fit in `cap`
+static long ab64_decode(const char *s, size_t len, uint8_t *out, size_t cap) {
+  if (len % 4 == 1) {
+    return -1;
+  }
+  size_t n = 0;
+  uint32_t acc = 0;
+  unsigned bits = 0;
+  for (size_t i = 0; i < len; i++) {
+    const int v = ab64_value(s[i]);
+    if (v < 0) {
+      return -1;
+    }
+    acc = (acc << 6) | (uint32_t)v;
+    bits += 6;
+    if (bits >= 8) {
+      bits -= 8;
+      if (n == cap) {
+        return -1;
+      }
+      out[n++] = (uint8_t)(acc >> bits);
+    }
+  }
+  return (long)n;
+}
+
+// Parses "$pbkdf2-sha256$<iterations>$<salt>$<key>"
+static bool credential_parse(struct user_credential *c, const char *s) {
+  s += strlen(HASH_PREFIX);
+  char *end;
+  errno = 0;
+  const unsigned long iter = strtoul(s, &end, 10);
+  if (end == s || *end != '$' || errno == ERANGE || iter < 1 ||
+      iter > USER_DB_MAX_ITERATIONS) {
+    return false;
+  }
+  const char *salt = end + 1;
+  const char *key = strchr(salt, '$');
+  if (key == NULL) {
+    return false;
+  }
+  const long salt_len = ab64_decode(salt, key - salt, c->salt, sizeof(c->salt));
+  key++;
+  if (salt_len <= 0 ||
+      ab64_decode(key, strlen(key), c->key, sizeof(c->key)) !=
+          (long)sizeof(c->key)) {
+    return false;
+  }
+  c->iterations = (uint32_t)iter;
+  c->salt_len = (uint8_t)salt_len;
+  return true;
+}
+
+void user_db_set_iterations(uint32_t iter) {
+  __atomic_store_n(&iterations, iter, __ATOMIC_RELAXED);
+}
+
+bool user_db_verify(const struct user_credential *c, const char *pass) {
+  uint8_t key[USER_DB_KEY_SIZE];
+  pbkdf2_sha256(pass, strlen(pass), c->salt, c->salt_len, c->iterations, key,
+                sizeof(key));
+  // Constant time: how much of the key matched must not show
+  uint8_t diff = 0;
+  for (size_t i = 0; i < sizeof(key); i++) {
+    diff |= key[i] ^ c->key[i];
+  }
+  return diff == 0;
+}
+
+// =============================================================================
+// Table
+// =============================================================================
+//
+// Linear probing over a power of two number of slots. Deleting leaves a
+// tombstone so the probe sequences running through the slot still reach
+// the users after it; tombstones are dropped whenever the table is rebuilt.
+
+#define MIN_SLOTS 64
+#define MAX_LOAD(slots) ((slots) / 4 * 3) // users plus tombstones
+
+struct user_record {
+  struct user_credential cred;
+  uint64_t rate;
+  char name[];
+};
+
+// A deleted user's slot
+static struct user_record tombstone;
+
+struct user_slot {
+  uint32_t hash;
+  struct user_record *record; // NULL if free
+};
+
+static pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct user_slot *slots = NULL;
+static size_t slot_count = 0; // power of two
+static size_t users = 0; // also read without the lock, see user_db_count()
+static size_t tombstones = 0;
+
+// FNV-1a, like user_stats.c; names are case sensitive
+static uint32_t name_hash(const char *name, size_t len) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ (uint8_t)name[i]) * 16777619u;
+  }
+  return h;
+}
+
+static bool slot_used(const struct user_slot *slot) {
+  return slot->record != NULL && slot->record != &tombstone;
+}
+
+// Slot holding `name`, or NULL
+static struct user_slot *find(const char *name, size_t len, uint32_t hash) {
+  if (slots == NULL) {
+    return NULL;
+  }
+  const size_t mask = slot_count - 1;
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    struct user_slot *slot = &slots[i];
+    if (slot->record == NULL) {
+      return NULL;
+    }
+    if (slot->record != &tombstone && slot->hash == hash &&
+        strncmp(slot->record->name, name, len) == 0 &&
+        slot->record->name[len] == '\0') {
+      return slot;
+    }
+  }
+}
+
+// Moves every user into a table of `count` slots
+static bool rebuild(size_t count) {
+  struct user_slot *fresh = calloc(count, sizeof(*fresh));
+  if (fresh == NULL) {
+    return false;
+  }
+  for (size_t i = 0; i < slot_count; i++) {
+    if (slot_used(&slots[i])) {
+      size_t j = slots[i].hash & (count - 1);
+      while (fresh[j].record != NULL) {
+        j = (j + 1) & (count - 1);
+      }
+      fresh[j] = slots[i];
+    }
+  }
+  free(slots);
+  slots = fresh;
+  slot_count = count;
+  tombstones = 0;
+  return true;
+}
+
+// Makes room for one more user
+static bool reserve(void) {
+  if (users + tombstones + 1 <= MAX_LOAD(slot_count)) {
+    return true;
+  }
+  size_t count = slot_count == 0 ? MIN_SLOTS : slot_count;
+  // Only grow if the users themselves need it, not the tombstones
+  while (users + 1 > MAX_LOAD(count) / 2) {
+    count *= 2;
+  }
+  return rebuild(count);
+}
+
+// =============================================================================
+// Changes
+// =============================================================================
+
+bool user_db_hashed(const char *pass) {
+  return strncmp(pass, HASH_PREFIX, strlen(HASH_PREFIX)) == 0;
+}
+
+void user_db_derive(const char *pass, struct user_credential *cred) {
+  credential_derive(cred, pass,
+                    __atomic_load_n(&iterations, __ATOMIC_RELAXED));
+}
+
+enum user_db_status user_db_add(const char *name, size_t name_len,
+                                const char *pass) {
+  struct user_credential cred;
+  if (user_db_hashed(pass)) {
+    if (!credential_parse(&cred, pass)) {
+      return USER_DB_BAD_HASH;
+    }
+  } else {
+    // Outside the lock: this is the slow part
+    user_db_derive(pass, &cred);
+  }
+  return user_db_add_credential(name, name_len, &cred);
+}
+
+enum user_db_status user_db_add_credential(const char *name, size_t name_len,
+                                           const struct user_credential *cred) {
+  const uint32_t hash = name_hash(name, name_len);
+  struct user_record *record = malloc(sizeof(*record) + name_len + 1);
+  if (record == NULL) {
+    return USER_DB_NO_MEMORY;
+  }
+  memcpy(record->name, name, name_len);
+  record->name[name_len] = '\0';
+  record->rate = USER_DB_RATE_DEFAULT;
+  record->cred = *cred;
+
+  enum user_db_status status = USER_DB_OK;
+  pthread_rwlock_wrlock(&lock);
+  if (find(name, name_len, hash) != NULL) {
+    status = USER_DB_EXISTS;
+  } else if (!reserve()) {
+    status = USER_DB_NO_MEMORY;
+  } else {
+    const size_t mask = slot_count - 1;
+    size_t i = hash & mask;
+    while (slot_used(&slots[i])) {
+      i = (i + 1) & mask;
+    }
+    if (slots[i].record == &tombstone) {
+      tombstones--;
+    }
+    slots[i] = (struct user_slot){hash, record};
+    __atomic_add_fetch(&users, 1, __ATOMIC_RELAXED);
+  }
+  pthread_rwlock_unlock(&lock);
+
+  if (status != USER_DB_OK) {
+    free(record);
+  }
+  return status;
+}
+
+enum user_db_status user_db_del(const char *name) {
+  const size_t len = strlen(name);
+  struct user_record *record = NULL;
+
+  pthread_rwlock_wrlock(&lock);
+  struct user_slot *slot = find(name, len, name_hash(name, len));
+  if (slot != NULL) {
+    record = slot->record;
+    *slot = (struct user_slot){.record = &tombstone};
+    __atomic_sub_fetch(&users, 1, __ATOMIC_RELAXED);
+    tombstones++;
+  }
+  pthread_rwlock_unlock(&lock);
+
+  free(record);
+  return record != NULL ? USER_DB_OK : USER_DB_NOT_FOUND;
+}
+
+void user_db_set_default_rate(uint64_t rate) {
+  __atomic_store_n(&default_rate, rate, __ATOMIC_RELAXED);
+}
+
+enum user_db_status user_db_set_rate(const char *name, uint64_t rate) {
+  const size_t len = strlen(name);
+
+  pthread_rwlock_wrlock(&lock);
+  struct user_slot *slot = find(name, len, name_hash(name, len));
+  if (slot != NULL) {
+    slot->record->rate = rate;
+  }
+  pthread_rwlock_unlock(&lock);
+
+  return slot != NULL ? USER_DB_OK : USER_DB_NOT_FOUND;
+}
+
+void user_db_destroy(void) {
+  pthread_rwlock_wrlock(&lock);
+  for (size_t i = 0; i < slot_count; i++) {
+    if (slot_used(&slots[i])) {
+      free(slots[i].record);
+    }
+  }
+  free(slots);
+  slots = NULL;
+  slot_count = tombstones = 0;
+  __atomic_store_n(&users, 0, __ATOMIC_RELAXED);
+  pthread_rwlock_unlock(&lock);
+}
+
+// =============================================================================
+// Lookups
+// =============================================================================
+
+bool user_db_lookup(const char *name, struct user_credential *cred) {
+  const size_t len = strlen(name);
+  const uint32_t hash = name_hash(name, len);
+
+  pthread_rwlock_rdlock(&lock);
+  const struct user_slot *slot = find(name, len, hash);
+  if (slot != NULL) {
+    *cred = slot->record->cred;
+  }
+  pthread_rwlock_unlock(&lock);
+
+  if (slot == NULL) {
+    // Random, so no password matches it
+    cred->iterations = __atomic_load_n(&iterations, __ATOMIC_RELAXED);
+    cred->salt_len = USER_DB_SALT_SIZE;
+    random_bytes(cred->salt, cred->salt_len);
+    random_bytes(cred->key, sizeof(cred->key));
+  }
+  return slot != NULL;
+}
+
+uint64_t user_db_rate(const char *name) {
+  const size_t len = strlen(name);
+  uint64_t rate = USER_DB_RATE_DEFAULT;
+
+  pthread_rwlock_rdlock(&lock);
+  const struct user_slot *slot = find(name, len, name_hash(name, len));
+  if (slot != NULL) {
+    rate = slot->record->rate;
+  }
+  pthread_rwlock_unlock(&lock);
+
+  return rate != USER_DB_RATE_DEFAULT
+             ? rate
+             : __atomic_load_n(&default_rate, __ATOMIC_RELAXED);
+}
+
+enum user_db_check user_db_check(const char *name, const char *pass) {
+  struct user_credential cred;
+  if (!user_db_lookup(name, &cred)) {
+    return USER_DB_UNKNOWN_USER;
+  }
+  return user_db_verify(&cred, pass) ? USER_DB_AUTHENTICATED
+                                     : USER_DB_WRONG_PASSWORD;
+}
+
+size_t user_db_count(void) {
+  return __atomic_load_n(&users, __ATOMIC_RELAXED);
+}
+
+void user_db_foreach(void (*fn)(const char *name, void *data), void *data) {
+  pthread_rwlock_rdlock(&lock);
+  for (size_t i = 0; i < slot_count; i++) {
+    if (slot_used(&slots[i])) {
+      fn(slots[i].record->name, data);
+    }
+  }
+  pthread_rwlock_unlock(&lock);
+}
+
+// =============================================================================
+// Files
+// =============================================================================
+
+// Lines of a file to add, parsed before any is hashed
+struct load_entry {
+  unsigned long lineno;
+  char *line; // name, then the password after name_len + 1
+  size_t name_len;
+  struct user_credential cred; // plain-text passwords only
+};
+
+#define LOAD_MAX_THREADS 64
+
+// Plain-text passwords in a file beyond which loading it says it is slow
+#define LOAD_WARN_PLAIN 1000
+
+struct load_work {
+  struct load_entry *entries;
+  size_t count;
+  size_t next; // taken with an atomic add
+};
+
+// Hashes the plain-text passwords left, from every loading thread
+static void *load_derive(void *arg) {
+  struct load_work *w = arg;
+  size_t i;
+  while ((i = __atomic_fetch_add(&w->next, 1, __ATOMIC_RELAXED)) < w->count) {
+    const char *pass = w->entries[i].line + w->entries[i].name_len + 1;
+    if (!user_db_hashed(pass)) {
+      user_db_derive(pass, &w->entries[i].cred);
+    }
+  }
+  return NULL;
+}
+
+// Each password takes tens of milliseconds to hash: with thousands of users
+// in a file that is minutes on one core, so every core takes a share
+static void load_derive_all(struct load_entry *entries, size_t count) {
+  struct load_work w = {.entries = entries, .count = count};
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cores > LOAD_MAX_THREADS) {
+    cores = LOAD_MAX_THREADS;
+  }
+  pthread_t threads[LOAD_MAX_THREADS];
+  long started = 0;
+  // this thread is one of them
+  while (started + 1 < cores && (size_t)started + 1 < count &&
+         pthread_create(&threads[started], NULL, load_derive, &w) == 0) {
+    started++;
+  }
+  load_derive(&w);
+  for (long i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+}
+
+long user_db_load(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  struct load_entry *entries = NULL;
+  size_t count = 0, room = 0;
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t n;
+  unsigned long lineno = 0;
+  const char *error = NULL;
+  while (error == NULL && (n = getline(&line, &cap, f)) != -1) {
+    lineno++;
+    while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r')) {
+      line[--n] = '\0';
+    }
+    if (n == 0 || line[0] == '#') {
+      continue;
+    }
+
+    const char *colon = strchr(line, ':');
+    if (colon == NULL) {
+      error = "expected name:password";
+    } else if (colon == line || colon - line > 255) {
+      error = "username must be 1 to 255 bytes long";
+    } else if (colon[1] == '\0' || strlen(colon + 1) > 255) {
+      error = "password must be 1 to 255 bytes long";
+    } else {
+      if (count == room) {
+        room = room == 0 ? 64 : 2 * room;
+        struct load_entry *grown = realloc(entries, room * sizeof(*entries));
+        if (grown == NULL) {
+          error = "out of memory";
+          break;
+        }
+        entries = grown;
+      }
+      entries[count] = (struct load_entry){
+          .lineno = lineno, .line = line, .name_len = colon - line};
+      count++;
+      line = NULL; // kept by the entry
+      cap = 0;
+    }
+  }
+  free(line);
+  fclose(f);
+
+  size_t plain = 0;
+  for (size_t i = 0; i < count; i++) {
+    plain += !user_db_hashed(entries[i].line + entries[i].name_len + 1);
+  }
+  if (plain > LOAD_WARN_PLAIN) {
+    fprintf(stderr,
+            "%s: hashing %zu plain-text passwords, this takes a while; give "
+            "them as " HASH_PREFIX "... to skip it\n",
+            path, plain);
+  }
+  load_derive_all(entries, count);
+
+  // In file order, so the first bad line is the one reported
+  long added = 0;
+  for (size_t i = 0; i < count && added >= 0; i++) {
+    const struct load_entry *e = &entries[i];
+    const char *pass = e->line + e->name_len + 1;
+    const enum user_db_status status =
+        user_db_hashed(pass) ? user_db_add(e->line, e->name_len, pass)
+                             : user_db_add_credential(e->line, e->name_len,
+                                                      &e->cred);
+    const char *add_error = NULL;
+    switch (status) {
+      case USER_DB_OK:
+        added++;
+        break;
+      case USER_DB_EXISTS:
+        add_error = "duplicate user";
+        break;
+      case USER_DB_BAD_HASH:
+        add_error = "malformed " HASH_PREFIX " hash";
+        break;
+      default:
+        add_error = "out of memory";
+        break;
+    }
+    if (add_error != NULL) {
+      fprintf(stderr, "%s:%lu: %s\n", path, e->lineno, add_error);
+      added = -1;
+    }
+  }
+  if (added >= 0 && error != NULL) {
+    fprintf(stderr, "%s:%lu: %s\n", path, lineno, error);
+    added = -1;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    free(entries[i].line);
+  }
+  free(entries);
+  return added;
+}
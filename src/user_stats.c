@@ -0,0 +1,246 @@
+#include "user_stats.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "metrics.h"
+
+// =============================================================================
+// Registry
+// =============================================================================
+
+#define MIN_BUCKETS 64 // power of two
+
+struct user_stats {
+  // Written by every worker serving the user; kept off the lines of other
+  // users' counters
+  _Alignas(METRICS_CACHE_LINE) uint64_t bytes_received;
+  uint64_t bytes_sent;
+  uint64_t active_sessions;
+  uint64_t total_sessions;
+  uint64_t auth_failures;
+
+  struct shaper_shared shaping[USER_STATS_DIRECTIONS];
+
+  struct user_stats *bucket_next;
+  struct user_stats *next; // in order of creation
+  char name[];
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+// Doubled whenever users outnumber them, so chains stay about one long
+static struct user_stats **buckets = NULL;
+static size_t bucket_count = 0, user_count = 0;
+static struct user_stats *head = NULL, *tail = NULL;
+
+// FNV-1a; names are case sensitive, like passwords
+static uint32_t name_hash(const char *name) {
+  uint32_t h = 2166136261u;
+  for (const char *c = name; *c; c++) {
+    h = (h ^ (uint8_t)*c) * 16777619u;
+  }
+  return h;
+}
+
+static struct user_stats *lookup(const char *name, uint32_t hash) {
+  if (buckets == NULL) {
+    return NULL;
+  }
+  for (struct user_stats *u = buckets[hash & (bucket_count - 1)]; u != NULL;
+       u = u->bucket_next) {
+    if (strcmp(u->name, name) == 0) {
+      return u;
+    }
+  }
+  return NULL;
+}
+
+static void bucket_insert(struct user_stats **table, size_t count,
+                          struct user_stats *u) {
+  struct user_stats **bucket = &table[name_hash(u->name) & (count - 1)];
+  u->bucket_next = *bucket;
+  *bucket = u;
+}
+
+// Makes room for one more user; false if out of memory
+static bool reserve(void) {
+  if (user_count < bucket_count) {
+    return true;
+  }
+  const size_t count = bucket_count == 0 ? MIN_BUCKETS : 2 * bucket_count;
+  struct user_stats **table = calloc(count, sizeof(*table));
+  if (table == NULL) {
+    return false;
+  }
+  for (struct user_stats *u = head; u != NULL; u = u->next) {
+    bucket_insert(table, count, u);
+  }
+  free(buckets);
+  buckets = table;
+  bucket_count = count;
+  return true;
+}
+
+struct user_stats *user_stats_get(const char *name) {
+  const uint32_t hash = name_hash(name);
+
+  pthread_mutex_lock(&lock);
+  struct user_stats *u = lookup(name, hash);
+  if (u == NULL) {
+    const size_t len = strlen(name) + 1;
+    // the size must be a multiple of the alignment
+    const size_t size = (sizeof(*u) + len + METRICS_CACHE_LINE - 1) /
+                        METRICS_CACHE_LINE * METRICS_CACHE_LINE;
+    u = reserve() ? aligned_alloc(METRICS_CACHE_LINE, size) : NULL;
+    if (u != NULL) {
+      memset(u, 0, sizeof(*u));
+      memcpy(u->name, name, len);
+      for (int d = 0; d < USER_STATS_DIRECTIONS; d++) {
+        shaper_shared_init(&u->shaping[d]);
+      }
+      bucket_insert(buckets, bucket_count, u);
+      user_count++;
+      if (tail != NULL) {
+        tail->next = u;
+      } else {
+        head = u;
+      }
+      tail = u;
+    }
+  }
+  pthread_mutex_unlock(&lock);
+  return u;
+}
+
+void user_stats_destroy(void) {
+  pthread_mutex_lock(&lock);
+  struct user_stats *u = head;
+  while (u != NULL) {
+    struct user_stats *next = u->next;
+    for (int d = 0; d < USER_STATS_DIRECTIONS; d++) {
+      shaper_shared_destroy(&u->shaping[d]);
+    }
+    free(u);
+    u = next;
+  }
+  head = tail = NULL;
+  free(buckets);
+  buckets = NULL;
+  bucket_count = user_count = 0;
+  pthread_mutex_unlock(&lock);
+}
+
+// =============================================================================
+// Counters
+// =============================================================================
+
+static void add(uint64_t *counter, uint64_t n) {
+  __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+void user_stats_session_open(struct user_stats *u) {
+  if (u != NULL) {
+    add(&u->active_sessions, 1);
+    add(&u->total_sessions, 1);
+  }
+}
+
+bool user_stats_session_try_open(struct user_stats *u, uint64_t max) {
+  if (u == NULL || max == 0) {
+    user_stats_session_open(u);
+    return true;
+  }
+  uint64_t active = __atomic_load_n(&u->active_sessions, __ATOMIC_RELAXED);
+  do {
+    if (active >= max) {
+      return false;
+    }
+  } while (!__atomic_compare_exchange_n(&u->active_sessions, &active,
+                                        active + 1, true, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED));
+  add(&u->total_sessions, 1);
+  return true;
+}
+
+void user_stats_session_close(struct user_stats *u) {
+  if (u != NULL) {
+    add(&u->active_sessions, (uint64_t)-1);
+  }
+}
+
+void user_stats_add_bytes_received(struct user_stats *u, size_t bytes) {
+  if (u != NULL) {
+    add(&u->bytes_received, bytes);
+  }
+}
+
+void user_stats_add_bytes_sent(struct user_stats *u, size_t bytes) {
+  if (u != NULL) {
+    add(&u->bytes_sent, bytes);
+  }
+}
+
+void user_stats_auth_failure(struct user_stats *u) {
+  if (u != NULL) {
+    add(&u->auth_failures, 1);
+  }
+}
+
+// =============================================================================
+// Shaping
+// =============================================================================
+
+void user_stats_set_rate(struct user_stats *u, uint64_t rate,
+                         uint64_t now_ms) {
+  if (u == NULL) {
+    return;
+  }
+  for (int d = 0; d < USER_STATS_DIRECTIONS; d++) {
+    shaper_shared_set_rate(&u->shaping[d], rate, now_ms);
+  }
+}
+
+struct shaper_shared *user_stats_shaper(struct user_stats *u,
+                                        enum user_stats_direction dir) {
+  return u != NULL ? &u->shaping[dir] : NULL;
+}
+
+// =============================================================================
+// Listing
+// =============================================================================
+
+static void view(const struct user_stats *u, struct user_stats_view *out) {
+  *out = (struct user_stats_view){
+      .name = u->name,
+      .bytes_received = __atomic_load_n(&u->bytes_received, __ATOMIC_RELAXED),
+      .bytes_sent = __atomic_load_n(&u->bytes_sent, __ATOMIC_RELAXED),
+      .active_sessions =
+          __atomic_load_n(&u->active_sessions, __ATOMIC_RELAXED),
+      .total_sessions = __atomic_load_n(&u->total_sessions, __ATOMIC_RELAXED),
+      .auth_failures = __atomic_load_n(&u->auth_failures, __ATOMIC_RELAXED),
+  };
+}
+
+bool user_stats_find(const char *name, struct user_stats_view *out) {
+  const uint32_t hash = name_hash(name);
+  pthread_mutex_lock(&lock);
+  const struct user_stats *u = lookup(name, hash);
+  if (u != NULL) {
+    view(u, out);
+  }
+  pthread_mutex_unlock(&lock);
+  return u != NULL;
+}
+
+void user_stats_foreach(void (*fn)(const struct user_stats_view *u,
+                                   void *data),
+                        void *data) {
+  pthread_mutex_lock(&lock);
+  for (const struct user_stats *u = head; u != NULL; u = u->next) {
+    struct user_stats_view v;
+    view(u, &v);
+    fn(&v, data);
+  }
+  pthread_mutex_unlock(&lock);
+}
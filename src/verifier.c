@@ -0,0 +1,385 @@
+#if !defined(_POSIX_C_SOURCE) || _POSIX_C_SOURCE < 200809L
+#undef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "verifier.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <time.h>
+
+#include "logger.h"
+#include "sha256.h"
+
+// =============================================================================
+// State
+// =============================================================================
+
+#define MAX_PASSWORD 255 // as RFC 1929 allows
+
+enum job_state {
+  JOB_QUEUED,
+  JOB_RUNNING,
+  JOB_DONE,
+};
+
+struct verifier_job {
+  fd_selector selector;
+  int fd;
+  enum job_state state;
+  bool cancelled; // while running: the thread frees it
+  bool derive;    // hashes the password into cred instead of checking it
+  bool authenticated; // or, for derive, whether cred holds the result
+
+  struct user_credential cred;
+  uint8_t digest[SHA256_DIGEST_SIZE]; // cache key
+  char password[MAX_PASSWORD + 1];
+
+  struct verifier_job *next; // queue link
+};
+
+struct cache_entry {
+  uint8_t digest[SHA256_DIGEST_SIZE];
+  time_t expires; // 0 if free
+};
+
+// One lock for the queue, the cache and every job's state, as in the
+// resolver: the KDF runs unlocked.
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pending = PTHREAD_COND_INITIALIZER;
+
+static struct verifier_job *queue_head = NULL;
+static struct verifier_job *queue_tail = NULL;
+static unsigned queued = 0;
+
+static struct cache_entry cache[VERIFIER_CACHE_SIZE];
+static uint8_t cache_key[SHA256_DIGEST_SIZE];
+static struct verifier_stats stats;
+
+static pthread_t *threads = NULL;
+static unsigned thread_count = 0;
+static bool stopping = false;
+
+static time_t now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+// Clears memory that held a password, even if it is freed right after
+static void wipe(void *p, size_t len) {
+  volatile uint8_t *v = p;
+  while (len-- > 0) {
+    *v++ = 0;
+  }
+}
+
+static void job_free(struct verifier_job *job) {
+  wipe(job->password, sizeof(job->password));
+  free(job);
+}
+
+// =============================================================================
+// Cache
+// =============================================================================
+
+// HMAC of the credential's fields (not the struct, its padding is
+// unspecified) and the password
+static void cache_digest(const struct user_credential *cred,
+                         const char *password, size_t len,
+                         uint8_t out[SHA256_DIGEST_SIZE]) {
+  uint8_t msg[sizeof(cred->iterations) + sizeof(cred->key) +
+              sizeof(cred->salt) + MAX_PASSWORD];
+  size_t n = 0;
+  memcpy(msg + n, &cred->iterations, sizeof(cred->iterations));
+  n += sizeof(cred->iterations);
+  memcpy(msg + n, cred->key, sizeof(cred->key));
+  n += sizeof(cred->key);
+  memcpy(msg + n, cred->salt, cred->salt_len);
+  n += cred->salt_len;
+  memcpy(msg + n, password, len);
+  n += len;
+  hmac_sha256(cache_key, sizeof(cache_key), msg, n, out);
+  wipe(msg, sizeof(msg));
+}
+
+static struct cache_entry *cache_slot(const uint8_t *digest) {
+  uint32_t i;
+  memcpy(&i, digest, sizeof(i));
+  return &cache[i & (VERIFIER_CACHE_SIZE - 1)];
+}
+
+static bool cache_hit(const uint8_t *digest) {
+  const struct cache_entry *e = cache_slot(digest);
+  return e->expires > now() &&
+         memcmp(e->digest, digest, SHA256_DIGEST_SIZE) == 0;
+}
+
+static void cache_insert(const uint8_t *digest) {
+  struct cache_entry *e = cache_slot(digest);
+  memcpy(e->digest, digest, SHA256_DIGEST_SIZE);
+  e->expires = now() + VERIFIER_CACHE_TTL;
+}
+
+// =============================================================================
+// Verifier threads
+// =============================================================================
+
+static void queue_push(struct verifier_job *job) {
+  job->next = NULL;
+  if (queue_tail != NULL) {
+    queue_tail->next = job;
+  } else {
+    queue_head = job;
+  }
+  queue_tail = job;
+  queued++;
+}
+
+static struct verifier_job *queue_pop(void) {
+  struct verifier_job *job = queue_head;
+  if (job != NULL) {
+    queue_head = job->next;
+    if (queue_head == NULL) {
+      queue_tail = NULL;
+    }
+    queued--;
+  }
+  return job;
+}
+
+static void queue_remove(struct verifier_job *job) {
+  struct verifier_job **p = &queue_head, *prev = NULL;
+  while (*p != job) {
+    prev = *p;
+    p = &(*p)->next;
+  }
+  *p = job->next;
+  if (queue_tail == job) {
+    queue_tail = prev;
+  }
+  queued--;
+}
+
+// Publishes the result of a job and wakes its session
+static void job_complete(struct verifier_job *job, bool authenticated) {
+  wipe(job->password, sizeof(job->password));
+  if (job->cancelled) {
+    free(job);
+    return;
+  }
+  job->authenticated = authenticated;
+  job->state = JOB_DONE;
+  // The selector hands the notification to its thread without calling
+  // back into us, so doing this under our lock can't deadlock.
+  if (selector_notify_block(job->selector, job->fd) != SELECTOR_SUCCESS) {
+    LOG_ERROR("Failed to notify verification of fd %d\n", job->fd);
+  }
+}
+
+static void *verifier_thread(void *arg) {
+  (void)arg;
+
+  pthread_mutex_lock(&lock);
+  while (true) {
+    while (queue_head == NULL && !stopping) {
+      pthread_cond_wait(&pending, &lock);
+    }
+    if (stopping) {
+      break;
+    }
+    struct verifier_job *job = queue_pop();
+    job->state = JOB_RUNNING;
+    pthread_mutex_unlock(&lock);
+
+    bool ok = true;
+    if (job->derive) {
+      user_db_derive(job->password, &job->cred);
+    } else {
+      ok = user_db_verify(&job->cred, job->password);
+    }
+
+    pthread_mutex_lock(&lock);
+    if (ok && !job->derive) {
+      cache_insert(job->digest);
+    }
+    job_complete(job, ok);
+  }
+  pthread_mutex_unlock(&lock);
+  return NULL;
+}
+
+int verifier_init(unsigned n) {
+  threads = calloc(n, sizeof(*threads));
+  if (threads == NULL) {
+    return -1;
+  }
+  while (getrandom(cache_key, sizeof(cache_key), 0) < 0 && errno == EINTR) {
+  }
+
+  stopping = false;
+  for (thread_count = 0; thread_count < n; thread_count++) {
+    if (pthread_create(&threads[thread_count], NULL, verifier_thread, NULL) !=
+        0) {
+      LOG_WARNING("Started only %u of %u verifier threads\n", thread_count, n);
+      break;
+    }
+  }
+  return thread_count > 0 ? 0 : -1;
+}
+
+void verifier_destroy(void) {
+  pthread_mutex_lock(&lock);
+  stopping = true;
+  pthread_cond_broadcast(&pending);
+  pthread_mutex_unlock(&lock);
+
+  for (unsigned i = 0; i < thread_count; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+  threads = NULL;
+  thread_count = 0;
+
+  pthread_mutex_lock(&lock);
+  // Checks nobody will run fail, so their sessions stop waiting
+  struct verifier_job *job;
+  while ((job = queue_pop()) != NULL) {
+    job_complete(job, false);
+  }
+  wipe(cache, sizeof(cache));
+  wipe(cache_key, sizeof(cache_key));
+  pthread_mutex_unlock(&lock);
+}
+
+// =============================================================================
+// Jobs
+// =============================================================================
+
+struct verifier_job *verifier_submit(fd_selector s, int fd,
+                                     const struct user_credential *cred,
+                                     const char *password) {
+  const size_t len = strlen(password);
+  if (len > MAX_PASSWORD) {
+    return NULL;
+  }
+  struct verifier_job *job = calloc(1, sizeof(*job));
+  if (job == NULL) {
+    return NULL;
+  }
+  job->selector = s;
+  job->fd = fd;
+  job->cred = *cred;
+  cache_digest(cred, password, len, job->digest);
+
+  pthread_mutex_lock(&lock);
+  if (thread_count == 0 || stopping) {
+    goto fail;
+  }
+  if (cache_hit(job->digest)) {
+    stats.hits++;
+    job->state = JOB_DONE;
+    job->authenticated = true;
+  } else {
+    if (queued >= VERIFIER_MAX_QUEUED) {
+      goto fail;
+    }
+    stats.misses++;
+    memcpy(job->password, password, len + 1);
+    job->state = JOB_QUEUED;
+    queue_push(job);
+    pthread_cond_signal(&pending);
+  }
+  pthread_mutex_unlock(&lock);
+  return job;
+
+fail:
+  pthread_mutex_unlock(&lock);
+  job_free(job);
+  return NULL;
+}
+
+struct verifier_job *verifier_submit_derive(fd_selector s, int fd,
+                                            const char *password) {
+  const size_t len = strlen(password);
+  if (len > MAX_PASSWORD) {
+    return NULL;
+  }
+  struct verifier_job *job = calloc(1, sizeof(*job));
+  if (job == NULL) {
+    return NULL;
+  }
+  job->selector = s;
+  job->fd = fd;
+  job->derive = true;
+  memcpy(job->password, password, len + 1);
+
+  pthread_mutex_lock(&lock);
+  if (thread_count == 0 || stopping || queued >= VERIFIER_MAX_QUEUED) {
+    pthread_mutex_unlock(&lock);
+    job_free(job);
+    return NULL;
+  }
+  job->state = JOB_QUEUED;
+  queue_push(job);
+  pthread_cond_signal(&pending);
+  pthread_mutex_unlock(&lock);
+  return job;
+}
+
+bool verifier_poll(struct verifier_job *job, bool *authenticated) {
+  pthread_mutex_lock(&lock);
+  const bool done = job->state == JOB_DONE;
+  pthread_mutex_unlock(&lock);
+
+  if (!done) {
+    return false;
+  }
+  *authenticated = job->authenticated;
+  job_free(job);
+  return true;
+}
+
+bool verifier_poll_derive(struct verifier_job *job, bool *derived,
+                          struct user_credential *cred) {
+  pthread_mutex_lock(&lock);
+  const bool done = job->state == JOB_DONE;
+  pthread_mutex_unlock(&lock);
+
+  if (!done) {
+    return false;
+  }
+  *derived = job->authenticated;
+  if (*derived) {
+    *cred = job->cred;
+  }
+  job_free(job);
+  return true;
+}
+
+void verifier_cancel(struct verifier_job *job) {
+  pthread_mutex_lock(&lock);
+  switch (job->state) {
+    case JOB_QUEUED:
+      queue_remove(job);
+      job_free(job);
+      break;
+    case JOB_RUNNING:
+      job->cancelled = true;
+      break;
+    case JOB_DONE:
+      job_free(job);
+      break;
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+void verifier_get_stats(struct verifier_stats *out) {
+  pthread_mutex_lock(&lock);
+  *out = stats;
+  pthread_mutex_unlock(&lock);
+}